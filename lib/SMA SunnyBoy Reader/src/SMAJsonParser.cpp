@@ -0,0 +1,133 @@
+#include "SMAJsonParser.h"
+
+int SMAJsonParser::readChar() {
+    if(_next>=0) {
+      int c=_next;
+      _next=-1;
+      return c;
+    }
+    char c;
+    if(_stream.readBytes(&c, 1)!=1) return -1;
+    return (uint8_t)c;
+}
+
+int SMAJsonParser::nextChar() {
+    int c;
+    do {
+      c=readChar();
+    } while(c==' ' || c=='\t' || c=='\r' || c=='\n');
+    return c;
+}
+
+bool SMAJsonParser::parse() {
+    _depth=0;
+    _next=-1;
+    return parseValue(nextChar());
+}
+
+bool SMAJsonParser::parseValue(int c) {
+    SMAJsonType type;
+    switch(c) {
+      case '{':
+        return parseObject();
+      case '[':
+        return parseArray();
+      case '"':
+        if(!readString(_value, sizeof(_value))) return false;
+        type=SMAJSON_STRING;
+        break;
+      case -1:
+        return false;
+      default:
+        type=readLiteral(c);
+        if(_value[0]=='\0') return false;
+        break;
+    }
+    _handler.onValue(_path, _depth, _value, type);
+    return true;
+}
+
+bool SMAJsonParser::parseObject() {
+    if(_depth>=SMAJSON_MAX_DEPTH) return false;
+    SMAJsonLevel& level=_path[_depth++];
+    level.key[0]='\0';
+    level.index=-1;
+    int c=nextChar();
+    if(c!='}') {
+      while(true) {
+        if(c!='"' || !readString(level.key, sizeof(level.key))) return false;
+        if(nextChar()!=':') return false;
+        if(!parseValue(nextChar())) return false;
+        c=nextChar();
+        if(c=='}') break;
+        if(c!=',') return false;
+        c=nextChar();
+      }
+    }
+    _handler.onEnd(_path, _depth);
+    _depth--;
+    return true;
+}
+
+bool SMAJsonParser::parseArray() {
+    if(_depth>=SMAJSON_MAX_DEPTH) return false;
+    SMAJsonLevel& level=_path[_depth++];
+    level.key[0]='\0';
+    level.index=0;
+    int c=nextChar();
+    if(c!=']') {
+      while(true) {
+        if(!parseValue(c)) return false;
+        c=nextChar();
+        if(c==']') break;
+        if(c!=',') return false;
+        level.index++;
+        c=nextChar();
+      }
+    }
+    _handler.onEnd(_path, _depth);
+    _depth--;
+    return true;
+}
+
+bool SMAJsonParser::readString(char* buffer, size_t size) {
+    size_t len=0;
+    int c;
+    while((c=readChar())!='"') {
+      if(c<0) return false;
+      if(c=='\\') {
+        c=readChar();
+        switch(c) {
+          case 'n': c='\n'; break;
+          case 't': c='\t'; break;
+          case 'r': c='\r'; break;
+          case 'b': c='\b'; break;
+          case 'f': c='\f'; break;
+          case 'u':
+            /* Not needed for the SMA keys and values, replace the code point */
+            for(byte i=0;i<4;i++) readChar();
+            c='?';
+            break;
+          case -1: return false;
+          default: break;
+        }
+      }
+      if(len<size-1) buffer[len++]=c;
+    }
+    buffer[len]='\0';
+    return true;
+}
+
+SMAJsonType SMAJsonParser::readLiteral(int c) {
+    size_t len=0;
+    while((c>='0' && c<='9') || (c>='a' && c<='z') || (c>='A' && c<='Z') || c=='-' || c=='+' || c=='.') {
+      if(len<sizeof(_value)-1) _value[len++]=c;
+      c=readChar();
+    }
+    _value[len]='\0';
+    /* The delimiter is needed by the caller */
+    _next=c;
+    if(_value[0]=='n') return SMAJSON_NULL;
+    if(_value[0]=='t' || _value[0]=='f') return SMAJSON_BOOL;
+    return SMAJSON_NUMBER;
+}
@@ -0,0 +1,94 @@
+/*
+  SMAJsonParser.h - Streaming JSON parser for the SMA SunnyBoy web API responses.
+  Reads the response once from the stream and reports every value with its path to a handler,
+  no document is built and the memory used is fixed, independent of the size of the response.
+*/
+
+#ifndef SMAJsonParser_h
+#define SMAJsonParser_h
+
+#include "Arduino.h"
+
+/* Maximum nesting depth of the parsed documents, SMA responses use up to 9 levels (status values with tags) */
+#ifndef SMAJSON_MAX_DEPTH
+#define SMAJSON_MAX_DEPTH 10
+#endif
+
+/* Maximum length of object keys, longer keys are truncated */
+#ifndef SMAJSON_MAX_KEY
+#define SMAJSON_MAX_KEY 24
+#endif
+
+/* Maximum length of values, longer values are truncated */
+#ifndef SMAJSON_MAX_VALUE
+#define SMAJSON_MAX_VALUE 48
+#endif
+
+enum SMAJsonType {
+  SMAJSON_NULL,
+  SMAJSON_BOOL,
+  SMAJSON_NUMBER,
+  SMAJSON_STRING
+};
+
+/* One level of the path to the current value
+ * key: current key if the level is an object, empty for arrays
+ * index: current index if the level is an array, -1 for objects
+ */
+struct SMAJsonLevel {
+  char key[SMAJSON_MAX_KEY];
+  int index;
+
+  bool is(const char* name) const { return strcmp(key, name)==0; }
+};
+
+class SMAJsonHandler {
+  public:
+     /* A value was parsed
+      * path: path[0] is the root level, path[depth-1] the object or array holding the value
+      * value: value as text, numbers are not converted
+      */
+     virtual void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) = 0;
+
+     /* The object or array path[depth-1] is closed */
+     virtual void onEnd(const SMAJsonLevel* path, uint8_t depth) {}
+};
+
+class SMAJsonParser {
+  public:
+     SMAJsonParser(Stream& stream, SMAJsonHandler& handler) : _stream(stream), _handler(handler) {}
+
+     /* Parse one JSON document
+      * returns: false on syntax error, timeout or a too deep document
+      */
+     bool parse();
+
+  private:
+     Stream& _stream;
+     SMAJsonHandler& _handler;
+     SMAJsonLevel _path[SMAJSON_MAX_DEPTH];
+     uint8_t _depth=0;
+     char _value[SMAJSON_MAX_VALUE];
+     int _next=-1;
+
+     int readChar();
+     int nextChar();
+     bool parseValue(int c);
+     bool parseObject();
+     bool parseArray();
+     bool readString(char* buffer, size_t size);
+     SMAJsonType readLiteral(int c);
+};
+
+/* Allocator for the StreamUtils buffering streams that hands out a caller provided buffer,
+ * keeps the read buffer on the stack instead of the heap
+ */
+struct SMAFixedAllocator {
+  SMAFixedAllocator(void* buffer) : _buffer(buffer) {}
+  void* allocate(size_t) { return _buffer; }
+  void deallocate(void*) {}
+
+  void* _buffer;
+};
+
+#endif
@@ -0,0 +1,228 @@
+/*
+  SMAKeys.h - Typed registry of the SMA SunnyBoy keys.
+  The request body for a set of keys is built at compile time, see SMAKeySet.
+*/
+
+#ifndef SMAKeys_h
+#define SMAKeys_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY_POWER "6100_40263F00" // W
+#define KEY_ENERGY_TODAY "6400_00262200" // Wh
+#define KEY_ENERGY_TOTAL "6400_00260100" // Wh
+
+/* AC values */
+#define KEY_AC_L1_POWER "6100_40464000" // W (only one if only one phase)
+#define KEY_AC_L1_VOLTAGE "6100_00464800" // 1e-2 V (only one if only one phase)
+#define KEY_AC_L1_CURRENT "6100_40465300" // mA (only one if only one phase)
+#define KEY_AC_L2_POWER "6100_40464100" // W (only if multiple phases)
+#define KEY_AC_L2_VOLTAGE "6100_00464900" // 1e-2 V (only if multiple phases)
+#define KEY_AC_L2_CURRENT "6100_40465400" // mA (only if multiple phases)
+#define KEY_AC_L3_POWER "6100_40464200" // W (only if multiple phases)
+#define KEY_AC_L3_VOLTAGE "6100_00464A00" // 1e-2 V (only if multiple phases)
+#define KEY_AC_L3_CURRENT "6100_40465500" // mA (only if multiple phases)
+#define KEY_AC_L1L2_VOLTAGE "6100_00464B00" // 1e-2 V (only if multiple phases)
+#define KEY_AC_L2L3_VOLTAGE "6100_00464C00" // 1e-2 V (only if multiple phases)
+#define KEY_AC_L3L1_VOLTAGE "6100_00464D00" // 1e-2 V (only if multiple phases)
+#define KEY_AC_FREQUENCY "6100_00465700" // 1e-2 Hz
+
+/* DC values */
+#define KEY_DC_POWER "6380_40251E00" // W
+#define KEY_DC_VOLTAGE "6380_40451F00" // 1e-2 V
+#define KEY_DC_CURRENT "6380_40452100" // mA
+
+#define KEY_OPERATING_TIME "6400_00462E00" // s
+#define KEY_FEED_IN_TIME "6400_00462F00" // s
+
+/* Device info */
+#define KEY_ETHERNET_IP "6180_104A9A00" // String
+#define KEY_ETHERNET_DNS_IP "6180_104A9D00" // String
+#define KEY_ETHERNET_NETMASK "6180_104A9B00" // String
+#define KEY_ETHERNET_GATEWAY_IP "6180_104A9C00" // String
+
+#define KEY_WLAN_IP "6180_104AB700" // String
+#define KEY_WLAN_DNS_IP "6180_104ABA00" // String
+#define KEY_WLAN_NETMASK "6180_104AB800" // String
+#define KEY_WLAN_GATEWAY_IP "6180_104AB900" // String
+#define KEY_WLAN_STRENGTH "6100_004AB600" // percentage
+
+#define KEY_DEVICE_WARNING "6100_00411F00"
+#define KEY_DEVICE_ERROR "6100_00412000"
+#define KEY_DEVICE_OK "6100_00411E00" // Gives nominal power (W) if ok
+
+/* All keys have the same length, the request body is built on that */
+#define SMA_KEY_LENGTH 13
+
+/* Ids of the keys, same order as SMA_KEY_TABLE */
+enum class SMAKeyId : uint8_t {
+  POWER,
+  ENERGY_TODAY,
+  ENERGY_TOTAL,
+  AC_L1_POWER,
+  AC_L1_VOLTAGE,
+  AC_L1_CURRENT,
+  AC_L2_POWER,
+  AC_L2_VOLTAGE,
+  AC_L2_CURRENT,
+  AC_L3_POWER,
+  AC_L3_VOLTAGE,
+  AC_L3_CURRENT,
+  AC_L1L2_VOLTAGE,
+  AC_L2L3_VOLTAGE,
+  AC_L3L1_VOLTAGE,
+  AC_FREQUENCY,
+  DC_POWER,
+  DC_VOLTAGE,
+  DC_CURRENT,
+  OPERATING_TIME,
+  FEED_IN_TIME,
+  ETHERNET_IP,
+  ETHERNET_DNS_IP,
+  ETHERNET_NETMASK,
+  ETHERNET_GATEWAY_IP,
+  WLAN_IP,
+  WLAN_DNS_IP,
+  WLAN_NETMASK,
+  WLAN_GATEWAY_IP,
+  WLAN_STRENGTH,
+  DEVICE_WARNING,
+  DEVICE_ERROR,
+  DEVICE_OK,
+  COUNT
+};
+
+enum class SMAUnit : uint8_t {
+  NONE,
+  W,
+  WH,
+  V,
+  A,
+  HZ,
+  S,
+  PERCENT
+};
+
+enum class SMAValueType : uint8_t {
+  INT,
+  STRING,
+  STATUS
+};
+
+/* Key string, unit and scale factor, value in unit = raw value * scale */
+struct SMAKeyInfo {
+  const char* key;
+  SMAUnit unit;
+  float scale;
+  SMAValueType type;
+};
+
+constexpr SMAKeyInfo SMA_KEY_TABLE[] = {
+  {KEY_POWER, SMAUnit::W, 1.0f, SMAValueType::INT},
+  {KEY_ENERGY_TODAY, SMAUnit::WH, 1.0f, SMAValueType::INT},
+  {KEY_ENERGY_TOTAL, SMAUnit::WH, 1.0f, SMAValueType::INT},
+  {KEY_AC_L1_POWER, SMAUnit::W, 1.0f, SMAValueType::INT},
+  {KEY_AC_L1_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_L1_CURRENT, SMAUnit::A, 0.001f, SMAValueType::INT},
+  {KEY_AC_L2_POWER, SMAUnit::W, 1.0f, SMAValueType::INT},
+  {KEY_AC_L2_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_L2_CURRENT, SMAUnit::A, 0.001f, SMAValueType::INT},
+  {KEY_AC_L3_POWER, SMAUnit::W, 1.0f, SMAValueType::INT},
+  {KEY_AC_L3_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_L3_CURRENT, SMAUnit::A, 0.001f, SMAValueType::INT},
+  {KEY_AC_L1L2_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_L2L3_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_L3L1_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_AC_FREQUENCY, SMAUnit::HZ, 0.01f, SMAValueType::INT},
+  {KEY_DC_POWER, SMAUnit::W, 1.0f, SMAValueType::INT},
+  {KEY_DC_VOLTAGE, SMAUnit::V, 0.01f, SMAValueType::INT},
+  {KEY_DC_CURRENT, SMAUnit::A, 0.001f, SMAValueType::INT},
+  {KEY_OPERATING_TIME, SMAUnit::S, 1.0f, SMAValueType::INT},
+  {KEY_FEED_IN_TIME, SMAUnit::S, 1.0f, SMAValueType::INT},
+  {KEY_ETHERNET_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_ETHERNET_DNS_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_ETHERNET_NETMASK, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_ETHERNET_GATEWAY_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_WLAN_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_WLAN_DNS_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_WLAN_NETMASK, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_WLAN_GATEWAY_IP, SMAUnit::NONE, 1.0f, SMAValueType::STRING},
+  {KEY_WLAN_STRENGTH, SMAUnit::PERCENT, 1.0f, SMAValueType::INT},
+  {KEY_DEVICE_WARNING, SMAUnit::NONE, 1.0f, SMAValueType::STATUS},
+  {KEY_DEVICE_ERROR, SMAUnit::NONE, 1.0f, SMAValueType::STATUS},
+  {KEY_DEVICE_OK, SMAUnit::W, 1.0f, SMAValueType::INT},
+};
+
+constexpr const SMAKeyInfo& smaKeyInfo(SMAKeyId id) { return SMA_KEY_TABLE[(uint8_t)id]; }
+
+namespace SMAKeys {
+
+constexpr size_t length(const char* str, size_t n=0) { return str[n]=='\0' ? n : length(str, n+1); }
+
+constexpr bool allKeysValid(size_t i=0) {
+  return i>=(size_t)SMAKeyId::COUNT || (length(SMA_KEY_TABLE[i].key)==SMA_KEY_LENGTH && allKeysValid(i+1));
+}
+
+static_assert(sizeof(SMA_KEY_TABLE)/sizeof(SMA_KEY_TABLE[0])==(size_t)SMAKeyId::COUNT, "SMA_KEY_TABLE does not match SMAKeyId");
+static_assert(allKeysValid(), "All SMA keys must have SMA_KEY_LENGTH characters");
+
+/* The body is {"keys":["<key>","<key>"], "destDev":[]} */
+constexpr const char* BODY_PREFIX = "{\"keys\":[";
+constexpr size_t BODY_PREFIX_LENGTH = 9;
+constexpr const char* BODY_SUFFIX = "], \"destDev\":[]}";
+constexpr size_t BODY_SUFFIX_LENGTH = 16;
+/* Quotes around the key and the separating comma */
+constexpr size_t BODY_KEY_LENGTH = SMA_KEY_LENGTH+3;
+
+constexpr size_t bodyLength(size_t numKeys) {
+  return BODY_PREFIX_LENGTH+numKeys*BODY_KEY_LENGTH-1+BODY_SUFFIX_LENGTH;
+}
+
+constexpr char keyChar(const SMAKeyId* ids, size_t j) {
+  return j%BODY_KEY_LENGTH==0 || j%BODY_KEY_LENGTH==SMA_KEY_LENGTH+1 ? '"'
+       : j%BODY_KEY_LENGTH==SMA_KEY_LENGTH+2 ? ','
+       : smaKeyInfo(ids[j/BODY_KEY_LENGTH]).key[j%BODY_KEY_LENGTH-1];
+}
+
+constexpr char bodyChar(const SMAKeyId* ids, size_t numKeys, size_t i) {
+  return i<BODY_PREFIX_LENGTH ? BODY_PREFIX[i]
+       : i<BODY_PREFIX_LENGTH+numKeys*BODY_KEY_LENGTH-1 ? keyChar(ids, i-BODY_PREFIX_LENGTH)
+       : i<bodyLength(numKeys) ? BODY_SUFFIX[i-BODY_PREFIX_LENGTH-numKeys*BODY_KEY_LENGTH+1]
+       : '\0';
+}
+
+template <size_t... I> struct IndexSequence {};
+template <size_t N, size_t... I> struct MakeIndexSequence : MakeIndexSequence<N-1, N-1, I...> {};
+template <size_t... I> struct MakeIndexSequence<0, I...> { typedef IndexSequence<I...> type; };
+
+template <SMAKeyId... Ids> struct IdList {
+  static constexpr SMAKeyId ids[] = {Ids...};
+};
+template <SMAKeyId... Ids> constexpr SMAKeyId IdList<Ids...>::ids[];
+
+template <class TSequence, SMAKeyId... Ids> struct Body;
+template <size_t... I, SMAKeyId... Ids> struct Body<IndexSequence<I...>, Ids...> {
+  static constexpr char text[] = {bodyChar(IdList<Ids...>::ids, sizeof...(Ids), I)...};
+};
+template <size_t... I, SMAKeyId... Ids> constexpr char Body<IndexSequence<I...>, Ids...>::text[];
+
+} // namespace SMAKeys
+
+/* A fixed set of keys for SMAReader::getValues, e.g.
+ * typedef SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY> PowerKeys;
+ * The request body is generated by the compiler, nothing is built at runtime.
+ */
+template <SMAKeyId... Ids> struct SMAKeySet {
+  static_assert(sizeof...(Ids)>0, "SMAKeySet needs at least one key");
+
+  static constexpr int count = sizeof...(Ids);
+  static constexpr const SMAKeyId* ids = SMAKeys::IdList<Ids...>::ids;
+  /* Request body for getValues.json, zero terminated */
+  static constexpr const char* body = SMAKeys::Body<typename SMAKeys::MakeIndexSequence<SMAKeys::bodyLength(sizeof...(Ids))+1>::type, Ids...>::text;
+};
+template <SMAKeyId... Ids> constexpr int SMAKeySet<Ids...>::count;
+template <SMAKeyId... Ids> constexpr const SMAKeyId* SMAKeySet<Ids...>::ids;
+template <SMAKeyId... Ids> constexpr const char* SMAKeySet<Ids...>::body;
+
+#endif
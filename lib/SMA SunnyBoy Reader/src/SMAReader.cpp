@@ -1,60 +1,489 @@
 #include "SMAReader.h"
 
+SMAConnection SMAConnectionPool::_connections[SMAREADER_POOL_SIZE];
+
+#ifdef ESP32
+static portMUX_TYPE poolMux=portMUX_INITIALIZER_UNLOCKED;
+#define SMAREADER_POOL_LOCK() portENTER_CRITICAL(&poolMux)
+#define SMAREADER_POOL_UNLOCK() portEXIT_CRITICAL(&poolMux)
+#else
+#define SMAREADER_POOL_LOCK() do { (void)0; } while (0)
+#define SMAREADER_POOL_UNLOCK() do { (void)0; } while (0)
+#endif
+
+/* Response headers needed to handle keep-alive and chunked bodies */
+static const char* headerKeys[] = {"Transfer-Encoding", "Connection"};
+
+/* Response handlers for the streaming parser */
+
+/* Forwards all values and picks up the error code of {"err":401} responses */
+class SMAErrorFilter : public SMAJsonHandler {
+  public:
+     SMAErrorFilter(SMAJsonHandler& handler) : _handler(handler) {}
+
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth==1 && path[0].is("err")) err=atoi(value);
+        else _handler.onValue(path, depth, value, type);
+     }
+     void onEnd(const SMAJsonLevel* path, uint8_t depth) override { _handler.onEnd(path, depth); }
+
+     int err=0;
+
+  private:
+     SMAJsonHandler& _handler;
+};
+
+/* Drops the response */
+class SMAIgnoreHandler : public SMAJsonHandler {
+  public:
+     void onValue(const SMAJsonLevel*, uint8_t, const char*, SMAJsonType) override {}
+};
+
+/* {"result":{"sid":"..."}} */
+class SMALoginHandler : public SMAJsonHandler {
+  public:
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth==2 && type==SMAJSON_STRING && path[0].is("result") && path[1].is("sid")) {
+           strncpy(sid, value, sizeof(sid)-1);
+        }
+     }
+
+     char sid[SMAJSON_MAX_VALUE]={0};
+};
+
+/* {"result":{"<serial>":{"<key>":{"1":[{"val":...}]}}}} */
+class SMAValuesHandler : public SMAJsonHandler {
+  public:
+     SMAValuesHandler(int numKeys, const String* keys) : _numKeys(numKeys), _keys(keys), _ids(nullptr) {}
+     SMAValuesHandler(int numKeys, const SMAKeyId* ids) : _numKeys(numKeys), _keys(nullptr), _ids(ids) {}
+
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth>=2 && path[0].is("result") && device[0]==0) strncpy(device, path[1].key, sizeof(device)-1);
+        if(depth!=6 || !path[0].is("result") || !path[3].is("1") || path[4].index!=0 || !path[5].is("val")) return;
+        for(int i=0;i<_numKeys;i++) {
+           if(strcmp(keyName(i), path[2].key)==0) {
+              setValue(i, value, type);
+              return;
+           }
+        }
+     }
+     void onEnd(const SMAJsonLevel* path, uint8_t depth) override {
+        if(depth==3 && path[0].is("result")) hasResult=true;
+     }
+
+     /* Clear the values before a new try */
+     virtual void reset() { hasResult=false; device[0]=0; }
+
+     bool hasResult=false;
+     /* Device key of the response, "<SUSy id>-<serial>" in hex */
+     char device[SMAJSON_MAX_KEY]={0};
+
+  protected:
+     int _numKeys;
+     const String* _keys;
+     const SMAKeyId* _ids;
+
+     const char* keyName(int i) { return _ids!=nullptr ? smaKeyInfo(_ids[i]).key : _keys[i].c_str(); }
+
+     virtual void setValue(int i, const char* value, SMAJsonType type) = 0;
+};
+
+class SMAIntValuesHandler : public SMAValuesHandler {
+  public:
+     SMAIntValuesHandler(int numKeys, const String* keys, int* values) : SMAValuesHandler(numKeys, keys), _values(values) {}
+     SMAIntValuesHandler(int numKeys, const SMAKeyId* ids, int* values) : SMAValuesHandler(numKeys, ids), _values(values) {}
+
+     void reset() override {
+        SMAValuesHandler::reset();
+        for(int i=0;i<_numKeys;i++) _values[i]=-1;
+     }
+
+  private:
+     int* _values;
+
+     void setValue(int i, const char* value, SMAJsonType type) override {
+        if(type==SMAJSON_NUMBER) {
+           _values[i]=strtol(value, nullptr, 10);
+           DEBUG_SMAREADER("Int value: %d, key: %s, value: %d\n", i, keyName(i), _values[i]);
+        } else {
+           DEBUG_SMAREADER("Value not found or not integer: %d, key: %s\n", i, keyName(i));
+        }
+     }
+};
+
+class SMAStringValuesHandler : public SMAValuesHandler {
+  public:
+     SMAStringValuesHandler(int numKeys, const String* keys, String* values) : SMAValuesHandler(numKeys, keys), _values(values) {}
+
+     void reset() override {
+        SMAValuesHandler::reset();
+        for(int i=0;i<_numKeys;i++) _values[i]="";
+     }
+
+  private:
+     String* _values;
+
+     void setValue(int i, const char* value, SMAJsonType type) override {
+        if(type==SMAJSON_STRING || type==SMAJSON_NUMBER) {
+           _values[i]=value;
+           DEBUG_SMAREADER("Value: %d, key: %s, value: %s\n", i, keyName(i), value);
+        }
+     }
+};
+
+/* getLogger.json into the ring buffer, entries already received are skipped */
+class SMALogBufferHandler : public SMAJsonHandler {
+  public:
+     SMALogBufferHandler(SMALogBuffer& buffer, uint32_t endTime) : _buffer(buffer), _endTime(endTime) {}
+
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth!=4 || !path[0].is("result") || path[2].index<0) return;
+        uint32_t val=type==SMAJSON_NUMBER ? strtoul(value, nullptr, 10) : (uint32_t)-1;
+        if(path[3].is("t")) _t=val;
+        else if(path[3].is("v")) _v=val;
+     }
+     void onEnd(const SMAJsonLevel* path, uint8_t depth) override {
+        if(depth==4 && path[0].is("result") && path[2].index>=0) {
+           if(_t!=(uint32_t)-1 && _t<=_endTime && (_buffer.lastTimestamp()==0 || _t>_buffer.lastTimestamp())) {
+              if(_buffer.push(_t, _v)) count++;
+           }
+           _t=(uint32_t)-1;
+           _v=(uint32_t)-1;
+        } else if(depth==3 && path[0].is("result")) {
+           hasResult=true;
+        }
+     }
+
+     int count=0;
+     bool hasResult=false;
+
+  private:
+     SMALogBuffer& _buffer;
+     uint32_t _endTime;
+     uint32_t _t=(uint32_t)-1;
+     uint32_t _v=(uint32_t)-1;
+};
+
+/* {"result":{"<serial>":{"<key>":{"<channel>":[{"val":...},...]}}}}
+ * status values are lists of tags {"val":[{"tag":...},...]}
+ */
+class SMAAllValuesHandler : public SMAJsonHandler {
+  public:
+     SMAAllValuesHandler(SMAValueCallback callback, void* context) : _callback(callback), _context(context) {}
+
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth<6 || !path[0].is("result") || path[4].index<0 || !path[5].is("val")) return;
+        if(depth==6 || (depth==8 && path[6].index>=0 && path[7].is("tag"))) {
+           if(_callback!=nullptr) _callback(path[2].key, path[3].key, path[4].index, value, type, _context);
+           count++;
+        }
+     }
+     void onEnd(const SMAJsonLevel* path, uint8_t depth) override {
+        if(depth==3 && path[0].is("result")) hasResult=true;
+     }
+
+     uint32_t count=0;
+     bool hasResult=false;
+
+  private:
+     SMAValueCallback _callback;
+     void* _context;
+};
+
+/* {"result":{"<serial>":[{"t":...,"v":...},...]}} */
+class SMALogHandler : public SMAJsonHandler {
+  public:
+     SMALogHandler(int maxValues, uint32_t* values, uint32_t* timestamps) : _maxValues(maxValues), _values(values), _timestamps(timestamps) {}
+
+     void onValue(const SMAJsonLevel* path, uint8_t depth, const char* value, SMAJsonType type) override {
+        if(depth!=4 || !path[0].is("result") || path[2].index<0) return;
+        uint32_t val=type==SMAJSON_NUMBER ? strtoul(value, nullptr, 10) : (uint32_t)-1;
+        if(path[3].is("t")) _t=val;
+        else if(path[3].is("v")) _v=val;
+     }
+     void onEnd(const SMAJsonLevel* path, uint8_t depth) override {
+        if(depth==4 && path[0].is("result") && path[2].index>=0) {
+           if(count<_maxValues) {
+              _values[count]=_v;
+              if(_timestamps!=nullptr) _timestamps[count]=_t;
+              count++;
+           }
+           _t=(uint32_t)-1;
+           _v=(uint32_t)-1;
+        } else if(depth==3 && path[0].is("result")) {
+           hasResult=true;
+        }
+     }
+
+     int count=0;
+     bool hasResult=false;
+
+  private:
+     int _maxValues;
+     uint32_t* _values;
+     uint32_t* _timestamps;
+     uint32_t _t=(uint32_t)-1;
+     uint32_t _v=(uint32_t)-1;
+};
+
+SMAConnection* SMAConnectionPool::acquire(IPAddress address) {
+    SMAConnection* found=nullptr;
+    SMAConnection* oldest=nullptr;
+    SMAREADER_POOL_LOCK();
+    for(SMAConnection& conn: _connections) {
+      if(conn.inUse) continue;
+      if(conn.address==address) {
+        found=&conn;
+        break;
+      }
+      if(oldest==nullptr || conn.lastUsed<oldest->lastUsed) oldest=&conn;
+    }
+    if(found==nullptr) found=oldest;
+    if(found!=nullptr) found->inUse=true;
+    SMAREADER_POOL_UNLOCK();
+
+    if(found!=nullptr && found->address!=address) {
+      DEBUG_SMAREADER("[HTTP] new pool slot for %s\n", address.toString().c_str());
+      found->client.stop();
+      found->address=address;
+      found->http10=false;
+      found->http10Left=0;
+    }
+    return found;
+}
+
+void SMAConnectionPool::release(SMAConnection* conn) {
+    SMAREADER_POOL_LOCK();
+    conn->inUse=false;
+    SMAREADER_POOL_UNLOCK();
+}
+
+void SMAConnectionPool::closeAll() {
+    for(SMAConnection& conn: _connections) {
+      if(!conn.inUse) conn.client.stop();
+    }
+}
+
+int SMAChunkedStream::upstreamRead() {
+    char c;
+    if(_upstream.readBytes(&c, 1)!=1) return -1;
+    return (uint8_t)c;
+}
+
+bool SMAChunkedStream::nextChunk() {
+    int c;
+    if(_afterChunk) {
+      /* CRLF after the chunk data */
+      while((c=upstreamRead())>=0 && c!='\n') {}
+      _afterChunk=false;
+    }
+    /* Chunk size in hex, optionally followed by extensions */
+    uint32_t size=0;
+    bool isExtension=false;
+    while((c=upstreamRead())>=0 && c!='\n') {
+      if(isExtension) continue;
+      if(c>='0' && c<='9') size=size*16+(c-'0');
+      else if(c>='a' && c<='f') size=size*16+(c-'a'+10);
+      else if(c>='A' && c<='F') size=size*16+(c-'A'+10);
+      else if(c==';') isExtension=true;
+    }
+    if(c<0 || size==0) {
+      /* Last chunk, skip the trailer up to the empty line */
+      while(c>=0) {
+        int len=0;
+        while((c=upstreamRead())>=0 && c!='\n') {
+          if(c!='\r') len++;
+        }
+        if(len==0) break;
+      }
+      _done=true;
+      return false;
+    }
+    _remaining=size;
+    _afterChunk=true;
+    return true;
+}
+
+int SMAChunkedStream::read() {
+    if(_peeked>=0) {
+      int c=_peeked;
+      _peeked=-1;
+      return c;
+    }
+    if(_done) return -1;
+    if(_remaining==0 && !nextChunk()) return -1;
+    int c=upstreamRead();
+    if(c<0) {
+      _done=true;
+      return -1;
+    }
+    _remaining--;
+    return c;
+}
+
+int SMAChunkedStream::peek() {
+    if(_peeked<0) _peeked=read();
+    return _peeked;
+}
+
+int SMAChunkedStream::available() {
+    if(_peeked>=0) return 1;
+    if(_done) return 0;
+    int avail=_upstream.available();
+    if(_remaining>0 && (uint32_t)avail>_remaining) return _remaining;
+    return avail>0 ? 1 : 0;
+}
+
 void SMAReader::setInverterIP(IPAddress inverterAddress) {
+	if (_inverterAddress != inverterAddress) {
+		// Session id and serial belong to the old inverter
+		_sid = "";
+		_serial = 0;
+	}
 	_inverterAddress = inverterAddress;
 }
 
-bool SMAReader::postSMA(const char* postURL, const char* postMessage, DynamicJsonDocument& jsonResult) {
-    DEBUG_SMAREADER("[HTTP] POST... URL: %s\n", postURL);
-    DEBUG_SMAREADER("[HTTP] POST... message: %s\n", postMessage);
-
-    http.useHTTP10(true);
-    WiFiClient client;
-    http.begin(client, postURL);
+int SMAReader::sendPost(SMAConnection& conn, const char* postURL, const char* postMessage) {
+    HTTPClient& http=conn.http;
+    bool useHTTP10=!_keepAlive || conn.http10;
+    http.useHTTP10(useHTTP10);
+    http.setReuse(!useHTTP10);
+    http.begin(conn.client, postURL);
+    http.collectHeaders(headerKeys, 2);
     http.addHeader("User-Agent", "Mozilla/5.0 (Windows NT 6.0; WOW64; rv:24.0) Gecko/20100101 Firefox/24.0");
     http.addHeader("Content-Type", "application/json");
     http.addHeader("Accept", "application/json, text/plain, */*");
+    return http.POST(postMessage);
+}
 
-    int httpCode = http.POST(postMessage);
+bool SMAReader::postSMA(const char* postURL, const char* postMessage, SMAJsonHandler& handler) {
+    DEBUG_SMAREADER("[HTTP] POST... URL: %s\n", postURL);
+    DEBUG_SMAREADER("[HTTP] POST... message: %s\n", postMessage);
+
+    _sessionExpired=false;
+    SMAConnection* pooled=SMAConnectionPool::acquire(_inverterAddress);
+    if(pooled==nullptr) {
+      /* All pooled connections are busy with other inverters, use a single HTTP/1.0 request */
+      DEBUG_SMAREADER("[HTTP] pool exhausted\n");
+      SMAConnection conn;
+      conn.http10=true;
+      return postConnection(conn, postURL, postMessage, handler);
+    }
+    bool isSuccess=postConnection(*pooled, postURL, postMessage, handler);
+    SMAConnectionPool::release(pooled);
+    return isSuccess;
+}
+
+bool SMAReader::postConnection(SMAConnection& conn, const char* postURL, const char* postMessage, SMAJsonHandler& handler) {
+    HTTPClient& http=conn.http;
+    bool isWarm=conn.client.connected();
+    uint32_t startTime=millis();
+
+    int httpCode = sendPost(conn, postURL, postMessage);
+    if(httpCode<0 && isWarm) {
+        /* Inverter closed the idle socket, try once on a fresh connection with HTTP/1.0 */
+        DEBUG_SMAREADER("[HTTP] kept-alive connection lost, reconnecting\n");
+        http.end();
+        conn.client.stop();
+        isWarm=false;
+        conn.http10=true;
+        httpCode = sendPost(conn, postURL, postMessage);
+        if(httpCode<0) {
+           /* No answer on a new connection either, the inverter is offline and keep-alive is not the problem */
+           conn.http10=false;
+        } else {
+           DEBUG_SMAREADER("[HTTP] falling back to HTTP/1.0\n");
+           conn.http10Left=SMAREADER_HTTP10_REQUESTS;
+        }
+    }
+    bool isHttp10=conn.http10;
+    conn.lastUsed=millis();
+    if(httpCode==HTTP_CODE_UNAUTHORIZED) {
+        _sessionExpired=true;
+    }
     if(httpCode!=HTTP_CODE_OK) {
         DEBUG_SMAREADER("[HTTP] POST... failed, error: %d: %s\n", httpCode, http.errorToString(httpCode).c_str());
         http.end();
         return false;
     }
+    if(!conn.http10 && http.header("Connection").equalsIgnoreCase("close")) {
+        DEBUG_SMAREADER("[HTTP] inverter does not keep connections, using HTTP/1.0\n");
+        conn.http10=true;
+        conn.http10Left=SMAREADER_HTTP10_REQUESTS;
+    }
 
+    SMAChunkedStream chunkedStream(http.getStream());
+    bool isChunked=http.header("Transfer-Encoding").equalsIgnoreCase("chunked");
+    Stream& bodyStream=isChunked ? (Stream&)chunkedStream : (Stream&)http.getStream();
+    /* Buffered reads with the buffer on the stack */
+    char readBuffer[SMAREADER_READ_BUFFER];
+    BasicReadBufferingStream<SMAFixedAllocator> bufferedStream(bodyStream, sizeof(readBuffer), SMAFixedAllocator(readBuffer));
+    SMAErrorFilter errorFilter(handler);
     #if defined(DEBUG_SMAREADER_ON) && defined(DEBUG_SMAREADER_PORT)
-    ReadLoggingStream loggingStream(http.getStream(), DEBUG_SMAREADER_PORT);
-    DeserializationError error=deserializeJson(jsonResult, loggingStream);
+    ReadLoggingStream loggingStream(bufferedStream, DEBUG_SMAREADER_PORT);
+    SMAJsonParser parser(loggingStream, errorFilter);
     #else
-    DeserializationError error=deserializeJson(jsonResult, http.getStream());
+    SMAJsonParser parser(bufferedStream, errorFilter);
     #endif
+    bool isParsed=parser.parse();
     DEBUG_SMAREADER("\n");
-        
+    if(isChunked) chunkedStream.finish();
+
     http.end();
-    if (error) {
-      DEBUG_SMAREADER("Parsing failed: %s\n", error.c_str());
+    DEBUG_SMAREADER("[HTTP] %s request took %lu ms\n", isWarm ? "warm" : "cold", millis()-startTime);
+    (void)startTime;
+    if (!isParsed) {
+      DEBUG_SMAREADER("Parsing failed\n");
+      return false;
+    }
+    /* An expired or unknown sid is answered with {"err":401} */
+    if(errorFilter.err==401) {
+      DEBUG_SMAREADER("Session expired\n");
+      _sessionExpired=true;
       return false;
     }
+    /* The fallback ends after some successful requests, the lost connection may have had another cause */
+    if(isHttp10 && conn.http10Left>0 && --conn.http10Left==0) {
+      DEBUG_SMAREADER("[HTTP] trying keep-alive again\n");
+      conn.http10=false;
+    }
     return true;
 }
 
+bool SMAReader::ensureSession() {
+    if(_sid.length()>0) return true;
+    return authorize();
+}
+
+bool SMAReader::postSession(const char* script, const char* postMessage, SMAJsonHandler& handler) {
+    if(!ensureSession()) return false;
+    char scriptURL[128];
+    snprintf(scriptURL, sizeof(scriptURL), "http://%d.%d.%d.%d/dyn/%s?sid=%s", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3], script, _sid.c_str());
+    bool isSuccess=postSMA(scriptURL, postMessage, handler);
+    if(_sessionExpired) {
+        /* Drop the sid, the next try logs in again */
+        DEBUG_SMAREADER("Renewing session\n");
+        _sid="";
+        return false;
+    }
+    return isSuccess;
+}
+
 bool SMAReader::authorize() {
     char authURL[40];
     sprintf(authURL, "http://%d.%d.%d.%d/dyn/login.json", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3]);
     char postText[40];
     sprintf(postText, "{\"right\":\"%s\", \"pass\":\"%s\"}", _accountType, _passwd);
 
-    /* Stream is considered read-only input, so the strings have to be stored too, the minimum size is then 2*JSON_OBJECT_SIZE(1)+28 */
-    DynamicJsonDocument jsonResult(2*JSON_OBJECT_SIZE(1)+35);
-    bool isSuccess=postSMA(authURL, postText, jsonResult);
+    SMALoginHandler handler;
+    bool isSuccess=postSMA(authURL, postText, handler);
     if(isSuccess) {
-        const char* res=jsonResult["result"]["sid"].as<const char*>();
-        if(res==nullptr) {
+        if(handler.sid[0]=='\0') {
            isSuccess=false;
            DEBUG_SMAREADER("Unexpected JSON format\n");
         }
         else {
-          _sid=res;
+          _sid=handler.sid;
           DEBUG_SMAREADER("Successful authorization, sid: %s\n", _sid.c_str());
         }
     }
@@ -69,13 +498,13 @@ bool SMAReader::logout() {
     }
     char logoutURL[128];
     sprintf(logoutURL, "http://%d.%d.%d.%d/dyn/logout.json?sid=%s", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3], _sid.c_str());
-    DynamicJsonDocument jsonResult(100);
-    bool isSuccess=postSMA(logoutURL, "{}", jsonResult);
+    SMAIgnoreHandler handler;
+    bool isSuccess=postSMA(logoutURL, "{}", handler);
+    _sid="";
     return isSuccess;
 }
 
-bool SMAReader::getValuesAux(int numKeys, const String* keys, DynamicJsonDocument& doc, JsonVariant& result) {
-    char scriptURL[128];
+bool SMAReader::getValuesAux(int numKeys, const String* keys, SMAValuesHandler& handler) {
     char postText[30+numKeys*17];
     char keyString[numKeys*17];
     strcpy(keyString, "\"");
@@ -89,114 +518,99 @@ bool SMAReader::getValuesAux(int numKeys, const String* keys, DynamicJsonDocumen
     }
     strcat(keyString, "\"");
     sprintf(postText, "{\"keys\":[%s], \"destDev\":[]}", keyString);
-    
+    return getValuesAux(postText, handler);
+}
+
+bool SMAReader::getValuesAux(const char* postText, SMAValuesHandler& handler) {
     for(byte i=0;i<_numTries;i++) {
       DEBUG_SMAREADER("Try: %d\n", i);
-      if(authorize()) {
-        sprintf(scriptURL, "http://%d.%d.%d.%d/dyn/getValues.json?sid=%s", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3], _sid.c_str());
-        bool postSuccess=postSMA(scriptURL, postText, doc);
-        logout();
-        if(postSuccess) {
-           JsonObject result0=doc["result"];
-           for(JsonPair p: result0) {
-              result=p.value();
-              DEBUG_SMAREADER("Parsed JSON successfully, try: %d\n", i+1);
-              return true;
-           }
-           DEBUG_SMAREADER("Unexpected JSON format, try: %d\n", i+1);
-        }
+      handler.reset();
+      if(postSession("getValues.json", postText, handler)) {
+         if(handler.hasResult) {
+            DEBUG_SMAREADER("Parsed JSON successfully, try: %d\n", i+1);
+            const char* serial=strchr(handler.device, '-');
+            _serial=serial!=nullptr ? strtoul(serial+1, nullptr, 16) : 0;
+            return true;
+         }
+         DEBUG_SMAREADER("Unexpected JSON format, try: %d\n", i+1);
       }
     }
     return false;
 }
 
 bool SMAReader::getValues(int numKeys, const String* keys, int* values) {
-    /* Stream is considered read-only input, so the strings have to be stored too, the minimum size is then 
-    // numKeys*JSON_ARRAY_SIZE(1)+(2*numKeys+2)*JSON_OBJECT_SIZE(1)+JSON_OBJECT_SIZE(numKeys)+21+20*numkeys */
-    DynamicJsonDocument doc(numKeys*JSON_ARRAY_SIZE(1)+(2*numKeys+2)*JSON_OBJECT_SIZE(1)+JSON_OBJECT_SIZE(numKeys)+40+20*numKeys);
-    JsonVariant result;
-    if(getValuesAux(numKeys, keys, doc, result)) {
-       for(int i=0;i<numKeys;i++) {
-          JsonVariant val=result[keys[i]]["1"][0]["val"];
-          if(val.is<int>()) {
-              values[i]=val.as<int>();
-              DEBUG_SMAREADER("Int value: %d, key: %s, value: %d\n", i, keys[i].c_str(), values[i]);
-          } else {
-              values[i]=-1;
-              DEBUG_SMAREADER("Value not found or not integer: %d, key: %s\n", i, keys[i].c_str());
-          }
-       }
-       return true;
-    }
-    return false;
+    SMAIntValuesHandler handler(numKeys, keys, values);
+    return getValuesAux(numKeys, keys, handler);
+}
+
+bool SMAReader::getValues(int numKeys, const SMAKeyId* ids, const char* body, int* values) {
+    SMAIntValuesHandler handler(numKeys, ids, values);
+    return getValuesAux(body, handler);
 }
 
 bool SMAReader::getValues(int numKeys, const String* keys, String* values) {
-    /* Stream is considered read-only input, so the strings have to be stored too, the minimum size is then 
-    // numKeys*JSON_ARRAY_SIZE(1)+(2*numKeys+2)*JSON_OBJECT_SIZE(1)+JSON_OBJECT_SIZE(numKeys)+21+20*numkeys 
-    // add extra for 20*numKeys for string results */
-    DynamicJsonDocument doc(numKeys*JSON_ARRAY_SIZE(1)+(2*numKeys+2)*JSON_OBJECT_SIZE(1)+JSON_OBJECT_SIZE(numKeys)+40+40*numKeys);
-    JsonVariant result;
-    if(getValuesAux(numKeys, keys, doc, result)) {
-       for(int i=0;i<numKeys;i++) {
-          JsonVariant val=result[keys[i]]["1"][0]["val"];
-          if(val.is<const char*>()) {
-              values[i]=val.as<const char*>();
-              DEBUG_SMAREADER("String value: %d, key: %s, value: %s\n", i, keys[i].c_str(), values[i].c_str());
-          } else if(val.is<int>()) {
-              values[i]=val.as<int>();
-              DEBUG_SMAREADER("Int value: %d, key: %s, value: %s\n", i, keys[i].c_str(), values[i].c_str());
-          } else {
-              values[i]="";
-              DEBUG_SMAREADER("Value not found: %d, key: %s\n", i, keys[i].c_str());
-          }
-       }
-       return true;
-    }
-    return false;
+    SMAStringValuesHandler handler(numKeys, keys, values);
+    return getValuesAux(numKeys, keys, handler);
 }
 
 int SMAReader::getLog(uint32_t startTime, uint32_t endTime, uint32_t* values, uint32_t* timestamps) {
-    char scriptURL[128];
     char postText[70];
     sprintf(postText, "{\"key\":28672, \"destDev\":[],\"tStart\":%lu,\"tEnd\":%lu}", startTime, endTime);
     int numValues=max((int)(endTime-startTime)/300+1,1);
-    DynamicJsonDocument doc(JSON_ARRAY_SIZE(numValues) + 2*JSON_OBJECT_SIZE(1) + numValues*JSON_OBJECT_SIZE(2)+45+4*numValues);
     for(byte i=0;i<_numTries;i++) {
       DEBUG_SMAREADER("Try: %d\n", i);
-      if(authorize()) {
-        sprintf(scriptURL, "http://%d.%d.%d.%d/dyn/getLogger.json?sid=%s", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3], _sid.c_str());
-        bool postSuccess=postSMA(scriptURL, postText, doc);
-        logout();
-        if(postSuccess) {
-           JsonObject result0=doc["result"];
-           for(JsonPair p: result0) {
-              int j=0;
-              for(JsonObject obj: p.value().as<JsonArray>()) {
-                 JsonVariant timestamp=obj["t"];
-                 JsonVariant val=obj["v"];
-                 if(val.is<int>()) values[j]=val.as<uint32_t>(); else values[j]=-1;
-                 if(timestamps!=nullptr) {
-                  if(timestamp.is<int>()) timestamps[j]=timestamp.as<uint32_t>(); else timestamps[j]=-1;
-                 }
-                 j++;
-              }
-              DEBUG_SMAREADER("Parsed JSON successfully, try: %d\n", i+1);
-              return j;
-           }
-           DEBUG_SMAREADER("Unexpected JSON format, try: %d\n", i+1);
-        }
+      SMALogHandler handler(numValues, values, timestamps);
+      if(postSession("getLogger.json", postText, handler)) {
+         if(handler.hasResult) {
+            DEBUG_SMAREADER("Parsed JSON successfully, try: %d\n", i+1);
+            return handler.count;
+         }
+         DEBUG_SMAREADER("Unexpected JSON format, try: %d\n", i+1);
       }
     }
     return -1;
 }
 
-bool SMAReader::getAllValues() {
-    if(!authorize()) return false;
-    char scriptURL[65];
-    sprintf(scriptURL, "http://%d.%d.%d.%d/dyn/getAllOnlValues.json?sid=%s", _inverterAddress[0], _inverterAddress[1], _inverterAddress[2], _inverterAddress[3], _sid.c_str());
+int SMAReader::getLog(uint32_t startTime, uint32_t endTime, SMALogBuffer& buffer) {
+    int numAdded=0;
+    while(!buffer.isFull()) {
+      /* Resume after the last entry received */
+      if(buffer.lastTimestamp()>=startTime) startTime=buffer.lastTimestamp()+1;
+      if(startTime>endTime) break;
+      uint32_t windowEnd=(endTime-startTime>=SMAREADER_LOG_WINDOW) ? startTime+SMAREADER_LOG_WINDOW-1 : endTime;
+      bool isSuccess=false;
+      for(byte i=0;i<_numTries && !isSuccess;i++) {
+        /* A failed try keeps the entries it got, the next try starts after them */
+        uint32_t tryStart=max(startTime, buffer.lastTimestamp()+1);
+        char postText[70];
+        sprintf(postText, "{\"key\":28672, \"destDev\":[],\"tStart\":%lu,\"tEnd\":%lu}", (unsigned long)tryStart, (unsigned long)windowEnd);
+        DEBUG_SMAREADER("Try: %d, window %lu - %lu\n", i, (unsigned long)tryStart, (unsigned long)windowEnd);
+        SMALogBufferHandler handler(buffer, windowEnd);
+        isSuccess=postSession("getLogger.json", postText, handler) && handler.hasResult;
+        numAdded+=handler.count;
+      }
+      if(!isSuccess) {
+        DEBUG_SMAREADER("Log window failed\n");
+        return numAdded>0 ? numAdded : -1;
+      }
+      if(!buffer.isFull()) startTime=windowEnd+1;
+      if(windowEnd==endTime) break;
+    }
+    return numAdded;
+}
+
+bool SMAReader::getAllValues(SMAValueCallback callback, void* context) {
     char postText[]="{\"destDev\":[]}";
-    DynamicJsonDocument jsonResult(10000);
-    bool isSuccess=postSMA(scriptURL, postText, jsonResult);
-    return isSuccess;
+    for(byte i=0;i<_numTries;i++) {
+      DEBUG_SMAREADER("Try: %d\n", i);
+      SMAAllValuesHandler handler(callback, context);
+      if(postSession("getAllOnlValues.json", postText, handler)) {
+         if(handler.hasResult) {
+            DEBUG_SMAREADER("Parsed %lu values, try: %d\n", (unsigned long)handler.count, i+1);
+            return true;
+         }
+         DEBUG_SMAREADER("Unexpected JSON format, try: %d\n", i+1);
+      }
+    }
+    return false;
 }
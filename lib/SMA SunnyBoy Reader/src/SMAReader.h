@@ -20,8 +20,9 @@
 #include <HTTPClient.h>
 #endif
 
-#include <ArduinoJson.h>
 #include <StreamUtils.h>
+#include "SMAJsonParser.h"
+#include "SMAKeys.h"
 
 
 #if defined(DEBUG_SMAREADER_ON) && defined(DEBUG_SMAREADER_PORT)
@@ -35,48 +36,149 @@
 #define SMAREADER_USER "usr"
 #define SMAREADER_INSTALLER "istl"
 
-#define KEY_POWER "6100_40263F00" // W
-#define KEY_ENERGY_TODAY "6400_00262200" // Wh
-#define KEY_ENERGY_TOTAL "6400_00260100" // Wh
-
-/* AC values */
-#define KEY_AC_L1_POWER "6100_40464000" // W (only one if only one phase)
-#define KEY_AC_L1_VOLTAGE "6100_00464800" // 1e-2 V (only one if only one phase)
-#define KEY_AC_L1_CURRENT "6100_40465300" // mA (only one if only one phase)
-#define KEY_AC_L2_POWER "6100_40464100" // W (only if multiple phases)
-#define KEY_AC_L2_VOLTAGE "6100_00464900" // 1e-2 V (only if multiple phases)
-#define KEY_AC_L2_CURRENT "6100_40465400" // mA (only if multiple phases)
-#define KEY_AC_L3_POWER "6100_40464200" // W (only if multiple phases)
-#define KEY_AC_L3_VOLTAGE "6100_00464A00" // 1e-2 V (only if multiple phases)
-#define KEY_AC_L3_CURRENT "6100_40465500" // mA (only if multiple phases)
-#define KEY_AC_L1L2_VOLTAGE "6100_00464B00" // 1e-2 V (only if multiple phases)
-#define KEY_AC_L2L3_VOLTAGE "6100_00464C00" // 1e-2 V (only if multiple phases)
-#define KEY_AC_L3L1_VOLTAGE "6100_00464D00" // 1e-2 V (only if multiple phases)
-#define KEY_AC_FREQUENCY "6100_00465700" // 1e-2 Hz 
-
-/* DC values */
-#define KEY_DC_POWER "6380_40251E00" // W
-#define KEY_DC_VOLTAGE "6380_40451F00" // 1e-2 V
-#define KEY_DC_CURRENT "6380_40452100" // mA
-
-#define KEY_OPERATING_TIME "6400_00462E00" // s
-#define KEY_FEED_IN_TIME "6400_00462F00" // s
-
-/* Device info */
-#define KEY_ETHERNET_IP "6180_104A9A00" // String
-#define KEY_ETHERNET_DNS_IP "6180_104A9D00" // String
-#define KEY_ETHERNET_NETMASK "6180_104A9B00" // String
-#define KEY_ETHERNET_GATEWAY_IP "6180_104A9C00" // String
-
-#define KEY_WLAN_IP "6180_104AB700" // String
-#define KEY_WLAN_DNS_IP "6180_104ABA00" // String
-#define KEY_WLAN_NETMASK "6180_104AB800" // String
-#define KEY_WLAN_GATEWAY_IP "6180_104AB900" // String
-#define KEY_WLAN_STRENGTH "6100_004AB600" // percentage
-
-#define KEY_DEVICE_WARNING "6100_00411F00"
-#define KEY_DEVICE_ERROR "6100_00412000"
-#define KEY_DEVICE_OK "6100_00411E00" // Gives nominal power (W) if ok
+
+/* Size of the stack buffer for reading responses */
+#ifndef SMAREADER_READ_BUFFER
+#define SMAREADER_READ_BUFFER 64
+#endif
+
+/* Time range requested at once by the paged getLog, in seconds */
+#ifndef SMAREADER_LOG_WINDOW
+#define SMAREADER_LOG_WINDOW 86400UL
+#endif
+
+/* Number of kept-alive connections, one per inverter polled in parallel */
+#ifndef SMAREADER_POOL_SIZE
+#define SMAREADER_POOL_SIZE 2
+#endif
+
+/* Successful HTTP/1.0 requests after a fallback, then keep-alive is tried again */
+#ifndef SMAREADER_HTTP10_REQUESTS
+#define SMAREADER_HTTP10_REQUESTS 10
+#endif
+
+/* Decoder for a HTTP/1.1 body with Transfer-Encoding: chunked
+ * Reads return the payload only, the end of the stream is the terminating zero size chunk
+ */
+class SMAChunkedStream : public Stream {
+  public:
+     SMAChunkedStream(Stream& upstream) : _upstream(upstream) {}
+
+     int available() override;
+     int read() override;
+     int peek() override;
+     size_t write(uint8_t) override { return 0; }
+     void flush() override {}
+
+     /* Skip the rest of the body, required before the connection can be reused */
+     void finish() { while(read()>=0) {} }
+
+  private:
+     Stream& _upstream;
+     uint32_t _remaining=0;
+     bool _afterChunk=false;
+     bool _done=false;
+     int _peeked=-1;
+
+     int upstreamRead();
+     bool nextChunk();
+};
+
+/* A persistent HTTP connection to one inverter */
+struct SMAConnection {
+     IPAddress address;
+     WiFiClient client;
+     HTTPClient http;
+     /* Inverter does not keep connections open, use HTTP/1.0 */
+     bool http10=false;
+     /* Successful requests left until the HTTP/1.0 fallback ends */
+     uint8_t http10Left=0;
+     /* Used by a request right now */
+     bool inUse=false;
+     uint32_t lastUsed=0;
+};
+
+/* Keep-alive connections shared by all SMAReader instances, keyed by inverter IP
+ * Safe to use from several tasks, a connection is used by one request at a time
+ */
+class SMAConnectionPool {
+  public:
+     /* Get the connection for the inverter, the least recently used free one is taken over if none matches
+      * returns: nullptr if all connections are in use
+      */
+     static SMAConnection* acquire(IPAddress address);
+
+     /* Return the connection after the request */
+     static void release(SMAConnection* conn);
+
+     /* Close all connections */
+     static void closeAll();
+
+  private:
+     static SMAConnection _connections[SMAREADER_POOL_SIZE];
+};
+
+class SMAValuesHandler;
+
+/* One entry of the energy log */
+struct SMALogEntry {
+  uint32_t timestamp;
+  uint32_t value;
+};
+
+/* Fixed capacity ring buffer for the paged getLog, the memory is provided by the caller
+ * New entries are rejected if the buffer is full, pop entries to make space
+ */
+class SMALogBuffer {
+  public:
+     SMALogBuffer(SMALogEntry* entries, uint16_t capacity) : _entries(entries), _capacity(capacity) {}
+
+     bool push(uint32_t timestamp, uint32_t value) {
+        if(isFull()) return false;
+        SMALogEntry& entry=_entries[(_head+_size)%_capacity];
+        entry.timestamp=timestamp;
+        entry.value=value;
+        _size++;
+        _last=timestamp;
+        return true;
+     }
+
+     bool pop(SMALogEntry& entry) {
+        if(isEmpty()) return false;
+        entry=_entries[_head];
+        _head=(_head+1)%_capacity;
+        _size--;
+        return true;
+     }
+
+     uint16_t size() const { return _size; }
+     uint16_t capacity() const { return _capacity; }
+     bool isEmpty() const { return _size==0; }
+     bool isFull() const { return _size==_capacity; }
+
+     /* Timestamp of the last entry pushed, 0 if none. Kept when entries are popped, getLog resumes after it */
+     uint32_t lastTimestamp() const { return _last; }
+
+     /* Remove all entries and the resume point */
+     void clear() { _head=0; _size=0; _last=0; }
+
+  private:
+     SMALogEntry* _entries;
+     uint16_t _capacity;
+     uint16_t _head=0;
+     uint16_t _size=0;
+     uint32_t _last=0;
+};
+
+/* Called by getAllValues for every value in the response
+ * key: SMA key, e.g. KEY_POWER
+ * channel: channel of the value, usually "1"
+ * index: index of the value in the channel, e.g. the DC input
+ * value: value as text, numbers are not converted, for status values the tag number
+ * type: SMAJSON_NUMBER, SMAJSON_STRING or SMAJSON_NULL
+ * context: pointer given to getAllValues
+ */
+typedef void (*SMAValueCallback)(const char* key, const char* channel, int index, const char* value, SMAJsonType type, void* context);
 
 class SMAReader {
   public:
@@ -96,6 +198,9 @@ class SMAReader {
 
      void setNumTries(byte numTries) { _numTries=numTries; }
 
+     /* Use HTTP/1.1 keep-alive connections (default) or a new HTTP/1.0 connection for every request */
+     void setKeepAlive(bool keepAlive) { _keepAlive=keepAlive; }
+
      /* Get the values corresponding to the keys
       * Does not support keys with String values: they get -1
       * keys: String array specifying which values to get, use the predefined KEY values in this header like KEY_POWER_CURRENT 
@@ -113,6 +218,15 @@ class SMAReader {
       * Note: if the operation succeeded, but there is an error in getting one of the keys, it gets value "" 
       */
      bool getValues(int numKeys, const String* keys, String* values);
+
+     /* Get the values of a fixed key set
+      * Same as the previous, but the request body is generated at compile time and no String is used
+      * TKeySet: SMAKeySet with the keys, e.g. SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY>
+      * values: int array with TKeySet::count entries, in the order of the key set
+      * returns: true if success (after the specified number of tries) else false
+      */
+     template <class TKeySet>
+     bool getValues(int* values) { return getValues(TKeySet::count, TKeySet::ids, TKeySet::body, values); }
      
      /* Get the log of total energy production since start (in Wh) between certain times with intervals of 5 min
       * startTime: start time of the interval as unix timestamp (seconds after 01/01/1970, midnight UTC) 
@@ -122,8 +236,43 @@ class SMAReader {
       * returns: number of values if success, otherwise -1
       */
      int getLog(uint32_t startTime, uint32_t endTime, uint32_t* values, uint32_t* timestamps=nullptr);
-     bool getAllValues();
+
+     /* Get the log of total energy production in pages, for long time ranges
+      * The range is requested in windows of SMAREADER_LOG_WINDOW seconds, each response is parsed while it is received.
+      * Reading stops when the buffer is full. Entries newer than buffer.lastTimestamp() are added only,
+      * so after popping entries the same call continues where the last one stopped.
+      * startTime: start time of the interval as unix timestamp
+      * endTime: end time of the interval as unix timestamp
+      * buffer: ring buffer for the (timestamp, Wh) entries
+      * returns: number of entries added, -1 if the first window failed
+      */
+     int getLog(uint32_t startTime, uint32_t endTime, SMALogBuffer& buffer);
+
+     /* Get all values the inverter provides
+      * The response is parsed while it is received, every value is given to the callback, nothing is stored.
+      * The memory used is the same, independent of the size of the response.
+      * callback: function called for every value, if null the values are only checked
+      * context: pointer that is passed to the callback
+      * returns: true if success (after the specified number of tries) else false
+      * Note: if a try fails after some values were received, the callback gets the values again in the next try
+      */
+     bool getAllValues(SMAValueCallback callback=nullptr, void* context=nullptr);
      void setInverterIP(IPAddress inverterAddress);
+
+     /* Close the session on the inverter
+      * The session id is kept and reused between calls, it is only renewed when the inverter reports it as expired.
+      * Call this only before a shutdown, a reboot or an OTA update, the inverter has only a few session slots.
+      * returns: true if the inverter accepted the logout
+      */
+     bool logout();
+
+     /* Check if a session id is available for the next request */
+     bool hasSession() { return _sid.length()>0; }
+
+     /* Serial number of the inverter, from the device key of the last getValues response
+      * returns: 0 before the first successful getValues or after a change of the IP
+      */
+     uint32_t getSerial() { return _serial; }
      
   private:
      IPAddress _inverterAddress;
@@ -131,12 +280,19 @@ class SMAReader {
      const char* _accountType;
      String _sid="";
      byte _numTries;
+     bool _sessionExpired=false;
+     bool _keepAlive=true;
+     uint32_t _serial=0;
 
-     HTTPClient http;
-     bool getValuesAux(int numKeys, const String* keys, DynamicJsonDocument& doc, JsonVariant& result);
-     bool postSMA(const char* postURL, const char* postMessage, DynamicJsonDocument& jsonResult);
+     bool getValuesAux(int numKeys, const String* keys, SMAValuesHandler& handler);
+     bool getValuesAux(const char* postText, SMAValuesHandler& handler);
+     bool getValues(int numKeys, const SMAKeyId* ids, const char* body, int* values);
+     bool postSMA(const char* postURL, const char* postMessage, SMAJsonHandler& handler);
+     bool postConnection(SMAConnection& conn, const char* postURL, const char* postMessage, SMAJsonHandler& handler);
+     int sendPost(SMAConnection& conn, const char* postURL, const char* postMessage);
+     bool postSession(const char* script, const char* postMessage, SMAJsonHandler& handler);
+     bool ensureSession();
      bool authorize();
-     bool logout();
      
 
      
@@ -0,0 +1,87 @@
+/**
+ * @file airtime.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Time on air of LoRa and FSK packets
+ * LoRa formula from the Semtech SX1261/2 datasheet, chapter 6.1.4:
+ *   Tsym      = 2^SF / BW
+ *   Tpreamble = (preamble + 4.25) * Tsym
+ *   symbols   = 8 + max(ceil((8 * size - 4 * SF + 28 + 16 * CRC - 20 * IH) / (4 * (SF - 2 * DE))) * (CR + 4), 0)
+ *   ToA       = Tpreamble + symbols * Tsym
+ * DE (low data rate optimization) is on when Tsym >= 16 ms
+ * @version 0.1
+ * @date 2021-10-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "airtime.h"
+
+/** FSK bit rate of the LoRaWAN FSK data rate */
+#define FSK_BITRATE 50000
+
+/** FSK preamble, sync word, length and CRC bytes */
+#define FSK_OVERHEAD (5 + 3 + 1 + 2)
+
+/**
+ * @brief Time on air of a LoRa packet
+ *
+ * @param sf spreading factor 5 .. 12
+ * @param bw_khz bandwidth in kHz
+ * @param size PHY payload size in bytes
+ * @param cr coding rate 1 .. 4 for 4/5 .. 4/8
+ * @param preamble preamble length in symbols
+ * @param crc true if the payload has a CRC
+ * @param implicit_header true for implicit header mode
+ * @return uint32_t time on air in microseconds
+ */
+uint32_t lora_time_on_air(uint8_t sf, uint16_t bw_khz, uint8_t size, uint8_t cr, uint16_t preamble, bool crc, bool implicit_header)
+{
+	// Tsym in us
+	uint32_t t_sym = ((uint32_t)1 << sf) * 1000 / bw_khz;
+	uint8_t de = t_sym >= 16000 ? 1 : 0;
+
+	int32_t num = 8 * size - 4 * sf + 28 + (crc ? 16 : 0) - (implicit_header ? 20 : 0);
+	int32_t den = 4 * (sf - 2 * de);
+	int32_t symbols = 8;
+	if (num > 0)
+	{
+		symbols += ((num + den - 1) / den) * (cr + 4);
+	}
+
+	// Preamble has 4.25 extra symbols, calculate in quarter symbols
+	uint64_t quarter_symbols = (uint64_t)(preamble + symbols) * 4 + 17;
+	return quarter_symbols * ((uint64_t)1 << sf) * 1000 / (4 * bw_khz);
+}
+
+/**
+ * @brief Time on air of a 50 kbps FSK packet
+ *
+ * @param size PHY payload size in bytes
+ * @return uint32_t time on air in microseconds
+ */
+uint32_t fsk_time_on_air(uint8_t size)
+{
+	return (uint64_t)(size + FSK_OVERHEAD) * 8 * 1000000 / FSK_BITRATE;
+}
+
+/**
+ * @brief Time on air of a LoRaWAN uplink
+ *
+ * @param sf spreading factor or SF_FSK
+ * @param bw_khz bandwidth in kHz, unused for FSK
+ * @param app_size application payload size
+ * @return uint32_t time on air in microseconds
+ */
+uint32_t uplink_time_on_air(uint8_t sf, uint16_t bw_khz, uint8_t app_size)
+{
+	uint16_t size = app_size + LORAWAN_OVERHEAD;
+	if (size > 255)
+	{
+		size = 255;
+	}
+	if (sf == SF_FSK)
+	{
+		return fsk_time_on_air(size);
+	}
+	return lora_time_on_air(sf, bw_khz, size, LORAWAN_CR, LORAWAN_PREAMBLE, true, false);
+}
@@ -0,0 +1,31 @@
+/**
+ * @file airtime.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Time on air of LoRa and FSK packets
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __AIRTIME_H__
+#define __AIRTIME_H__
+
+#include <stdint.h>
+
+// LoRaWAN overhead of an uplink without FOpts: MHDR, FHDR, FPort and MIC
+#define LORAWAN_OVERHEAD 13
+
+// LoRaWAN uplink settings: coding rate 4/5, 8 symbols preamble, explicit header, CRC on
+#define LORAWAN_CR 1
+#define LORAWAN_PREAMBLE 8
+
+// Spreading factor value for the 50 kbps FSK data rate
+#define SF_FSK 0
+
+uint32_t lora_time_on_air(uint8_t sf, uint16_t bw_khz, uint8_t size, uint8_t cr, uint16_t preamble, bool crc, bool implicit_header);
+uint32_t fsk_time_on_air(uint8_t size);
+uint32_t uplink_time_on_air(uint8_t sf, uint16_t bw_khz, uint8_t app_size);
+
+#endif
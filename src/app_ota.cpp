@@ -34,6 +34,10 @@ void initOTA()
 						   Serial.println(debugMsg);
 						   BLE_PRINTF("OTA start");
 						   g_ota_running = true;
+						   // Free the session slot on the inverter before the reboot
+						   logout_inverters();
+						   uplink_save();
+						   SMAConnectionPool::closeAll();
 						   udp.close();
 						//    ~AsyncUDP();
 						   digitalWrite(LED_BLUE, HIGH); // Turn on blue LED
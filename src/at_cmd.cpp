@@ -14,11 +14,6 @@
 #define ATCMD_SIZE 160
 #define ATQUERY_SIZE 128
 
-#define AT_ERRNO_NOSUPP (1)
-#define AT_ERRNO_NOALLOW (2)
-#define AT_ERRNO_PARA_VAL (5)
-#define AT_ERRNO_PARA_NUM (6)
-#define AT_ERRNO_SYS (8)
 #define AT_CB_PRINT (0xFF)
 
 static char atcmd[ATCMD_SIZE];
@@ -632,6 +627,38 @@ static int at_query_join_status()
 	return 0;
 }
 
+/**
+ * @brief AT+JOINST=? Get the state of the join manager
+ * State, join requests sent and if the session was restored from the preferences
+ *
+ * @return int always 0
+ */
+static int at_query_join_state(void)
+{
+	Preferences preferences;
+	preferences.begin("Join", true);
+	bool saved = preferences.getBool("valid", false);
+	preferences.end();
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%s:%ld:%d", join_state_names[g_join_state], g_join_attempts, saved ? 1 : 0);
+	return 0;
+}
+
+/**
+ * @brief AT+JOINST=0 Drop the saved session, the next start does a new OTAA join
+ *
+ * @param str 0
+ * @return int 0 if valid parameter
+ */
+static int at_exec_join_state(char *str)
+{
+	if (strcmp(str, "0") != 0)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	join_clear_session();
+	return 0;
+}
+
 /**
  * @brief AT+CFM=? Get current confirm/unconfirmed packet status
  * 
@@ -695,6 +722,10 @@ static int at_exec_datarate(char *str)
 
 	g_lorawan_settings.data_rate = datarate;
 	save_lora_settings();
+	if (g_lorawan_initialized)
+	{
+		lmh_datarate_set(g_lorawan_settings.data_rate, g_lorawan_settings.adr_enabled);
+	}
 
 	return 0;
 }
@@ -729,6 +760,10 @@ static int at_exec_adr(char *str)
 	g_lorawan_settings.adr_enabled = (adr == 1 ? true : false);
 
 	save_lora_settings();
+	if (g_lorawan_initialized)
+	{
+		lmh_datarate_set(g_lorawan_settings.data_rate, g_lorawan_settings.adr_enabled);
+	}
 
 	return 0;
 }
@@ -798,6 +833,7 @@ static int at_exec_sendfreq(char *str)
 
 	g_lorawan_settings.send_repeat_time = time * 1000;
 	save_lora_settings();
+	set_poll_interval();
 
 	return 0;
 }
@@ -858,6 +894,9 @@ static int at_query_version(void)
  */
 static int at_exec_reboot(void)
 {
+	logout_inverters();
+	uplink_save();
+	join_save_session();
 	delay(100);
 	esp_restart();
 	return 0;
@@ -874,6 +913,7 @@ static int at_exec_restore(void)
 	lora_prefs.begin("LoRaCred", false);
 	lora_prefs.putBool("valid", false);
 	lora_prefs.end();
+	join_clear_session();
 
 	get_lora_prefs();
 
@@ -940,6 +980,696 @@ static int at_query_sma(void)
 	return 0;
 }
 
+/**
+ * @brief AT+INV=idx:a:b:c:d[:password] Set an additional inverter
+ * 0.0.0.0 removes the inverter, changes are active after reboot
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_inv(char *str)
+{
+	char *param;
+	IPAddress newIP(0, 0, 0, 0);
+	long part;
+
+	param = strtok(str, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	long idx = strtol(param, NULL, 0);
+	if ((idx < 1) || (idx >= MAX_INVERTERS))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	for (int ip_idx = 0; ip_idx < 4; ip_idx++)
+	{
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		part = strtol(param, NULL, 0);
+		if ((part < 0) || (part > 254))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		newIP[ip_idx] = part;
+	}
+	param = strtok(NULL, ":");
+	if ((param != NULL) && (strlen(param) >= sizeof(g_inverters[0].passwd)))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	save_inverter(idx, newIP, param);
+	return 0;
+}
+
+/**
+ * @brief AT+INV=? List the inverters
+ *
+ * @return int always 0
+ */
+static int at_query_inv(void)
+{
+	int len = 0;
+	g_at_query_buf[0] = 0;
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		IPAddress ip = idx == 0 ? inverterIP : get_inverter(idx);
+		if ((uint32_t)ip == 0)
+		{
+			continue;
+		}
+		len += snprintf(&g_at_query_buf[len], ATQUERY_SIZE - len, "%s%d:%d:%d:%d:%d", len == 0 ? "" : ",", idx, ip[0], ip[1], ip[2], ip[3]);
+	}
+	return 0;
+}
+
+/**
+ * @brief AT+SMABE=<backend> Set the backend of the inverters
+ * 0 = web API, 1 = Speedwire, 2 = Modbus TCP, active after reboot
+ *
+ * @param str backend
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_backend(char *str)
+{
+	if ((str[0] < '0') || (str[0] > '0' + BACKEND_MODBUS) || (str[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_sma_backend = str[0] - '0';
+	save_backend();
+	return 0;
+}
+
+/**
+ * @brief AT+SMABE=? Get the backend of the inverters
+ *
+ * @return int always 0
+ */
+static int at_query_backend(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_sma_backend);
+	return 0;
+}
+
+/**
+ * @brief AT+SWSCAN=? Find SMA devices with the Speedwire discovery
+ *
+ * @return int always 0
+ */
+static int at_query_swscan(void)
+{
+	IPAddress found[MAX_INVERTERS];
+	uint8_t count = speedwire_discover(found, MAX_INVERTERS, 2000);
+	int len = snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", count);
+	for (uint8_t idx = 0; idx < count; idx++)
+	{
+		len += snprintf(&g_at_query_buf[len], ATQUERY_SIZE - len, ",%d:%d:%d:%d", found[idx][0], found[idx][1], found[idx][2], found[idx][3]);
+	}
+	return 0;
+}
+
+/**
+ * @brief AT+DISC=<fails> Set the failed polls before the inverter discovery starts
+ * 0 = no automatic discovery
+ *
+ * @param str failed polls
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_disc(char *str)
+{
+	char *end;
+	long fails = strtol(str, &end, 0);
+	if ((end == str) || (*end != 0) || (fails < 0) || (fails > 100))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_disc_fail_limit = fails;
+	save_discovery_prefs();
+	return 0;
+}
+
+/**
+ * @brief AT+DISC=? Get the discovery status and the devices found
+ *
+ * @return int always 0
+ */
+static int at_query_disc(void)
+{
+	discovery_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+DISC Start the inverter discovery now
+ *
+ * @return int 0 if started, AT_ERRNO_NOALLOW if a discovery is running or WiFi is not connected
+ */
+static int at_run_disc(void)
+{
+	return discovery_start() ? 0 : AT_ERRNO_NOALLOW;
+}
+
+/**
+ * @brief AT+METER=? Get the last reading of the SMA Energy Meter
+ *
+ * @return int always 0
+ */
+static int at_query_meter(void)
+{
+	meter_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+CACHE=? Get the cached inverter values and the cache statistics
+ *
+ * @return int always 0
+ */
+static int at_query_cache(void)
+{
+	cache_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+HIST=<level>:<from>[:<count>] Print the history
+ * Level 0 = samples, 1 = 5 minutes, 2 = hours, 3 = days
+ * One line per point, time:power:peak power:samples:total energy
+ *
+ * @param str level, UTC time of the first point, number of points
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_hist(char *str)
+{
+	char *param = strtok(str, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	long level = strtol(param, NULL, 0);
+	param = strtok(NULL, ":");
+	if ((level < HIST_LVL_RAW) || (level > HIST_LVL_DAY) || (param == NULL))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	uint32_t from = strtoul(param, NULL, 0);
+	long count = 12;
+	param = strtok(NULL, ":");
+	if (param != NULL)
+	{
+		count = strtol(param, NULL, 0);
+		if ((count < 1) || (count > 100))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+	}
+
+	// Read in chunks, the store is locked while reading
+	const long chunk = 12;
+	s_hist_point points[chunk];
+	AT_PRINTF("\r\n");
+	while (count > 0)
+	{
+		int num = history_read(level, from, 0xFFFFFFFF, points, min(count, chunk));
+		for (int idx = 0; idx < num; idx++)
+		{
+			AT_PRINTF("%ld:%d:%d:%d:%ld\r\n", points[idx].utc, points[idx].power, points[idx].peak,
+					  points[idx].samples, points[idx].energy);
+		}
+		if (num < min(count, chunk))
+		{
+			break;
+		}
+		count -= num;
+		from = points[num - 1].utc + 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief AT+HIST=? Get the history status
+ *
+ * @return int always 0
+ */
+static int at_query_hist(void)
+{
+	history_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+UDPFMT=<format> Set the format of the UDP broadcast
+ * 0 = JSON, 1 = binary
+ *
+ * @param str format
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_udp_format(char *str)
+{
+	if (((str[0] != '0') && (str[0] != '1')) || (str[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_udp_format = str[0] - '0';
+	save_udp_prefs();
+	return 0;
+}
+
+/**
+ * @brief AT+UDPFMT=? Get the format of the UDP broadcast and the frames sent
+ *
+ * @return int always 0
+ */
+static int at_query_udp_format(void)
+{
+	udp_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+UDPSUB=mode:interval[:www:xxx:yyy:zzz] Set the local UDP feed
+ * mode 0 = broadcast, 1 = unicast to the subscribers, 2 = multicast to the group www.xxx.yyy.zzz
+ * interval = poll interval of the local feed in seconds, 0 = uplink interval
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_udp_sub(char *str)
+{
+	char *param = strtok(str, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	long mode = strtol(param, NULL, 0);
+	if ((mode < UDP_MODE_BROADCAST) || (mode > UDP_MODE_MULTICAST))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	param = strtok(NULL, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	long interval = strtol(param, NULL, 0);
+	if ((interval < 0) || (interval > 3600) || ((interval != 0) && (interval < 5)))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	IPAddress group = multiIP;
+	param = strtok(NULL, ":");
+	if (param != NULL)
+	{
+		for (int ip_idx = 0; ip_idx < 4; ip_idx++)
+		{
+			if (param == NULL)
+			{
+				return AT_ERRNO_PARA_VAL;
+			}
+			long part = strtol(param, NULL, 0);
+			if ((part < 0) || (part > 255))
+			{
+				return AT_ERRNO_PARA_VAL;
+			}
+			group[ip_idx] = part;
+			param = strtok(NULL, ":");
+		}
+		if ((group[0] < 224) || (group[0] > 239))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+	}
+	g_udp_mode = mode;
+	g_udp_local_interval = interval;
+	multiIP = group;
+	save_subscriber_prefs();
+	set_poll_interval();
+	return 0;
+}
+
+/**
+ * @brief AT+UDPSUB=? Get the local UDP feed settings and the number of subscribers
+ *
+ * @return int always 0
+ */
+static int at_query_udp_sub(void)
+{
+	subscriber_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+MQTT=host:port[:user[:password]] Set the MQTT broker
+ * AT+MQTT=0 disables MQTT
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_mqtt(char *str)
+{
+	s_mqtt_settings new_settings = g_mqtt_settings;
+	if (strcmp(str, "0") == 0)
+	{
+		new_settings.host[0] = 0;
+	}
+	else
+	{
+		char *param = strtok(str, ":");
+		if ((param == NULL) || (strlen(param) >= sizeof(new_settings.host)))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		strcpy(new_settings.host, param);
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		long port = strtol(param, NULL, 0);
+		if ((port < 1) || (port > 65535))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		new_settings.port = port;
+		new_settings.user[0] = 0;
+		new_settings.pass[0] = 0;
+		param = strtok(NULL, ":");
+		if (param != NULL)
+		{
+			if (strlen(param) >= sizeof(new_settings.user))
+			{
+				return AT_ERRNO_PARA_VAL;
+			}
+			strcpy(new_settings.user, param);
+			param = strtok(NULL, ":");
+			if (param != NULL)
+			{
+				if (strlen(param) >= sizeof(new_settings.pass))
+				{
+					return AT_ERRNO_PARA_VAL;
+				}
+				strcpy(new_settings.pass, param);
+			}
+		}
+	}
+	g_mqtt_settings = new_settings;
+	save_mqtt_prefs();
+	mqtt_settings_changed();
+	return 0;
+}
+
+/**
+ * @brief AT+MQTT=? Get the MQTT broker and status
+ * Host, port, user, connected, samples in the offline buffer, samples sent and dropped
+ *
+ * @return int always 0
+ */
+static int at_query_mqtt(void)
+{
+	int len = snprintf(g_at_query_buf, ATQUERY_SIZE, "%s:%d:%s:", g_mqtt_settings.host[0] == 0 ? "0" : g_mqtt_settings.host,
+					   g_mqtt_settings.port, g_mqtt_settings.user);
+	if (len < ATQUERY_SIZE)
+	{
+		mqtt_status(&g_at_query_buf[len], ATQUERY_SIZE - len);
+	}
+	return 0;
+}
+
+/**
+ * @brief AT+MQTTOPT=topic:qos:retain:batch Set the MQTT topic prefix and the message options
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_mqtt_options(char *str)
+{
+	s_mqtt_settings new_settings = g_mqtt_settings;
+	char *param = strtok(str, ":");
+	if ((param == NULL) || (strlen(param) >= sizeof(new_settings.topic)))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	strcpy(new_settings.topic, param);
+	long values[3];
+	const long max_values[3] = {2, 1, 10};
+	for (uint8_t idx = 0; idx < 3; idx++)
+	{
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		values[idx] = strtol(param, NULL, 0);
+		if ((values[idx] < 0) || (values[idx] > max_values[idx]))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+	}
+	if (values[2] == 0)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	new_settings.qos = values[0];
+	new_settings.retain = values[1] == 1;
+	new_settings.batch = values[2];
+	g_mqtt_settings = new_settings;
+	save_mqtt_prefs();
+	mqtt_settings_changed();
+	return 0;
+}
+
+/**
+ * @brief AT+MQTTOPT=? Get the MQTT topic prefix and the message options
+ *
+ * @return int always 0
+ */
+static int at_query_mqtt_options(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%s:%d:%d:%d", g_mqtt_settings.topic, g_mqtt_settings.qos,
+			 g_mqtt_settings.retain ? 1 : 0, g_mqtt_settings.batch);
+	return 0;
+}
+
+/**
+ * @brief AT+POLL=en:lat:lon:fast:slow:night Set the adaptive polling
+ * AT+POLL=0 switches back to polling every send repeat time
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_poll(char *str)
+{
+	char *param;
+	s_poll_settings new_settings = g_poll_settings;
+
+	param = strtok(str, ":");
+	if ((param == NULL) || ((param[0] != '0') && (param[0] != '1')) || (param[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	new_settings.enabled = param[0] == '1';
+
+	param = strtok(NULL, ":");
+	if (param != NULL)
+	{
+		new_settings.lat = strtof(param, NULL);
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		new_settings.lon = strtof(param, NULL);
+		if ((new_settings.lat < -90.0) || (new_settings.lat > 90.0) || (new_settings.lon < -180.0) || (new_settings.lon > 180.0))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+
+		uint32_t *times[] = {&new_settings.fast_time, &new_settings.slow_time, &new_settings.night_time};
+		for (uint8_t idx = 0; idx < 3; idx++)
+		{
+			param = strtok(NULL, ":");
+			if (param == NULL)
+			{
+				break;
+			}
+			long time = strtol(param, NULL, 0);
+			if ((time < 10) || (time > 86400))
+			{
+				return AT_ERRNO_PARA_VAL;
+			}
+			*times[idx] = time;
+		}
+	}
+
+	g_poll_settings = new_settings;
+	save_poll_prefs();
+	set_poll_interval();
+	return 0;
+}
+
+/**
+ * @brief AT+POLL=? Get the adaptive poll settings and the current mode
+ *
+ * @return int always 0
+ */
+static int at_query_poll(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%.3f:%.3f:%ld:%ld:%ld:%s", g_poll_settings.enabled ? 1 : 0,
+			 g_poll_settings.lat, g_poll_settings.lon,
+			 g_poll_settings.fast_time, g_poll_settings.slow_time, g_poll_settings.night_time,
+			 poll_mode_names[g_poll_mode]);
+	return 0;
+}
+
+/**
+ * @brief AT+BATCH=n Set the max samples per LoRaWAN packet
+ * 1 sends every sample in the single sample frame
+ *
+ * @param str parameters
+ * @return int 0 if ok, AT_ERRNO_PARA_VAL if parameters are wrong
+ */
+static int at_exec_batch(char *str)
+{
+	long batch = strtol(str, NULL, 0);
+	if ((batch < 1) || (batch > 64))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_batch_max = batch;
+	save_batch_prefs();
+	return 0;
+}
+
+/**
+ * @brief AT+BATCH=? Get the max samples per packet and the max payload of the current DR
+ *
+ * @return int always 0
+ */
+static int at_query_batch(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%d", g_batch_max, lora_max_payload());
+	return 0;
+}
+
+/**
+ * @brief AT+CODEC=<format>[:<mask>] Set the packet format
+ * 0 = batch frame, 1 = compact codec with the optional channels in mask (0 .. 63)
+ *
+ * @param str format and optional channel mask
+ * @return int 0 if correct parameter
+ */
+static int at_exec_codec(char *str)
+{
+	char *param = strtok(str, ":");
+	if ((param == NULL) || ((param[0] != '0') && (param[0] != '1')) || (param[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	uint8_t format = param[0] == '1' ? FORMAT_CODEC : FORMAT_BATCH;
+
+	uint8_t mask = g_batch_mask;
+	param = strtok(NULL, ":");
+	if (param != NULL)
+	{
+		long value = strtol(param, NULL, 0);
+		if ((value < 0) || (value > 63))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		mask = value;
+	}
+
+	// Send the samples collected in the old format
+	batch_flush();
+	g_batch_format = format;
+	g_batch_mask = mask;
+	save_batch_prefs();
+	return 0;
+}
+
+/**
+ * @brief AT+CODEC=? Get the packet format and the channel mask
+ *
+ * @return int always 0
+ */
+static int at_query_codec(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%d", g_batch_format, g_batch_mask);
+	return 0;
+}
+
+/**
+ * @brief AT+UPQ=? Get the uplink queue status
+ * Packets in RAM, packets in flash, queued, sent, dropped and retries
+ *
+ * @return int always 0
+ */
+static int at_query_upq(void)
+{
+	uint16_t in_flash;
+	uint16_t in_ram = uplink_pending(&in_flash);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%d:%ld:%ld:%ld:%ld", in_ram, in_flash,
+			 g_uplink_stats.queued, g_uplink_stats.sent, g_uplink_stats.dropped, g_uplink_stats.retries);
+	return 0;
+}
+
+/**
+ * @brief AT+AIRTIME=? Get the airtime budget
+ * Time on air of a max size packet in ms, deferred uplinks,
+ * then name, used ms and budget ms of each duty cycle sub-band in use
+ *
+ * @return int always 0
+ */
+static int at_query_airtime(void)
+{
+	airtime_status(g_at_query_buf, ATQUERY_SIZE);
+	return 0;
+}
+
+/**
+ * @brief AT+TASKS Print timing statistics of the tasks
+ * Processing time, age of the sample when it was taken from the queue,
+ * queue depth, dropped samples, readiness of the sinks and stack high-water mark
+ *
+ * @return int always 0
+ */
+static int at_exec_tasks(void)
+{
+	AT_PRINTF("\r\nTask\tRuns\tLast\tMax\tWait\tQueue\tDrops\tReady\tStack\r\n");
+	for (uint8_t stage = 0; stage < g_num_stages; stage++)
+	{
+		s_task_stats *stats = &g_task_stats[stage];
+		AT_PRINTF("%s\t%ld\t%ld\t%ld\t%ld\t%d\t%ld\t%s\t%d\r\n", stats->name, stats->runs,
+				  stats->last_ms, stats->max_ms, stats->wait_ms,
+				  stats->queue != NULL ? uxQueueMessagesWaiting(stats->queue) : 0, stats->drops,
+				  stage == STAGE_ACQ ? "-" : (stats->is_ready ? "1" : "0"),
+				  stats->task != NULL ? uxTaskGetStackHighWaterMark(stats->task) : 0);
+	}
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		AT_PRINTF("Inv%d\t-\t%ld\t-\t-\t-\t-\t-\t%d\r\n", idx, g_inverters[idx].poll_time,
+				  g_inverters[idx].task != NULL ? uxTaskGetStackHighWaterMark(g_inverters[idx].task) : 0);
+	}
+	AT_PRINTF("AT\t-\t-\t-\t-\t-\t-\t-\t%d\r\n", uxTaskGetStackHighWaterMark(NULL));
+	AT_PRINTF("\r\nJob\tPeriod\tNext\tMaxLate\r\n");
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		s_job *job = &g_jobs[idx];
+		if (job->callback == NULL)
+		{
+			continue;
+		}
+		AT_PRINTF("%s\t%ld\t%ld\t%ld\r\n", job->name, job->period,
+				  job->active ? (long)(job->due - millis()) : -1L, job->max_late);
+	}
+	return 0;
+}
+
 static int at_exec_list_all(void);
 
 /**
@@ -963,8 +1693,12 @@ static atcmd_t g_at_cmd_list[] = {
 	{"+CFM", "Get or set the confirm mode", at_query_confirm, at_exec_confirm, NULL},
 	{"+JOIN", "Join network", at_query_join, at_exec_join, NULL},
 	{"+NJS", "Get the join status", at_query_join_status, NULL, NULL},
+	{"+JOINST", "Get the join state or drop the saved session", at_query_join_state, at_exec_join_state, NULL},
 	{"+NJM", "Get or set the network join mode", at_query_joinmode, at_exec_joinmode, NULL},
 	{"+SENDFREQ", "Get or Set the automatic send time", at_query_sendfreq, at_exec_sendfreq, NULL},
+	{"+POLL", "Get or Set the adaptive polling", at_query_poll, at_exec_poll, NULL},
+	{"+BATCH", "Get or Set the samples per packet", at_query_batch, at_exec_batch, NULL},
+	{"+CODEC", "Get or Set the packet format", at_query_codec, at_exec_codec, NULL},
 	// LoRa network management
 	{"+ADR", "Get or set the adaptive data rate setting", at_query_adr, at_exec_adr, NULL},
 	{"+CLASS", "Get or set the device class", at_query_class, at_exec_class, NULL},
@@ -977,8 +1711,23 @@ static atcmd_t g_at_cmd_list[] = {
 	{"+RSSI", "Last RX packet RSSI", at_query_rssi, NULL, NULL},
 	{"+SNR", "Last RX packet SNR", at_query_snr, NULL, NULL},
 	{"+VER", "Get SW version", at_query_version, NULL, NULL},
+	{"+TASKS", "Show task timing and stack usage", NULL, NULL, at_exec_tasks},
+	{"+AIRTIME", "Get the airtime budget", at_query_airtime, NULL, NULL},
+	{"+UPQ", "Get the uplink queue status", at_query_upq, NULL, NULL},
 	// SMA inverter IP address setup
 	{"+SMA", "Get and Set SMA inverter IP address", at_query_sma, at_exec_sma, NULL},
+	{"+INV", "Get and Set additional SMA inverters", at_query_inv, at_exec_inv, NULL},
+	{"+SMABE", "Get and Set the SMA inverter backend", at_query_backend, at_exec_backend, NULL},
+	{"+SWSCAN", "Find SMA devices with Speedwire", at_query_swscan, NULL, NULL},
+	{"+METER", "Get the SMA Energy Meter reading", at_query_meter, NULL, NULL},
+	{"+DISC", "Find inverters that changed their IP", at_query_disc, at_exec_disc, at_run_disc},
+	{"+CACHE", "Get the cached inverter values", at_query_cache, NULL, NULL},
+	{"+HIST", "Get the history of the samples", at_query_hist, at_exec_hist, NULL},
+	// Local outputs
+	{"+UDPFMT", "Get and Set the UDP broadcast format", at_query_udp_format, at_exec_udp_format, NULL},
+	{"+UDPSUB", "Get and Set the local UDP feed mode", at_query_udp_sub, at_exec_udp_sub, NULL},
+	{"+MQTT", "Get and Set the MQTT broker", at_query_mqtt, at_exec_mqtt, NULL},
+	{"+MQTTOPT", "Get and Set the MQTT topic and options", at_query_mqtt_options, at_exec_mqtt_options, NULL},
 
 };
 
@@ -1008,6 +1757,44 @@ static int at_exec_list_all(void)
 	return 0;
 }
 
+/**
+ * @brief Execute a command of the AT command table without the serial parser
+ * Used by the LoRaWAN downlink commands, so they share the checks of the AT commands
+ *
+ * @param cmd_name command as in g_at_cmd_list, e.g. "+DR"
+ * @param str parameter or NULL for the command without parameter
+ * @return int 0 if success, AT_ERRNO_xxx otherwise
+ */
+int at_exec_cmd(const char *cmd_name, char *str)
+{
+	for (unsigned int idx = 0; idx < sizeof(g_at_cmd_list) / sizeof(atcmd_t); idx++)
+	{
+		if (strcmp(g_at_cmd_list[idx].cmd_name, cmd_name) != 0)
+		{
+			continue;
+		}
+		int ret;
+		if (str == NULL)
+		{
+			if (g_at_cmd_list[idx].exec_cmd_no_para == NULL)
+			{
+				return AT_ERRNO_NOALLOW;
+			}
+			ret = g_at_cmd_list[idx].exec_cmd_no_para();
+		}
+		else
+		{
+			if (g_at_cmd_list[idx].exec_cmd == NULL)
+			{
+				return AT_ERRNO_NOALLOW;
+			}
+			ret = g_at_cmd_list[idx].exec_cmd(str);
+		}
+		return ret == -1 ? AT_ERRNO_SYS : ret;
+	}
+	return AT_ERRNO_NOSUPP;
+}
+
 /**
  * @brief Handle received AT command
  * 
@@ -1177,7 +1964,7 @@ void at_serial_input(uint8_t cmd)
 
 	if ((cmd >= '0' && cmd <= '9') || (cmd >= 'a' && cmd <= 'z') ||
 		(cmd >= 'A' && cmd <= 'Z') || cmd == '?' || cmd == '+' || cmd == ':' ||
-		cmd == '=' || cmd == ' ' || cmd == ',')
+		cmd == '=' || cmd == ' ' || cmd == ',' || cmd == '.' || cmd == '-')
 	{
 		atcmd[atcmd_index++] = cmd;
 	}
@@ -13,6 +13,12 @@
 #ifndef __AT_H__
 #define __AT_H__
 
+#define AT_ERRNO_NOSUPP (1)
+#define AT_ERRNO_NOALLOW (2)
+#define AT_ERRNO_PARA_VAL (5)
+#define AT_ERRNO_PARA_NUM (6)
+#define AT_ERRNO_SYS (8)
+
 #define AT_PRINTF(...)           \
 	Serial.printf(__VA_ARGS__);  \
 	if (g_ble_uart_is_connected) \
@@ -0,0 +1,448 @@
+/**
+ * @file batch.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Pack several samples into one LoRaWAN packet, sized to the max payload of the region and DR
+ * Either in the fixed size batch frame or with the compact codec, see codec.cpp
+ * A packet that is not full is sent at the latest BATCH_MAX_AGE after its first sample
+ * @version 0.1
+ * @date 2021-10-22
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include "codec.h"
+
+static_assert(VAL_ENERGY_TOTAL == 2 + CH_NUM, "poll_keys_t does not match the codec channels");
+
+/** Flag for a single sample */
+#define FRAME_SINGLE 0x20
+
+/** Flag for a batch of samples */
+#define FRAME_BATCH 0x21
+
+/** Flag for the energy log backfill */
+#define FRAME_LOG 0x22
+
+/** Size of the following log entries, time delta and energy delta */
+#define LOG_NEXT_SIZE 4
+
+/** Size of the batch header, flag and time of the first sample */
+#define BATCH_HEADER_SIZE 5
+
+/** Size of the first sample, power and absolute energy */
+#define BATCH_FIRST_SIZE 6
+
+/** Size of the following samples, time delta, power and energy delta */
+#define BATCH_NEXT_SIZE 6
+
+/** Energy delta marker, the absolute energy follows */
+#define BATCH_ENERGY_ABS 0xFFFF
+
+/** Size of the absolute energy after the marker */
+#define BATCH_ABS_SIZE 4
+
+/** Max time from the first sample of a packet until the packet is queued */
+#define BATCH_MAX_AGE 900000
+
+/** Max samples per packet, 1 sends every sample in the single sample frame */
+uint8_t g_batch_max = 1;
+
+/** Packet format, FORMAT_BATCH or FORMAT_CODEC */
+uint8_t g_batch_format = FORMAT_BATCH;
+
+/** Optional channels sent with FORMAT_CODEC, bit n = e_codec_channel n */
+uint8_t g_batch_mask = 0;
+
+/** Packet under construction */
+static uint8_t batch_buffer[UPLINK_MAX_PAYLOAD];
+static uint8_t batch_len = 0;
+static uint8_t batch_count = 0;
+static uint32_t batch_last_time = 0;
+static int batch_last_energy = 0;
+static s_codec_encoder batch_codec;
+
+/** Protects the packet, samples are added by the LoRa sink, the deadline job and AT+CODEC flush it */
+static SemaphoreHandle_t batch_mutex = NULL;
+
+/** Scheduler job that queues the packet at its deadline */
+static int8_t batch_job_id = -1;
+
+/** Max payload by DR for EU868 like regions (AS923, CN470, CN779, EU433, EU868, KR920, IN865, RU864) */
+static const uint8_t max_payload_eu[] = {51, 51, 51, 115, 222, 222, 222, 222};
+
+/** Max payload by DR for AU915 */
+static const uint8_t max_payload_au[] = {51, 51, 51, 115, 222, 222, 222, 0, 53, 129, 242, 242, 242, 242};
+
+/** Max payload by DR for US915 */
+static const uint8_t max_payload_us[] = {11, 53, 125, 242, 242, 0, 0, 0, 53, 129, 242, 242, 242, 242};
+
+/**
+ * @brief Get the current data rate
+ * With ADR the data rate is taken from the MAC layer
+ *
+ * @return uint8_t data rate
+ */
+uint8_t lora_datarate(void)
+{
+	uint8_t data_rate = g_lorawan_settings.data_rate;
+	if (g_lorawan_settings.adr_enabled && g_lorawan_initialized)
+	{
+		MibRequestConfirm_t mib_req;
+		mib_req.Type = MIB_CHANNELS_DATARATE;
+		if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK)
+		{
+			data_rate = mib_req.Param.ChannelsDatarate;
+		}
+	}
+	return data_rate;
+}
+
+/**
+ * @brief Get the max payload for the current region and data rate
+ *
+ * @return uint8_t max application payload in bytes
+ */
+uint8_t lora_max_payload(void)
+{
+	uint8_t data_rate = lora_datarate();
+
+	const uint8_t *table = max_payload_eu;
+	uint8_t table_size = sizeof(max_payload_eu);
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_AU915:
+		table = max_payload_au;
+		table_size = sizeof(max_payload_au);
+		break;
+	case LORAMAC_REGION_US915:
+		table = max_payload_us;
+		table_size = sizeof(max_payload_us);
+		break;
+	default:
+		break;
+	}
+	if ((data_rate >= table_size) || (table[data_rate] == 0))
+	{
+		return table[0];
+	}
+	return table[data_rate];
+}
+
+/**
+ * @brief Put a 16 bit value big endian into a packet
+ *
+ * @param buffer packet
+ * @param len packet size, updated
+ * @param value value to add
+ */
+static void put_16(uint8_t *buffer, uint8_t *len, uint16_t value)
+{
+	buffer[(*len)++] = value >> 8;
+	buffer[(*len)++] = value;
+}
+
+/**
+ * @brief Put a 32 bit value big endian into a packet
+ *
+ * @param buffer packet
+ * @param len packet size, updated
+ * @param value value to add
+ */
+static void put_32(uint8_t *buffer, uint8_t *len, uint32_t value)
+{
+	put_16(buffer, len, value >> 16);
+	put_16(buffer, len, value);
+}
+
+/**
+ * @brief Queue the packet under construction, call with batch_mutex taken
+ *
+ */
+static void flush_packet(void)
+{
+	unschedule(batch_job_id);
+	if (batch_count == 0)
+	{
+		return;
+	}
+	if (g_batch_format == FORMAT_CODEC)
+	{
+		batch_len = codec_end(&batch_codec);
+	}
+	myLog_d("Sending %d samples in %d bytes", batch_count, batch_len);
+	if (send_lora_packet(batch_buffer, batch_len) != LMH_SUCCESS)
+	{
+		myLog_e("Packet error, too big to queue");
+	}
+	batch_len = 0;
+	batch_count = 0;
+}
+
+/**
+ * @brief Queue the packet under construction
+ *
+ */
+void batch_flush(void)
+{
+	if (batch_mutex == NULL)
+	{
+		// Not started yet, there is no packet
+		return;
+	}
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	flush_packet();
+	xSemaphoreGive(batch_mutex);
+}
+
+/**
+ * @brief Scheduler job, queue a packet that did not fill up in time
+ *
+ */
+static void batch_deadline_job(void)
+{
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	if (batch_count != 0)
+	{
+		myLog_d("Batch deadline, %d samples", batch_count);
+	}
+	flush_packet();
+	xSemaphoreGive(batch_mutex);
+}
+
+/**
+ * @brief Start the deadline of a new packet, call with its first sample
+ *
+ */
+static void start_deadline(void)
+{
+	if (batch_job_id < 0)
+	{
+		batch_job_id = schedule("Batch", batch_deadline_job, BATCH_MAX_AGE, 0);
+	}
+	else
+	{
+		reschedule(batch_job_id, BATCH_MAX_AGE, 0);
+	}
+}
+
+/**
+ * @brief Add a sample to the codec packet, call with batch_mutex taken
+ *
+ * @param sample the sample
+ */
+static void codec_sample_add(s_sample *sample)
+{
+	s_codec_sample codec_sample;
+	codec_sample.time = sample->utc;
+	codec_sample.power = sample->values[0];
+	codec_sample.energy = sample->values[1];
+	for (uint8_t ch = 0; ch < CH_NUM; ch++)
+	{
+		codec_sample.channels[ch] = sample->values[2 + ch];
+	}
+
+	if ((batch_count != 0) && !codec_add(&batch_codec, &codec_sample))
+	{
+		// Packet full or time went backwards, start a new one
+		flush_packet();
+	}
+	if (batch_count == 0)
+	{
+		codec_begin(&batch_codec, batch_buffer, lora_max_payload(), g_batch_mask);
+		if (!codec_add(&batch_codec, &codec_sample))
+		{
+			myLog_e("Sample does not fit into a packet");
+			return;
+		}
+		start_deadline();
+	}
+	batch_count++;
+
+	if ((batch_count >= g_batch_max) && !airtime_low())
+	{
+		flush_packet();
+	}
+}
+
+/**
+ * @brief Add a sample to the batch frame, call with batch_mutex taken
+ *
+ * @param sample the sample
+ */
+static void frame_sample_add(s_sample *sample)
+{
+	int power = sample->values[0];
+	int energy = sample->values[1];
+
+	if ((g_batch_max <= 1) && (batch_count == 0) && !airtime_low())
+	{
+		// Single sample frame, power and energy as 16 bit
+		batch_len = 0;
+		batch_buffer[batch_len++] = FRAME_SINGLE;
+		put_16(batch_buffer, &batch_len, power);
+		put_16(batch_buffer, &batch_len, energy);
+		batch_count = 1;
+		flush_packet();
+		return;
+	}
+
+	uint32_t time_delta = sample->utc - batch_last_time;
+	uint32_t energy_delta = energy - batch_last_energy;
+	uint8_t needed = BATCH_FIRST_SIZE;
+	if (batch_count != 0)
+	{
+		needed = BATCH_NEXT_SIZE;
+		if ((energy < batch_last_energy) || (energy_delta >= BATCH_ENERGY_ABS))
+		{
+			// Energy today restarted or jumped
+			needed += BATCH_ABS_SIZE;
+		}
+		if ((time_delta > 0xFFFF) || (batch_len + needed > lora_max_payload()))
+		{
+			flush_packet();
+			needed = BATCH_FIRST_SIZE;
+		}
+	}
+
+	if (batch_count == 0)
+	{
+		batch_len = 0;
+		batch_buffer[batch_len++] = FRAME_BATCH;
+		put_32(batch_buffer, &batch_len, sample->utc);
+		put_16(batch_buffer, &batch_len, power);
+		put_32(batch_buffer, &batch_len, energy);
+		start_deadline();
+	}
+	else
+	{
+		put_16(batch_buffer, &batch_len, time_delta);
+		put_16(batch_buffer, &batch_len, power);
+		if (needed > BATCH_NEXT_SIZE)
+		{
+			put_16(batch_buffer, &batch_len, BATCH_ENERGY_ABS);
+			put_32(batch_buffer, &batch_len, energy);
+		}
+		else
+		{
+			put_16(batch_buffer, &batch_len, energy_delta);
+		}
+	}
+	batch_count++;
+	batch_last_time = sample->utc;
+	batch_last_energy = energy;
+
+	if ((batch_count >= g_batch_max) && !airtime_low())
+	{
+		flush_packet();
+	}
+}
+
+/**
+ * @brief Add a sample to the packet, the packet is queued when it is full
+ * or has g_batch_max samples
+ * When the airtime budget runs low the packets are filled up to the max payload
+ *
+ * @param sample the sample
+ */
+void batch_add(s_sample *sample)
+{
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	if (g_batch_format == FORMAT_CODEC)
+	{
+		codec_sample_add(sample);
+	}
+	else
+	{
+		frame_sample_add(sample);
+	}
+	xSemaphoreGive(batch_mutex);
+}
+
+/**
+ * @brief Queue the energy log read for a backfill request
+ * The entries are packed into as many packets as needed, entries without a value are skipped
+ *
+ * @param timestamps UTC time of the entries
+ * @param values total energy in Wh, (uint32_t)-1 for entries without a value
+ * @param count number of entries
+ */
+void batch_send_log(uint32_t *timestamps, uint32_t *values, int count)
+{
+	uint8_t buffer[UPLINK_MAX_PAYLOAD];
+	uint8_t len = 0;
+	uint8_t max_len = lora_max_payload();
+	uint32_t last_time = 0;
+	uint32_t last_energy = 0;
+
+	for (int entry = 0; entry < count; entry++)
+	{
+		if (values[entry] == (uint32_t)-1)
+		{
+			continue;
+		}
+		uint32_t time_delta = timestamps[entry] - last_time;
+		uint32_t energy_delta = values[entry] - last_energy;
+		bool is_abs = (values[entry] < last_energy) || (energy_delta >= BATCH_ENERGY_ABS);
+		if ((len != 0) && ((time_delta > 0xFFFF) || (len + LOG_NEXT_SIZE + (is_abs ? BATCH_ABS_SIZE : 0) > max_len)))
+		{
+			send_lora_packet(buffer, len);
+			len = 0;
+		}
+
+		if (len == 0)
+		{
+			buffer[len++] = FRAME_LOG;
+			put_32(buffer, &len, timestamps[entry]);
+			put_32(buffer, &len, values[entry]);
+		}
+		else
+		{
+			put_16(buffer, &len, time_delta);
+			if (is_abs)
+			{
+				put_16(buffer, &len, BATCH_ENERGY_ABS);
+				put_32(buffer, &len, values[entry]);
+			}
+			else
+			{
+				put_16(buffer, &len, energy_delta);
+			}
+		}
+		last_time = timestamps[entry];
+		last_energy = values[entry];
+	}
+	if (len != 0)
+	{
+		send_lora_packet(buffer, len);
+	}
+}
+
+/**
+ * @brief Read the batch size and packet format from the preferences, call once at startup
+ *
+ */
+void get_batch_prefs(void)
+{
+	batch_mutex = xSemaphoreCreateMutex();
+	Preferences preferences;
+	preferences.begin("Batch", false);
+	g_batch_max = preferences.getUChar("n", 1);
+	g_batch_format = preferences.getUChar("f", FORMAT_BATCH);
+	g_batch_mask = preferences.getUChar("m", 0);
+	preferences.end();
+}
+
+/**
+ * @brief Save the batch size and packet format
+ *
+ */
+void save_batch_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("Batch", false);
+	preferences.putUChar("n", g_batch_max);
+	preferences.putUChar("f", g_batch_format);
+	preferences.putUChar("m", g_batch_mask);
+	preferences.end();
+}
@@ -182,6 +182,8 @@ class WiFiCallBackHandler : public BLECharacteristicCallbacks
 			}
 			else if (json_buffer.containsKey("reset"))
 			{
+				logout_inverters();
+				uplink_save();
 				WiFi.disconnect();
 				esp_restart();
 			}
@@ -288,12 +290,15 @@ class LoRaCallBackHandler : public BLECharacteristicCallbacks
 
 		// Save new settings
 		save_lora_settings();
+		set_poll_interval();
 
 		log_settings();
 
 		if (g_lorawan_settings.resetRequest)
 		{
 			myLog_d("Initiate reset");
+			logout_inverters();
+			uplink_save();
 			delay(1000);
 			esp_restart();
 		}
@@ -0,0 +1,261 @@
+/**
+ * @file codec.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Compact codec for the solar data LoRaWAN packets
+ *
+ * Packet layout, schema version 1:
+ *   header      1 byte  CODEC_HEADER
+ *   mask        1 byte  optional channels in the packet, bit n = e_codec_channel n
+ *   count       1 byte  number of samples
+ *   per sample:
+ *     time      varint  seconds since the previous sample, UTC seconds for the first sample
+ *     power     zigzag varint, difference to the previous sample
+ *     energy    varint, (difference to the previous sample << 1)
+ *               or (absolute value << 1) | 1 if the counter was reset
+ *     channels  zigzag varint, difference to the previous sample, for each bit set in mask
+ * The first sample is coded against a sample with all values 0.
+ *
+ * @version 0.1
+ * @date 2021-10-23
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "codec.h"
+
+/** Size of header, mask and count */
+#define CODEC_HEAD_SIZE 3
+
+/** Max size of a 32 bit varint */
+#define VARINT_MAX 5
+
+/**
+ * @brief Write an unsigned varint, 7 bit per byte, low bits first
+ *
+ * @param out buffer
+ * @param value value to write
+ * @return uint8_t bytes written
+ */
+static uint8_t put_varint(uint8_t *out, uint32_t value)
+{
+	uint8_t len = 0;
+	while (value >= 0x80)
+	{
+		out[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+	return len;
+}
+
+/**
+ * @brief Read an unsigned varint
+ *
+ * @param in buffer
+ * @param len bytes left in the buffer
+ * @param value read value
+ * @return int bytes read or -1 if the varint is truncated or too long
+ */
+static int get_varint(const uint8_t *in, int len, uint32_t *value)
+{
+	uint32_t result = 0;
+	for (int idx = 0; (idx < len) && (idx < VARINT_MAX); idx++)
+	{
+		result |= (uint32_t)(in[idx] & 0x7F) << (7 * idx);
+		if ((in[idx] & 0x80) == 0)
+		{
+			*value = result;
+			return idx + 1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Map signed to unsigned, small magnitudes give small values
+ */
+static uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/**
+ * @brief Reverse of zigzag()
+ */
+static int32_t unzigzag(uint32_t value)
+{
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/**
+ * @brief Difference of two values, wraps around instead of overflowing
+ */
+static int32_t diff(int32_t value, int32_t last)
+{
+	return (int32_t)((uint32_t)value - (uint32_t)last);
+}
+
+/**
+ * @brief Reverse of diff()
+ */
+static int32_t add(int32_t last, int32_t delta)
+{
+	return (int32_t)((uint32_t)last + (uint32_t)delta);
+}
+
+/**
+ * @brief Start a packet
+ *
+ * @param enc encoder state
+ * @param buffer packet buffer
+ * @param size max packet size
+ * @param mask optional channels to include, bit n = e_codec_channel n
+ */
+void codec_begin(s_codec_encoder *enc, uint8_t *buffer, uint8_t size, uint8_t mask)
+{
+	enc->buffer = buffer;
+	enc->size = size;
+	enc->mask = mask & ((1 << CH_NUM) - 1);
+	enc->count = 0;
+	enc->len = CODEC_HEAD_SIZE;
+	memset(&enc->last, 0, sizeof(enc->last));
+}
+
+/**
+ * @brief Add a sample to the packet
+ *
+ * @param enc encoder state
+ * @param sample the sample
+ * @return true if added, false if the sample does not fit, the packet is unchanged
+ */
+bool codec_add(s_codec_encoder *enc, const s_codec_sample *sample)
+{
+	if ((enc->count == CODEC_MAX_SAMPLES) || (enc->size < CODEC_HEAD_SIZE))
+	{
+		return false;
+	}
+	if ((sample->energy < 0) || ((enc->count != 0) && (sample->time < enc->last.time)))
+	{
+		// Energy must be a positive counter, samples must be in time order
+		return false;
+	}
+
+	uint8_t temp[VARINT_MAX * (3 + CH_NUM)];
+	uint8_t len = 0;
+	len += put_varint(&temp[len], enc->count == 0 ? sample->time : sample->time - enc->last.time);
+	len += put_varint(&temp[len], zigzag(diff(sample->power, enc->last.power)));
+	if (sample->energy >= enc->last.energy)
+	{
+		len += put_varint(&temp[len], (uint32_t)(sample->energy - enc->last.energy) << 1);
+	}
+	else
+	{
+		len += put_varint(&temp[len], ((uint32_t)sample->energy << 1) | 1);
+	}
+	for (uint8_t ch = 0; ch < CH_NUM; ch++)
+	{
+		if (enc->mask & (1 << ch))
+		{
+			len += put_varint(&temp[len], zigzag(diff(sample->channels[ch], enc->last.channels[ch])));
+		}
+	}
+
+	if (enc->len + len > enc->size)
+	{
+		return false;
+	}
+	memcpy(&enc->buffer[enc->len], temp, len);
+	enc->len += len;
+	enc->count++;
+	enc->last = *sample;
+	return true;
+}
+
+/**
+ * @brief Finish the packet
+ *
+ * @param enc encoder state
+ * @return uint8_t packet size, 0 if the packet has no samples
+ */
+uint8_t codec_end(s_codec_encoder *enc)
+{
+	if (enc->count == 0)
+	{
+		return 0;
+	}
+	enc->buffer[0] = CODEC_HEADER;
+	enc->buffer[1] = enc->mask;
+	enc->buffer[2] = enc->count;
+	return enc->len;
+}
+
+/**
+ * @brief Decode a packet
+ *
+ * @param buffer packet
+ * @param len packet size
+ * @param samples buffer for the samples, channels not in the packet are set to 0
+ * @param max_samples size of the samples buffer
+ * @param mask set to the channels in the packet
+ * @return int number of samples or -1 if the packet is invalid or has more than max_samples samples
+ */
+int codec_decode(const uint8_t *buffer, uint8_t len, s_codec_sample *samples, int max_samples, uint8_t *mask)
+{
+	if ((len < CODEC_HEAD_SIZE) || (buffer[0] != CODEC_HEADER) || (buffer[1] >= (1 << CH_NUM)))
+	{
+		return -1;
+	}
+	*mask = buffer[1];
+	int count = buffer[2];
+	if (count > max_samples)
+	{
+		return -1;
+	}
+
+	s_codec_sample last;
+	memset(&last, 0, sizeof(last));
+	int pos = CODEC_HEAD_SIZE;
+	for (int idx = 0; idx < count; idx++)
+	{
+		s_codec_sample *sample = &samples[idx];
+		uint32_t value;
+		int used;
+
+		if ((used = get_varint(&buffer[pos], len - pos, &value)) < 0)
+		{
+			return -1;
+		}
+		pos += used;
+		sample->time = idx == 0 ? value : last.time + value;
+
+		if ((used = get_varint(&buffer[pos], len - pos, &value)) < 0)
+		{
+			return -1;
+		}
+		pos += used;
+		sample->power = add(last.power, unzigzag(value));
+
+		if ((used = get_varint(&buffer[pos], len - pos, &value)) < 0)
+		{
+			return -1;
+		}
+		pos += used;
+		sample->energy = (value & 1) ? (int32_t)(value >> 1) : add(last.energy, value >> 1);
+
+		for (uint8_t ch = 0; ch < CH_NUM; ch++)
+		{
+			sample->channels[ch] = 0;
+			if (*mask & (1 << ch))
+			{
+				if ((used = get_varint(&buffer[pos], len - pos, &value)) < 0)
+				{
+					return -1;
+				}
+				pos += used;
+				sample->channels[ch] = add(last.channels[ch], unzigzag(value));
+			}
+		}
+		last = *sample;
+	}
+	return pos == len ? count : -1;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file codec.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Compact codec for the solar data LoRaWAN packets
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-23
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// Header byte, high nibble marks the codec, low nibble is the schema version
+#define CODEC_MARK 0x40
+#define CODEC_VERSION 1
+#define CODEC_HEADER (CODEC_MARK | CODEC_VERSION)
+
+// Max samples in one packet
+#define CODEC_MAX_SAMPLES 255
+
+// Optional channels, bit number in the channel mask
+enum e_codec_channel
+{
+	CH_DC_VOLTAGE = 0,
+	CH_DC_CURRENT,
+	CH_AC_FREQUENCY,
+	CH_L1_POWER,
+	CH_L2_POWER,
+	CH_L3_POWER,
+	CH_NUM
+};
+
+struct s_codec_sample
+{
+	// UTC seconds
+	uint32_t time;
+	// W
+	int32_t power;
+	// Wh, counter that only goes up until it is reset
+	int32_t energy;
+	// Raw values as read from the inverter, see SMA_KEY_TABLE for the scale
+	int32_t channels[CH_NUM];
+};
+
+struct s_codec_encoder
+{
+	uint8_t *buffer;
+	uint8_t size;
+	uint8_t len;
+	uint8_t mask;
+	uint8_t count;
+	s_codec_sample last;
+};
+
+void codec_begin(s_codec_encoder *enc, uint8_t *buffer, uint8_t size, uint8_t mask);
+bool codec_add(s_codec_encoder *enc, const s_codec_sample *sample);
+uint8_t codec_end(s_codec_encoder *enc);
+int codec_decode(const uint8_t *buffer, uint8_t len, s_codec_sample *samples, int max_samples, uint8_t *mask);
+
+#endif
@@ -0,0 +1,439 @@
+/**
+ * @file discovery.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Find inverters that changed their IP, e.g. after a new DHCP lease
+ * Runs when an inverter failed g_disc_fail_limit polls in a row, or with AT+DISC.
+ * The candidates are collected in this order, the probe runs only if the first two found no new device:
+ *   Speedwire multicast discovery
+ *   mDNS, HTTP services with a host name starting with SMA
+ *   Probe of the local /24 network, GET /dyn/login.json must answer with JSON
+ * Each failing inverter gets the first candidate that no other inverter uses and has the serial
+ * of the inverter. An inverter with an unknown serial is not moved, the candidates are only listed
+ * with AT+DISC. The new IP is saved in the preferences, after a reboot it is used without a new discovery.
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Default failed polls before the discovery starts */
+#define DISC_FAIL_DEFAULT 3
+
+/** Min time between two automatic runs, the inverters may just be switched off */
+#define DISC_MIN_INTERVAL 1800000
+
+/** Max candidates of a run */
+#define DISC_MAX_FOUND 8
+
+/** Time to wait for the Speedwire responses */
+#define DISC_SPEEDWIRE_TIME 2000
+
+/** Parallel probe tasks */
+#define DISC_PROBE_TASKS 6
+
+/** Connect timeout of a probe */
+#define DISC_PROBE_TIMEOUT 300
+
+/** Time to wait for the HTTP header of a probe */
+#define DISC_HEADER_TIMEOUT 1000
+
+/** Stack size of the probe tasks */
+#define DISC_STACK_SIZE 4096
+
+/** Stack size of the discovery task, it reads the serials of the candidates like a poll task */
+#define DISC_TASK_STACK 6144
+
+/** Failed polls before the discovery starts, 0 for no automatic discovery */
+uint8_t g_disc_fail_limit = DISC_FAIL_DEFAULT;
+
+/** Discovery task, NULL if no discovery is running */
+static TaskHandle_t disc_task = NULL;
+
+/** millis() of the start of the last run */
+static uint32_t last_run = 0;
+
+/** Runs since boot */
+static uint16_t num_runs = 0;
+
+/** Inverters moved to a new IP since boot */
+static uint16_t num_moved = 0;
+
+/** Candidates of the last run */
+static IPAddress found[DISC_MAX_FOUND];
+
+/** Number of candidates of the last run */
+static uint8_t num_found = 0;
+
+/** Serials of the candidates of the running discovery, 0 if not read yet */
+static uint32_t found_serial[DISC_MAX_FOUND];
+
+/** Protects the candidate list, it is filled by the probe tasks */
+static portMUX_TYPE found_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** Network of the probe, host part 0 */
+static uint32_t probe_net = 0;
+
+/** Next host of the probe */
+static uint16_t probe_next = 1;
+
+/** Signals finished probe tasks */
+static SemaphoreHandle_t probe_done = NULL;
+
+/**
+ * @brief Add a candidate if it is not in the list
+ *
+ * @param ip IP of the candidate
+ */
+static void add_found(IPAddress ip)
+{
+	if (((uint32_t)ip == 0) || (ip == WiFi.localIP()))
+	{
+		return;
+	}
+	portENTER_CRITICAL(&found_mux);
+	bool known = false;
+	for (uint8_t idx = 0; idx < num_found; idx++)
+	{
+		known |= found[idx] == ip;
+	}
+	if (!known && (num_found < DISC_MAX_FOUND))
+	{
+		found[num_found++] = ip;
+	}
+	portEXIT_CRITICAL(&found_mux);
+}
+
+/**
+ * @brief Check if a candidate is used by an inverter
+ *
+ * @param ip IP of the candidate
+ * @return true if an inverter has this IP
+ */
+static bool in_use(IPAddress ip)
+{
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		if (g_inverters[idx].ip == ip)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Check if there is a candidate no inverter uses
+ *
+ * @return true if a new device was found
+ */
+static bool has_new(void)
+{
+	for (uint8_t idx = 0; idx < num_found; idx++)
+	{
+		if (!in_use(found[idx]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Find SMA devices that announce themselves with mDNS
+ *
+ */
+static void find_mdns(void)
+{
+	int count = MDNS.queryService("http", "tcp");
+	for (int idx = 0; idx < count; idx++)
+	{
+		if (strncasecmp(MDNS.hostname(idx).c_str(), "SMA", 3) == 0)
+		{
+			add_found(MDNS.IP(idx));
+		}
+	}
+}
+
+/**
+ * @brief Check if a host has the SMA web API
+ *
+ * @param ip IP of the host
+ * @return true if GET /dyn/login.json returns JSON
+ */
+static bool probe_host(IPAddress ip)
+{
+	WiFiClient client;
+	if (client.connect(ip, 80, DISC_PROBE_TIMEOUT) != 1)
+	{
+		return false;
+	}
+	client.printf("GET /dyn/login.json HTTP/1.0\r\nHost: %s\r\n\r\n", ip.toString().c_str());
+
+	bool is_sma = false;
+	char line[64];
+	uint8_t len = 0;
+	uint32_t start_time = millis();
+	while (client.connected() && ((millis() - start_time) < DISC_HEADER_TIMEOUT))
+	{
+		int c = client.read();
+		if (c < 0)
+		{
+			delay(5);
+			continue;
+		}
+		if (c != '\n')
+		{
+			if ((c != '\r') && (len < sizeof(line) - 1))
+			{
+				line[len++] = tolower(c);
+			}
+			continue;
+		}
+		line[len] = 0;
+		if (len == 0)
+		{
+			// End of the header
+			break;
+		}
+		if ((strncmp(line, "content-type:", 13) == 0) && (strstr(line, "json") != NULL))
+		{
+			is_sma = true;
+			break;
+		}
+		len = 0;
+	}
+	client.stop();
+	return is_sma;
+}
+
+/**
+ * @brief Probe task, takes the next host of the network until all hosts are checked
+ *
+ * @param pvParameters not used
+ */
+static void probe_task(void *pvParameters)
+{
+	while (true)
+	{
+		portENTER_CRITICAL(&found_mux);
+		uint16_t host = probe_next++;
+		portEXIT_CRITICAL(&found_mux);
+		if (host > 254)
+		{
+			break;
+		}
+		IPAddress ip(probe_net | ((uint32_t)host << 24));
+		if ((ip != WiFi.localIP()) && (ip != WiFi.gatewayIP()) && probe_host(ip))
+		{
+			myLog_d("Discovery: web API at %s", ip.toString().c_str());
+			add_found(ip);
+		}
+	}
+	xSemaphoreGive(probe_done);
+	vTaskDelete(NULL);
+}
+
+/**
+ * @brief Probe all hosts of the local /24 network, DISC_PROBE_TASKS at a time
+ *
+ */
+static void find_probe(void)
+{
+	probe_net = (uint32_t)WiFi.localIP() & 0x00FFFFFF;
+	probe_next = 1;
+	uint8_t started = 0;
+	for (uint8_t idx = 0; idx < DISC_PROBE_TASKS; idx++)
+	{
+		if (xTaskCreate(probe_task, "Probe", DISC_STACK_SIZE, NULL, 1, NULL) == pdPASS)
+		{
+			started++;
+		}
+	}
+	for (uint8_t idx = 0; idx < started; idx++)
+	{
+		xSemaphoreTake(probe_done, portMAX_DELAY);
+	}
+}
+
+/**
+ * @brief Give the failing inverters the candidates no other inverter uses
+ * A candidate is only taken if it has the serial of the inverter
+ *
+ * @param all true to move every failing inverter, false only those over the fail limit
+ */
+static void assign_found(bool all)
+{
+	memset(found_serial, 0, sizeof(found_serial));
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		s_inverter *inv = &g_inverters[idx];
+		if ((inv->fails == 0) || (!all && (inv->fails < g_disc_fail_limit)))
+		{
+			continue;
+		}
+		if (inv->serial == 0)
+		{
+			myLog_e("Discovery: serial of inverter %d not known, not moved", idx);
+			continue;
+		}
+		for (uint8_t f_idx = 0; f_idx < num_found; f_idx++)
+		{
+			if (in_use(found[f_idx]))
+			{
+				continue;
+			}
+			if (found_serial[f_idx] == 0)
+			{
+				// Read with the password of this inverter, another inverter may have another password
+				found_serial[f_idx] = read_inverter_serial(idx, found[f_idx]);
+			}
+			if (found_serial[f_idx] != inv->serial)
+			{
+				myLog_d("Discovery: %s has serial %ld, not inverter %d", found[f_idx].toString().c_str(), found_serial[f_idx], idx);
+				continue;
+			}
+			myLog_d("Discovery: inverter %d moved from %s to %s", idx, inv->ip.toString().c_str(), found[f_idx].toString().c_str());
+			set_inverter_ip(idx, found[f_idx]);
+			num_moved++;
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Discovery task, runs once
+ *
+ * @param pvParameters true if started with AT+DISC
+ */
+static void discovery_task(void *pvParameters)
+{
+	bool manual = pvParameters != NULL;
+	uint32_t start_time = millis();
+	num_found = 0;
+
+	IPAddress list[DISC_MAX_FOUND];
+	uint8_t count = speedwire_discover(list, DISC_MAX_FOUND, DISC_SPEEDWIRE_TIME);
+	for (uint8_t idx = 0; idx < count; idx++)
+	{
+		add_found(list[idx]);
+	}
+	find_mdns();
+	if (!has_new())
+	{
+		find_probe();
+	}
+	myLog_d("Discovery: %d devices in %ld ms", num_found, millis() - start_time);
+
+	assign_found(manual);
+
+	Preferences preferences;
+	preferences.begin("Disc", false);
+	uint32_t list_ips[DISC_MAX_FOUND];
+	for (uint8_t idx = 0; idx < num_found; idx++)
+	{
+		list_ips[idx] = (uint32_t)found[idx];
+	}
+	preferences.putBytes("list", list_ips, num_found * sizeof(uint32_t));
+	preferences.end();
+
+	disc_task = NULL;
+	vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start a discovery now
+ *
+ * @return true if it was started, false if one is running or WiFi is not connected
+ */
+bool discovery_start(void)
+{
+	if ((disc_task != NULL) || !WiFi.isConnected())
+	{
+		return false;
+	}
+	last_run = millis();
+	num_runs++;
+	return xTaskCreate(discovery_task, "Disc", DISC_TASK_STACK, (void *)1, 1, &disc_task) == pdPASS;
+}
+
+/**
+ * @brief Called after each poll, starts the discovery if an inverter failed too often
+ *
+ */
+void discovery_check(void)
+{
+	if ((g_disc_fail_limit == 0) || (disc_task != NULL) || !WiFi.isConnected())
+	{
+		return;
+	}
+	if ((num_runs != 0) && ((millis() - last_run) < DISC_MIN_INTERVAL))
+	{
+		return;
+	}
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		if (g_inverters[idx].fails >= g_disc_fail_limit)
+		{
+			myLog_d("Discovery: inverter %d failed %d times", idx, g_inverters[idx].fails);
+			last_run = millis();
+			num_runs++;
+			xTaskCreate(discovery_task, "Disc", DISC_TASK_STACK, (void *)0, 1, &disc_task);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Get the discovery status for AT+DISC
+ * Fail limit, runs, moved inverters, running flag, then the devices of the last run
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void discovery_status(char *buffer, uint8_t size)
+{
+	int len = snprintf(buffer, size, "%d:%d:%d:%d", g_disc_fail_limit, num_runs, num_moved, disc_task != NULL);
+	if (disc_task != NULL)
+	{
+		return;
+	}
+	for (uint8_t idx = 0; (idx < num_found) && (len < size); idx++)
+	{
+		len += snprintf(&buffer[len], size - len, ",%d:%d:%d:%d", found[idx][0], found[idx][1], found[idx][2], found[idx][3]);
+	}
+}
+
+/**
+ * @brief Save the fail limit
+ *
+ */
+void save_discovery_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("Disc", false);
+	preferences.putUChar("n", g_disc_fail_limit);
+	preferences.end();
+}
+
+/**
+ * @brief Read the fail limit and the devices of the last run from the preferences
+ *
+ */
+void init_discovery(void)
+{
+	probe_done = xSemaphoreCreateCounting(DISC_PROBE_TASKS, 0);
+
+	Preferences preferences;
+	preferences.begin("Disc", false);
+	g_disc_fail_limit = preferences.getUChar("n", DISC_FAIL_DEFAULT);
+	uint32_t list_ips[DISC_MAX_FOUND];
+	size_t len = preferences.getBytes("list", list_ips, sizeof(list_ips));
+	preferences.end();
+	num_found = len / sizeof(uint32_t);
+	for (uint8_t idx = 0; idx < num_found; idx++)
+	{
+		found[idx] = IPAddress(list_ips[idx]);
+	}
+}
@@ -0,0 +1,247 @@
+/**
+ * @file downlink.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Remote commands over LoRaWAN downlinks
+ * A downlink on DOWNLINK_PORT holds one or more commands, each an opcode followed by its parameters (big endian).
+ * The settings are changed through the AT command table, so they get the same checks as the AT commands.
+ * The result of each command is sent back in an ACK uplink.
+ * @version 0.1
+ * @date 2021-10-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "at_cmd.h"
+
+/** fPort of the command downlinks */
+#define DOWNLINK_PORT 10
+
+/** Flag of the ACK uplink */
+#define FRAME_ACK 0x30
+
+/** Opcodes */
+#define OP_SEND_INTERVAL 0x01
+#define OP_POLL_NOW 0x02
+#define OP_BACKFILL 0x03
+#define OP_DATARATE 0x04
+#define OP_ADR 0x05
+#define OP_REBOOT 0x06
+
+/** Max intervals of a backfill request, one week */
+#define BACKFILL_MAX 2016
+
+/** Time between the reboot command and the reboot, leaves time to send the ACK */
+#define REBOOT_DELAY 30000
+
+/** Command handler
+ * @param param parameters of the command
+ * @return int 0 if success, AT_ERRNO_xxx otherwise
+ */
+typedef int (*downlink_handler_t)(uint8_t *param);
+
+struct s_opcode
+{
+	uint8_t opcode;
+	uint8_t param_size;
+	downlink_handler_t handler;
+};
+
+/** Scheduler job that processes the downlinks */
+static int8_t downlink_job_id = -1;
+
+/** Set by the reboot command, the next run of the job reboots */
+static bool reboot_pending = false;
+
+/**
+ * @brief Read a 16 bit big endian value
+ */
+static uint16_t get_16(uint8_t *param)
+{
+	return (param[0] << 8) | param[1];
+}
+
+/**
+ * @brief Call the setter of an AT command with a number
+ *
+ * @param cmd_name command as in the AT command table
+ * @param value value to set
+ * @return int 0 if success, AT_ERRNO_xxx otherwise
+ */
+static int set_value(const char *cmd_name, long value)
+{
+	char param[12];
+	snprintf(param, sizeof(param), "%ld", value);
+	return at_exec_cmd(cmd_name, param);
+}
+
+/**
+ * @brief Set the send interval in seconds, 0 stops the automatic polling
+ */
+static int op_send_interval(uint8_t *param)
+{
+	return set_value("+SENDFREQ", get_16(param));
+}
+
+/**
+ * @brief Poll the inverters now
+ */
+static int op_poll_now(uint8_t *param)
+{
+	poll_now();
+	return 0;
+}
+
+/**
+ * @brief Send the energy log of the last N 5 minute intervals
+ */
+static int op_backfill(uint8_t *param)
+{
+	uint16_t intervals = get_16(param);
+	if ((intervals == 0) || (intervals > BACKFILL_MAX))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	request_backfill(intervals);
+	return 0;
+}
+
+/**
+ * @brief Set the data rate
+ */
+static int op_datarate(uint8_t *param)
+{
+	return set_value("+DR", param[0]);
+}
+
+/**
+ * @brief Enable or disable ADR
+ */
+static int op_adr(uint8_t *param)
+{
+	return set_value("+ADR", param[0]);
+}
+
+/**
+ * @brief Reboot after the ACK was sent
+ */
+static int op_reboot(uint8_t *param)
+{
+	reboot_pending = true;
+	return 0;
+}
+
+/** Command table */
+static const s_opcode opcodes[] = {
+	{OP_SEND_INTERVAL, 2, op_send_interval},
+	{OP_POLL_NOW, 0, op_poll_now},
+	{OP_BACKFILL, 2, op_backfill},
+	{OP_DATARATE, 1, op_datarate},
+	{OP_ADR, 1, op_adr},
+	{OP_REBOOT, 0, op_reboot},
+};
+
+/**
+ * @brief Execute the commands of a downlink
+ * Processing stops at the first unknown or truncated command or when the ACK is full
+ *
+ * @param data downlink payload
+ * @param size payload size
+ * @param reply buffer for the ACK, flag and opcode + result for each command
+ * @param reply_size size of the ACK buffer
+ * @param reply_len set to the ACK size
+ * @return uint8_t number of executed commands
+ */
+uint8_t downlink_dispatch(uint8_t *data, uint8_t size, uint8_t *reply, uint8_t reply_size, uint8_t *reply_len)
+{
+	uint8_t pos = 0;
+	uint8_t num_cmds = 0;
+	*reply_len = 0;
+	reply[(*reply_len)++] = FRAME_ACK;
+
+	while ((pos < size) && (*reply_len + 2 <= reply_size))
+	{
+		uint8_t opcode = data[pos++];
+		const s_opcode *cmd = NULL;
+		for (uint8_t idx = 0; idx < sizeof(opcodes) / sizeof(s_opcode); idx++)
+		{
+			if (opcodes[idx].opcode == opcode)
+			{
+				cmd = &opcodes[idx];
+				break;
+			}
+		}
+
+		reply[(*reply_len)++] = opcode;
+		if (cmd == NULL)
+		{
+			myLog_e("Unknown downlink opcode %02X", opcode);
+			reply[(*reply_len)++] = AT_ERRNO_NOSUPP;
+			break;
+		}
+		if (pos + cmd->param_size > size)
+		{
+			myLog_e("Downlink opcode %02X truncated", opcode);
+			reply[(*reply_len)++] = AT_ERRNO_PARA_NUM;
+			break;
+		}
+		int result = cmd->handler(&data[pos]);
+		myLog_d("Downlink opcode %02X result %d", opcode, result);
+		reply[(*reply_len)++] = result;
+		pos += cmd->param_size;
+		num_cmds++;
+	}
+	return num_cmds;
+}
+
+/**
+ * @brief Scheduler job, process a received downlink or reboot after the reboot command
+ *
+ */
+static void downlink_job(void)
+{
+	if (reboot_pending && (g_rx_data_len == 0))
+	{
+		myLog_d("Reboot requested by downlink");
+		at_exec_cmd("Z", NULL);
+		return;
+	}
+
+	// Class A, the next downlink can only arrive after the next uplink
+	uint8_t data[256];
+	uint8_t size = g_rx_data_len;
+	memcpy(data, g_rx_lora_data, size);
+	g_rx_data_len = 0;
+	if ((size == 0) || (g_rx_port != DOWNLINK_PORT))
+	{
+		return;
+	}
+
+	uint8_t reply[UPLINK_MAX_PAYLOAD];
+	uint8_t reply_len;
+	downlink_dispatch(data, size, reply, lora_max_payload(), &reply_len);
+	send_lora_packet(reply, reply_len);
+
+	if (reboot_pending)
+	{
+		reschedule(downlink_job_id, REBOOT_DELAY, 0);
+	}
+}
+
+/**
+ * @brief Called from the LoRaWAN RX callback, the downlink is processed in the scheduler task
+ *
+ */
+void downlink_received(void)
+{
+	reschedule(downlink_job_id, 0, 0);
+}
+
+/**
+ * @brief Add the downlink job to the scheduler, it runs only when a downlink arrived
+ *
+ */
+void init_downlink(void)
+{
+	downlink_job_id = schedule("Dnl", downlink_job, 0, 0);
+	unschedule(downlink_job_id);
+}
@@ -0,0 +1,366 @@
+/**
+ * @file duty.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Airtime budget of the uplinks, rolling one hour window per duty cycle sub-band
+ * The MAC selects the channel only when sending, so every uplink is charged to all sub-bands
+ * that have an enabled channel and is sent only if all of them have budget left.
+ * @version 0.1
+ * @date 2021-10-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include "airtime.h"
+
+/** Slots of the rolling window */
+#define AIRTIME_SLOTS 12
+
+/** Length of a slot in ms, 12 slots of 5 minutes give one hour */
+#define AIRTIME_SLOT_TIME 300000
+
+/** Budget window in us */
+#define AIRTIME_WINDOW 3600000000UL
+
+/** Used budget in % from which the batching fills the packets up */
+#define AIRTIME_LOW_PERCENT 50
+
+/** Max sub-bands of a region */
+#define MAX_BANDS 5
+
+/** Channels checked for the sub-bands */
+#define MAX_CHANNELS 16
+
+/** Frequency of the first default channel of EU868, used before the MAC is up */
+#define DEFAULT_FREQ 868100000
+
+/** Duty cycle sub-band, duty cycle is 1 / duty_div */
+struct s_duty_band
+{
+	const char *name;
+	uint32_t min_freq;
+	uint32_t max_freq;
+	uint16_t duty_div;
+};
+
+/** Spreading factor and bandwidth of a data rate */
+struct s_dr
+{
+	uint8_t sf;
+	uint16_t bw;
+};
+
+/** ETSI EN300.220 sub-bands of EU868 */
+static const s_duty_band bands_eu868[] = {
+	{"g", 863000000, 868000000, 100},
+	{"g1", 868000000, 868600000, 100},
+	{"g2", 868700000, 869200000, 1000},
+	{"g3", 869400000, 869650000, 10},
+	{"g4", 869700000, 870000000, 100},
+};
+
+/** Regions with one 1% band (EU433, CN779, RU864) */
+static const s_duty_band bands_1p[] = {
+	{"all", 0, 0xFFFFFFFF, 100},
+};
+
+/** Data rates of EU868 like regions */
+static const s_dr dr_eu[] = {{12, 125}, {11, 125}, {10, 125}, {9, 125}, {8, 125}, {7, 125}, {7, 250}, {SF_FSK, 0}};
+
+/** Data rates of US915 */
+static const s_dr dr_us[] = {{10, 125}, {9, 125}, {8, 125}, {7, 125}, {8, 500}};
+
+/** Data rates of AU915 */
+static const s_dr dr_au[] = {{12, 125}, {11, 125}, {10, 125}, {9, 125}, {8, 125}, {7, 125}, {8, 500}};
+
+/** Used airtime in us per band and slot */
+static uint32_t used_us[MAX_BANDS][AIRTIME_SLOTS];
+
+/** Slot number + 1 of the entries in used_us, 0 for empty */
+static uint32_t slot_ids[MAX_BANDS][AIRTIME_SLOTS];
+
+/** Uplinks held back because the budget was used up */
+static uint32_t deferred = 0;
+
+/** Protects the budget, it is charged by the scheduler and checked by the LoRa task */
+static portMUX_TYPE airtime_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Get the sub-bands of the current region
+ *
+ * @param count set to the number of bands
+ * @return const s_duty_band* band table, NULL if the region has no duty cycle limit
+ */
+static const s_duty_band *get_bands(uint8_t *count)
+{
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_EU868:
+		*count = sizeof(bands_eu868) / sizeof(s_duty_band);
+		return bands_eu868;
+	case LORAMAC_REGION_EU433:
+	case LORAMAC_REGION_CN779:
+	case LORAMAC_REGION_RU864:
+		*count = sizeof(bands_1p) / sizeof(s_duty_band);
+		return bands_1p;
+	default:
+		*count = 0;
+		return NULL;
+	}
+}
+
+/**
+ * @brief Find the sub-bands with an enabled channel
+ *
+ * @param bands band table
+ * @param count number of bands
+ * @return uint8_t bit n set if band n has an enabled channel
+ */
+static uint8_t active_bands(const s_duty_band *bands, uint8_t count)
+{
+	if (count == 1)
+	{
+		return 0x01;
+	}
+
+	uint8_t active = 0;
+	uint32_t frequencies[MAX_CHANNELS] = {0};
+	if (g_lorawan_initialized)
+	{
+		MibRequestConfirm_t mib_req;
+		mib_req.Type = MIB_CHANNELS;
+		if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK)
+		{
+			ChannelParams_t *channels = mib_req.Param.ChannelList;
+			mib_req.Type = MIB_CHANNELS_MASK;
+			if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK)
+			{
+				for (uint8_t ch = 0; ch < MAX_CHANNELS; ch++)
+				{
+					if (mib_req.Param.ChannelsMask[0] & (1 << ch))
+					{
+						frequencies[ch] = channels[ch].Frequency;
+					}
+				}
+			}
+		}
+	}
+	if (frequencies[0] == 0)
+	{
+		frequencies[0] = DEFAULT_FREQ;
+	}
+
+	for (uint8_t ch = 0; ch < MAX_CHANNELS; ch++)
+	{
+		for (uint8_t band = 0; band < count; band++)
+		{
+			if ((frequencies[ch] >= bands[band].min_freq) && (frequencies[ch] < bands[band].max_freq))
+			{
+				active |= 1 << band;
+			}
+		}
+	}
+	return active;
+}
+
+/**
+ * @brief Used airtime of a band in the rolling window
+ *
+ * @param band band index
+ * @param slot current slot number + 1
+ * @return uint32_t used airtime in us
+ */
+static uint32_t band_used(uint8_t band, uint32_t slot)
+{
+	uint32_t used = 0;
+	for (uint8_t idx = 0; idx < AIRTIME_SLOTS; idx++)
+	{
+		if ((slot_ids[band][idx] != 0) && (slot - slot_ids[band][idx] < AIRTIME_SLOTS))
+		{
+			used += used_us[band][idx];
+		}
+	}
+	return used;
+}
+
+/**
+ * @brief Get the current slot number + 1
+ */
+static uint32_t current_slot(void)
+{
+	return millis() / AIRTIME_SLOT_TIME + 1;
+}
+
+/**
+ * @brief Time on air of an uplink with the current region and data rate
+ *
+ * @param size application payload size
+ * @return uint32_t time on air in us
+ */
+uint32_t airtime_of(uint8_t size)
+{
+	const s_dr *table = dr_eu;
+	uint8_t table_size = sizeof(dr_eu) / sizeof(s_dr);
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_US915:
+		table = dr_us;
+		table_size = sizeof(dr_us) / sizeof(s_dr);
+		break;
+	case LORAMAC_REGION_AU915:
+		table = dr_au;
+		table_size = sizeof(dr_au) / sizeof(s_dr);
+		break;
+	default:
+		break;
+	}
+	uint8_t data_rate = lora_datarate();
+	if (data_rate >= table_size)
+	{
+		// Unknown data rate, assume the slowest
+		data_rate = 0;
+	}
+	return uplink_time_on_air(table[data_rate].sf, table[data_rate].bw, size);
+}
+
+/**
+ * @brief Check if an uplink fits into the budget of all active sub-bands
+ *
+ * @param size application payload size
+ * @return true if the uplink can be sent
+ */
+bool airtime_allowed(uint8_t size)
+{
+	uint8_t count;
+	const s_duty_band *bands = get_bands(&count);
+	if (bands == NULL)
+	{
+		return true;
+	}
+
+	uint32_t toa = airtime_of(size);
+	uint8_t active = active_bands(bands, count);
+	uint32_t slot = current_slot();
+	bool allowed = true;
+	portENTER_CRITICAL(&airtime_mux);
+	for (uint8_t band = 0; band < count; band++)
+	{
+		if ((active & (1 << band)) && (band_used(band, slot) + toa > AIRTIME_WINDOW / bands[band].duty_div))
+		{
+			allowed = false;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&airtime_mux);
+	return allowed;
+}
+
+/**
+ * @brief Count an uplink held back by the budget, called once per packet
+ *
+ */
+void airtime_deferred(void)
+{
+	portENTER_CRITICAL(&airtime_mux);
+	deferred++;
+	portEXIT_CRITICAL(&airtime_mux);
+}
+
+/**
+ * @brief Charge a sent uplink to all active sub-bands
+ *
+ * @param size application payload size
+ */
+void airtime_charge(uint8_t size)
+{
+	uint8_t count;
+	const s_duty_band *bands = get_bands(&count);
+	if (bands == NULL)
+	{
+		return;
+	}
+
+	uint32_t toa = airtime_of(size);
+	uint8_t active = active_bands(bands, count);
+	uint32_t slot = current_slot();
+	uint8_t idx = slot % AIRTIME_SLOTS;
+	portENTER_CRITICAL(&airtime_mux);
+	for (uint8_t band = 0; band < count; band++)
+	{
+		if ((active & (1 << band)) == 0)
+		{
+			continue;
+		}
+		if (slot_ids[band][idx] != slot)
+		{
+			slot_ids[band][idx] = slot;
+			used_us[band][idx] = 0;
+		}
+		used_us[band][idx] += toa;
+	}
+	portEXIT_CRITICAL(&airtime_mux);
+}
+
+/**
+ * @brief Check if the budget runs low, the batching then fills the packets to the max payload
+ *
+ * @return true if an active sub-band used more than AIRTIME_LOW_PERCENT of its budget
+ */
+bool airtime_low(void)
+{
+	uint8_t count;
+	const s_duty_band *bands = get_bands(&count);
+	if (bands == NULL)
+	{
+		return false;
+	}
+
+	uint8_t active = active_bands(bands, count);
+	uint32_t slot = current_slot();
+	bool low = false;
+	portENTER_CRITICAL(&airtime_mux);
+	for (uint8_t band = 0; band < count; band++)
+	{
+		if ((active & (1 << band)) && (band_used(band, slot) > AIRTIME_WINDOW / bands[band].duty_div / 100 * AIRTIME_LOW_PERCENT))
+		{
+			low = true;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&airtime_mux);
+	return low;
+}
+
+/**
+ * @brief Write the budget status for AT+AIRTIME
+ * Time on air of a max size packet, deferred uplinks, then name, used and budget in ms of each active sub-band
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @return uint8_t length of the text
+ */
+uint8_t airtime_status(char *buffer, uint8_t size)
+{
+	int len = snprintf(buffer, size, "%ld:%ld", airtime_of(lora_max_payload()) / 1000, deferred);
+
+	uint8_t count;
+	const s_duty_band *bands = get_bands(&count);
+	if (bands == NULL)
+	{
+		return len;
+	}
+	uint8_t active = active_bands(bands, count);
+	uint32_t slot = current_slot();
+	for (uint8_t band = 0; (band < count) && (len < size); band++)
+	{
+		if ((active & (1 << band)) == 0)
+		{
+			continue;
+		}
+		portENTER_CRITICAL(&airtime_mux);
+		uint32_t used = band_used(band, slot);
+		portEXIT_CRITICAL(&airtime_mux);
+		len += snprintf(&buffer[len], size - len, ":%s:%ld:%ld", bands[band].name, used / 1000, AIRTIME_WINDOW / bands[band].duty_div / 1000);
+	}
+	return len < size ? len : size - 1;
+}
@@ -0,0 +1,770 @@
+/**
+ * @file history.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Time series store of the samples on a raw flash partition
+ *
+ * The store has four levels, every sample and the 5 minute, hour and day rollups.
+ * Each level has its own sectors, used as a ring. Records are only appended, a sector is
+ * erased when the ring wraps around, so every sector is erased equally often.
+ *
+ * Sector header, little endian:
+ *   0  magic HIST_MAGIC
+ *   4  level
+ *   5  version
+ *   6  reserved
+ *   7  CRC8 of the header
+ *   8  sequence number, increased with every new sector of the level
+ *   12 erase count of the sector
+ *   16 UTC time of the first record
+ *   20 total energy of the first record
+ *
+ * Record, 12 bytes:
+ *   0  time after the base of the sector, in units of the level period, 24 bit
+ *   3  total energy after the base of the sector in Wh, 24 bit
+ *   6  power, W
+ *   8  peak power, W
+ *   10 samples of the rollup
+ *   11 CRC8 of the record
+ *
+ * A record is decoded without its neighbours, so a record can be found with a binary search
+ * in the sector. A sample that does not fit the offsets of the sector starts a new sector.
+ * The day index has the first record of each day, a range read starts there without a search
+ * over all sectors.
+ *
+ * The rollups are kept in RAM until their period is over, the open period is lost on a reboot.
+ *
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "history.h"
+#include <string.h>
+
+/** Magic of a sector header, "HST1" */
+#define HIST_MAGIC 0x31545348
+
+/** Version of the record format */
+#define HIST_VERSION 1
+
+/** Max time offset of a record, 0xFFFFFF is the erased flash */
+#define HIST_MAX_OFFSET 0xFFFFFE
+
+/** Seconds of a day */
+#define HIST_DAY 86400
+
+/** Sector header */
+struct s_hist_header
+{
+	uint32_t magic;
+	uint8_t level;
+	uint8_t version;
+	uint8_t reserved;
+	uint8_t check;
+	uint32_t seq;
+	uint32_t erases;
+	uint32_t base_utc;
+	uint32_t base_energy;
+};
+
+static_assert(sizeof(s_hist_header) == HIST_HEADER_SIZE, "s_hist_header does not match HIST_HEADER_SIZE");
+
+/** Sectors and period of the levels, all sectors of the store are used */
+static const struct
+{
+	uint8_t sectors;
+	uint32_t unit;
+} hist_levels[HIST_LEVELS] = {
+	{6, 1},		   // HIST_LVL_RAW
+	{5, 300},	   // HIST_LVL_5MIN
+	{3, 3600},	   // HIST_LVL_HOUR
+	{2, HIST_DAY}, // HIST_LVL_DAY
+};
+
+static_assert(6 + 5 + 3 + 2 == HIST_SECTORS, "hist_levels does not match HIST_SECTORS");
+
+/**
+ * @brief CRC8, polynom 0x07
+ */
+static uint8_t crc8(const uint8_t *data, size_t len)
+{
+	uint8_t crc = 0;
+	for (size_t idx = 0; idx < len; idx++)
+	{
+		crc ^= data[idx];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/**
+ * @brief Read a little endian 24 bit value
+ */
+static uint32_t get_le24(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | ((uint32_t)ptr[2] << 16);
+}
+
+/**
+ * @brief Write a little endian 24 bit value
+ */
+static void put_le24(uint8_t *ptr, uint32_t value)
+{
+	ptr[0] = value & 0xFF;
+	ptr[1] = (value >> 8) & 0xFF;
+	ptr[2] = (value >> 16) & 0xFF;
+}
+
+/**
+ * @brief Read a little endian 16 bit value
+ */
+static uint16_t get_le16(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8);
+}
+
+/**
+ * @brief Write a little endian 16 bit value
+ */
+static void put_le16(uint8_t *ptr, uint16_t value)
+{
+	ptr[0] = value & 0xFF;
+	ptr[1] = value >> 8;
+}
+
+/**
+ * @brief Address of a record in the store
+ */
+static uint32_t slot_address(const s_hist_ring *ring, uint8_t sector, uint16_t slot)
+{
+	return (ring->first + sector) * HIST_SECTOR_SIZE + HIST_HEADER_SIZE + slot * HIST_RECORD_SIZE;
+}
+
+/**
+ * @brief Next sector of the ring
+ */
+static uint8_t next_sector(const s_hist_ring *ring, uint8_t sector)
+{
+	return (sector + 1) % ring->count;
+}
+
+/**
+ * @brief Read and check a sector header
+ *
+ * @param hist the store
+ * @param level level of the sector
+ * @param sector sector of the ring
+ * @param header output
+ * @return true if the header is valid
+ */
+static bool read_header(s_history *hist, uint8_t level, uint8_t sector, s_hist_header *header)
+{
+	const s_hist_ring *ring = &hist->rings[level];
+	if (!hist->flash->read((ring->first + sector) * HIST_SECTOR_SIZE, header, sizeof(s_hist_header)))
+	{
+		return false;
+	}
+	uint8_t check = header->check;
+	header->check = 0;
+	return (header->magic == HIST_MAGIC) && (header->level == level) && (header->version == HIST_VERSION) &&
+		   (crc8((const uint8_t *)header, sizeof(s_hist_header)) == check);
+}
+
+/**
+ * @brief Read and decode a record
+ *
+ * @param hist the store
+ * @param ring level of the record
+ * @param sector sector of the ring
+ * @param slot slot in the sector
+ * @param point output, can be NULL
+ * @return int 1 if valid, 0 if the slot is empty, -1 if the record is damaged
+ */
+static int read_record(s_history *hist, const s_hist_ring *ring, uint8_t sector, uint16_t slot, s_hist_point *point)
+{
+	uint8_t record[HIST_RECORD_SIZE];
+	if (!hist->flash->read(slot_address(ring, sector, slot), record, HIST_RECORD_SIZE))
+	{
+		return -1;
+	}
+	bool empty = true;
+	for (uint8_t idx = 0; idx < HIST_RECORD_SIZE; idx++)
+	{
+		empty &= record[idx] == 0xFF;
+	}
+	if (empty)
+	{
+		return 0;
+	}
+	if (crc8(record, HIST_RECORD_SIZE - 1) != record[HIST_RECORD_SIZE - 1])
+	{
+		return -1;
+	}
+	if (point != NULL)
+	{
+		point->utc = ring->sector_utc[sector] + get_le24(&record[0]) * ring->unit;
+		point->energy = ring->sector_energy[sector] + get_le24(&record[3]);
+		point->power = get_le16(&record[6]);
+		point->peak = get_le16(&record[8]);
+		point->samples = record[10];
+	}
+	return 1;
+}
+
+/**
+ * @brief Find the first empty slot of a sector, the records are written without gaps
+ */
+static uint16_t find_used(s_history *hist, const s_hist_ring *ring, uint8_t sector)
+{
+	uint16_t low = 0;
+	uint16_t high = HIST_SLOTS;
+	while (low < high)
+	{
+		uint16_t mid = (low + high) / 2;
+		if (read_record(hist, ring, sector, mid, NULL) == 0)
+		{
+			high = mid;
+		}
+		else
+		{
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+/**
+ * @brief Find the first record of a sector at or after a time
+ * Damaged records are skipped
+ *
+ * @param hist the store
+ * @param ring level of the sector
+ * @param sector sector of the ring
+ * @param utc UTC time
+ * @param low first slot to check
+ * @return uint16_t slot of the record, used[sector] if there is none
+ */
+static uint16_t find_slot(s_history *hist, const s_hist_ring *ring, uint8_t sector, uint32_t utc, uint16_t low)
+{
+	uint16_t high = ring->used[sector];
+	while (low < high)
+	{
+		uint16_t mid = (low + high) / 2;
+		uint16_t probe = mid;
+		s_hist_point point;
+		while ((probe < high) && (read_record(hist, ring, sector, probe, &point) != 1))
+		{
+			probe++;
+		}
+		if ((probe < high) && (point.utc < utc))
+		{
+			low = probe + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**
+ * @brief Set the first record of a day, an older day in the same index entry is replaced
+ */
+static void set_day(s_hist_ring *ring, uint32_t utc, uint8_t sector, uint16_t slot)
+{
+	uint16_t day = utc / HIST_DAY;
+	s_hist_day *entry = &ring->days[day % HIST_DAY_SLOTS];
+	entry->day = day;
+	entry->pos = (sector << 12) | slot;
+}
+
+/**
+ * @brief Find the first and last valid record of a sector
+ *
+ * @return true if the sector has a valid record
+ */
+static bool sector_range(s_history *hist, const s_hist_ring *ring, uint8_t sector, s_hist_point *first, uint16_t *first_slot, s_hist_point *last)
+{
+	int16_t slot = 0;
+	while ((slot < ring->used[sector]) && (read_record(hist, ring, sector, slot, first) != 1))
+	{
+		slot++;
+	}
+	if (slot == ring->used[sector])
+	{
+		return false;
+	}
+	*first_slot = slot;
+	slot = ring->used[sector] - 1;
+	while (read_record(hist, ring, sector, slot, last) != 1)
+	{
+		slot--;
+	}
+	return true;
+}
+
+/**
+ * @brief Update the day index before a sector is erased
+ * A day that goes on in the new oldest sector starts there, the other days of the sector are removed
+ *
+ * @param hist the store
+ * @param ring level of the sector
+ * @param sector the sector, the oldest sector must already be the next one
+ */
+static void drop_days(s_history *hist, s_hist_ring *ring, uint8_t sector)
+{
+	s_hist_point first;
+	s_hist_point last;
+	uint16_t first_slot = 0;
+	bool has_next = (sector != ring->oldest) && sector_range(hist, ring, ring->oldest, &first, &first_slot, &last);
+	for (uint8_t idx = 0; idx < HIST_DAY_SLOTS; idx++)
+	{
+		s_hist_day *entry = &ring->days[idx];
+		if ((entry->day == 0) || ((entry->pos >> 12) != sector))
+		{
+			continue;
+		}
+		if (has_next && (entry->day == first.utc / HIST_DAY))
+		{
+			entry->pos = (ring->oldest << 12) | first_slot;
+		}
+		else
+		{
+			entry->day = 0;
+		}
+	}
+}
+
+/**
+ * @brief Read the sector headers of a level, find the head and build the day index
+ *
+ * @param hist the store
+ * @param level level to mount
+ */
+static void mount_level(s_history *hist, uint8_t level)
+{
+	s_hist_ring *ring = &hist->rings[level];
+	ring->head = 0xFF;
+	ring->oldest = 0;
+	ring->seq = 0;
+	ring->last_utc = 0;
+	memset(ring->days, 0, sizeof(ring->days));
+
+	bool valid[HIST_MAX_RING];
+	for (uint8_t sector = 0; sector < ring->count; sector++)
+	{
+		s_hist_header header;
+		valid[sector] = read_header(hist, level, sector, &header);
+		ring->used[sector] = 0;
+		ring->erases[sector] = header.magic == HIST_MAGIC ? header.erases : 0;
+		if (!valid[sector])
+		{
+			continue;
+		}
+		ring->sector_utc[sector] = header.base_utc;
+		ring->sector_energy[sector] = header.base_energy;
+		ring->used[sector] = find_used(hist, ring, sector);
+		if ((ring->head == 0xFF) || (header.seq > ring->seq))
+		{
+			ring->head = sector;
+			ring->seq = header.seq;
+		}
+	}
+	if (ring->head == 0xFF)
+	{
+		return;
+	}
+
+	// The sectors are written in ring order, the oldest is the first valid one after the head
+	ring->oldest = next_sector(ring, ring->head);
+	while (!valid[ring->oldest])
+	{
+		ring->oldest = next_sector(ring, ring->oldest);
+	}
+	// First record of each day
+	uint16_t last_day = 0;
+	for (uint8_t sector = ring->oldest;; sector = next_sector(ring, sector))
+	{
+		s_hist_point first;
+		s_hist_point last;
+		uint16_t first_slot;
+		if (sector_range(hist, ring, sector, &first, &first_slot, &last))
+		{
+			for (uint16_t day = first.utc / HIST_DAY; day <= last.utc / HIST_DAY; day++)
+			{
+				if (day == last_day)
+				{
+					continue;
+				}
+				uint16_t slot = day == first.utc / HIST_DAY ? first_slot : find_slot(hist, ring, sector, day * HIST_DAY, first_slot);
+				if (slot < ring->used[sector])
+				{
+					set_day(ring, day * HIST_DAY, sector, slot);
+				}
+			}
+			last_day = last.utc / HIST_DAY;
+			ring->last_utc = last.utc;
+		}
+		if (sector == ring->head)
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Mount the store, the flash is only read
+ *
+ * @param hist the store
+ * @param flash access to the flash
+ * @return true if any level has records
+ */
+bool hist_mount(s_history *hist, const s_hist_flash *flash)
+{
+	memset(hist, 0, sizeof(s_history));
+	hist->flash = flash;
+	uint8_t first = 0;
+	bool has_records = false;
+	for (uint8_t level = 0; level < HIST_LEVELS; level++)
+	{
+		s_hist_ring *ring = &hist->rings[level];
+		ring->first = first;
+		ring->count = hist_levels[level].sectors;
+		ring->unit = hist_levels[level].unit;
+		first += ring->count;
+		mount_level(hist, level);
+		has_records |= ring->head != 0xFF;
+	}
+	return has_records;
+}
+
+/**
+ * @brief Erase all records
+ *
+ * @param hist the store, must be mounted
+ */
+void hist_format(s_history *hist)
+{
+	const s_hist_flash *flash = hist->flash;
+	for (uint8_t sector = 0; sector < HIST_SECTORS; sector++)
+	{
+		flash->erase(sector);
+	}
+	hist_mount(hist, flash);
+}
+
+/**
+ * @brief Start a new sector of a level, the oldest sector is erased if the ring is full
+ *
+ * @param hist the store
+ * @param level level of the sector
+ * @param utc time of the first record
+ * @param energy total energy of the first record
+ * @return true if the sector is ready
+ */
+static bool open_sector(s_history *hist, uint8_t level, uint32_t utc, uint32_t energy)
+{
+	s_hist_ring *ring = &hist->rings[level];
+	uint8_t sector = ring->head == 0xFF ? 0 : next_sector(ring, ring->head);
+	if (ring->head == 0xFF)
+	{
+		ring->oldest = sector;
+	}
+	else if (sector == ring->oldest)
+	{
+		ring->oldest = next_sector(ring, sector);
+	}
+	drop_days(hist, ring, sector);
+	ring->used[sector] = 0;
+
+	// Keep the erase count of the sector
+	s_hist_header header;
+	if (!hist->flash->read((ring->first + sector) * HIST_SECTOR_SIZE, &header, sizeof(s_hist_header)) || (header.magic != HIST_MAGIC))
+	{
+		header.erases = ring->erases[sector];
+	}
+	ring->erases[sector] = header.erases + 1;
+	hist->stats.erased++;
+	if (!hist->flash->erase(ring->first + sector))
+	{
+		return false;
+	}
+
+	header.magic = HIST_MAGIC;
+	header.level = level;
+	header.version = HIST_VERSION;
+	header.reserved = 0;
+	header.check = 0;
+	header.seq = ++ring->seq;
+	header.erases = ring->erases[sector];
+	header.base_utc = utc;
+	header.base_energy = energy;
+	header.check = crc8((const uint8_t *)&header, sizeof(s_hist_header));
+	hist->stats.written_bytes += sizeof(s_hist_header);
+	if (!hist->flash->write((ring->first + sector) * HIST_SECTOR_SIZE, &header, sizeof(s_hist_header)))
+	{
+		return false;
+	}
+
+	ring->head = sector;
+	ring->sector_utc[sector] = utc;
+	ring->sector_energy[sector] = energy;
+	return true;
+}
+
+/**
+ * @brief Append a record to a level
+ *
+ * @param hist the store
+ * @param level level of the record
+ * @param point the record, the time must be after the last record of the level
+ * @return true if the record was written
+ */
+static bool append(s_history *hist, uint8_t level, const s_hist_point *point)
+{
+	s_hist_ring *ring = &hist->rings[level];
+	uint8_t head = ring->head;
+	if ((head != 0xFF) && (point->utc <= ring->last_utc))
+	{
+		return false;
+	}
+	if ((head == 0xFF) || (ring->used[head] >= HIST_SLOTS) || (point->energy < ring->sector_energy[head]) ||
+		(point->energy - ring->sector_energy[head] > HIST_MAX_OFFSET) ||
+		((point->utc - ring->sector_utc[head]) / ring->unit > HIST_MAX_OFFSET))
+	{
+		if (!open_sector(hist, level, point->utc, point->energy))
+		{
+			hist->stats.errors++;
+			return false;
+		}
+		head = ring->head;
+	}
+
+	uint8_t record[HIST_RECORD_SIZE];
+	put_le24(&record[0], (point->utc - ring->sector_utc[head]) / ring->unit);
+	put_le24(&record[3], point->energy - ring->sector_energy[head]);
+	put_le16(&record[6], point->power);
+	put_le16(&record[8], point->peak);
+	record[10] = point->samples;
+	record[11] = crc8(record, HIST_RECORD_SIZE - 1);
+
+	// A failed write can leave a damaged record, the slot is not used again
+	uint16_t slot = ring->used[head]++;
+	hist->stats.written_bytes += HIST_RECORD_SIZE;
+	if (!hist->flash->write(slot_address(ring, head, slot), record, HIST_RECORD_SIZE))
+	{
+		hist->stats.errors++;
+		return false;
+	}
+	if ((ring->last_utc == 0) || (point->utc / HIST_DAY != ring->last_utc / HIST_DAY))
+	{
+		set_day(ring, point->utc, head, slot);
+	}
+	ring->last_utc = point->utc;
+	return true;
+}
+
+/**
+ * @brief Add a sample, the rollups of the periods that are over are written as well
+ *
+ * @param hist the store
+ * @param utc UTC time of the sample, must be after the last sample
+ * @param power power in W, negative values are stored as 0
+ * @param energy total energy in Wh
+ * @return true if the sample was written
+ */
+bool hist_add(s_history *hist, uint32_t utc, int power, uint32_t energy)
+{
+	s_hist_point point;
+	point.utc = utc;
+	point.power = power < 0 ? 0 : (power >= HIST_NO_POWER ? HIST_NO_POWER - 1 : power);
+	point.peak = point.power;
+	point.samples = 1;
+	point.energy = energy;
+	if (!append(hist, HIST_LVL_RAW, &point))
+	{
+		return false;
+	}
+	hist->stats.samples++;
+	hist->stats.payload_bytes += sizeof(utc) + sizeof(point.power) + sizeof(energy);
+
+	for (uint8_t level = HIST_LVL_5MIN; level < HIST_LEVELS; level++)
+	{
+		s_hist_rollup *rollup = &hist->rollups[level];
+		uint32_t unit = hist->rings[level].unit;
+		// A sample at the end of a period belongs to it, like the entries of the inverter log
+		uint32_t end = ((utc + unit - 1) / unit) * unit;
+		if ((rollup->count != 0) && (rollup->end != end))
+		{
+			s_hist_point sum;
+			sum.utc = rollup->end;
+			sum.power = rollup->power_sum / rollup->count;
+			sum.peak = rollup->peak;
+			sum.samples = rollup->count > 255 ? 255 : rollup->count;
+			sum.energy = rollup->energy;
+			append(hist, level, &sum);
+			memset(rollup, 0, sizeof(s_hist_rollup));
+		}
+		rollup->end = end;
+		rollup->power_sum += point.power;
+		rollup->peak = point.power > rollup->peak ? point.power : rollup->peak;
+		rollup->count++;
+		rollup->energy = energy;
+	}
+	return true;
+}
+
+/**
+ * @brief Find the first record of a level at or after a time
+ * The day index gives the first record of the day, the rest is a binary search in the sector
+ *
+ * @param hist the store
+ * @param level level to search
+ * @param utc UTC time
+ * @param pos output, position of the record
+ * @return true if there is a record
+ */
+bool hist_seek(s_history *hist, uint8_t level, uint32_t utc, s_hist_pos *pos)
+{
+	s_hist_ring *ring = &hist->rings[level];
+	if (ring->head == 0xFF)
+	{
+		return false;
+	}
+
+	uint8_t sector = ring->oldest;
+	uint16_t slot = 0;
+	const s_hist_day *entry = &ring->days[(utc / HIST_DAY) % HIST_DAY_SLOTS];
+	if ((entry->day != 0) && (entry->day == utc / HIST_DAY))
+	{
+		sector = entry->pos >> 12;
+		slot = entry->pos & 0x0FFF;
+	}
+	else
+	{
+		// Last sector that starts at or before the time
+		for (uint8_t check = ring->oldest;; check = next_sector(ring, check))
+		{
+			if ((ring->used[check] != 0) && (ring->sector_utc[check] <= utc))
+			{
+				sector = check;
+			}
+			if (check == ring->head)
+			{
+				break;
+			}
+		}
+	}
+
+	while (true)
+	{
+		slot = find_slot(hist, ring, sector, utc, slot);
+		if (slot < ring->used[sector])
+		{
+			pos->sector = sector;
+			pos->slot = slot;
+			return true;
+		}
+		if (sector == ring->head)
+		{
+			return false;
+		}
+		sector = next_sector(ring, sector);
+		slot = 0;
+	}
+}
+
+/**
+ * @brief Read the records of a time range
+ *
+ * @param hist the store
+ * @param level level to read
+ * @param from UTC time of the first record
+ * @param to UTC time of the last record
+ * @param points output
+ * @param max_points size of the output
+ * @return int number of records, oldest first
+ */
+int hist_read(s_history *hist, uint8_t level, uint32_t from, uint32_t to, s_hist_point *points, int max_points)
+{
+	s_hist_pos pos;
+	if ((level >= HIST_LEVELS) || !hist_seek(hist, level, from, &pos))
+	{
+		return 0;
+	}
+	const s_hist_ring *ring = &hist->rings[level];
+	int count = 0;
+	while (count < max_points)
+	{
+		if (pos.slot >= ring->used[pos.sector])
+		{
+			if (pos.sector == ring->head)
+			{
+				break;
+			}
+			pos.sector = next_sector(ring, pos.sector);
+			pos.slot = 0;
+			continue;
+		}
+		int result = read_record(hist, ring, pos.sector, pos.slot++, &points[count]);
+		if (result != 1)
+		{
+			continue;
+		}
+		if (points[count].utc > to)
+		{
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+/**
+ * @brief Get the number of records of a level, damaged records included
+ */
+uint32_t hist_records(s_history *hist, uint8_t level)
+{
+	const s_hist_ring *ring = &hist->rings[level];
+	uint32_t count = 0;
+	for (uint8_t sector = 0; sector < ring->count; sector++)
+	{
+		count += ring->used[sector];
+	}
+	return count;
+}
+
+/**
+ * @brief Get the time of the oldest record of a level
+ *
+ * @return uint32_t UTC time, 0 if the level is empty
+ */
+uint32_t hist_oldest(s_history *hist, uint8_t level)
+{
+	const s_hist_ring *ring = &hist->rings[level];
+	return ring->head == 0xFF ? 0 : ring->sector_utc[ring->oldest];
+}
+
+/**
+ * @brief Get the highest erase count of all sectors
+ */
+uint32_t hist_max_erases(s_history *hist)
+{
+	uint32_t max_erases = 0;
+	for (uint8_t level = 0; level < HIST_LEVELS; level++)
+	{
+		for (uint8_t sector = 0; sector < hist->rings[level].count; sector++)
+		{
+			if (hist->rings[level].erases[sector] > max_erases)
+			{
+				max_erases = hist->rings[level].erases[sector];
+			}
+		}
+	}
+	return max_erases;
+}
@@ -0,0 +1,159 @@
+/**
+ * @file history.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Time series store of the samples on a raw flash partition
+ * Plain C++ without Arduino dependencies, the flash is accessed through s_hist_flash,
+ * so the same code can be used on a PC with a file as flash
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Erase unit of the flash
+#define HIST_SECTOR_SIZE 4096
+
+// Sectors of the store, the 64 kB history partition
+#define HIST_SECTORS 16
+
+// Size of the sector header
+#define HIST_HEADER_SIZE 24
+
+// Size of a record
+#define HIST_RECORD_SIZE 12
+
+// Records in a sector
+#define HIST_SLOTS ((HIST_SECTOR_SIZE - HIST_HEADER_SIZE) / HIST_RECORD_SIZE)
+
+// Levels of the store, every sample and the rollups
+#define HIST_LVL_RAW 0
+#define HIST_LVL_5MIN 1
+#define HIST_LVL_HOUR 2
+#define HIST_LVL_DAY 3
+#define HIST_LEVELS 4
+
+// Max sectors of a level
+#define HIST_MAX_RING 8
+
+// Entries of the day index of a level
+#define HIST_DAY_SLOTS 64
+
+// Power value of a record without power
+#define HIST_NO_POWER 0xFFFF
+
+// Access to the flash, addresses are relative to the start of the store
+struct s_hist_flash
+{
+	bool (*read)(uint32_t address, void *data, size_t len);
+	bool (*write)(uint32_t address, const void *data, size_t len);
+	bool (*erase)(uint32_t sector);
+};
+
+// A point of the time series
+struct s_hist_point
+{
+	// UTC time, for the rollups the end of the period
+	uint32_t utc;
+	// W, for the rollups the average of the period
+	uint16_t power;
+	// W, for the rollups the max of the period
+	uint16_t peak;
+	// Samples of the rollup, max 255
+	uint8_t samples;
+	// Total energy in Wh
+	uint32_t energy;
+};
+
+// Position of a record, sector of the ring and slot in the sector
+struct s_hist_pos
+{
+	uint8_t sector;
+	uint16_t slot;
+};
+
+// Day index entry
+struct s_hist_day
+{
+	// Days since 1970, 0 if the entry is free
+	uint16_t day;
+	// First record of the day, sector << 12 | slot
+	uint16_t pos;
+};
+
+// Sectors of a level, used as a ring
+struct s_hist_ring
+{
+	// First sector of the level in the store
+	uint8_t first;
+	// Number of sectors
+	uint8_t count;
+	// Period of the level in seconds, also the time unit of the records
+	uint32_t unit;
+	// Sector that is written, 0xFF if the level is empty
+	uint8_t head;
+	// Oldest sector with records
+	uint8_t oldest;
+	// Sequence number of the head sector
+	uint32_t seq;
+	// Time of the newest record
+	uint32_t last_utc;
+	// Used slots per sector
+	uint16_t used[HIST_MAX_RING];
+	// Base time and energy per sector, the records are offsets to it
+	uint32_t sector_utc[HIST_MAX_RING];
+	uint32_t sector_energy[HIST_MAX_RING];
+	// Erase count per sector
+	uint32_t erases[HIST_MAX_RING];
+	s_hist_day days[HIST_DAY_SLOTS];
+};
+
+// Running rollup of a level
+struct s_hist_rollup
+{
+	// End of the period, 0 if nothing was added
+	uint32_t end;
+	uint32_t power_sum;
+	uint16_t peak;
+	uint16_t count;
+	uint32_t energy;
+};
+
+// Flash statistics
+struct s_hist_stats
+{
+	// Samples added
+	uint32_t samples;
+	// Bytes of the samples, time, power and energy
+	uint32_t payload_bytes;
+	// Bytes programmed, records and headers
+	uint32_t written_bytes;
+	// Sectors erased
+	uint32_t erased;
+	// Records that could not be written
+	uint32_t errors;
+};
+
+struct s_history
+{
+	const s_hist_flash *flash;
+	s_hist_ring rings[HIST_LEVELS];
+	s_hist_rollup rollups[HIST_LEVELS];
+	s_hist_stats stats;
+};
+
+bool hist_mount(s_history *hist, const s_hist_flash *flash);
+void hist_format(s_history *hist);
+bool hist_add(s_history *hist, uint32_t utc, int power, uint32_t energy);
+int hist_read(s_history *hist, uint8_t level, uint32_t from, uint32_t to, s_hist_point *points, int max_points);
+bool hist_seek(s_history *hist, uint8_t level, uint32_t utc, s_hist_pos *pos);
+uint32_t hist_records(s_history *hist, uint8_t level);
+uint32_t hist_oldest(s_history *hist, uint8_t level);
+uint32_t hist_max_erases(s_history *hist);
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * @file history_store.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief History of the samples in the history partition
+ * The partition is used without a file system, see history.cpp for the layout.
+ * The spiffs partition is left to the uplink queue file.
+ * The samples come from their own sink, AT+HIST and the backfill read the history.
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include <esp_partition.h>
+
+/** Label of the partition in custompart.csv */
+#define HIST_PARTITION "history"
+
+/** Backlog of the history sink */
+#define HIST_BACKLOG 4
+
+/** Points read from the store at a time */
+#define HIST_READ_CHUNK 12
+
+/** The store */
+static s_history history;
+
+/** Partition of the store, NULL if there is none */
+static const esp_partition_t *hist_partition = NULL;
+
+/** Protects the store, written by the sink task and read by the AT commands and the backfill */
+static SemaphoreHandle_t hist_lock = NULL;
+
+/**
+ * @brief Read from the partition
+ */
+static bool flash_read(uint32_t address, void *data, size_t len)
+{
+	return esp_partition_read(hist_partition, address, data, len) == ESP_OK;
+}
+
+/**
+ * @brief Write to the partition, only bits that are 1 can be changed
+ */
+static bool flash_write(uint32_t address, const void *data, size_t len)
+{
+	return esp_partition_write(hist_partition, address, data, len) == ESP_OK;
+}
+
+/**
+ * @brief Erase a sector of the partition
+ */
+static bool flash_erase(uint32_t sector)
+{
+	return esp_partition_erase_range(hist_partition, sector * HIST_SECTOR_SIZE, HIST_SECTOR_SIZE) == ESP_OK;
+}
+
+/** Access to the partition */
+static const s_hist_flash hist_flash = {flash_read, flash_write, flash_erase};
+
+/**
+ * @brief History sink, stores the valid samples with a synced time
+ *
+ * @param sample the sample
+ */
+static void history_sink(s_sample *sample)
+{
+	if (!sample->valid || (sample->utc < VALID_TIME))
+	{
+		return;
+	}
+	xSemaphoreTake(hist_lock, portMAX_DELAY);
+	hist_add(&history, sample->utc, sample->values[0], sample->values[VAL_ENERGY_TOTAL]);
+	xSemaphoreGive(hist_lock);
+}
+
+/**
+ * @brief Read the points of a time range
+ *
+ * @param level HIST_LVL_RAW, HIST_LVL_5MIN, HIST_LVL_HOUR or HIST_LVL_DAY
+ * @param from UTC time of the first point
+ * @param to UTC time of the last point
+ * @param points output
+ * @param max_points size of the output
+ * @return int number of points, oldest first
+ */
+int history_read(uint8_t level, uint32_t from, uint32_t to, s_hist_point *points, int max_points)
+{
+	if (hist_partition == NULL)
+	{
+		return 0;
+	}
+	xSemaphoreTake(hist_lock, portMAX_DELAY);
+	int count = hist_read(&history, level, from, to, points, max_points);
+	xSemaphoreGive(hist_lock);
+	return count;
+}
+
+/**
+ * @brief Read the 5 minute rollups in the format of read_inverter_log()
+ * There is an entry for every LOG_INTERVAL from start to end
+ *
+ * @param start UTC time of the first entry
+ * @param end UTC time of the last entry, max LOG_CHUNK entries
+ * @param values array of LOG_CHUNK values, total energy in Wh, (uint32_t)-1 if there is no rollup
+ * @param timestamps array of LOG_CHUNK entry times
+ * @return int number of entries with a value
+ */
+int history_read_log(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps)
+{
+	int slots = (end - start) / LOG_INTERVAL + 1;
+	for (int idx = 0; idx < slots; idx++)
+	{
+		timestamps[idx] = start + idx * LOG_INTERVAL;
+		values[idx] = (uint32_t)-1;
+	}
+
+	int found = 0;
+	s_hist_point points[HIST_READ_CHUNK];
+	uint32_t from = start;
+	while (from <= end)
+	{
+		int count = history_read(HIST_LVL_5MIN, from, end, points, HIST_READ_CHUNK);
+		for (int idx = 0; idx < count; idx++)
+		{
+			uint32_t offset = points[idx].utc - start;
+			if ((offset % LOG_INTERVAL) == 0)
+			{
+				values[offset / LOG_INTERVAL] = points[idx].energy;
+				found++;
+			}
+		}
+		if (count < HIST_READ_CHUNK)
+		{
+			break;
+		}
+		from = points[count - 1].utc + 1;
+	}
+	return found;
+}
+
+/**
+ * @brief Get the history status for AT+HIST
+ * Records of the levels, time of the oldest record of the levels,
+ * then the highest erase count, bytes of the samples, bytes written and write errors
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void history_status(char *buffer, uint8_t size)
+{
+	if (hist_partition == NULL)
+	{
+		snprintf(buffer, size, "no partition");
+		return;
+	}
+	xSemaphoreTake(hist_lock, portMAX_DELAY);
+	int len = 0;
+	for (uint8_t level = 0; level < HIST_LEVELS; level++)
+	{
+		len += snprintf(&buffer[len], size - len, "%s%ld", level == 0 ? "" : ":", hist_records(&history, level));
+	}
+	for (uint8_t level = 0; (level < HIST_LEVELS) && (len < size); level++)
+	{
+		len += snprintf(&buffer[len], size - len, "%s%ld", level == 0 ? "," : ":", hist_oldest(&history, level));
+	}
+	if (len < size)
+	{
+		snprintf(&buffer[len], size - len, ",%ld:%ld:%ld:%ld", hist_max_erases(&history), history.stats.payload_bytes,
+				 history.stats.written_bytes, history.stats.errors);
+	}
+	xSemaphoreGive(hist_lock);
+}
+
+/**
+ * @brief Mount the store and add the history sink, call after start_tasks()
+ *
+ */
+void init_history(void)
+{
+	hist_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, HIST_PARTITION);
+	if ((hist_partition == NULL) || (hist_partition->size < HIST_SECTORS * HIST_SECTOR_SIZE))
+	{
+		myLog_e("No partition for the history");
+		hist_partition = NULL;
+		return;
+	}
+	hist_lock = xSemaphoreCreateMutex();
+	uint32_t start_time = millis();
+	hist_mount(&history, &hist_flash);
+	myLog_d("History: %ld samples, mounted in %ld ms", hist_records(&history, HIST_LVL_RAW), millis() - start_time);
+	add_sink("Hist", history_sink, NULL, HIST_BACKLOG);
+}
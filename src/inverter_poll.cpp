@@ -0,0 +1,275 @@
+/**
+ * @file inverter_poll.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Poll rounds, all inverters are read in parallel by one task per inverter
+ * and the values are aggregated over the inverters that answered
+ * Uses only the reader interface, the backends and the preferences are in inverters.cpp
+ * @version 0.1
+ * @date 2021-10-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <my-log.h>
+#include "inverters.h"
+
+/** Stack size of the poll tasks, HTTP client and streaming parser */
+#define INV_TASK_STACK 6144
+
+/** Event bit of the first poll task, one bit per inverter */
+#define INV_DONE_BIT 0x01
+
+/** Inverter table, entry 0 is the inverter set with AT+SMA or BLE */
+s_inverter g_inverters[MAX_INVERTERS];
+
+/** Number of inverters in the table */
+uint8_t g_num_inverters = 1;
+
+/** Event group to signal finished polls */
+static EventGroupHandle_t inv_events = NULL;
+
+/** Only one poll or log read at a time, the cache refresh and the acquisition task both read the inverters */
+static SemaphoreHandle_t inv_lock = NULL;
+
+/** Round of the last request, results of older rounds are ignored */
+static uint32_t inv_round = 0;
+
+/** Protects the busy flags of the poll tasks */
+static portMUX_TYPE inv_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Poll task, one per inverter
+ * Waits for the notification from poll_round() or read_inverter_log()
+ * and reads the values or the energy log
+ * A request that took longer than the caller waited is finished, its result has an old round
+ * and is ignored
+ *
+ * @param pvParameters index into g_inverters
+ */
+static void inverter_task(void *pvParameters)
+{
+	uint8_t idx = (uintptr_t)pvParameters;
+	s_inverter *inv = &g_inverters[idx];
+
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		uint32_t round = inv->round;
+		uint32_t start_time = millis();
+		if (inv->log_end != 0)
+		{
+			inv->log_count = inv->reader->getLog(inv->log_start, inv->log_end, inv->log_values, inv->log_times);
+			inv->success = inv->log_count >= 0;
+		}
+		else
+		{
+			inv->success = inv->reader->getValues(inv->values);
+			inv->poll_time = millis() - start_time;
+			myLog_d("Inverter %d: %s in %ld ms", idx, inv->success ? "success" : "fail", inv->poll_time);
+		}
+		inv->done_round = round;
+		xEventGroupSetBits(inv_events, INV_DONE_BIT << idx);
+		// Cleared after the done bit, a new round clears a late done bit before it starts this task again
+		portENTER_CRITICAL(&inv_mux);
+		inv->busy = false;
+		portEXIT_CRITICAL(&inv_mux);
+	}
+}
+
+/**
+ * @brief Start a new round of requests, poll tasks that still work on an older round are skipped
+ *
+ * @param log_start UTC time of the first log entry
+ * @param log_end UTC time of the last log entry, 0 to read the values
+ * @return EventBits_t done bits of the started poll tasks
+ */
+static EventBits_t start_round(uint32_t log_start, uint32_t log_end)
+{
+	EventBits_t all_bits = 0;
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		all_bits |= INV_DONE_BIT << idx;
+	}
+	inv_round++;
+	xEventGroupClearBits(inv_events, all_bits);
+
+	EventBits_t started = 0;
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		s_inverter *inv = &g_inverters[idx];
+		portENTER_CRITICAL(&inv_mux);
+		bool busy = inv->busy;
+		inv->busy = true;
+		portEXIT_CRITICAL(&inv_mux);
+		if (busy)
+		{
+			myLog_e("Inverter %d is still busy", idx);
+			continue;
+		}
+		inv->round = inv_round;
+		inv->success = false;
+		inv->log_start = log_start;
+		inv->log_end = log_end;
+		xTaskNotifyGive(inv->task);
+		started |= INV_DONE_BIT << idx;
+	}
+	return started;
+}
+
+/**
+ * @brief Wait for the poll tasks of a round
+ *
+ * @param started done bits from start_round()
+ * @param timeout_ms max time to wait
+ * @return EventBits_t done bits of the poll tasks that finished in time
+ */
+static EventBits_t wait_round(EventBits_t started, uint32_t timeout_ms)
+{
+	if (started == 0)
+	{
+		return 0;
+	}
+	return xEventGroupWaitBits(inv_events, started, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & started;
+}
+
+/**
+ * @brief Check if an inverter has a valid result of the current round
+ */
+static bool round_ok(s_inverter *inv, uint8_t idx, EventBits_t done)
+{
+	return ((done & (INV_DONE_BIT << idx)) != 0) && (inv->done_round == inv_round) && inv->success;
+}
+
+/**
+ * @brief Start one poll task per inverter in the table
+ * Call after the table and the readers are set up
+ */
+void start_inverter_tasks(void)
+{
+	inv_events = xEventGroupCreate();
+	inv_lock = xSemaphoreCreateMutex();
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		myLog_d("Inverter %d: %s", idx, g_inverters[idx].ip.toString().c_str());
+		xTaskCreate(inverter_task, "SMA", INV_TASK_STACK, (void *)(uintptr_t)idx, 1, &g_inverters[idx].task);
+	}
+}
+
+/**
+ * @brief Poll all inverters in parallel and sum up the values
+ * The poll takes as long as the slowest inverter, not the sum of all
+ * Voltages and frequencies are averaged instead of summed
+ *
+ * @param values array of poll_keys_t::count values, sums over the inverters that answered
+ * @param timeout_ms max time to wait for the inverters
+ * @param answered called for each inverter that answered, before the next round can start
+ * @return uint8_t number of inverters that answered
+ */
+uint8_t poll_round(int *values, uint32_t timeout_ms, void (*answered)(s_inverter *inv))
+{
+	xSemaphoreTake(inv_lock, portMAX_DELAY);
+	EventBits_t done = wait_round(start_round(0, 0), timeout_ms);
+
+	uint8_t num_ok = 0;
+	uint8_t num_values[poll_keys_t::count];
+	for (uint8_t val_idx = 0; val_idx < poll_keys_t::count; val_idx++)
+	{
+		values[val_idx] = 0;
+		num_values[val_idx] = 0;
+	}
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		s_inverter *inv = &g_inverters[idx];
+		if (!round_ok(inv, idx, done))
+		{
+			myLog_e("Inverter %d did not answer", idx);
+			if (inv->fails < 255)
+			{
+				inv->fails++;
+			}
+			continue;
+		}
+		inv->fails = 0;
+		num_ok++;
+		if (answered != NULL)
+		{
+			answered(inv);
+		}
+		for (uint8_t val_idx = 0; val_idx < poll_keys_t::count; val_idx++)
+		{
+			// at night the current value turns to -1
+			if (inv->values[val_idx] > 0)
+			{
+				values[val_idx] += inv->values[val_idx];
+				num_values[val_idx]++;
+			}
+		}
+	}
+	for (uint8_t val_idx = 0; val_idx < poll_keys_t::count; val_idx++)
+	{
+		SMAUnit unit = smaKeyInfo(poll_keys_t::ids[val_idx]).unit;
+		if (((unit == SMAUnit::V) || (unit == SMAUnit::HZ)) && (num_values[val_idx] > 1))
+		{
+			values[val_idx] /= num_values[val_idx];
+		}
+	}
+	xSemaphoreGive(inv_lock);
+	return num_ok;
+}
+
+/**
+ * @brief Read the energy log of all inverters in parallel and sum it up
+ * An entry is valid only if all inverters answered and have an entry with the same time,
+ * a sum without an inverter would look like a drop of the total energy
+ *
+ * @param start UTC time of the first entry
+ * @param end UTC time of the last entry, max LOG_CHUNK entries of 5 minutes
+ * @param values array of LOG_CHUNK values, total energy in Wh, (uint32_t)-1 if an inverter has no entry
+ * @param timestamps array of LOG_CHUNK entry times
+ * @param timeout_ms max time to wait for the inverters
+ * @return int number of entries or -1 if no inverter answered
+ */
+int read_inverter_log(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps, uint32_t timeout_ms)
+{
+	xSemaphoreTake(inv_lock, portMAX_DELAY);
+	EventBits_t done = wait_round(start_round(start, end), timeout_ms);
+
+	int count = -1;
+	bool missing = false;
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		s_inverter *inv = &g_inverters[idx];
+		if (!round_ok(inv, idx, done))
+		{
+			myLog_e("Inverter %d did not send the log", idx);
+			missing = true;
+			continue;
+		}
+		if (count < 0)
+		{
+			count = min(inv->log_count, LOG_CHUNK);
+			memcpy(values, inv->log_values, count * sizeof(uint32_t));
+			memcpy(timestamps, inv->log_times, count * sizeof(uint32_t));
+			continue;
+		}
+		for (int entry = 0; entry < count; entry++)
+		{
+			if ((entry >= inv->log_count) || (inv->log_times[entry] != timestamps[entry]) || (inv->log_values[entry] == (uint32_t)-1))
+			{
+				values[entry] = (uint32_t)-1;
+			}
+			else if (values[entry] != (uint32_t)-1)
+			{
+				values[entry] += inv->log_values[entry];
+			}
+		}
+	}
+	for (int entry = 0; missing && (entry < count); entry++)
+	{
+		values[entry] = (uint32_t)-1;
+	}
+	xSemaphoreGive(inv_lock);
+	return count;
+}
+
@@ -0,0 +1,273 @@
+/**
+ * @file inverters.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Readers and preferences of the SMA inverters, the poll rounds are in inverter_poll.cpp
+ * The inverters are read with the web API, Speedwire or Modbus TCP, see g_sma_backend
+ * @version 0.1
+ * @date 2021-10-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Backend of all inverters, BACKEND_WEBAPI, BACKEND_SPEEDWIRE or BACKEND_MODBUS */
+uint8_t g_sma_backend = BACKEND_WEBAPI;
+
+/** Backend for the JSON web API of the inverter, follows changes of the inverter IP */
+class WebApiReader : public InverterReader
+{
+public:
+	WebApiReader(SMAReader *reader, IPAddress *ip) : _reader(reader), _ip(ip) {}
+	bool getValues(int *values)
+	{
+		_reader->setInverterIP(*_ip);
+		return _reader->getValues<poll_keys_t>(values);
+	}
+	int getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps)
+	{
+		_reader->setInverterIP(*_ip);
+		return _reader->getLog(start, end, values, timestamps);
+	}
+	void logout(void) { _reader->logout(); }
+	uint32_t getSerial(void) { return _reader->getSerial(); }
+
+private:
+	SMAReader *_reader;
+	IPAddress *_ip;
+};
+
+/** Web API backend of entry 0 */
+static WebApiReader main_reader(&smaReader, &g_inverters[0].ip);
+
+/**
+ * @brief Create the reader of an inverter for the selected backend
+ *
+ * @param inv the inverter, ip and passwd must be set
+ * @return InverterReader* the reader
+ */
+static InverterReader *create_reader(s_inverter *inv)
+{
+	if (g_sma_backend == BACKEND_SPEEDWIRE)
+	{
+		return new_speedwire_reader(&inv->ip, inv->passwd);
+	}
+	if (g_sma_backend == BACKEND_MODBUS)
+	{
+		return new_modbus_reader(&inv->ip);
+	}
+	if (inv == &g_inverters[0])
+	{
+		return &main_reader;
+	}
+	return new WebApiReader(new SMAReader(inv->ip, SMAREADER_USER, inv->passwd, 5), &inv->ip);
+}
+
+/**
+ * @brief Read the additional inverters from the preferences
+ * and start one poll task per inverter
+ * Call after get_wifi_prefs(), entry 0 uses inverterIP and, with the web API, smaReader
+ */
+void init_inverters(void)
+{
+	Preferences preferences;
+	preferences.begin("SMAInv", false);
+	g_sma_backend = preferences.getUChar("be", BACKEND_WEBAPI);
+
+	g_inverters[0].ip = inverterIP;
+	snprintf(g_inverters[0].passwd, sizeof(g_inverters[0].passwd), "%s", INVERTERPWD);
+	g_inverters[0].reader = create_reader(&g_inverters[0]);
+	g_inverters[0].serial = preferences.getULong("sn_0", 0);
+	g_num_inverters = 1;
+
+	for (uint8_t idx = 1; idx < MAX_INVERTERS; idx++)
+	{
+		char key[8];
+		snprintf(key, sizeof(key), "ip_%d", idx);
+		uint32_t ip = preferences.getULong(key, 0);
+		if (ip == 0)
+		{
+			continue;
+		}
+		s_inverter *inv = &g_inverters[g_num_inverters];
+		inv->slot = idx;
+		inv->ip = IPAddress(ip);
+		snprintf(key, sizeof(key), "pw_%d", idx);
+		String passwd = preferences.getString(key, INVERTERPWD);
+		snprintf(inv->passwd, sizeof(inv->passwd), "%s", passwd.c_str());
+		snprintf(key, sizeof(key), "sn_%d", idx);
+		inv->serial = preferences.getULong(key, 0);
+		inv->reader = create_reader(inv);
+		g_num_inverters++;
+	}
+	preferences.end();
+
+	start_inverter_tasks();
+}
+
+/**
+ * @brief Keep the serial of an inverter that answered, the discovery moves an inverter
+ * only to a device with the same serial
+ *
+ * @param inv the inverter
+ */
+static void learn_serial(s_inverter *inv)
+{
+	uint32_t serial = inv->reader->getSerial();
+	if ((serial == 0) || (serial == inv->serial))
+	{
+		return;
+	}
+	myLog_d("Inverter at %s has serial %ld", inv->ip.toString().c_str(), serial);
+	inv->serial = serial;
+	Preferences preferences;
+	preferences.begin("SMAInv", false);
+	char key[8];
+	snprintf(key, sizeof(key), "sn_%d", inv->slot);
+	preferences.putULong(key, serial);
+	preferences.end();
+}
+
+/**
+ * @brief Poll all inverters, learn the serials and look for inverters that moved
+ *
+ * @param values array of poll_keys_t::count values, sums over the inverters that answered
+ * @param timeout_ms max time to wait for the inverters
+ * @return uint8_t number of inverters that answered
+ */
+uint8_t poll_inverters(int *values, uint32_t timeout_ms)
+{
+	g_inverters[0].ip = inverterIP;
+	uint8_t num_ok = poll_round(values, timeout_ms, learn_serial);
+	// Look for inverters that moved to another IP
+	discovery_check();
+	return num_ok;
+}
+
+/**
+ * @brief Save an additional inverter to the preferences
+ * Changes to the table are active after the next reboot
+ *
+ * @param idx 1 .. MAX_INVERTERS - 1, entry 0 is set with AT+SMA
+ * @param ip inverter IP, 0.0.0.0 removes the entry
+ * @param passwd inverter password, NULL keeps the default password
+ */
+void save_inverter(uint8_t idx, IPAddress ip, const char *passwd)
+{
+	Preferences preferences;
+	preferences.begin("SMAInv", false);
+	char key[8];
+	snprintf(key, sizeof(key), "ip_%d", idx);
+	preferences.putULong(key, (uint32_t)ip);
+	snprintf(key, sizeof(key), "pw_%d", idx);
+	if (passwd != NULL)
+	{
+		preferences.putString(key, passwd);
+	}
+	else
+	{
+		preferences.remove(key);
+	}
+	// Maybe another inverter, the serial is taken again from the next poll
+	snprintf(key, sizeof(key), "sn_%d", idx);
+	preferences.remove(key);
+	preferences.end();
+}
+
+/**
+ * @brief Change the IP of an inverter, used by the discovery
+ * The new IP is saved and used from the next poll on
+ *
+ * @param idx index into g_inverters
+ * @param ip new IP
+ */
+void set_inverter_ip(uint8_t idx, IPAddress ip)
+{
+	s_inverter *inv = &g_inverters[idx];
+	inv->ip = ip;
+	inv->fails = 0;
+	if (idx == 0)
+	{
+		inverterIP = ip;
+		saveSmaIP();
+		smaReader.setInverterIP(ip);
+		return;
+	}
+	Preferences preferences;
+	preferences.begin("SMAInv", false);
+	char key[8];
+	snprintf(key, sizeof(key), "ip_%d", inv->slot);
+	preferences.putULong(key, (uint32_t)ip);
+	preferences.end();
+}
+
+/**
+ * @brief Read the serial of a device with the backend and the password of an inverter
+ * Used by the discovery to check a candidate before the inverter is moved to it
+ *
+ * @param idx index into g_inverters, its password is used
+ * @param ip IP of the device
+ * @return uint32_t serial of the device, 0 if it did not answer
+ */
+uint32_t read_inverter_serial(uint8_t idx, IPAddress ip)
+{
+	int values[poll_keys_t::count];
+	const char *passwd = g_inverters[idx].passwd;
+	if (g_sma_backend == BACKEND_WEBAPI)
+	{
+		SMAReader sma_reader(ip, SMAREADER_USER, passwd, 1);
+		WebApiReader reader(&sma_reader, &ip);
+		uint32_t serial = reader.getValues(values) ? reader.getSerial() : 0;
+		reader.logout();
+		return serial;
+	}
+	InverterReader *reader = g_sma_backend == BACKEND_SPEEDWIRE ? new_speedwire_reader(&ip, passwd, true) : new_modbus_reader(&ip);
+	uint32_t serial = reader->getValues(values) ? reader->getSerial() : 0;
+	reader->logout();
+	delete reader;
+	return serial;
+}
+
+/**
+ * @brief Get the stored IP of an additional inverter
+ *
+ * @param idx 1 .. MAX_INVERTERS - 1
+ * @return IPAddress stored IP, 0.0.0.0 if the entry is empty
+ */
+IPAddress get_inverter(uint8_t idx)
+{
+	Preferences preferences;
+	preferences.begin("SMAInv", true);
+	char key[8];
+	snprintf(key, sizeof(key), "ip_%d", idx);
+	IPAddress ip(preferences.getULong(key, 0));
+	preferences.end();
+	return ip;
+}
+
+/**
+ * @brief Close the sessions on the inverters before a reboot or an OTA update
+ * The inverters have only a few session slots
+ */
+void logout_inverters(void)
+{
+	for (uint8_t idx = 0; idx < g_num_inverters; idx++)
+	{
+		if (g_inverters[idx].reader != NULL)
+		{
+			g_inverters[idx].reader->logout();
+		}
+	}
+}
+
+/**
+ * @brief Save the backend of the inverters, active after the next reboot
+ *
+ */
+void save_backend(void)
+{
+	Preferences preferences;
+	preferences.begin("SMAInv", false);
+	preferences.putUChar("be", g_sma_backend);
+	preferences.end();
+}
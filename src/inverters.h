@@ -0,0 +1,99 @@
+/**
+ * @file inverters.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Keys of the inverters, the reader interface and the inverter table
+ * Only Arduino and FreeRTOS types, so the poll rounds can be tested on a PC
+ * @version 0.1
+ * @date 2021-10-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __INVERTERS_H__
+#define __INVERTERS_H__
+
+#include <Arduino.h>
+#include <SMAKeys.h>
+
+/** Keys read from the SMA inverter, request body is built at compile time
+ * Power and energy first, then the optional channels in the order of e_codec_channel, then the total energy */
+typedef SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY,
+				  SMAKeyId::DC_VOLTAGE, SMAKeyId::DC_CURRENT, SMAKeyId::AC_FREQUENCY,
+				  SMAKeyId::AC_L1_POWER, SMAKeyId::AC_L2_POWER, SMAKeyId::AC_L3_POWER,
+				  SMAKeyId::ENERGY_TOTAL>
+	poll_keys_t;
+
+// Index of the total energy in the values
+#define VAL_ENERGY_TOTAL (poll_keys_t::count - 1)
+
+/** Common interface of the inverter backends */
+class InverterReader
+{
+public:
+	virtual ~InverterReader() {}
+	// Read the values of poll_keys_t, false if the inverter did not answer
+	virtual bool getValues(int *values) = 0;
+	// Read the energy log, same as SMAReader::getLog()
+	virtual int getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps) = 0;
+	// Close the session, call only before a reboot
+	virtual void logout(void) = 0;
+	// Serial number of the inverter, 0 before the first successful getValues()
+	virtual uint32_t getSerial(void) = 0;
+};
+
+InverterReader *new_speedwire_reader(IPAddress *ip, const char *passwd, bool probe = false);
+InverterReader *new_modbus_reader(IPAddress *ip);
+
+#define MAX_INVERTERS 6
+
+// Energy log entries read in one request, 4 hours
+#define LOG_CHUNK 48
+
+// Interval of the energy log entries
+#define LOG_INTERVAL 300
+
+struct s_inverter
+{
+	IPAddress ip;
+	char passwd[33] = {0};
+	InverterReader *reader = NULL;
+	int values[poll_keys_t::count] = {0};
+	bool success = false;
+	uint32_t poll_time = 0;
+	// Failed polls in a row
+	uint8_t fails = 0;
+	// Index of the entry in the preferences, 0 for the inverter set with AT+SMA
+	uint8_t slot = 0;
+	// Serial of the inverter, taken from the polls, 0 if it is not known yet
+	uint32_t serial = 0;
+	TaskHandle_t task = NULL;
+	// Request round of the poll task and the round of its last result
+	uint32_t round = 0;
+	uint32_t done_round = 0;
+	// Set while the poll task works on a request
+	bool busy = false;
+	// Energy log request, log_end != 0 reads the log instead of the values
+	uint32_t log_start = 0;
+	uint32_t log_end = 0;
+	int log_count = 0;
+	uint32_t log_values[LOG_CHUNK];
+	uint32_t log_times[LOG_CHUNK];
+};
+
+void init_inverters(void);
+uint8_t poll_inverters(int *values, uint32_t timeout_ms = 60000);
+int read_inverter_log(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps, uint32_t timeout_ms = 60000);
+void save_inverter(uint8_t idx, IPAddress ip, const char *passwd);
+IPAddress get_inverter(uint8_t idx);
+void logout_inverters(void);
+void save_backend(void);
+void set_inverter_ip(uint8_t idx, IPAddress ip);
+uint32_t read_inverter_serial(uint8_t idx, IPAddress ip);
+extern s_inverter g_inverters[];
+extern uint8_t g_num_inverters;
+
+// Poll rounds, the parallel requests to the poll tasks
+void start_inverter_tasks(void);
+uint8_t poll_round(int *values, uint32_t timeout_ms, void (*answered)(s_inverter *inv) = NULL);
+
+#endif
@@ -0,0 +1,602 @@
+/**
+ * @file join.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief LoRaWAN join manager
+ * Retries failed joins with exponential backoff and jitter and rotates the data rate of the join.
+ * The OTAA session is saved in the preferences, after a reboot it is restored instead of a new join.
+ * A restored session that gets no downlinks is probably unknown to the network, it is dropped then.
+ * The RX windows, the channels and the channel mask the network set are saved with the session,
+ * lmh_init() resets them to the defaults of the region and they are set again when the session is restored.
+ * @version 0.1
+ * @date 2021-10-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Backoff after the first failed join in seconds */
+#define JOIN_BACKOFF_MIN 30
+
+/** Max backoff in seconds */
+#define JOIN_BACKOFF_MAX 3600
+
+/** Jitter of the backoff in % */
+#define JOIN_JITTER 25
+
+/** Max time for a join request with all its trials */
+#define JOIN_TIMEOUT 300000
+
+/** The uplink counter is saved every JOIN_FCNT_STEP uplinks and increased by this on restore */
+#define JOIN_FCNT_STEP 100
+
+/** Uplinks without a downlink after which a restored session is dropped */
+#define JOIN_LINK_FAILS 12
+
+/** A LinkCheckReq is sent after every JOIN_LINK_CHECK uplinks without a downlink, the network must answer it */
+#define JOIN_LINK_CHECK 4
+
+/** Check interval of the uplink counter while joined */
+#define JOIN_CHECK_TIME 60000
+
+/** Channels of the regions where the network adds channels, the others have a fixed channel plan */
+#define JOIN_MAX_CHANNELS 16
+
+/** Words of the largest channel mask, 96 channels of CN470 */
+#define JOIN_MASK_WORDS 6
+
+/** MAC parameters of a session that are not the defaults of the region */
+struct s_mac_params
+{
+	uint32_t rx1_delay = 0;
+	uint32_t rx2_delay = 0;
+	Rx2ChannelParams_t rx2 = {0, 0};
+	uint16_t mask[JOIN_MASK_WORDS] = {0};
+	// Empty for a region with a fixed channel plan
+	ChannelParams_t channels[JOIN_MAX_CHANNELS];
+};
+
+/** Current join state */
+e_join_state g_join_state = JOIN_IDLE;
+
+/** Names of the join states */
+const char *join_state_names[] = {"IDLE", "PENDING", "BACKOFF", "JOINED"};
+
+/** Join requests since the session was cleared */
+uint32_t g_join_attempts = 0;
+
+/** Scheduler job of the join manager */
+static int8_t join_job_id = -1;
+
+/** Failed join requests in a row */
+static uint8_t join_fails = 0;
+
+/** true if the session was restored from the preferences */
+static bool session_restored = false;
+
+/** Uplink counter of the restored session */
+static uint32_t restored_fcnt = 0;
+
+/** Last saved uplink counter */
+static uint32_t saved_fcnt = 0;
+
+/** Downlink counter at the last check */
+static uint32_t last_fcnt_down = 0;
+
+/** Uplink counter when the last downlink was seen */
+static uint32_t last_down_fcnt = 0;
+
+/** Uplinks without a downlink at the next LinkCheckReq */
+static uint32_t next_link_check = JOIN_LINK_CHECK;
+
+/** Set after a join, the session is saved by the scheduler job */
+static bool session_pending = false;
+
+/** MAC parameters of the restored session */
+static s_mac_params restored_mac;
+
+/** true if the restored session has saved MAC parameters */
+static bool mac_restored = false;
+
+/**
+ * @brief Identify the credentials and region the session belongs to (FNV-1a)
+ *
+ * @return uint32_t hash of EUIs, key and region
+ */
+static uint32_t session_id(void)
+{
+	uint32_t hash = 2166136261UL;
+	const uint8_t *parts[] = {g_lorawan_settings.node_device_eui, g_lorawan_settings.node_app_eui, g_lorawan_settings.node_app_key};
+	const uint8_t sizes[] = {8, 8, 16};
+	for (uint8_t part = 0; part < 3; part++)
+	{
+		for (uint8_t idx = 0; idx < sizes[part]; idx++)
+		{
+			hash = (hash ^ parts[part][idx]) * 16777619UL;
+		}
+	}
+	return (hash ^ g_lorawan_settings.lora_region) * 16777619UL;
+}
+
+/**
+ * @brief Get the uplink counter from the MAC
+ *
+ * @return uint32_t uplink counter
+ */
+static uint32_t get_fcnt(void)
+{
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_UPLINK_COUNTER;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return 0;
+	}
+	return mib_req.Param.UpLinkCounter;
+}
+
+/**
+ * @brief Get the downlink counter from the MAC
+ *
+ * @return uint32_t downlink counter, ACKs and MAC answers count as well
+ */
+static uint32_t get_fcnt_down(void)
+{
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_DOWNLINK_COUNTER;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return 0;
+	}
+	return mib_req.Param.DownLinkCounter;
+}
+
+/**
+ * @brief Start the downlink check of a joined session
+ *
+ */
+static void reset_link_check(void)
+{
+	last_fcnt_down = get_fcnt_down();
+	last_down_fcnt = get_fcnt();
+	next_link_check = JOIN_LINK_CHECK;
+}
+
+/**
+ * @brief Check that a restored session still gets downlinks
+ * Works with unconfirmed uplinks as well, a LinkCheckReq is sent with the next uplink
+ * when there was no downlink for a while. If the network does not answer it either,
+ * the session is dropped and the device restarts with a new join.
+ * Runs in the scheduler job, not in the callbacks of the MAC
+ */
+static void check_link(void)
+{
+	uint32_t fcnt = get_fcnt();
+	uint32_t fcnt_down = get_fcnt_down();
+	if (fcnt_down != last_fcnt_down)
+	{
+		last_fcnt_down = fcnt_down;
+		last_down_fcnt = fcnt;
+		next_link_check = JOIN_LINK_CHECK;
+		return;
+	}
+	uint32_t silent = fcnt - last_down_fcnt;
+	if (silent >= JOIN_LINK_FAILS)
+	{
+		myLog_e("No downlink for %ld uplinks of the restored session, restart with a new join", silent);
+		join_clear_session();
+		uplink_save();
+		delay(100);
+		esp_restart();
+	}
+	if (silent >= next_link_check)
+	{
+		MlmeReq_t mlme_req;
+		mlme_req.Type = MLME_LINK_CHECK;
+		LoRaMacMlmeRequest(&mlme_req);
+		next_link_check = silent + JOIN_LINK_CHECK;
+		myLog_d("No downlink for %ld uplinks, link check requested", silent);
+	}
+}
+
+/**
+ * @brief Words of the channel mask of the region
+ *
+ * @return uint8_t size of the channel mask in 16 bit words
+ */
+static uint8_t mask_words(void)
+{
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_US915:
+	case LORAMAC_REGION_AU915:
+		// 72 channels
+		return 5;
+	case LORAMAC_REGION_CN470:
+		// 96 channels
+		return 6;
+	default:
+		return 1;
+	}
+}
+
+/**
+ * @brief Check if the network can add channels in the region
+ *
+ * @return true if the region has a fixed channel plan, only the mask is set by the network
+ */
+static bool fixed_channel_plan(void)
+{
+	return mask_words() > 1;
+}
+
+/**
+ * @brief Read the RX windows and channels the network set with the join accept and MAC commands
+ *
+ * @param params MAC parameters
+ * @return true if all parameters were read
+ */
+static bool read_mac_params(s_mac_params *params)
+{
+	MibRequestConfirm_t mib_req;
+	memset(params->channels, 0, sizeof(params->channels));
+
+	mib_req.Type = MIB_RECEIVE_DELAY_1;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return false;
+	}
+	params->rx1_delay = mib_req.Param.ReceiveDelay1;
+	mib_req.Type = MIB_RECEIVE_DELAY_2;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return false;
+	}
+	params->rx2_delay = mib_req.Param.ReceiveDelay2;
+	mib_req.Type = MIB_RX2_CHANNEL;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return false;
+	}
+	params->rx2 = mib_req.Param.Rx2Channel;
+	mib_req.Type = MIB_CHANNELS_MASK;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		return false;
+	}
+	memcpy(params->mask, mib_req.Param.ChannelsMask, mask_words() * sizeof(uint16_t));
+	if (!fixed_channel_plan())
+	{
+		mib_req.Type = MIB_CHANNELS;
+		if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+		{
+			return false;
+		}
+		memcpy(params->channels, mib_req.Param.ChannelList, sizeof(params->channels));
+	}
+	return true;
+}
+
+/**
+ * @brief Save the MAC parameters with the session
+ *
+ * @param preferences open "Join" preferences
+ */
+static void save_mac_params(Preferences &preferences)
+{
+	s_mac_params params;
+	if (!read_mac_params(&params))
+	{
+		myLog_e("Can't read the MAC parameters");
+		preferences.remove("mac");
+		return;
+	}
+	preferences.putBytes("mac", &params, sizeof(params));
+}
+
+/**
+ * @brief Set the MAC parameters of the restored session again, lmh_init() reset them to the defaults
+ * The channels of the join accept are added before the mask that enables them
+ */
+static void restore_mac_params(void)
+{
+	MibRequestConfirm_t mib_req;
+	if (!fixed_channel_plan())
+	{
+		mib_req.Type = MIB_CHANNELS;
+		if (LoRaMacMibGetRequestConfirm(&mib_req) == LORAMAC_STATUS_OK)
+		{
+			ChannelParams_t *channels = mib_req.Param.ChannelList;
+			for (uint8_t ch = 0; ch < JOIN_MAX_CHANNELS; ch++)
+			{
+				if ((restored_mac.channels[ch].Frequency != 0) && (restored_mac.channels[ch].Frequency != channels[ch].Frequency))
+				{
+					LoRaMacChannelAdd(ch, restored_mac.channels[ch]);
+				}
+			}
+		}
+	}
+	mib_req.Type = MIB_CHANNELS_MASK;
+	mib_req.Param.ChannelsMask = restored_mac.mask;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_RX2_CHANNEL;
+	mib_req.Param.Rx2Channel = restored_mac.rx2;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_RECEIVE_DELAY_1;
+	mib_req.Param.ReceiveDelay1 = restored_mac.rx1_delay;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_RECEIVE_DELAY_2;
+	mib_req.Param.ReceiveDelay2 = restored_mac.rx2_delay;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	myLog_d("Restored RX1 delay %ld ms, RX2 %ld Hz DR%d", restored_mac.rx1_delay, restored_mac.rx2.Frequency, restored_mac.rx2.Datarate);
+}
+
+/**
+ * @brief Save the session of a new OTAA join
+ *
+ */
+static void save_session(void)
+{
+	MibRequestConfirm_t mib_req;
+	uint8_t nwk_skey[16];
+	uint8_t app_skey[16];
+
+	mib_req.Type = MIB_NWK_SKEY;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		myLog_e("Can't read the session keys");
+		return;
+	}
+	memcpy(nwk_skey, mib_req.Param.NwkSKey, 16);
+	mib_req.Type = MIB_APP_SKEY;
+	if (LoRaMacMibGetRequestConfirm(&mib_req) != LORAMAC_STATUS_OK)
+	{
+		myLog_e("Can't read the session keys");
+		return;
+	}
+	memcpy(app_skey, mib_req.Param.AppSKey, 16);
+
+	Preferences preferences;
+	preferences.begin("Join", false);
+	preferences.putULong("id", session_id());
+	preferences.putULong("addr", lmh_getDevAddr());
+	preferences.putBytes("nwk", nwk_skey, 16);
+	preferences.putBytes("app", app_skey, 16);
+	preferences.putULong("fcnt", 0);
+	save_mac_params(preferences);
+	preferences.putBool("valid", true);
+	preferences.end();
+	saved_fcnt = 0;
+	myLog_d("Session saved");
+}
+
+/**
+ * @brief Save the uplink counter of the session
+ * The MAC parameters are saved as well, the network can change them with MAC commands
+ *
+ */
+void join_save_session(void)
+{
+	if ((g_join_state != JOIN_JOINED) || !g_lorawan_settings.otaa_enabled)
+	{
+		return;
+	}
+	uint32_t fcnt = get_fcnt();
+	Preferences preferences;
+	preferences.begin("Join", false);
+	preferences.putULong("fcnt", fcnt);
+	save_mac_params(preferences);
+	preferences.end();
+	saved_fcnt = fcnt;
+}
+
+/**
+ * @brief Drop the saved session, the next start does a new OTAA join
+ *
+ */
+void join_clear_session(void)
+{
+	Preferences preferences;
+	preferences.begin("Join", false);
+	preferences.putBool("valid", false);
+	preferences.end();
+}
+
+/**
+ * @brief Restore a saved OTAA session, call before lmh_init()
+ * The session is set up as ABP, lmh_init() must be called with OTAA disabled then
+ * The saved MAC parameters are set in join_succeeded(), after lmh_init() reset them
+ *
+ * @return true if a session was restored
+ */
+bool join_restore_session(void)
+{
+	session_restored = false;
+	mac_restored = false;
+	if (!g_lorawan_settings.otaa_enabled)
+	{
+		return false;
+	}
+
+	Preferences preferences;
+	preferences.begin("Join", true);
+	g_join_attempts = preferences.getULong("joins", 0);
+	if (!preferences.getBool("valid", false) || (preferences.getULong("id", 0) != session_id()))
+	{
+		preferences.end();
+		return false;
+	}
+	static uint8_t nwk_skey[16];
+	static uint8_t app_skey[16];
+	uint32_t dev_addr = preferences.getULong("addr", 0);
+	preferences.getBytes("nwk", nwk_skey, 16);
+	preferences.getBytes("app", app_skey, 16);
+	restored_fcnt = preferences.getULong("fcnt", 0) + JOIN_FCNT_STEP;
+	// Sessions saved before the MAC parameters were added keep the defaults
+	mac_restored = preferences.getBytes("mac", &restored_mac, sizeof(restored_mac)) == sizeof(restored_mac);
+	preferences.end();
+
+	lmh_setDevAddr(dev_addr);
+	lmh_setNwkSKey(nwk_skey);
+	lmh_setAppSKey(app_skey);
+	otaaDevAddr = dev_addr;
+	session_restored = true;
+	myLog_d("Restored session of %08lX, uplink counter %ld", dev_addr, restored_fcnt);
+	return true;
+}
+
+/**
+ * @brief Data rate for a join attempt, starts with the configured DR
+ * and goes down in steps of 2 to the lowest DR, then starts over
+ *
+ * @param attempt failed joins before this one
+ * @return uint8_t data rate
+ */
+static uint8_t join_datarate(uint8_t attempt)
+{
+	uint8_t min_dr = 0;
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_AU915:
+	case LORAMAC_REGION_AS923:
+		// Dwell time limit
+		min_dr = 2;
+		break;
+	default:
+		break;
+	}
+	uint8_t first_dr = max(g_lorawan_settings.data_rate, min_dr);
+	uint8_t steps = (first_dr - min_dr) / 2 + 1;
+	return first_dr - (attempt % steps) * 2;
+}
+
+/**
+ * @brief Backoff before the next join attempt
+ *
+ * @param fails failed joins in a row
+ * @return uint32_t backoff in ms
+ */
+static uint32_t join_backoff(uint8_t fails)
+{
+	uint32_t backoff = JOIN_BACKOFF_MIN;
+	for (uint8_t idx = 1; (idx < fails) && (backoff < JOIN_BACKOFF_MAX); idx++)
+	{
+		backoff *= 2;
+	}
+	backoff = min(backoff, (uint32_t)JOIN_BACKOFF_MAX) * 1000;
+	return backoff / 100 * random(100 - JOIN_JITTER, 100 + JOIN_JITTER + 1);
+}
+
+/**
+ * @brief Scheduler job, send the join request or save the uplink counter when joined
+ *
+ */
+static void join_job(void)
+{
+	switch (g_join_state)
+	{
+	case JOIN_IDLE:
+	case JOIN_BACKOFF:
+	{
+		uint8_t data_rate = join_datarate(join_fails);
+		if (!session_restored)
+		{
+			lmh_datarate_set(data_rate, g_lorawan_settings.adr_enabled);
+			g_join_attempts++;
+			Preferences preferences;
+			preferences.begin("Join", false);
+			preferences.putULong("joins", g_join_attempts);
+			preferences.end();
+			myLog_d("Join request %ld with DR%d", g_join_attempts, data_rate);
+		}
+		g_join_state = JOIN_PENDING;
+		reschedule(join_job_id, JOIN_TIMEOUT, 0);
+		lmh_join();
+		break;
+	}
+	case JOIN_PENDING:
+		// No answer from the MAC
+		myLog_e("Join request timed out");
+		join_failed();
+		break;
+	case JOIN_JOINED:
+		if (session_pending)
+		{
+			session_pending = false;
+			if (session_restored)
+			{
+				join_save_session();
+			}
+			else if (g_lorawan_settings.otaa_enabled)
+			{
+				save_session();
+			}
+		}
+		else if (get_fcnt() >= saved_fcnt + JOIN_FCNT_STEP)
+		{
+			join_save_session();
+		}
+		if (session_restored)
+		{
+			check_link();
+		}
+		break;
+	}
+}
+
+/**
+ * @brief Called from the LoRaWAN joined callback, the session is saved in the scheduler task
+ *
+ */
+void join_succeeded(void)
+{
+	g_join_state = JOIN_JOINED;
+	join_fails = 0;
+	lmh_datarate_set(g_lorawan_settings.data_rate, g_lorawan_settings.adr_enabled);
+
+	if (session_restored)
+	{
+		// Continue above the last saved counter, the network drops frame counters it has seen
+		MibRequestConfirm_t mib_req;
+		mib_req.Type = MIB_UPLINK_COUNTER;
+		mib_req.Param.UpLinkCounter = restored_fcnt;
+		LoRaMacMibSetRequestConfirm(&mib_req);
+		if (mac_restored)
+		{
+			restore_mac_params();
+		}
+	}
+	reset_link_check();
+	session_pending = true;
+	reschedule(join_job_id, 0, JOIN_CHECK_TIME);
+}
+
+/**
+ * @brief Called from the LoRaWAN join failed callback, after all trials of the request failed
+ *
+ */
+void join_failed(void)
+{
+	join_fails++;
+	uint32_t backoff = join_backoff(join_fails);
+	g_join_state = JOIN_BACKOFF;
+	myLog_e("Join failed %d times, next try in %ld s", join_fails, backoff / 1000);
+	reschedule(join_job_id, backoff, 0);
+}
+
+/**
+ * @brief Start the join manager, call after lmh_init()
+ *
+ */
+void start_join(void)
+{
+	g_join_state = JOIN_IDLE;
+	join_fails = 0;
+	if (join_job_id < 0)
+	{
+		join_job_id = schedule("Join", join_job, 0, 0);
+	}
+	else
+	{
+		reschedule(join_job_id, 0, 0);
+	}
+}
@@ -17,6 +17,8 @@ s_lorawan_settings g_lorawan_settings;
 uint8_t g_rx_lora_data[256];
 /** Length of received data */
 uint8_t g_rx_data_len = 0;
+/** fPort of received data */
+uint8_t g_rx_port = 0;
 /** Buffer for received LoRaWan data */
 uint8_t g_tx_lora_data[256];
 /** Length of received data */
@@ -118,6 +120,9 @@ int8_t init_lorawan(void)
 	lmh_setAppSKey(g_lorawan_settings.node_apps_key);
 	lmh_setDevAddr(g_lorawan_settings.node_dev_addr);
 
+	// A saved OTAA session replaces the ABP keys and the join
+	bool restored = join_restore_session();
+
 #if MYLOG_LOG_LEVEL >= MYLOG_LOG_LEVEL_DEBUG
 	Serial.print("DevEUI: ");
 	for (int idx = 0; idx < 8; idx++)
@@ -147,7 +152,7 @@ int8_t init_lorawan(void)
 
 	myLog_d("Initialize LoRaWAN for region %s", region_names[g_lorawan_settings.lora_region]);
 	// Initialize LoRaWan
-	if (lmh_init(&lora_callbacks, lora_param_init, g_lorawan_settings.otaa_enabled, (eDeviceClass)g_lorawan_settings.lora_class, (LoRaMacRegion_t)g_lorawan_settings.lora_region) != 0)
+	if (lmh_init(&lora_callbacks, lora_param_init, g_lorawan_settings.otaa_enabled && !restored, (eDeviceClass)g_lorawan_settings.lora_class, (LoRaMacRegion_t)g_lorawan_settings.lora_region) != 0)
 	{
 		myLog_e("Failed to initialize LoRaWAN");
 		return -2;
@@ -161,9 +166,9 @@ int8_t init_lorawan(void)
 		return -3;
 	}
 
-	// Start Join process
+	// Start Join process, it is retried by the join manager
 	myLog_d("Start Join request");
-	lmh_join();
+	start_join();
 
 	g_lorawan_initialized = true;
 	return 0;
@@ -179,8 +184,8 @@ void lpwan_join_fail_handler(void)
 {
 	myLog_e("OTAA joined failed");
 	myLog_e("Check LPWAN credentials and if a gateway is in range");
-	// Restart Join procedure
-	myLog_e("Restart network join request");
+	// Restart Join procedure after the backoff
+	join_failed();
 }
 
 /**
@@ -201,6 +206,8 @@ static void lpwan_joined_handler(void)
 		myLog_d("ABP joined");
 	}
 
+	join_succeeded();
+
 	delay(100); // Just to enable the serial port to send the message
 
 	// Class A is default in the LoRaWAN lib. If app needs different class, request change here
@@ -231,6 +238,8 @@ static void lpwan_rx_handler(lmh_app_data_t *app_data)
 	// Copy the data into loop data buffer
 	memcpy(g_rx_lora_data, app_data->buffer, app_data->buffsize);
 	g_rx_data_len = app_data->buffsize;
+	g_rx_port = app_data->port;
+	downlink_received();
 }
 
 /**
@@ -254,6 +263,7 @@ static void lpwan_unconfirm_tx_finished(void)
 	digitalWrite(LED_BLUE, LOW);
 	myLog_d("Uncomfirmed TX finished");
 	g_rx_fin_result = true;
+	uplink_tx_finished(true);
 }
 
 /**
@@ -266,14 +276,25 @@ static void lpwan_confirm_tx_finished(bool result)
 	digitalWrite(LED_BLUE, LOW);
 	myLog_d("Comfirmed TX finished with result %s", result ? "ACK" : "NAK");
 	g_rx_fin_result = result;
+	uplink_tx_finished(result);
 }
 
 /**
- * @brief Send a LoRaWan package
+ * @brief Queue a LoRaWan package, it is sent when the network is joined and the radio is free
  * 
- * @return result of send request
+ * @return LMH_SUCCESS if queued, LMH_ERROR if the package is too large
  */
 lmh_error_status send_lora_packet(uint8_t *data, uint8_t size)
+{
+	return uplink_enqueue(g_lorawan_settings.app_port, data, size) ? LMH_SUCCESS : LMH_ERROR;
+}
+
+/**
+ * @brief Send a LoRaWan package now, used by the uplink queue
+ * 
+ * @return result of send request
+ */
+lmh_error_status lora_send_frame(uint8_t port, uint8_t *data, uint8_t size)
 {
 	if (lmh_join_status_get() != LMH_SET)
 	{
@@ -283,7 +304,7 @@ lmh_error_status send_lora_packet(uint8_t *data, uint8_t size)
 	}
 
 	digitalWrite(LED_BLUE, HIGH);
-	m_lora_app_data.port = g_lorawan_settings.app_port;
+	m_lora_app_data.port = port;
 
 	m_lora_app_data.buffsize = size;
 
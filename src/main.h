@@ -23,6 +23,7 @@
 #include <esp_system.h>
 #include <nvs.h>
 #include <nvs_flash.h>
+#include <SPIFFS.h>
 
 #include <my-log.h>
 #include <ArduinoJson.h>
@@ -38,6 +39,7 @@
 
 int8_t init_lorawan(void);
 lmh_error_status send_lora_packet(uint8_t *data, uint8_t size);
+lmh_error_status lora_send_frame(uint8_t port, uint8_t *data, uint8_t size);
 
 #define LORAWAN_DATA_MARKER 0x57
 
@@ -96,6 +98,9 @@ extern bool g_lpwan_has_joined;
 extern bool g_lorawan_initialized;
 extern int16_t g_last_rssi;
 extern int8_t g_last_snr;
+extern uint8_t g_rx_lora_data[];
+extern uint8_t g_rx_data_len;
+extern uint8_t g_rx_port;
 extern uint32_t otaaDevAddr;
 
 void initOTA();
@@ -162,6 +167,7 @@ uint8_t get_lora_batt(void);
 
 // AT Command stuff
 void at_serial_input(uint8_t cmd);
+int at_exec_cmd(const char *cmd_name, char *str);
 void start_check_serial(void);
 
 // Display stuff
@@ -176,4 +182,269 @@ union value_s
 	uint16_t val_16 = 0;
 	uint8_t val_8[2];
 };
-extern SMAReader smaReader;
\ No newline at end of file
+extern SMAReader smaReader;
+
+// Reader stuff
+#define BACKEND_WEBAPI 0
+#define BACKEND_SPEEDWIRE 1
+#define BACKEND_MODBUS 2
+
+void init_speedwire(void);
+uint8_t speedwire_discover(IPAddress *list, uint8_t max_count, uint32_t timeout_ms);
+void meter_status(char *buffer, uint8_t size);
+extern uint8_t g_sma_backend;
+
+// Multi inverter stuff
+#include "inverters.h"
+
+// Discovery stuff
+void init_discovery(void);
+void discovery_check(void);
+bool discovery_start(void);
+void discovery_status(char *buffer, uint8_t size);
+void save_discovery_prefs(void);
+extern uint8_t g_disc_fail_limit;
+
+// Value cache stuff
+struct s_cache_stats
+{
+	// Fresh values returned by cache_get()
+	uint32_t hits = 0;
+	// Values older than the TTL, returned while the refresh runs
+	uint32_t stale = 0;
+	// Keys without a value yet
+	uint32_t misses = 0;
+	// Reads of the inverters
+	uint32_t fetches = 0;
+	// Reads that waited for a running read instead of starting another one
+	uint32_t coalesced = 0;
+};
+
+void init_cache(void);
+uint8_t cache_fetch(int *values, uint32_t timeout_ms = 60000);
+bool cache_get(SMAKeyId id, int *value, uint32_t *age_ms);
+void cache_status(char *buffer, uint8_t size);
+extern s_cache_stats g_cache_stats;
+
+// History stuff
+#include "history.h"
+void init_history(void);
+int history_read(uint8_t level, uint32_t from, uint32_t to, s_hist_point *points, int max_points);
+int history_read_log(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps);
+void history_status(char *buffer, uint8_t size);
+
+// Task stuff
+struct s_sample
+{
+	// millis() when the sample was taken
+	uint32_t timestamp = 0;
+	// UTC time, seconds since boot until the time is synced
+	uint32_t utc = 0;
+	int values[poll_keys_t::count] = {0};
+	uint8_t num_ok = 0;
+	bool valid = false;
+	// Sample of the uplink interval, with a faster local feed the other samples are not sent over LoRaWAN
+	bool uplink = true;
+};
+
+// Timestamps before this are from an unsynced clock
+#define VALID_TIME 1600000000
+
+// Stage of the acquisition task, the sinks follow
+#define STAGE_ACQ 0
+// Max sinks, the consumers of the samples
+#define MAX_SINKS 6
+#define MAX_STAGES (MAX_SINKS + 1)
+
+struct s_task_stats
+{
+	const char *name = NULL;
+	TaskHandle_t task = NULL;
+	// Backlog of the sink
+	QueueHandle_t queue = NULL;
+	void (*handler)(s_sample *sample) = NULL;
+	// Returns true if the sink can take a sample, NULL if it is always ready
+	bool (*ready)(void) = NULL;
+	// Result of the last readiness check
+	bool is_ready = true;
+	// Samples handled
+	uint32_t runs = 0;
+	// Processing time of the last sample
+	uint32_t last_ms = 0;
+	// Max processing time
+	uint32_t max_ms = 0;
+	// Age of the last sample when the stage got it
+	uint32_t wait_ms = 0;
+	// Samples dropped because the stage was behind
+	uint32_t drops = 0;
+};
+
+void start_tasks(void);
+void poll_now(void);
+void request_backfill(uint16_t intervals);
+void set_poll_interval(void);
+void record_stage(s_task_stats *stats, uint32_t wait_ms, uint32_t proc_ms);
+extern s_task_stats g_task_stats[];
+extern uint8_t g_num_stages;
+
+// Sink stuff
+int8_t add_sink(const char *name, void (*handler)(s_sample *sample), bool (*ready)(void), uint8_t backlog);
+void publish_sample(uint8_t stage, s_sample *sample);
+void publish_all(s_sample *sample);
+void init_sinks(void);
+void get_udp_prefs(void);
+void save_udp_prefs(void);
+void udp_status(char *buffer, uint8_t size);
+extern uint8_t g_udp_format;
+
+// UDP feed stuff
+#define UDP_MODE_BROADCAST 0
+#define UDP_MODE_UNICAST 1
+#define UDP_MODE_MULTICAST 2
+#define MAX_SUBSCRIBERS 8
+
+struct s_subscriber
+{
+	// 0 if the entry is free
+	uint32_t ip = 0;
+	uint16_t port = 0;
+	// UDP_FORMAT_JSON or UDP_FORMAT_BINARY
+	uint8_t format = 0;
+	// millis() when the lease ends
+	uint32_t expires = 0;
+};
+
+void init_subscribers(void);
+uint8_t get_subscribers(s_subscriber *list);
+uint32_t local_poll_interval(void);
+void subscriber_status(char *buffer, uint8_t size);
+void get_subscriber_prefs(void);
+void save_subscriber_prefs(void);
+extern uint8_t g_udp_mode;
+extern uint16_t g_udp_local_interval;
+extern IPAddress multiIP;
+extern WiFiUDP udpClientServer;
+
+// MQTT stuff
+struct s_mqtt_settings
+{
+	// Broker, MQTT is disabled if empty
+	char host[64] = {0};
+	uint16_t port = 1883;
+	char user[32] = {0};
+	char pass[32] = {0};
+	// Prefix of the topics
+	char topic[48] = {0};
+	uint8_t qos = 1;
+	bool retain = true;
+	// Samples per message
+	uint8_t batch = 1;
+};
+extern s_mqtt_settings g_mqtt_settings;
+void init_mqtt(void);
+void get_mqtt_prefs(void);
+void save_mqtt_prefs(void);
+void mqtt_settings_changed(void);
+void mqtt_status(char *buffer, uint8_t size);
+
+// Scheduler stuff
+#include "scheduler.h"
+void ota_job(void);
+void wifi_job(void);
+
+// Adaptive poll stuff
+#include "poll_mode.h"
+
+struct s_poll_settings
+{
+	bool enabled = false;
+	// Location for sunrise and sunset, degrees north and east
+	float lat = 0.0;
+	float lon = 0.0;
+	// Poll intervals in seconds
+	uint32_t fast_time = 60;
+	uint32_t slow_time = 300;
+	uint32_t night_time = 1800;
+};
+
+uint32_t get_poll_interval(s_sample *sample);
+void get_poll_prefs(void);
+void save_poll_prefs(void);
+extern s_poll_settings g_poll_settings;
+extern e_poll_mode g_poll_mode;
+extern const char *poll_mode_names[];
+
+// Uplink queue stuff
+// Max LoRaWAN application payload
+#define UPLINK_MAX_PAYLOAD 242
+
+struct s_uplink
+{
+	// UTC time when the packet was queued
+	uint32_t timestamp;
+	uint8_t port;
+	uint8_t size;
+	uint8_t data[UPLINK_MAX_PAYLOAD];
+};
+
+struct s_uplink_stats
+{
+	uint32_t queued = 0;
+	uint32_t sent = 0;
+	uint32_t spilled = 0;
+	uint32_t dropped = 0;
+	uint32_t retries = 0;
+};
+
+void init_uplink(void);
+bool uplink_enqueue(uint8_t port, uint8_t *data, uint8_t size);
+void uplink_tx_finished(bool success);
+void uplink_drain_job(void);
+uint16_t uplink_pending(uint16_t *in_flash);
+void uplink_save(void);
+extern s_uplink_stats g_uplink_stats;
+
+// Downlink stuff
+void init_downlink(void);
+void downlink_received(void);
+uint8_t downlink_dispatch(uint8_t *data, uint8_t size, uint8_t *reply, uint8_t reply_size, uint8_t *reply_len);
+
+// Join stuff
+enum e_join_state
+{
+	JOIN_IDLE = 0,
+	JOIN_PENDING,
+	JOIN_BACKOFF,
+	JOIN_JOINED
+};
+extern e_join_state g_join_state;
+extern const char *join_state_names[];
+extern uint32_t g_join_attempts;
+void start_join(void);
+void join_succeeded(void);
+void join_failed(void);
+bool join_restore_session(void);
+void join_save_session(void);
+void join_clear_session(void);
+
+// Airtime stuff
+bool airtime_allowed(uint8_t size);
+void airtime_deferred(void);
+void airtime_charge(uint8_t size);
+bool airtime_low(void);
+uint32_t airtime_of(uint8_t size);
+uint8_t airtime_status(char *buffer, uint8_t size);
+
+// Batch stuff
+uint8_t lora_datarate(void);
+uint8_t lora_max_payload(void);
+#define FORMAT_BATCH 0
+#define FORMAT_CODEC 1
+void batch_add(s_sample *sample);
+void batch_flush(void);
+void batch_send_log(uint32_t *timestamps, uint32_t *values, int count);
+void get_batch_prefs(void);
+void save_batch_prefs(void);
+extern uint8_t g_batch_max;
+extern uint8_t g_batch_format;
+extern uint8_t g_batch_mask;
\ No newline at end of file
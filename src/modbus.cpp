@@ -0,0 +1,263 @@
+/**
+ * @file modbus.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Modbus TCP requests for SMA inverters
+ *
+ * Read input registers request, big endian:
+ *   0  transaction id
+ *   2  protocol id, 0
+ *   4  length of the rest
+ *   6  unit id
+ *   7  function MB_FUNC_READ_INPUT
+ *   8  first register
+ *   10 number of registers
+ *
+ * The response has the same header, then the function, the byte count and the registers.
+ * An error response has bit 7 of the function set and the exception code.
+ *
+ * All values of the keys are 32 bit, two registers, the SMA register numbers are used as addresses.
+ *
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "modbus.h"
+
+/** Registers of a value */
+#define MB_VALUE_WORDS 2
+
+/** Max unused registers between two values that are read with one request */
+#define MB_MAX_GAP 32
+
+/** Register of a key */
+struct s_mb_register
+{
+	// 0 if the key has no register
+	uint16_t address;
+	bool is_signed;
+};
+
+/** Registers of the keys, same order as SMAKeyId */
+static const s_mb_register mb_registers[] = {
+	{30775, true},	// POWER
+	{30535, false}, // ENERGY_TODAY
+	{30529, false}, // ENERGY_TOTAL
+	{30777, true},	// AC_L1_POWER
+	{30783, false}, // AC_L1_VOLTAGE
+	{30977, true},	// AC_L1_CURRENT
+	{30779, true},	// AC_L2_POWER
+	{30785, false}, // AC_L2_VOLTAGE
+	{30979, true},	// AC_L2_CURRENT
+	{30781, true},	// AC_L3_POWER
+	{30787, false}, // AC_L3_VOLTAGE
+	{30981, true},	// AC_L3_CURRENT
+	{30789, false}, // AC_L1L2_VOLTAGE
+	{30791, false}, // AC_L2L3_VOLTAGE
+	{30793, false}, // AC_L3L1_VOLTAGE
+	{30803, false}, // AC_FREQUENCY
+	{30773, true},	// DC_POWER
+	{30771, true},	// DC_VOLTAGE
+	{30769, true},	// DC_CURRENT
+	{30541, false}, // OPERATING_TIME
+	{30543, false}, // FEED_IN_TIME
+	{0, false},		// ETHERNET_IP
+	{0, false},		// ETHERNET_DNS_IP
+	{0, false},		// ETHERNET_NETMASK
+	{0, false},		// ETHERNET_GATEWAY_IP
+	{0, false},		// WLAN_IP
+	{0, false},		// WLAN_DNS_IP
+	{0, false},		// WLAN_NETMASK
+	{0, false},		// WLAN_GATEWAY_IP
+	{0, false},		// WLAN_STRENGTH
+	{0, false},		// DEVICE_WARNING
+	{0, false},		// DEVICE_ERROR
+	{0, false},		// DEVICE_OK
+};
+
+static_assert(sizeof(mb_registers) / sizeof(mb_registers[0]) == (size_t)SMAKeyId::COUNT, "mb_registers does not match SMAKeyId");
+
+/**
+ * @brief Read a big endian 16 bit value
+ */
+static uint16_t get_be16(const uint8_t *ptr)
+{
+	return (ptr[0] << 8) | ptr[1];
+}
+
+/**
+ * @brief Write a big endian 16 bit value
+ */
+static void put_be16(uint8_t *ptr, uint16_t value)
+{
+	ptr[0] = value >> 8;
+	ptr[1] = value & 0xFF;
+}
+
+/**
+ * @brief Build a read input registers request
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param transaction transaction id, the response has the same
+ * @param block registers to read
+ * @return size_t length of the request, 0 if the buffer is too small
+ */
+size_t mb_build_read(uint8_t *buffer, size_t size, uint16_t transaction, const s_mb_block *block)
+{
+	if (size < MB_REQUEST_SIZE)
+	{
+		return 0;
+	}
+	put_be16(&buffer[0], transaction);
+	put_be16(&buffer[2], 0);
+	put_be16(&buffer[4], MB_REQUEST_SIZE - MB_HEADER_SIZE);
+	buffer[6] = MB_UNIT_ID;
+	buffer[7] = MB_FUNC_READ_INPUT;
+	put_be16(&buffer[8], block->address);
+	put_be16(&buffer[10], block->count);
+	return MB_REQUEST_SIZE;
+}
+
+/**
+ * @brief Get the length of a frame from its header
+ *
+ * @param header the first MB_HEADER_SIZE bytes of the frame
+ * @return size_t length of the frame with the header
+ */
+size_t mb_frame_length(const uint8_t *header)
+{
+	return MB_HEADER_SIZE + get_be16(&header[4]);
+}
+
+/**
+ * @brief Parse the response to a read request
+ *
+ * @param buffer the response
+ * @param len length of the response
+ * @param transaction transaction id of the request
+ * @param block registers of the request
+ * @param data set to the first register in the response
+ * @return int number of bytes of the registers, -1 if the response is wrong, -2 for an exception response
+ */
+int mb_parse_read(const uint8_t *buffer, size_t len, uint16_t transaction, const s_mb_block *block, const uint8_t **data)
+{
+	if ((len < MB_HEADER_SIZE + 3) || (get_be16(&buffer[0]) != transaction) || (get_be16(&buffer[2]) != 0) || (mb_frame_length(buffer) > len))
+	{
+		return -1;
+	}
+	if (buffer[7] == (MB_FUNC_READ_INPUT | 0x80))
+	{
+		return -2;
+	}
+	uint8_t byte_count = buffer[8];
+	if ((buffer[7] != MB_FUNC_READ_INPUT) || (byte_count != 2 * block->count) || (MB_HEADER_SIZE + 3 + (size_t)byte_count > len))
+	{
+		return -1;
+	}
+	*data = &buffer[MB_HEADER_SIZE + 3];
+	return byte_count;
+}
+
+/**
+ * @brief Plan the read requests for a set of keys
+ * The registers are sorted and close registers are read with one request
+ *
+ * @param ids key ids
+ * @param count number of keys
+ * @param blocks output array
+ * @param max_blocks size of the output array
+ * @return uint8_t number of blocks
+ */
+uint8_t mb_plan_blocks(const SMAKeyId *ids, uint8_t count, s_mb_block *blocks, uint8_t max_blocks)
+{
+	// Sorted addresses of the keys that have a register
+	uint16_t addresses[(size_t)SMAKeyId::COUNT];
+	uint8_t num_addresses = 0;
+	for (uint8_t idx = 0; idx < count; idx++)
+	{
+		uint16_t address = mb_registers[(uint8_t)ids[idx]].address;
+		if (address == 0)
+		{
+			continue;
+		}
+		uint8_t pos = num_addresses;
+		while ((pos > 0) && (addresses[pos - 1] > address))
+		{
+			addresses[pos] = addresses[pos - 1];
+			pos--;
+		}
+		addresses[pos] = address;
+		num_addresses++;
+	}
+
+	uint8_t num_blocks = 0;
+	for (uint8_t idx = 0; idx < num_addresses; idx++)
+	{
+		uint16_t address = addresses[idx];
+		if (num_blocks > 0)
+		{
+			s_mb_block *block = &blocks[num_blocks - 1];
+			uint16_t block_end = block->address + block->count;
+			if (address < block_end)
+			{
+				// Same register twice
+				continue;
+			}
+			if ((address - block_end <= MB_MAX_GAP) && (address + MB_VALUE_WORDS - block->address <= MB_MAX_REGISTERS))
+			{
+				block->count = address + MB_VALUE_WORDS - block->address;
+				continue;
+			}
+		}
+		if (num_blocks == max_blocks)
+		{
+			break;
+		}
+		blocks[num_blocks].address = address;
+		blocks[num_blocks].count = MB_VALUE_WORDS;
+		num_blocks++;
+	}
+	return num_blocks;
+}
+
+/**
+ * @brief Get the value of a key from the registers of a block
+ *
+ * @param block registers of the request
+ * @param data registers from mb_parse_read()
+ * @param id key id
+ * @param value set to the value, -1 if the inverter has no value (NaN)
+ * @return true if the block has the registers of the key
+ */
+bool mb_find_value(const s_mb_block *block, const uint8_t *data, SMAKeyId id, int *value)
+{
+	const s_mb_register *reg = &mb_registers[(uint8_t)id];
+	if ((reg->address == 0) || (reg->address < block->address) || (reg->address + MB_VALUE_WORDS > block->address + block->count))
+	{
+		return false;
+	}
+	const uint8_t *ptr = &data[2 * (reg->address - block->address)];
+	uint32_t raw = mb_get_u32(ptr);
+	if (reg->is_signed)
+	{
+		*value = raw == 0x80000000 ? -1 : (int32_t)raw;
+	}
+	else
+	{
+		*value = raw == 0xFFFFFFFF ? -1 : (int)raw;
+	}
+	return true;
+}
+
+/**
+ * @brief Get an unsigned 32 bit value, two registers
+ *
+ * @param data first register of the value
+ * @return uint32_t the value
+ */
+uint32_t mb_get_u32(const uint8_t *data)
+{
+	return ((uint32_t)get_be16(data) << 16) | get_be16(&data[2]);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file modbus.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Modbus TCP requests for SMA inverters, register map of the keys and coalescing of the registers
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MODBUS_H__
+#define __MODBUS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <SMAKeys.h>
+
+// Modbus TCP port
+#define MB_PORT 502
+
+// Unit id of the inverter, SMA default
+#define MB_UNIT_ID 3
+
+// Read input registers
+#define MB_FUNC_READ_INPUT 0x04
+
+// Size of the MBAP header up to the unit id
+#define MB_HEADER_SIZE 6
+
+// Size of a read request
+#define MB_REQUEST_SIZE 12
+
+// Max registers of one read
+#define MB_MAX_REGISTERS 125
+
+// Max size of a response
+#define MB_RESPONSE_MAX (MB_HEADER_SIZE + 3 + 2 * MB_MAX_REGISTERS)
+
+// Max blocks for one key set
+#define MB_MAX_BLOCKS 8
+
+// Register of the serial number, U32
+#define MB_REG_SERIAL 30057
+
+// Registers read with one request
+struct s_mb_block
+{
+	uint16_t address;
+	uint16_t count;
+};
+
+size_t mb_build_read(uint8_t *buffer, size_t size, uint16_t transaction, const s_mb_block *block);
+size_t mb_frame_length(const uint8_t *header);
+int mb_parse_read(const uint8_t *buffer, size_t len, uint16_t transaction, const s_mb_block *block, const uint8_t **data);
+uint8_t mb_plan_blocks(const SMAKeyId *ids, uint8_t count, s_mb_block *blocks, uint8_t max_blocks);
+bool mb_find_value(const s_mb_block *block, const uint8_t *data, SMAKeyId id, int *value);
+uint32_t mb_get_u32(const uint8_t *data);
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * @file modbus_reader.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Modbus TCP backend of the inverters
+ * The connection to the inverter is kept open between the polls and opened again after an error.
+ * The registers of poll_keys_t are read in a few blocks, see mb_plan_blocks().
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include "modbus.h"
+
+/** Time to wait for the connection */
+#define MB_CONNECT_TIMEOUT 3000
+
+/** Time to wait for a response */
+#define MB_TIMEOUT 2000
+
+/** Time between two checks of the connection while waiting */
+#define MB_WAIT_STEP 5
+
+/** Backend for Modbus TCP */
+class ModbusReader : public InverterReader
+{
+public:
+	ModbusReader(IPAddress *ip);
+	bool getValues(int *values);
+	int getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps);
+	void logout(void);
+	uint32_t getSerial(void) { return _serial; }
+
+private:
+	bool connect(void);
+	bool read(size_t offset, size_t len);
+	int request(const s_mb_block *block, const uint8_t **data);
+
+	IPAddress *_ip;
+	IPAddress _connected_ip;
+	WiFiClient _client;
+	uint16_t _transaction = 0;
+	uint32_t _serial = 0;
+	uint8_t _num_blocks = 0;
+	s_mb_block _blocks[MB_MAX_BLOCKS];
+	uint8_t _packet[MB_RESPONSE_MAX];
+};
+
+/**
+ * @brief Create the reader, the blocks for poll_keys_t are planned once
+ *
+ * @param ip IP of the inverter, read on every connect
+ */
+ModbusReader::ModbusReader(IPAddress *ip)
+{
+	_ip = ip;
+	_num_blocks = mb_plan_blocks(poll_keys_t::ids, poll_keys_t::count, _blocks, MB_MAX_BLOCKS);
+}
+
+/**
+ * @brief Open the connection if it is not open or the IP of the inverter changed
+ *
+ * @return true if connected
+ */
+bool ModbusReader::connect(void)
+{
+	if (_client.connected() && (_connected_ip == *_ip))
+	{
+		return true;
+	}
+	_client.stop();
+	if (!WiFi.isConnected())
+	{
+		return false;
+	}
+	if (_client.connect(*_ip, MB_PORT, MB_CONNECT_TIMEOUT) != 1)
+	{
+		myLog_e("Modbus: no connection to %s", _ip->toString().c_str());
+		return false;
+	}
+	_client.setNoDelay(true);
+	_connected_ip = *_ip;
+	// Maybe another device, read the serial again
+	_serial = 0;
+	myLog_d("Modbus: connected to %s", _ip->toString().c_str());
+	return true;
+}
+
+/**
+ * @brief Read from the connection into the packet buffer
+ *
+ * @param offset position in the packet buffer
+ * @param len bytes to read
+ * @return true if all bytes were received in time
+ */
+bool ModbusReader::read(size_t offset, size_t len)
+{
+	size_t received = 0;
+	uint32_t start_time = millis();
+	while (received < len)
+	{
+		int available = _client.available();
+		if (available > 0)
+		{
+			received += _client.read(&_packet[offset + received], min((size_t)available, len - received));
+			continue;
+		}
+		if (!_client.connected() || ((millis() - start_time) > MB_TIMEOUT))
+		{
+			return false;
+		}
+		delay(MB_WAIT_STEP);
+	}
+	return true;
+}
+
+/**
+ * @brief Read a block of registers
+ *
+ * @param block registers to read
+ * @param data set to the first register in the packet buffer
+ * @return int bytes of the registers, -1 if the connection failed, -2 if the inverter refused the request
+ */
+int ModbusReader::request(const s_mb_block *block, const uint8_t **data)
+{
+	_transaction++;
+	size_t len = mb_build_read(_packet, sizeof(_packet), _transaction, block);
+	if (_client.write(_packet, len) != len)
+	{
+		return -1;
+	}
+	if (!read(0, MB_HEADER_SIZE))
+	{
+		return -1;
+	}
+	len = mb_frame_length(_packet);
+	if ((len > sizeof(_packet)) || !read(MB_HEADER_SIZE, len - MB_HEADER_SIZE))
+	{
+		return -1;
+	}
+	return mb_parse_read(_packet, len, _transaction, block, data);
+}
+
+/**
+ * @brief Read the values of poll_keys_t, one request per planned block
+ *
+ * @param values array of poll_keys_t::count values, -1 for values the inverter does not have
+ * @return true if all blocks were read
+ */
+bool ModbusReader::getValues(int *values)
+{
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		values[idx] = -1;
+	}
+	if (!connect())
+	{
+		return false;
+	}
+	for (uint8_t b_idx = 0; b_idx < _num_blocks; b_idx++)
+	{
+		const uint8_t *data;
+		int result = request(&_blocks[b_idx], &data);
+		if (result == -2)
+		{
+			myLog_e("Modbus: registers %d..%d refused", _blocks[b_idx].address, _blocks[b_idx].address + _blocks[b_idx].count - 1);
+			continue;
+		}
+		if (result < 0)
+		{
+			// Lost the connection or out of sync, start over on the next poll
+			_client.stop();
+			return false;
+		}
+		for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+		{
+			mb_find_value(&_blocks[b_idx], data, poll_keys_t::ids[idx], &values[idx]);
+		}
+	}
+	if (_serial == 0)
+	{
+		const s_mb_block serial_block = {MB_REG_SERIAL, 2};
+		const uint8_t *data;
+		if (request(&serial_block, &data) == 4)
+		{
+			uint32_t serial = mb_get_u32(data);
+			_serial = serial == 0xFFFFFFFF ? 0 : serial;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief The energy log is not available over Modbus
+ *
+ * @return int always -1
+ */
+int ModbusReader::getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps)
+{
+	return -1;
+}
+
+/**
+ * @brief Close the connection
+ *
+ */
+void ModbusReader::logout(void)
+{
+	_client.stop();
+}
+
+/**
+ * @brief Create a Modbus TCP reader
+ *
+ * @param ip IP of the inverter, read on every connect
+ * @return InverterReader* the reader
+ */
+InverterReader *new_modbus_reader(IPAddress *ip)
+{
+	return new ModbusReader(ip);
+}
@@ -0,0 +1,429 @@
+/**
+ * @file mqtt.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief MQTT sink, publishes the samples to a broker
+ * The samples are kept in an offline buffer in PSRAM until the broker confirmed them.
+ * Up to g_mqtt_settings.batch samples are sent as one JSON array to <topic>/samples.
+ * <topic>/status is "online" while connected and "offline" as last will.
+ * @version 0.1
+ * @date 2021-10-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include <AsyncMqttClient.h>
+
+/** Samples in the offline buffer with PSRAM */
+#define MQTT_BUFFER_SIZE 512
+
+/** Samples in the offline buffer without PSRAM */
+#define MQTT_BUFFER_SIZE_NO_PSRAM 32
+
+/** Max samples in one message */
+#define MQTT_MAX_BATCH 10
+
+/** Size of a message */
+#define MQTT_PAYLOAD_SIZE 1536
+
+/** Interval of the connection check and of the flush of the offline buffer */
+#define MQTT_CHECK_TIME 5000
+
+/** Max time for the connection to the broker */
+#define MQTT_CONNECT_TIMEOUT 30000
+
+/** Max time for the broker to confirm a message, it is sent again after that */
+#define MQTT_PUBLISH_TIMEOUT 30000
+
+/** Backlog of the sink, the samples are moved to the offline buffer immediately */
+#define MQTT_BACKLOG 4
+
+/** Settings of the MQTT sink */
+s_mqtt_settings g_mqtt_settings;
+
+/** Sample in the offline buffer */
+struct s_mqtt_record
+{
+	uint32_t utc;
+	int values[poll_keys_t::count];
+};
+
+/** JSON names of the values, same order as poll_keys_t */
+static const char *value_names[] = {"p", "e", "udc", "idc", "f", "p1", "p2", "p3", "et"};
+static_assert(sizeof(value_names) / sizeof(value_names[0]) == poll_keys_t::count, "value_names must match poll_keys_t");
+
+/** The MQTT client */
+static AsyncMqttClient mqtt_client;
+
+/** Offline buffer */
+static s_mqtt_record *ring = NULL;
+
+/** Size of the offline buffer */
+static uint16_t ring_size = 0;
+
+/** Oldest sample in the offline buffer */
+static uint16_t ring_head = 0;
+
+/** Samples in the offline buffer */
+static uint16_t ring_count = 0;
+
+/** Protects the offline buffer, it is filled by the sink task and flushed by the scheduler */
+static SemaphoreHandle_t mqtt_mutex = NULL;
+
+/** Scheduler job of the MQTT sink */
+static int8_t mqtt_job_id = -1;
+
+/** Packet id of the message waiting for the confirmation of the broker, 0 if none */
+static volatile uint16_t pending_id = 0;
+
+/** Samples in the message waiting for the confirmation */
+static volatile uint16_t pending_count = 0;
+
+/** millis() when the pending message was sent */
+static uint32_t pending_start = 0;
+
+/** true while connecting to the broker */
+static volatile bool connecting = false;
+
+/** millis() of the last connection attempt */
+static uint32_t connect_start = 0;
+
+/** Set when the settings changed, the client reconnects */
+static volatile bool reconnect = false;
+
+/** Samples confirmed by the broker */
+static uint32_t mqtt_sent = 0;
+
+/** Samples dropped because the offline buffer was full */
+static uint32_t mqtt_dropped = 0;
+
+/** Topic of the status */
+static char status_topic[sizeof(g_mqtt_settings.topic) + 8];
+
+/** Topic of the samples */
+static char samples_topic[sizeof(g_mqtt_settings.topic) + 9];
+
+/** Message buffer */
+static char payload[MQTT_PAYLOAD_SIZE];
+
+/**
+ * @brief Build the JSON array of the oldest samples in the offline buffer
+ *
+ * @param count max samples
+ * @param len set to the size of the message
+ * @return uint16_t samples in the message, 0 if the buffer is empty
+ */
+static uint16_t build_message(uint16_t count, size_t *len)
+{
+	DynamicJsonDocument json_buffer(MQTT_PAYLOAD_SIZE * 2);
+	JsonArray samples = json_buffer.to<JsonArray>();
+	count = min(count, ring_count);
+	for (uint16_t idx = 0; idx < count; idx++)
+	{
+		s_mqtt_record *record = &ring[(ring_head + idx) % ring_size];
+		JsonObject sample = samples.createNestedObject();
+		sample["t"] = record->utc;
+		for (uint8_t val = 0; val < poll_keys_t::count; val++)
+		{
+			float scale = smaKeyInfo(poll_keys_t::ids[val]).scale;
+			if (scale == 1.0f)
+			{
+				sample[value_names[val]] = record->values[val];
+			}
+			else
+			{
+				sample[value_names[val]] = record->values[val] * scale;
+			}
+		}
+	}
+	*len = serializeJson(json_buffer, payload, MQTT_PAYLOAD_SIZE);
+	return count;
+}
+
+/**
+ * @brief Remove samples from the offline buffer
+ *
+ * @param count samples to remove
+ */
+static void ring_remove(uint16_t count)
+{
+	count = min(count, ring_count);
+	ring_head = (ring_head + count) % ring_size;
+	ring_count -= count;
+}
+
+/**
+ * @brief Send the oldest samples when the batch is full
+ * Only one message is sent at a time, with QoS > 0 the samples are removed
+ * when the broker confirmed the message
+ *
+ */
+static void flush(void)
+{
+	xSemaphoreTake(mqtt_mutex, portMAX_DELAY);
+	while (mqtt_client.connected() && (ring_count >= g_mqtt_settings.batch))
+	{
+		if (pending_id != 0)
+		{
+			if ((millis() - pending_start) < MQTT_PUBLISH_TIMEOUT)
+			{
+				break;
+			}
+			myLog_e("MQTT publish %d not confirmed", pending_id);
+			pending_id = 0;
+		}
+
+		size_t len;
+		uint16_t count = build_message(g_mqtt_settings.batch, &len);
+		uint16_t packet_id = mqtt_client.publish(samples_topic, g_mqtt_settings.qos, g_mqtt_settings.retain, payload, len);
+		if (packet_id == 0)
+		{
+			myLog_e("MQTT publish failed");
+			break;
+		}
+		if (g_mqtt_settings.qos == 0)
+		{
+			ring_remove(count);
+			mqtt_sent += count;
+			continue;
+		}
+		pending_count = count;
+		pending_start = millis();
+		pending_id = packet_id;
+	}
+	xSemaphoreGive(mqtt_mutex);
+}
+
+/**
+ * @brief Callback of the MQTT client, the broker confirmed a message
+ *
+ * @param packet_id id of the message
+ */
+static void on_mqtt_publish(uint16_t packet_id)
+{
+	xSemaphoreTake(mqtt_mutex, portMAX_DELAY);
+	if ((pending_id == 0) || (packet_id != pending_id))
+	{
+		xSemaphoreGive(mqtt_mutex);
+		return;
+	}
+	ring_remove(pending_count);
+	mqtt_sent += pending_count;
+	pending_id = 0;
+	xSemaphoreGive(mqtt_mutex);
+	reschedule(mqtt_job_id, 0, MQTT_CHECK_TIME);
+}
+
+/**
+ * @brief Callback of the MQTT client, connected to the broker
+ *
+ * @param session_present unused
+ */
+static void on_mqtt_connect(bool session_present)
+{
+	connecting = false;
+	pending_id = 0;
+	myLog_d("MQTT connected");
+	mqtt_client.publish(status_topic, 1, true, "online");
+	reschedule(mqtt_job_id, 0, MQTT_CHECK_TIME);
+}
+
+/**
+ * @brief Callback of the MQTT client, disconnected from the broker
+ * Samples of an unconfirmed message stay in the offline buffer and are sent again
+ *
+ * @param reason reason of the disconnect
+ */
+static void on_mqtt_disconnect(AsyncMqttClientDisconnectReason reason)
+{
+	connecting = false;
+	pending_id = 0;
+	myLog_d("MQTT disconnected, reason %d", (int)reason);
+}
+
+/**
+ * @brief Scheduler job, connect to the broker and send the offline buffer
+ *
+ */
+static void mqtt_job(void)
+{
+	if (reconnect || (g_mqtt_settings.host[0] == 0))
+	{
+		reconnect = false;
+		if (mqtt_client.connected() || connecting)
+		{
+			connecting = false;
+			mqtt_client.disconnect(true);
+			return;
+		}
+	}
+	if ((g_mqtt_settings.host[0] == 0) || !WiFi.isConnected())
+	{
+		return;
+	}
+
+	if (mqtt_client.connected())
+	{
+		flush();
+		return;
+	}
+	if (connecting)
+	{
+		if ((millis() - connect_start) >= MQTT_CONNECT_TIMEOUT)
+		{
+			myLog_e("MQTT connect timeout");
+			connecting = false;
+			mqtt_client.disconnect(true);
+		}
+		return;
+	}
+
+	snprintf(status_topic, sizeof(status_topic), "%s/status", g_mqtt_settings.topic);
+	snprintf(samples_topic, sizeof(samples_topic), "%s/samples", g_mqtt_settings.topic);
+	mqtt_client.setServer(g_mqtt_settings.host, g_mqtt_settings.port);
+	if (g_mqtt_settings.user[0] != 0)
+	{
+		mqtt_client.setCredentials(g_mqtt_settings.user, g_mqtt_settings.pass);
+	}
+	else
+	{
+		mqtt_client.setCredentials(NULL, NULL);
+	}
+	mqtt_client.setWill(status_topic, 1, true, "offline");
+	myLog_d("MQTT connect to %s:%d", g_mqtt_settings.host, g_mqtt_settings.port);
+	connecting = true;
+	connect_start = millis();
+	mqtt_client.connect();
+}
+
+/**
+ * @brief Put a sample into the offline buffer and send the buffer if the batch is full
+ * The oldest sample is dropped when the buffer is full
+ *
+ * @param sample the sample
+ */
+static void mqtt_sink(s_sample *sample)
+{
+	if (!sample->valid || (g_mqtt_settings.host[0] == 0) || (ring == NULL))
+	{
+		return;
+	}
+
+	xSemaphoreTake(mqtt_mutex, portMAX_DELAY);
+	if (ring_count == ring_size)
+	{
+		if (pending_id != 0)
+		{
+			// Don't remove samples of the message on its way
+			xSemaphoreGive(mqtt_mutex);
+			mqtt_dropped++;
+			return;
+		}
+		ring_remove(1);
+		mqtt_dropped++;
+	}
+	s_mqtt_record *record = &ring[(ring_head + ring_count) % ring_size];
+	record->utc = sample->utc;
+	memcpy(record->values, sample->values, sizeof(record->values));
+	ring_count++;
+	xSemaphoreGive(mqtt_mutex);
+
+	flush();
+}
+
+/**
+ * @brief Get the MQTT status for AT+MQTT
+ * Connected, samples in the offline buffer, samples sent and samples dropped
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void mqtt_status(char *buffer, uint8_t size)
+{
+	snprintf(buffer, size, "%d:%d:%lu:%lu", mqtt_client.connected() ? 1 : 0, ring_count, (unsigned long)mqtt_sent, (unsigned long)mqtt_dropped);
+}
+
+/**
+ * @brief Apply changed settings, the client reconnects with the new settings
+ *
+ */
+void mqtt_settings_changed(void)
+{
+	reconnect = true;
+	reschedule(mqtt_job_id, 0, MQTT_CHECK_TIME);
+}
+
+/**
+ * @brief Read the MQTT settings from the preferences
+ *
+ */
+void get_mqtt_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("MQTT", false);
+	preferences.getString("h", g_mqtt_settings.host, sizeof(g_mqtt_settings.host));
+	g_mqtt_settings.port = preferences.getUShort("p", 1883);
+	preferences.getString("u", g_mqtt_settings.user, sizeof(g_mqtt_settings.user));
+	preferences.getString("pw", g_mqtt_settings.pass, sizeof(g_mqtt_settings.pass));
+	if (preferences.getString("t", g_mqtt_settings.topic, sizeof(g_mqtt_settings.topic)) == 0)
+	{
+		snprintf(g_mqtt_settings.topic, sizeof(g_mqtt_settings.topic), "sma/%s", g_ap_name);
+	}
+	g_mqtt_settings.qos = preferences.getUChar("q", 1);
+	g_mqtt_settings.retain = preferences.getBool("r", true);
+	g_mqtt_settings.batch = preferences.getUChar("n", 1);
+	preferences.end();
+
+	if ((g_mqtt_settings.batch == 0) || (g_mqtt_settings.batch > MQTT_MAX_BATCH))
+	{
+		g_mqtt_settings.batch = 1;
+	}
+}
+
+/**
+ * @brief Save the MQTT settings
+ *
+ */
+void save_mqtt_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("MQTT", false);
+	preferences.putString("h", g_mqtt_settings.host);
+	preferences.putUShort("p", g_mqtt_settings.port);
+	preferences.putString("u", g_mqtt_settings.user);
+	preferences.putString("pw", g_mqtt_settings.pass);
+	preferences.putString("t", g_mqtt_settings.topic);
+	preferences.putUChar("q", g_mqtt_settings.qos);
+	preferences.putBool("r", g_mqtt_settings.retain);
+	preferences.putUChar("n", g_mqtt_settings.batch);
+	preferences.end();
+}
+
+/**
+ * @brief Set up the offline buffer and the MQTT client, add the sink and its job
+ *
+ */
+void init_mqtt(void)
+{
+	get_mqtt_prefs();
+
+	mqtt_mutex = xSemaphoreCreateMutex();
+	if (psramFound())
+	{
+		ring = (s_mqtt_record *)ps_malloc(MQTT_BUFFER_SIZE * sizeof(s_mqtt_record));
+		ring_size = MQTT_BUFFER_SIZE;
+	}
+	if (ring == NULL)
+	{
+		ring = (s_mqtt_record *)malloc(MQTT_BUFFER_SIZE_NO_PSRAM * sizeof(s_mqtt_record));
+		ring_size = MQTT_BUFFER_SIZE_NO_PSRAM;
+	}
+
+	mqtt_client.setClientId(g_ap_name);
+	mqtt_client.onConnect(on_mqtt_connect);
+	mqtt_client.onDisconnect(on_mqtt_disconnect);
+	mqtt_client.onPublish(on_mqtt_publish);
+
+	add_sink("MQTT", mqtt_sink, NULL, MQTT_BACKLOG);
+	mqtt_job_id = schedule("MQTT", mqtt_job, MQTT_CHECK_TIME, MQTT_CHECK_TIME);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file poll_mode.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Poll mode from power changes and sunrise/sunset
+ * Fast polls after a large power change, slow polls while the power is stable,
+ * night polls from sunset to sunrise
+ * @version 0.1
+ * @date 2021-10-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "poll_mode.h"
+#include <math.h>
+#include <stdlib.h>
+
+/** Power change that switches to fast polling, in W */
+#define POLL_MIN_DELTA 50
+
+/** Power change that switches to fast polling, in % of the last power */
+#define POLL_DELTA_PERCENT 10
+
+/** Fast polls after the last large power change */
+#define POLL_FAST_HOLD 3
+
+/** Time before sunrise and after sunset that still counts as day, in minutes */
+#define POLL_TWILIGHT 30
+
+/** Degrees to radians and back */
+#define POLL_DEG_TO_RAD (M_PI / 180.0)
+#define POLL_RAD_TO_DEG (180.0 / M_PI)
+
+/** Power of the previous sample */
+static int last_power = 0;
+
+/** Remaining fast polls */
+static uint8_t fast_hold = 0;
+
+/**
+ * @brief Calculate sunrise and sunset (NOAA approximation)
+ *
+ * @param day_of_year 0 .. 365
+ * @param lat latitude in degrees, north positive
+ * @param lon longitude in degrees, east positive
+ * @param sunrise sunrise in minutes after midnight UTC, can be negative or > 1440
+ * @param sunset sunset in minutes after midnight UTC, can be negative or > 1440
+ * @return int 0 if the sun rises and sets, 1 if the sun does not set, -1 if the sun does not rise
+ */
+int sun_times(int day_of_year, float lat, float lon, float *sunrise, float *sunset)
+{
+	float gamma = 2.0 * M_PI / 365.0 * day_of_year;
+	float eq_time = 229.18 * (0.000075 + 0.001868 * cos(gamma) - 0.032077 * sin(gamma) - 0.014615 * cos(2 * gamma) - 0.040849 * sin(2 * gamma));
+	float decl = 0.006918 - 0.399912 * cos(gamma) + 0.070257 * sin(gamma) - 0.006758 * cos(2 * gamma) + 0.000907 * sin(2 * gamma) - 0.002697 * cos(3 * gamma) + 0.00148 * sin(3 * gamma);
+	float lat_rad = lat * POLL_DEG_TO_RAD;
+
+	// Hour angle of the sun at 90.833 degree zenith
+	float cos_ha = cos(90.833 * POLL_DEG_TO_RAD) / (cos(lat_rad) * cos(decl)) - tan(lat_rad) * tan(decl);
+	if (cos_ha > 1.0)
+	{
+		return -1;
+	}
+	if (cos_ha < -1.0)
+	{
+		return 1;
+	}
+	float ha = acos(cos_ha) * POLL_RAD_TO_DEG;
+	*sunrise = 720.0 - 4.0 * (lon + ha) - eq_time;
+	*sunset = 720.0 - 4.0 * (lon - ha) - eq_time;
+	return 0;
+}
+
+/**
+ * @brief Check if the sun is up, including twilight
+ *
+ * @param now UTC time
+ * @param lat latitude in degrees
+ * @param lon longitude in degrees
+ * @return true if it is day
+ */
+bool is_daytime(time_t now, float lat, float lon)
+{
+	struct tm utc;
+	gmtime_r(&now, &utc);
+
+	float sunrise;
+	float sunset;
+	int result = sun_times(utc.tm_yday, lat, lon, &sunrise, &sunset);
+	if (result != 0)
+	{
+		return result > 0;
+	}
+
+	int rise = ((int)sunrise - POLL_TWILIGHT + 2 * 1440) % 1440;
+	int set = ((int)sunset + POLL_TWILIGHT + 2 * 1440) % 1440;
+	int minute = utc.tm_hour * 60 + utc.tm_min;
+	if (rise < set)
+	{
+		return (minute >= rise) && (minute < set);
+	}
+	// Day crosses midnight UTC
+	return (minute >= rise) || (minute < set);
+}
+
+/**
+ * @brief Select the poll mode for a new power value
+ *
+ * @param power current power, -1 at night
+ * @param is_day true if the sun is up
+ * @return e_poll_mode new poll mode
+ */
+e_poll_mode poll_policy(int power, bool is_day)
+{
+	int delta = abs(power - last_power);
+	int threshold = abs(last_power) * POLL_DELTA_PERCENT / 100;
+	if (threshold < POLL_MIN_DELTA)
+	{
+		threshold = POLL_MIN_DELTA;
+	}
+	last_power = power;
+
+	if (!is_day)
+	{
+		fast_hold = 0;
+		return POLL_NIGHT;
+	}
+	if (delta > threshold)
+	{
+		fast_hold = POLL_FAST_HOLD;
+	}
+	if (fast_hold > 0)
+	{
+		fast_hold--;
+		return POLL_FAST;
+	}
+	return POLL_SLOW;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file poll_mode.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Poll mode from power changes and sunrise/sunset
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __POLL_MODE_H__
+#define __POLL_MODE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+enum e_poll_mode
+{
+	POLL_FIXED = 0,
+	POLL_FAST,
+	POLL_SLOW,
+	POLL_NIGHT
+};
+
+int sun_times(int day_of_year, float lat, float lon, float *sunrise, float *sunset);
+bool is_daytime(time_t now, float lat, float lon);
+e_poll_mode poll_policy(int power, bool is_day);
+
+#endif
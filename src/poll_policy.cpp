@@ -0,0 +1,111 @@
+/**
+ * @file poll_policy.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Adaptive poll interval from power changes and sunrise/sunset
+ * The poll mode is selected in poll_mode.cpp, this file has the settings and the intervals
+ * @version 0.1
+ * @date 2021-10-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Timestamps before this are from an unsynced clock */
+#define POLL_VALID_TIME 1600000000
+
+/** Adaptive poll settings */
+s_poll_settings g_poll_settings;
+
+/** Current poll mode */
+e_poll_mode g_poll_mode = POLL_FIXED;
+
+/** Names of the poll modes */
+const char *poll_mode_names[] = {"FIXED", "FAST", "SLOW", "NIGHT"};
+
+/**
+ * @brief Get the next poll interval
+ *
+ * @param sample new sample or NULL to get the interval of the current mode
+ * @return uint32_t poll interval in ms
+ */
+uint32_t get_poll_interval(s_sample *sample)
+{
+	if (!g_poll_settings.enabled)
+	{
+		g_poll_mode = POLL_FIXED;
+		return g_lorawan_settings.send_repeat_time;
+	}
+	if (g_poll_mode == POLL_FIXED)
+	{
+		g_poll_mode = POLL_SLOW;
+	}
+
+	if ((sample != NULL) && (sample->num_ok != 0))
+	{
+		time_t now = time(NULL);
+		bool is_day;
+		if (now > POLL_VALID_TIME)
+		{
+			is_day = is_daytime(now, g_poll_settings.lat, g_poll_settings.lon);
+		}
+		else
+		{
+			// No time yet, at night the inverters report no power
+			is_day = sample->values[0] > 0;
+		}
+		e_poll_mode new_mode = poll_policy(sample->values[0], is_day);
+		if (new_mode != g_poll_mode)
+		{
+			myLog_d("Poll mode %s", poll_mode_names[new_mode]);
+		}
+		g_poll_mode = new_mode;
+	}
+
+	switch (g_poll_mode)
+	{
+	case POLL_FAST:
+		return g_poll_settings.fast_time * 1000;
+	case POLL_NIGHT:
+		return g_poll_settings.night_time * 1000;
+	default:
+		return g_poll_settings.slow_time * 1000;
+	}
+}
+
+/**
+ * @brief Read the adaptive poll settings from the preferences
+ *
+ */
+void get_poll_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("Poll", false);
+	g_poll_settings.enabled = preferences.getBool("en", false);
+	g_poll_settings.lat = preferences.getFloat("lat", 0.0);
+	g_poll_settings.lon = preferences.getFloat("lon", 0.0);
+	g_poll_settings.fast_time = preferences.getULong("fast", 60);
+	g_poll_settings.slow_time = preferences.getULong("slow", 300);
+	g_poll_settings.night_time = preferences.getULong("night", 1800);
+	preferences.end();
+	myLog_d("Adaptive poll %s lat %.3f lon %.3f fast %ld slow %ld night %ld", g_poll_settings.enabled ? "enabled" : "disabled",
+			g_poll_settings.lat, g_poll_settings.lon,
+			g_poll_settings.fast_time, g_poll_settings.slow_time, g_poll_settings.night_time);
+}
+
+/**
+ * @brief Save the adaptive poll settings
+ *
+ */
+void save_poll_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("Poll", false);
+	preferences.putBool("en", g_poll_settings.enabled);
+	preferences.putFloat("lat", g_poll_settings.lat);
+	preferences.putFloat("lon", g_poll_settings.lon);
+	preferences.putULong("fast", g_poll_settings.fast_time);
+	preferences.putULong("slow", g_poll_settings.slow_time);
+	preferences.putULong("night", g_poll_settings.night_time);
+	preferences.end();
+}
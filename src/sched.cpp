@@ -0,0 +1,180 @@
+/**
+ * @file sched.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Deadline scheduler for the periodic jobs, runs in the Arduino loop task
+ * @version 0.1
+ * @date 2021-10-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <my-log.h>
+#include "scheduler.h"
+
+/** Job table */
+s_job g_jobs[MAX_JOBS];
+
+/** Protects the job table, jobs are (re)scheduled from other tasks */
+static portMUX_TYPE sched_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** Task running the scheduler, woken up when a job is (re)scheduled */
+static TaskHandle_t sched_task = NULL;
+
+/**
+ * @brief Wake up the scheduler task so it picks up a changed deadline
+ *
+ */
+static void wake_scheduler(void)
+{
+	if ((sched_task != NULL) && (sched_task != xTaskGetCurrentTaskHandle()))
+	{
+		xTaskNotifyGive(sched_task);
+	}
+}
+
+/**
+ * @brief Add a job
+ *
+ * @param name short name for AT+TASKS
+ * @param callback function to call, runs in the scheduler task
+ * @param due_ms delay from now until the first call
+ * @param period_ms time between calls, 0 for a single call
+ * @return int8_t job id or -1 if the job table is full
+ */
+int8_t schedule(const char *name, void (*callback)(void), uint32_t due_ms, uint32_t period_ms)
+{
+	int8_t id = -1;
+	portENTER_CRITICAL(&sched_mux);
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		if (g_jobs[idx].callback == NULL)
+		{
+			g_jobs[idx].name = name;
+			g_jobs[idx].callback = callback;
+			g_jobs[idx].due = millis() + due_ms;
+			g_jobs[idx].period = period_ms;
+			g_jobs[idx].active = true;
+			g_jobs[idx].max_late = 0;
+			id = idx;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&sched_mux);
+	if (id < 0)
+	{
+		myLog_e("Job table full, can't add %s", name);
+	}
+	wake_scheduler();
+	return id;
+}
+
+/**
+ * @brief Change the deadline and period of a job
+ *
+ * @param id job id from schedule()
+ * @param due_ms delay from now until the next call
+ * @param period_ms time between calls, 0 for a single call
+ */
+void reschedule(int8_t id, uint32_t due_ms, uint32_t period_ms)
+{
+	if ((id < 0) || (id >= MAX_JOBS))
+	{
+		return;
+	}
+	portENTER_CRITICAL(&sched_mux);
+	g_jobs[id].due = millis() + due_ms;
+	g_jobs[id].period = period_ms;
+	g_jobs[id].active = true;
+	portEXIT_CRITICAL(&sched_mux);
+	wake_scheduler();
+}
+
+/**
+ * @brief Stop a job, it can be restarted with reschedule()
+ *
+ * @param id job id from schedule()
+ */
+void unschedule(int8_t id)
+{
+	if ((id < 0) || (id >= MAX_JOBS))
+	{
+		return;
+	}
+	portENTER_CRITICAL(&sched_mux);
+	g_jobs[id].active = false;
+	portEXIT_CRITICAL(&sched_mux);
+}
+
+/**
+ * @brief Run all due jobs, the most overdue first
+ *
+ * @return uint32_t time in ms until the next deadline
+ */
+uint32_t run_scheduler(void)
+{
+	sched_task = xTaskGetCurrentTaskHandle();
+
+	while (true)
+	{
+		uint32_t now = millis();
+		int8_t next = -1;
+		int32_t next_late = INT32_MIN;
+
+		portENTER_CRITICAL(&sched_mux);
+		for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+		{
+			if (!g_jobs[idx].active)
+			{
+				continue;
+			}
+			int32_t late = (int32_t)(now - g_jobs[idx].due);
+			if (late > next_late)
+			{
+				next_late = late;
+				next = idx;
+			}
+		}
+		if ((next < 0) || (next_late < 0))
+		{
+			portEXIT_CRITICAL(&sched_mux);
+			return (next < 0) ? SCHED_MAX_IDLE : min((uint32_t)-next_late, (uint32_t)SCHED_MAX_IDLE);
+		}
+
+		s_job *job = &g_jobs[next];
+		if ((uint32_t)next_late > job->max_late)
+		{
+			job->max_late = next_late;
+		}
+		if (job->period == 0)
+		{
+			job->active = false;
+		}
+		else
+		{
+			job->due += job->period;
+			// Skip missed periods instead of running them back to back
+			if ((int32_t)(now - job->due) >= 0)
+			{
+				job->due = now + job->period;
+			}
+		}
+		void (*callback)(void) = job->callback;
+		portEXIT_CRITICAL(&sched_mux);
+
+		callback();
+	}
+}
+
+/**
+ * @brief Block the calling task until the next deadline or until a job is (re)scheduled
+ * The CPU idles in the FreeRTOS idle task meanwhile
+ *
+ * @param idle_ms time until the next deadline
+ */
+void sched_idle(uint32_t idle_ms)
+{
+	if (idle_ms > 0)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(idle_ms));
+	}
+}
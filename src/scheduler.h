@@ -0,0 +1,42 @@
+/**
+ * @file scheduler.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Deadline scheduler for the periodic jobs
+ * Only Arduino and FreeRTOS calls, so the scheduler can be tested on a PC
+ * Not sched.h, that name is taken by the C library
+ * @version 0.1
+ * @date 2021-10-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <Arduino.h>
+
+#define MAX_JOBS 12
+// Longest time the scheduler task blocks without checking the jobs
+#define SCHED_MAX_IDLE 1000
+
+struct s_job
+{
+	const char *name = NULL;
+	void (*callback)(void) = NULL;
+	// Next deadline in millis()
+	uint32_t due = 0;
+	// 0 for a single call
+	uint32_t period = 0;
+	bool active = false;
+	// Max delay of a call after its deadline
+	uint32_t max_late = 0;
+};
+
+int8_t schedule(const char *name, void (*callback)(void), uint32_t due_ms, uint32_t period_ms);
+void reschedule(int8_t id, uint32_t due_ms, uint32_t period_ms);
+void unschedule(int8_t id);
+uint32_t run_scheduler(void);
+void sched_idle(uint32_t idle_ms);
+extern s_job g_jobs[];
+
+#endif
@@ -0,0 +1,340 @@
+/**
+ * @file sinks.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Sinks of the samples, LoRaWAN, UDP feed and display
+ * Each sink has its own task and backlog queue. A sink that is not ready keeps its backlog
+ * until it is ready again, the oldest sample is dropped when the backlog is full.
+ * The acquisition task never waits for a sink.
+ * @version 0.1
+ * @date 2021-10-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include "udp_frame.h"
+
+/** Default backlog of a sink */
+#define SINK_BACKLOG 4
+
+/** Time between the readiness checks of a sink that is not ready */
+#define SINK_RETRY_TIME 1000
+
+/** Stack size of the sink tasks */
+#define SINK_STACK_SIZE 4096
+
+/** Time between LoRa and UDP transmission of the same sample */
+#define UDP_DECOUPLE_TIME 5000
+
+/** Redraw interval of the display, the text is moved on every redraw */
+#define DISPLAY_REFRESH_TIME 30000
+
+/** UDP broadcast port */
+int udpBcPort = 9997;
+
+/** Format of the UDP broadcast, UDP_FORMAT_JSON or UDP_FORMAT_BINARY */
+uint8_t g_udp_format = UDP_FORMAT_JSON;
+
+/** Frame buffer of the UDP broadcast, only used by the UDP sink task */
+static uint8_t udp_buffer[UDP_JSON_MAX];
+
+/** UDP frames sent */
+static uint32_t udp_frames = 0;
+
+/** Stage of the display sink */
+static int8_t display_stage = -1;
+
+/** Last sample, redrawn by the display refresh job */
+static s_sample last_sample;
+
+/** Protects last_sample */
+static portMUX_TYPE sample_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Sink task, waits for samples and hands them to the sink handler when the sink is ready
+ *
+ * @param pvParameters statistics of the stage
+ */
+static void sink_task(void *pvParameters)
+{
+	s_task_stats *stats = (s_task_stats *)pvParameters;
+	s_sample sample;
+	while (true)
+	{
+		if (xQueuePeek(stats->queue, &sample, portMAX_DELAY) != pdTRUE)
+		{
+			continue;
+		}
+		stats->is_ready = (stats->ready == NULL) || stats->ready();
+		if (!stats->is_ready)
+		{
+			// Keep the backlog, the publisher drops the oldest samples if it is full
+			vTaskDelay(pdMS_TO_TICKS(SINK_RETRY_TIME));
+			continue;
+		}
+		if (xQueueReceive(stats->queue, &sample, 0) != pdTRUE)
+		{
+			continue;
+		}
+		uint32_t start_time = millis();
+		stats->handler(&sample);
+		record_stage(stats, start_time - sample.timestamp, millis() - start_time);
+	}
+}
+
+/**
+ * @brief Add a sink and start its task
+ *
+ * @param name name of the sink, used for the task
+ * @param handler called from the sink task for each sample
+ * @param ready returns true if the sink can take a sample, NULL if it is always ready
+ * @param backlog samples kept while the sink is busy or not ready
+ * @return int8_t stage of the sink or -1 if there is no free slot
+ */
+int8_t add_sink(const char *name, void (*handler)(s_sample *sample), bool (*ready)(void), uint8_t backlog)
+{
+	if (g_num_stages == MAX_STAGES)
+	{
+		myLog_e("No free sink slot for %s", name);
+		return -1;
+	}
+	s_task_stats *stats = &g_task_stats[g_num_stages];
+	stats->name = name;
+	stats->handler = handler;
+	stats->ready = ready;
+	stats->queue = xQueueCreate(backlog, sizeof(s_sample));
+	if (stats->queue == NULL)
+	{
+		myLog_e("No memory for the backlog of %s", name);
+		return -1;
+	}
+	if (xTaskCreate(sink_task, name, SINK_STACK_SIZE, stats, 1, &stats->task) != pdPASS)
+	{
+		myLog_e("Failed to start the task of %s", name);
+		vQueueDelete(stats->queue);
+		stats->queue = NULL;
+		return -1;
+	}
+	return g_num_stages++;
+}
+
+/**
+ * @brief Send a sample to a sink, the oldest sample is dropped if the sink is behind
+ *
+ * @param stage stage of the sink
+ * @param sample the sample
+ */
+void publish_sample(uint8_t stage, s_sample *sample)
+{
+	s_task_stats *stats = &g_task_stats[stage];
+	if (xQueueSend(stats->queue, sample, 0) != pdTRUE)
+	{
+		s_sample dropped;
+		xQueueReceive(stats->queue, &dropped, 0);
+		xQueueSend(stats->queue, sample, 0);
+		stats->drops++;
+	}
+}
+
+/**
+ * @brief Send a sample to all sinks
+ *
+ * @param sample the sample
+ */
+void publish_all(s_sample *sample)
+{
+	portENTER_CRITICAL(&sample_mux);
+	last_sample = *sample;
+	portEXIT_CRITICAL(&sample_mux);
+	for (uint8_t stage = STAGE_ACQ + 1; stage < g_num_stages; stage++)
+	{
+		publish_sample(stage, sample);
+	}
+}
+
+/**
+ * @brief Send a sample over LoRaWAN
+ * The samples are queued in the uplink queue until the network is joined
+ *
+ * @param sample the sample
+ */
+static void lora_sink(s_sample *sample)
+{
+	if (!sample->valid || !sample->uplink)
+	{
+		return;
+	}
+
+	myLog_d("Current power %d W - Collected today %d Wh", sample->values[0], sample->values[1]);
+	BLE_PRINTF("Current power %d W - Collected today %d Wh", sample->values[0], sample->values[1]);
+	batch_add(sample);
+}
+
+/**
+ * @brief UDP broadcast is possible only with WiFi
+ *
+ * @return true if WiFi is connected
+ */
+static bool udp_ready(void)
+{
+	return WiFi.isConnected();
+}
+
+/**
+ * @brief Write a frame into the UDP frame buffer
+ *
+ * @param frame values of the frame
+ * @param format UDP_FORMAT_JSON or UDP_FORMAT_BINARY
+ * @return size_t length of the frame
+ */
+static size_t udp_build_frame(s_udp_frame *frame, uint8_t format)
+{
+	if (format == UDP_FORMAT_BINARY)
+	{
+		return udp_frame_binary(udp_buffer, sizeof(udp_buffer), frame);
+	}
+	return udp_frame_json((char *)udp_buffer, sizeof(udp_buffer), frame);
+}
+
+/**
+ * @brief Send a sample over UDP, as broadcast, to each subscriber or to the multicast group
+ *
+ * @param sample the sample
+ */
+static void udp_sink(s_sample *sample)
+{
+	if (!sample->valid)
+	{
+		return;
+	}
+
+	// decouple LoRa and WiFi transmission
+	uint32_t age = millis() - sample->timestamp;
+	if (sample->uplink && (age < UDP_DECOUPLE_TIME))
+	{
+		vTaskDelay(pdMS_TO_TICKS(UDP_DECOUPLE_TIME - age));
+	}
+
+	s_udp_frame frame;
+	frame.time = sample->utc;
+	frame.power = sample->values[0];
+	frame.energy_today = sample->values[1];
+	frame.energy_total = sample->values[VAL_ENERGY_TOTAL];
+	frame.status = UDP_STATUS_VALID;
+	frame.status |= sample->num_ok == g_num_inverters ? UDP_STATUS_ALL_INVERTERS : 0;
+	frame.status |= sample->utc > VALID_TIME ? UDP_STATUS_TIME_SYNCED : 0;
+	frame.status |= g_lpwan_has_joined ? UDP_STATUS_JOINED : 0;
+
+	if (g_udp_mode == UDP_MODE_UNICAST)
+	{
+		s_subscriber list[MAX_SUBSCRIBERS];
+		uint8_t count = get_subscribers(list);
+		for (uint8_t idx = 0; idx < count; idx++)
+		{
+			size_t len = udp_build_frame(&frame, list[idx].format);
+			udp.writeTo(udp_buffer, len, IPAddress(list[idx].ip), list[idx].port);
+			udp_frames++;
+		}
+		return;
+	}
+
+	size_t len = udp_build_frame(&frame, g_udp_format);
+	if (g_udp_mode == UDP_MODE_MULTICAST)
+	{
+		s_subscriber list[MAX_SUBSCRIBERS];
+		if (get_subscribers(list) == 0)
+		{
+			return;
+		}
+		udp.writeTo(udp_buffer, len, multiIP, udpBcPort);
+	}
+	else
+	{
+		// Broadcast the data from the SMA inverter
+		udp.broadcastTo(udp_buffer, len, udpBcPort);
+	}
+	udp_frames++;
+	myLog_d("UDP broadcast done");
+	BLE_PRINTF("UDP broadcast done");
+}
+
+/**
+ * @brief Get the UDP status for AT+UDPFMT
+ * Format and frames sent
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void udp_status(char *buffer, uint8_t size)
+{
+	snprintf(buffer, size, "%d:%ld", g_udp_format, udp_frames);
+}
+
+/**
+ * @brief Read the UDP broadcast format from the preferences
+ *
+ */
+void get_udp_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("UDP", false);
+	g_udp_format = preferences.getUChar("f", UDP_FORMAT_JSON);
+	preferences.end();
+}
+
+/**
+ * @brief Save the UDP broadcast format
+ *
+ */
+void save_udp_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("UDP", false);
+	preferences.putUChar("f", g_udp_format);
+	preferences.end();
+}
+
+/**
+ * @brief Show a sample on the display
+ *
+ * @param sample the sample
+ */
+static void display_sink(s_sample *sample)
+{
+	if ((sample->num_ok != 0) && !sample->valid)
+	{
+		return;
+	}
+	write_display(sample->values[0], sample->values[1]);
+}
+
+/**
+ * @brief Scheduler job, redraw the last sample
+ * Moves the text to avoid burn-in on the OLED
+ *
+ */
+static void display_refresh_job(void)
+{
+	s_sample sample;
+	portENTER_CRITICAL(&sample_mux);
+	sample = last_sample;
+	portEXIT_CRITICAL(&sample_mux);
+	if ((sample.timestamp != 0) && (display_stage > 0))
+	{
+		publish_sample(display_stage, &sample);
+	}
+}
+
+/**
+ * @brief Add the LoRaWAN, UDP and display sinks
+ * and the display refresh job to the scheduler
+ *
+ */
+void init_sinks(void)
+{
+	get_udp_prefs();
+	add_sink("LoRa", lora_sink, NULL, SINK_BACKLOG);
+	add_sink("UDP", udp_sink, udp_ready, SINK_BACKLOG);
+	display_stage = add_sink("Disp", display_sink, NULL, SINK_BACKLOG);
+	schedule("Disp", display_refresh_job, DISPLAY_REFRESH_TIME, DISPLAY_REFRESH_TIME);
+}
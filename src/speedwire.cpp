@@ -0,0 +1,589 @@
+/**
+ * @file speedwire.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief SMA Speedwire packets
+ *
+ * A packet is "SMA\0" followed by tags, each tag is length (2 byte), tag (2 byte) and data, big endian.
+ * The list ends with a tag of length 0. The data tag SW_TAG_DATA starts with the protocol id.
+ *
+ * Inverter data, offsets in the data tag, little endian:
+ *   0  protocol id SW_PROTOCOL_INVERTER (big endian)
+ *   2  length in 4 byte words after the protocol id
+ *   3  control
+ *   4  destination SUSy id and serial
+ *   10 control 2
+ *   12 source SUSy id and serial
+ *   18 control 2
+ *   20 error code
+ *   22 fragment counter
+ *   24 packet id, bit 15 set in requests
+ *   26 command
+ *   30 first record
+ *   34 last record
+ *   38 records
+ *
+ * Energy Meter data, big endian:
+ *   0  protocol id SW_PROTOCOL_METER
+ *   2  SUSy id and serial
+ *   8  ms ticker
+ *   12 OBIS records, channel, index, type, tariff, then 4 bytes (type 4) or 8 bytes (type 8)
+ *
+ * @version 0.1
+ * @date 2021-10-29
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "speedwire.h"
+#include <string.h>
+
+/** Offset of the data tag content in a packet built here */
+#define SW_DATA_OFFSET 16
+
+/** Size of the inverter header in the data tag, up to the command */
+#define SW_INV_HEADER 26
+
+/** Offset of the records in the data tag */
+#define SW_RECORDS_OFFSET 38
+
+/** SUSy id used by all clients */
+#define SW_ANY_SUSY 0xFFFF
+
+/** Serial used by all clients */
+#define SW_ANY_SERIAL 0xFFFFFFFF
+
+/** Login as user */
+#define SW_USER_GROUP 0x07
+
+/** Session timeout of the login in seconds */
+#define SW_LOGIN_TIMEOUT 900
+
+/** Length of the password field */
+#define SW_PASSWORD_LEN 12
+
+/** Added to the password characters of the user group */
+#define SW_PASSWORD_USER 0x88
+
+/** Max gap between two record ranges of a command that are read with one query */
+#define SW_QUERY_GAP 0x4000
+
+/** OBIS index of the power and energy bought */
+#define SW_OBIS_IN 1
+
+/** OBIS index of the power and energy sold */
+#define SW_OBIS_OUT 2
+
+/** Packet header up to the data tag content, the length is set when the packet is finished */
+static const uint8_t sw_header[SW_DATA_OFFSET] = {'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x10};
+
+/** Discovery request */
+static const uint8_t sw_discovery[SW_DISCOVERY_SIZE] = {'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00};
+
+/**
+ * @brief Read a little endian 16 bit value
+ */
+static uint16_t get_u16(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8);
+}
+
+/**
+ * @brief Read a little endian 32 bit value
+ */
+uint32_t sw_get_u32(const uint8_t *ptr)
+{
+	return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+/**
+ * @brief Read a little endian 64 bit value
+ */
+uint64_t sw_get_u64(const uint8_t *ptr)
+{
+	return (uint64_t)sw_get_u32(ptr) | ((uint64_t)sw_get_u32(ptr + 4) << 32);
+}
+
+/**
+ * @brief Read a big endian 16 bit value
+ */
+static uint16_t get_be16(const uint8_t *ptr)
+{
+	return (ptr[0] << 8) | ptr[1];
+}
+
+/**
+ * @brief Read a big endian 32 bit value
+ */
+static uint32_t get_be32(const uint8_t *ptr)
+{
+	return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3];
+}
+
+/**
+ * @brief Read a big endian 64 bit value
+ */
+static uint64_t get_be64(const uint8_t *ptr)
+{
+	return ((uint64_t)get_be32(ptr) << 32) | (uint64_t)get_be32(ptr + 4);
+}
+
+/**
+ * @brief Write a little endian 16 bit value
+ */
+static void put_u16(uint8_t *ptr, uint16_t value)
+{
+	ptr[0] = value;
+	ptr[1] = value >> 8;
+}
+
+/**
+ * @brief Write a little endian 32 bit value
+ */
+static void put_u32(uint8_t *ptr, uint32_t value)
+{
+	put_u16(ptr, value);
+	put_u16(ptr + 2, value >> 16);
+}
+
+/**
+ * @brief Write the packet header and the inverter header
+ *
+ * @param buffer output buffer, at least SW_DATA_OFFSET + SW_INV_HEADER bytes
+ * @param ctrl control byte
+ * @param ctrl2 control word
+ * @param src address of the sender
+ * @param dst address of the inverter
+ * @param packet_id packet id
+ */
+static void put_header(uint8_t *buffer, uint8_t ctrl, uint16_t ctrl2, const s_sw_address *src, const s_sw_address *dst, uint16_t packet_id)
+{
+	memcpy(buffer, sw_header, SW_DATA_OFFSET);
+	uint8_t *data = &buffer[SW_DATA_OFFSET];
+	data[0] = SW_PROTOCOL_INVERTER >> 8;
+	data[1] = SW_PROTOCOL_INVERTER & 0xFF;
+	data[3] = ctrl;
+	put_u16(&data[4], dst->susy_id);
+	put_u32(&data[6], dst->serial);
+	put_u16(&data[10], ctrl2);
+	put_u16(&data[12], src->susy_id);
+	put_u32(&data[14], src->serial);
+	put_u16(&data[18], ctrl2);
+	put_u16(&data[20], 0);
+	put_u16(&data[22], 0);
+	put_u16(&data[24], packet_id | 0x8000);
+}
+
+/**
+ * @brief Set the lengths and add the end tag
+ *
+ * @param buffer packet
+ * @param len length of the packet without the end tag
+ * @return size_t length of the packet
+ */
+static size_t finish_packet(uint8_t *buffer, size_t len)
+{
+	size_t data_len = len - SW_DATA_OFFSET;
+	buffer[12] = data_len >> 8;
+	buffer[13] = data_len & 0xFF;
+	buffer[SW_DATA_OFFSET + 2] = (data_len - 2) / 4;
+	memset(&buffer[len], 0, 4);
+	return len + 4;
+}
+
+/**
+ * @brief Build the discovery request, sent to the multicast group
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @return size_t length of the request, 0 if the buffer is too small
+ */
+size_t sw_build_discovery(uint8_t *buffer, size_t size)
+{
+	if (size < SW_DISCOVERY_SIZE)
+	{
+		return 0;
+	}
+	memcpy(buffer, sw_discovery, SW_DISCOVERY_SIZE);
+	return SW_DISCOVERY_SIZE;
+}
+
+/**
+ * @brief Build the login request of the user group
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param src address of the sender
+ * @param packet_id packet id
+ * @param password password of the user group, max SW_PASSWORD_LEN characters are used
+ * @param now UTC time
+ * @return size_t length of the request, 0 if the buffer is too small
+ */
+size_t sw_build_login(uint8_t *buffer, size_t size, const s_sw_address *src, uint16_t packet_id, const char *password, uint32_t now)
+{
+	size_t len = SW_DATA_OFFSET + SW_INV_HEADER + 20 + SW_PASSWORD_LEN;
+	if (size < len + 4)
+	{
+		return 0;
+	}
+	const s_sw_address any = {SW_ANY_SUSY, SW_ANY_SERIAL};
+	put_header(buffer, 0xA0, 0x0100, src, &any, packet_id);
+	uint8_t *cmd = &buffer[SW_DATA_OFFSET + SW_INV_HEADER];
+	put_u32(&cmd[0], SW_CMD_LOGIN);
+	put_u32(&cmd[4], SW_USER_GROUP);
+	put_u32(&cmd[8], SW_LOGIN_TIMEOUT);
+	put_u32(&cmd[12], now);
+	put_u32(&cmd[16], 0);
+	size_t pw_len = strlen(password);
+	for (uint8_t idx = 0; idx < SW_PASSWORD_LEN; idx++)
+	{
+		cmd[20 + idx] = (idx < pw_len ? password[idx] : 0) + SW_PASSWORD_USER;
+	}
+	return finish_packet(buffer, len);
+}
+
+/**
+ * @brief Build the logout request
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param src address of the sender
+ * @param packet_id packet id
+ * @return size_t length of the request, 0 if the buffer is too small
+ */
+size_t sw_build_logout(uint8_t *buffer, size_t size, const s_sw_address *src, uint16_t packet_id)
+{
+	size_t len = SW_DATA_OFFSET + SW_INV_HEADER + 8;
+	if (size < len + 4)
+	{
+		return 0;
+	}
+	const s_sw_address any = {SW_ANY_SUSY, SW_ANY_SERIAL};
+	put_header(buffer, 0xA0, 0x0300, src, &any, packet_id);
+	uint8_t *cmd = &buffer[SW_DATA_OFFSET + SW_INV_HEADER];
+	put_u32(&cmd[0], SW_CMD_LOGOUT);
+	put_u32(&cmd[4], 0xFFFFFFFF);
+	return finish_packet(buffer, len);
+}
+
+/**
+ * @brief Build a query of a record range or of the day archive
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param src address of the sender
+ * @param dst address of the inverter
+ * @param packet_id packet id
+ * @param query command and range
+ * @return size_t length of the request, 0 if the buffer is too small
+ */
+size_t sw_build_query(uint8_t *buffer, size_t size, const s_sw_address *src, const s_sw_address *dst, uint16_t packet_id, const s_sw_query *query)
+{
+	size_t len = SW_DATA_OFFSET + SW_INV_HEADER + 12;
+	if (size < len + 4)
+	{
+		return 0;
+	}
+	put_header(buffer, query->command == SW_CMD_ARCHIVE_DAY ? 0xE0 : 0xA0, 0x0000, src, dst, packet_id);
+	uint8_t *cmd = &buffer[SW_DATA_OFFSET + SW_INV_HEADER];
+	put_u32(&cmd[0], query->command);
+	put_u32(&cmd[4], query->first);
+	put_u32(&cmd[8], query->last);
+	return finish_packet(buffer, len);
+}
+
+/**
+ * @brief Find a tag in a packet
+ *
+ * @param buffer the datagram
+ * @param len length of the datagram
+ * @param tag tag to look for
+ * @param tag_len set to the length of the tag content
+ * @return const uint8_t* start of the tag content, NULL if it is not a Speedwire packet or the tag is missing
+ */
+const uint8_t *sw_find_tag(const uint8_t *buffer, size_t len, uint16_t tag, uint16_t *tag_len)
+{
+	if ((len < 8) || (memcmp(buffer, sw_header, 4) != 0))
+	{
+		return NULL;
+	}
+	size_t pos = 4;
+	while (pos + 4 <= len)
+	{
+		uint16_t this_len = get_be16(&buffer[pos]);
+		uint16_t this_tag = get_be16(&buffer[pos + 2]);
+		if ((this_len == 0) && (this_tag == 0))
+		{
+			break;
+		}
+		if (pos + 4 + this_len > len)
+		{
+			break;
+		}
+		if (this_tag == tag)
+		{
+			*tag_len = this_len;
+			return &buffer[pos + 4];
+		}
+		pos += 4 + this_len;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Parse an inverter response
+ *
+ * @param buffer the datagram, must stay valid while the response is used
+ * @param len length of the datagram
+ * @param response set to the header fields and the position of the records
+ * @return true if it is an inverter response
+ */
+bool sw_parse_response(const uint8_t *buffer, size_t len, s_sw_response *response)
+{
+	uint16_t data_len;
+	const uint8_t *data = sw_find_tag(buffer, len, SW_TAG_DATA, &data_len);
+	if ((data == NULL) || (data_len < SW_RECORDS_OFFSET) || (get_be16(data) != SW_PROTOCOL_INVERTER))
+	{
+		return false;
+	}
+	response->src.susy_id = get_u16(&data[12]);
+	response->src.serial = sw_get_u32(&data[14]);
+	response->error = get_u16(&data[20]);
+	response->fragment = get_u16(&data[22]);
+	response->packet_id = get_u16(&data[24]) & 0x7FFF;
+	response->command = sw_get_u32(&data[26]);
+	response->first = sw_get_u32(&data[30]);
+	response->last = sw_get_u32(&data[34]);
+	response->records = &data[SW_RECORDS_OFFSET];
+	response->records_size = data_len - SW_RECORDS_OFFSET;
+	response->record_size = 0;
+
+	// The full range 0 .. 0xFFFFFFFF wraps the count to 0
+	uint32_t count = response->last - response->first + 1;
+	if ((response->last >= response->first) && (count != 0) && (count <= response->records_size) && (response->records_size % count == 0))
+	{
+		response->record_size = response->records_size / count;
+	}
+	return true;
+}
+
+/**
+ * @brief Parse an Energy Meter frame
+ * Only the total power and energy are read, the values per phase are skipped
+ *
+ * @param buffer the datagram
+ * @param len length of the datagram
+ * @param meter set to the values of the frame
+ * @return true if it is an Energy Meter frame
+ */
+bool sw_parse_meter(const uint8_t *buffer, size_t len, s_sw_meter *meter)
+{
+	uint16_t data_len;
+	const uint8_t *data = sw_find_tag(buffer, len, SW_TAG_DATA, &data_len);
+	if ((data == NULL) || (data_len < 12) || (get_be16(data) != SW_PROTOCOL_METER))
+	{
+		return false;
+	}
+	meter->src.susy_id = get_be16(&data[2]);
+	meter->src.serial = get_be32(&data[4]);
+	meter->ticker = get_be32(&data[8]);
+	meter->power_in = 0;
+	meter->power_out = 0;
+	meter->energy_in = 0;
+	meter->energy_out = 0;
+
+	uint16_t pos = 12;
+	while (pos + 4 <= data_len)
+	{
+		uint8_t channel = data[pos];
+		uint8_t index = data[pos + 1];
+		uint8_t type = data[pos + 2];
+		uint8_t value_len = type == 8 ? 8 : 4;
+		if (pos + 4 + value_len > data_len)
+		{
+			break;
+		}
+		const uint8_t *value = &data[pos + 4];
+		if (channel == 0)
+		{
+			if ((index == SW_OBIS_IN) && (type == 4))
+			{
+				meter->power_in = get_be32(value);
+			}
+			else if ((index == SW_OBIS_OUT) && (type == 4))
+			{
+				meter->power_out = get_be32(value);
+			}
+			else if ((index == SW_OBIS_IN) && (type == 8))
+			{
+				meter->energy_in = get_be64(value);
+			}
+			else if ((index == SW_OBIS_OUT) && (type == 8))
+			{
+				meter->energy_out = get_be64(value);
+			}
+		}
+		pos += 4 + value_len;
+	}
+	return true;
+}
+
+/**
+ * @brief Parse a discovery response
+ *
+ * @param buffer the datagram
+ * @param len length of the datagram
+ * @param ip set to the IP of the device, first octet in the lowest byte like IPAddress
+ * @return true if it is a discovery response with an IP
+ */
+bool sw_parse_discovery(const uint8_t *buffer, size_t len, uint32_t *ip)
+{
+	uint16_t tag_len;
+	const uint8_t *data = sw_find_tag(buffer, len, SW_TAG_IP, &tag_len);
+	if ((data == NULL) || (tag_len != 4))
+	{
+		return false;
+	}
+	*ip = sw_get_u32(data);
+	return *ip != 0;
+}
+
+/**
+ * @brief Get the query of a key
+ * The object of the web API key is the Speedwire command + 0x1000, e.g. 6100_40263F00 is read with
+ * command 0x51000200, the LRI is the middle of the second part
+ *
+ * @param id key id
+ * @param query set to the command and the record range of the key
+ * @return true if the key can be read over Speedwire
+ */
+bool sw_key_query(SMAKeyId id, s_sw_query *query)
+{
+	const SMAKeyInfo &info = smaKeyInfo(id);
+	if (info.type == SMAValueType::STRING)
+	{
+		return false;
+	}
+	uint32_t object = 0;
+	uint32_t code = 0;
+	for (uint8_t idx = 0; idx < SMA_KEY_LENGTH; idx++)
+	{
+		char c = info.key[idx];
+		uint8_t nibble;
+		if ((c >= '0') && (c <= '9'))
+		{
+			nibble = c - '0';
+		}
+		else if ((c >= 'A') && (c <= 'F'))
+		{
+			nibble = c - 'A' + 10;
+		}
+		else
+		{
+			continue;
+		}
+		if (idx < 4)
+		{
+			object = (object << 4) | nibble;
+		}
+		else
+		{
+			code = (code << 4) | nibble;
+		}
+	}
+	query->command = ((object - 0x1000) << 16) | 0x0200;
+	query->first = code & 0x00FFFF00;
+	query->last = query->first | 0xFF;
+	return true;
+}
+
+/**
+ * @brief Plan the queries for a set of keys
+ * Keys with the same command are read with one query if their LRIs are close
+ *
+ * @param ids key ids
+ * @param count number of keys
+ * @param queries output array
+ * @param max_queries size of the output array
+ * @return uint8_t number of queries
+ */
+uint8_t sw_plan_queries(const SMAKeyId *ids, uint8_t count, s_sw_query *queries, uint8_t max_queries)
+{
+	uint8_t num_queries = 0;
+	for (uint8_t idx = 0; idx < count; idx++)
+	{
+		s_sw_query key_query;
+		if (!sw_key_query(ids[idx], &key_query))
+		{
+			continue;
+		}
+		bool merged = false;
+		for (uint8_t q_idx = 0; q_idx < num_queries; q_idx++)
+		{
+			s_sw_query *query = &queries[q_idx];
+			if (query->command != key_query.command)
+			{
+				continue;
+			}
+			uint32_t first = key_query.first < query->first ? key_query.first : query->first;
+			uint32_t last = key_query.last > query->last ? key_query.last : query->last;
+			// Merge if the range grows by less than the gap
+			if ((last - first) - (query->last - query->first) <= SW_QUERY_GAP + 0xFF)
+			{
+				query->first = first;
+				query->last = last;
+				merged = true;
+				break;
+			}
+		}
+		if (!merged && (num_queries < max_queries))
+		{
+			queries[num_queries++] = key_query;
+		}
+	}
+	return num_queries;
+}
+
+/**
+ * @brief Find the value of a key in a response, the first channel is used if there are several
+ * The low byte of the command is not compared, the inverter sets it in the response
+ *
+ * @param response parsed response
+ * @param id key id
+ * @param value set to the value, -1 if the inverter has no value (NaN)
+ * @return true if the response has a record of the key
+ */
+bool sw_find_value(const s_sw_response *response, SMAKeyId id, int *value)
+{
+	s_sw_query key_query;
+	if ((response->record_size < 12) || !sw_key_query(id, &key_query) || ((key_query.command ^ response->command) & 0xFFFFFF00))
+	{
+		return false;
+	}
+	for (uint16_t pos = 0; pos + response->record_size <= response->records_size; pos += response->record_size)
+	{
+		const uint8_t *record = &response->records[pos];
+		uint32_t code = sw_get_u32(record);
+		if ((code & 0x00FFFF00) != key_query.first)
+		{
+			continue;
+		}
+		if (response->record_size == 16)
+		{
+			// Counter
+			uint64_t counter = sw_get_u64(&record[8]);
+			*value = (counter == 0xFFFFFFFFFFFFFFFFULL) || (counter == 0x8000000000000000ULL) ? -1 : (int)counter;
+		}
+		else if ((code >> 24) == SW_TYPE_SIGNED)
+		{
+			uint32_t raw = sw_get_u32(&record[8]);
+			*value = raw == 0x80000000 ? -1 : (int32_t)raw;
+		}
+		else
+		{
+			uint32_t raw = sw_get_u32(&record[8]);
+			*value = (raw == 0xFFFFFFFF) || (raw == 0x80000000) ? -1 : (int)raw;
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,126 @@
+/**
+ * @file speedwire.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief SMA Speedwire packets, request builders and a parser that works on the received datagram
+ * The parsed structs only point into the datagram, nothing is copied or allocated.
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-29
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __SPEEDWIRE_H__
+#define __SPEEDWIRE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <SMAKeys.h>
+
+// UDP port of Speedwire, unicast and multicast
+#define SW_PORT 9522
+
+// Multicast group of the discovery and the Energy Meter frames, 239.12.255.254
+#define SW_GROUP_0 239
+#define SW_GROUP_1 12
+#define SW_GROUP_2 255
+#define SW_GROUP_3 254
+
+// Protocol ids in the data tag
+#define SW_PROTOCOL_INVERTER 0x6065
+#define SW_PROTOCOL_METER 0x6069
+
+// Tags of the packet
+#define SW_TAG_DATA 0x0010
+#define SW_TAG_IP 0x0030
+
+// Commands
+#define SW_CMD_LOGIN 0xFFFD040C
+#define SW_CMD_LOGOUT 0xFFFD010E
+#define SW_CMD_ARCHIVE_DAY 0x70000200
+
+// Error code of the response if the password was wrong
+#define SW_ERROR_LOGIN 0x0100
+
+// Size of a discovery request
+#define SW_DISCOVERY_SIZE 20
+
+// Max size of a request, the login is the largest with 78 bytes
+#define SW_REQUEST_MAX 80
+
+// Max size of a received datagram
+#define SW_PACKET_MAX 1024
+
+// Size of a record of the day archive
+#define SW_ARCHIVE_RECORD 12
+
+// Data type of a record, high byte of the record code
+#define SW_TYPE_UNSIGNED 0x00
+#define SW_TYPE_SIGNED 0x40
+
+// Device address
+struct s_sw_address
+{
+	uint16_t susy_id;
+	uint32_t serial;
+};
+
+// Inverter response, points into the datagram
+struct s_sw_response
+{
+	s_sw_address src;
+	uint16_t error;
+	// Packets that follow this one, 0 for the last packet of a response
+	uint16_t fragment;
+	uint16_t packet_id;
+	uint32_t command;
+	// Record indices for value queries, times for the archive
+	uint32_t first;
+	uint32_t last;
+	const uint8_t *records;
+	uint16_t records_size;
+	// 0 if the size is not given by first and last
+	uint16_t record_size;
+};
+
+// Energy Meter frame, values in 0.1 W and Ws
+struct s_sw_meter
+{
+	s_sw_address src;
+	// ms ticker of the meter
+	uint32_t ticker;
+	uint32_t power_in;
+	uint32_t power_out;
+	uint64_t energy_in;
+	uint64_t energy_out;
+};
+
+// Query of a range of records
+struct s_sw_query
+{
+	uint32_t command;
+	uint32_t first;
+	uint32_t last;
+};
+
+// Max queries for one key set
+#define SW_MAX_QUERIES 8
+
+size_t sw_build_discovery(uint8_t *buffer, size_t size);
+size_t sw_build_login(uint8_t *buffer, size_t size, const s_sw_address *src, uint16_t packet_id, const char *password, uint32_t now);
+size_t sw_build_logout(uint8_t *buffer, size_t size, const s_sw_address *src, uint16_t packet_id);
+size_t sw_build_query(uint8_t *buffer, size_t size, const s_sw_address *src, const s_sw_address *dst, uint16_t packet_id, const s_sw_query *query);
+
+const uint8_t *sw_find_tag(const uint8_t *buffer, size_t len, uint16_t tag, uint16_t *tag_len);
+bool sw_parse_response(const uint8_t *buffer, size_t len, s_sw_response *response);
+bool sw_parse_meter(const uint8_t *buffer, size_t len, s_sw_meter *meter);
+bool sw_parse_discovery(const uint8_t *buffer, size_t len, uint32_t *ip);
+
+bool sw_key_query(SMAKeyId id, s_sw_query *query);
+uint8_t sw_plan_queries(const SMAKeyId *ids, uint8_t count, s_sw_query *queries, uint8_t max_queries);
+bool sw_find_value(const s_sw_response *response, SMAKeyId id, int *value);
+
+uint32_t sw_get_u32(const uint8_t *ptr);
+uint64_t sw_get_u64(const uint8_t *ptr);
+
+#endif
@@ -0,0 +1,505 @@
+/**
+ * @file speedwire_reader.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Speedwire backend of the inverters, discovery and SMA Energy Meter
+ * The inverters are queried with unicast UDP packets, one socket per inverter.
+ * The multicast group is shared by the discovery and the Energy Meter frames.
+ * @version 0.1
+ * @date 2021-10-29
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <WiFi.h>
+#include <my-log.h>
+#include "inverters.h"
+#include "scheduler.h"
+#include "speedwire.h"
+
+/** Time to wait for a response */
+#define SW_TIMEOUT 1000
+
+/** Time between two checks of the socket while waiting */
+#define SW_WAIT_STEP 5
+
+/** SUSy id of this device */
+#define SW_APP_SUSY 125
+
+/** Base of the serial of this device */
+#define SW_APP_SERIAL 900000000
+
+/** First local port of the inverter sockets, one port per reader */
+#define SW_LOCAL_PORT 9530
+
+/** Local port of the reader that checks the serial of a discovered device */
+#define SW_PROBE_PORT (SW_LOCAL_PORT + MAX_INVERTERS)
+
+/** Interval of the check for Energy Meter frames */
+#define METER_CHECK_TIME 500
+
+/** Readings older than this are not shown */
+#define METER_MAX_AGE 10000
+
+/** Local ports used by the readers */
+static uint8_t num_readers = 0;
+
+/** Socket of the multicast group */
+static WiFiUDP sw_multicast;
+
+/** true while the multicast group is joined */
+static bool sw_joined = false;
+
+/** Protects the multicast socket, it is used by the scheduler and the AT commands */
+static SemaphoreHandle_t sw_mutex = NULL;
+
+/** Last Energy Meter reading */
+static s_sw_meter last_meter;
+
+/** millis() of the last Energy Meter reading, 0 if there is none */
+static uint32_t meter_time = 0;
+
+/** Protects the Energy Meter reading */
+static portMUX_TYPE meter_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** Receive buffer of the multicast socket */
+static uint8_t sw_packet[SW_PACKET_MAX];
+
+/**
+ * @brief Get the address of this device
+ *
+ * @return s_sw_address SUSy id and a serial from the MAC
+ */
+static s_sw_address app_address(void)
+{
+	s_sw_address address;
+	address.susy_id = SW_APP_SUSY;
+	address.serial = SW_APP_SERIAL + (uint32_t)(ESP.getEfuseMac() >> 24) % 100000000;
+	return address;
+}
+
+/** Backend for the Speedwire protocol */
+class SpeedwireReader : public InverterReader
+{
+public:
+	SpeedwireReader(IPAddress *ip, const char *passwd, uint16_t port);
+	bool getValues(int *values);
+	int getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps);
+	void logout(void);
+	uint32_t getSerial(void);
+
+private:
+	bool open(void);
+	bool login(void);
+	bool send(size_t len);
+	bool receive(s_sw_response *response);
+
+	IPAddress *_ip;
+	const char *_passwd;
+	uint16_t _port;
+	WiFiUDP _udp;
+	bool _open = false;
+	bool _logged_in = false;
+	s_sw_address _src;
+	s_sw_address _dst = {0xFFFF, 0xFFFFFFFF};
+	uint16_t _packet_id = 0;
+	uint8_t _num_queries = 0;
+	s_sw_query _queries[SW_MAX_QUERIES];
+	uint8_t _packet[SW_PACKET_MAX];
+};
+
+/**
+ * @brief Create the reader, the queries for poll_keys_t are planned once
+ *
+ * @param ip IP of the inverter, read on every request
+ * @param passwd password of the user group
+ * @param port local UDP port
+ */
+SpeedwireReader::SpeedwireReader(IPAddress *ip, const char *passwd, uint16_t port)
+{
+	_ip = ip;
+	_passwd = passwd;
+	_port = port;
+	_src = app_address();
+	_num_queries = sw_plan_queries(poll_keys_t::ids, poll_keys_t::count, _queries, SW_MAX_QUERIES);
+}
+
+/**
+ * @brief Open the socket
+ *
+ * @return true if the socket is open
+ */
+bool SpeedwireReader::open(void)
+{
+	if (!WiFi.isConnected())
+	{
+		if (_open)
+		{
+			_udp.stop();
+			_open = false;
+			_logged_in = false;
+		}
+		return false;
+	}
+	if (!_open)
+	{
+		_open = _udp.begin(_port) == 1;
+	}
+	return _open;
+}
+
+/**
+ * @brief Send the request in the packet buffer, old packets are dropped first
+ *
+ * @param len length of the request
+ * @return true if it was sent
+ */
+bool SpeedwireReader::send(size_t len)
+{
+	while (_udp.parsePacket() > 0)
+	{
+		_udp.flush();
+	}
+	if (len == 0)
+	{
+		return false;
+	}
+	_udp.beginPacket(*_ip, SW_PORT);
+	_udp.write(_packet, len);
+	return _udp.endPacket() == 1;
+}
+
+/**
+ * @brief Wait for the response to the last request
+ *
+ * @param response parsed response, points into the packet buffer
+ * @return true if the response was received in time
+ */
+bool SpeedwireReader::receive(s_sw_response *response)
+{
+	uint32_t start_time = millis();
+	while ((millis() - start_time) < SW_TIMEOUT)
+	{
+		int size = _udp.parsePacket();
+		if (size <= 0)
+		{
+			delay(SW_WAIT_STEP);
+			continue;
+		}
+		int len = _udp.read(_packet, SW_PACKET_MAX);
+		if ((_udp.remoteIP() != *_ip) || !sw_parse_response(_packet, len, response) || (response->packet_id != _packet_id))
+		{
+			continue;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Log in with the user group, the inverter answers with its address
+ *
+ * @return true if the login was accepted
+ */
+bool SpeedwireReader::login(void)
+{
+	_packet_id = (_packet_id + 1) & 0x7FFF;
+	s_sw_response response;
+	if (!send(sw_build_login(_packet, SW_PACKET_MAX, &_src, _packet_id, _passwd, time(NULL))) || !receive(&response))
+	{
+		myLog_e("Speedwire: no login response from %s", _ip->toString().c_str());
+		return false;
+	}
+	if (response.error != 0)
+	{
+		myLog_e("Speedwire: login refused by %s, error %04X", _ip->toString().c_str(), response.error);
+		return false;
+	}
+	_dst = response.src;
+	_logged_in = true;
+	myLog_d("Speedwire: logged in to %d:%ld", _dst.susy_id, _dst.serial);
+	return true;
+}
+
+/**
+ * @brief Read the values of poll_keys_t, one query per planned range
+ *
+ * @param values array of poll_keys_t::count values, -1 for values the inverter does not have
+ * @return true if all queries were answered
+ */
+bool SpeedwireReader::getValues(int *values)
+{
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		values[idx] = -1;
+	}
+	if (!open() || (!_logged_in && !login()))
+	{
+		return false;
+	}
+	for (uint8_t q_idx = 0; q_idx < _num_queries; q_idx++)
+	{
+		_packet_id = (_packet_id + 1) & 0x7FFF;
+		s_sw_response response;
+		if (!send(sw_build_query(_packet, SW_PACKET_MAX, &_src, &_dst, _packet_id, &_queries[q_idx])) || !receive(&response))
+		{
+			return false;
+		}
+		if (response.error != 0)
+		{
+			// Session timed out on the inverter, log in again on the next poll
+			_logged_in = false;
+			return false;
+		}
+		for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+		{
+			sw_find_value(&response, poll_keys_t::ids[idx], &values[idx]);
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Read the day archive, total energy every 5 minutes
+ * The inverter sends the archive in several packets
+ *
+ * @param start UTC time of the first entry
+ * @param end UTC time of the last entry
+ * @param values array of LOG_CHUNK values, total energy in Wh, (uint32_t)-1 if the inverter has no value
+ * @param timestamps array of LOG_CHUNK entry times
+ * @return int number of entries or -1 if the inverter did not answer
+ */
+int SpeedwireReader::getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps)
+{
+	if (!open() || (!_logged_in && !login()))
+	{
+		return -1;
+	}
+	_packet_id = (_packet_id + 1) & 0x7FFF;
+	s_sw_query query = {SW_CMD_ARCHIVE_DAY, start, end};
+	s_sw_response response;
+	if (!send(sw_build_query(_packet, SW_PACKET_MAX, &_src, &_dst, _packet_id, &query)))
+	{
+		return -1;
+	}
+
+	int count = 0;
+	int max_count = min((int)(end - start) / 300 + 1, LOG_CHUNK);
+	while (receive(&response))
+	{
+		if (response.error != 0)
+		{
+			_logged_in = false;
+			return -1;
+		}
+		for (uint16_t pos = 0; (pos + SW_ARCHIVE_RECORD <= response.records_size) && (count < max_count); pos += SW_ARCHIVE_RECORD)
+		{
+			const uint8_t *record = &response.records[pos];
+			uint32_t time = sw_get_u32(record);
+			if ((time < start) || (time > end))
+			{
+				continue;
+			}
+			uint64_t energy = sw_get_u64(&record[4]);
+			timestamps[count] = time;
+			values[count] = (energy == 0xFFFFFFFFFFFFFFFFULL) || (energy == 0x8000000000000000ULL) ? (uint32_t)-1 : (uint32_t)energy;
+			count++;
+		}
+		if (response.fragment == 0)
+		{
+			return count;
+		}
+	}
+	// Lost the last packets, the entries received are used
+	return count > 0 ? count : -1;
+}
+
+/**
+ * @brief Close the session on the inverter
+ *
+ */
+void SpeedwireReader::logout(void)
+{
+	if (!_logged_in || !open())
+	{
+		return;
+	}
+	_packet_id = (_packet_id + 1) & 0x7FFF;
+	send(sw_build_logout(_packet, SW_PACKET_MAX, &_src, _packet_id));
+	_logged_in = false;
+}
+
+/**
+ * @brief Get the serial of the inverter, the inverter sends it with the login response
+ *
+ * @return uint32_t serial, 0 before the first login
+ */
+uint32_t SpeedwireReader::getSerial(void)
+{
+	return _dst.serial == 0xFFFFFFFF ? 0 : _dst.serial;
+}
+
+/**
+ * @brief Create a Speedwire reader
+ *
+ * @param ip IP of the inverter, read on every request
+ * @param passwd password of the user group
+ * @param probe true for a short lived reader of the discovery, it has its own local port
+ * @return InverterReader* the reader
+ */
+InverterReader *new_speedwire_reader(IPAddress *ip, const char *passwd, bool probe)
+{
+	return new SpeedwireReader(ip, passwd, probe ? SW_PROBE_PORT : SW_LOCAL_PORT + num_readers++);
+}
+
+/**
+ * @brief Join the multicast group, call with sw_mutex taken
+ *
+ * @return true if the group is joined
+ */
+static bool join_group(void)
+{
+	if (!WiFi.isConnected())
+	{
+		if (sw_joined)
+		{
+			sw_multicast.stop();
+			sw_joined = false;
+		}
+		return false;
+	}
+	if (!sw_joined)
+	{
+		sw_joined = sw_multicast.beginMulticast(IPAddress(SW_GROUP_0, SW_GROUP_1, SW_GROUP_2, SW_GROUP_3), SW_PORT) == 1;
+	}
+	return sw_joined;
+}
+
+/**
+ * @brief Keep an Energy Meter frame
+ *
+ * @param len length of the frame in sw_packet
+ * @return true if it was an Energy Meter frame
+ */
+static bool handle_meter(int len)
+{
+	s_sw_meter meter;
+	if (!sw_parse_meter(sw_packet, len, &meter))
+	{
+		return false;
+	}
+	portENTER_CRITICAL(&meter_mux);
+	last_meter = meter;
+	meter_time = millis();
+	portEXIT_CRITICAL(&meter_mux);
+	return true;
+}
+
+/**
+ * @brief Scheduler job, read the Energy Meter frames
+ *
+ */
+static void meter_job(void)
+{
+	if (xSemaphoreTake(sw_mutex, 0) != pdTRUE)
+	{
+		// Discovery is running, it reads the frames
+		return;
+	}
+	if (join_group())
+	{
+		int len;
+		while ((len = sw_multicast.parsePacket()) > 0)
+		{
+			len = sw_multicast.read(sw_packet, SW_PACKET_MAX);
+			handle_meter(len);
+		}
+	}
+	xSemaphoreGive(sw_mutex);
+}
+
+/**
+ * @brief Find SMA devices with the Speedwire discovery request
+ *
+ * @param list output array for the IPs
+ * @param max_count size of the output array
+ * @param timeout_ms time to wait for the responses
+ * @return uint8_t number of devices found
+ */
+uint8_t speedwire_discover(IPAddress *list, uint8_t max_count, uint32_t timeout_ms)
+{
+	if ((sw_mutex == NULL) || (xSemaphoreTake(sw_mutex, pdMS_TO_TICKS(timeout_ms)) != pdTRUE))
+	{
+		return 0;
+	}
+	uint8_t count = 0;
+	if (join_group())
+	{
+		size_t len = sw_build_discovery(sw_packet, SW_PACKET_MAX);
+		sw_multicast.beginPacket(IPAddress(SW_GROUP_0, SW_GROUP_1, SW_GROUP_2, SW_GROUP_3), SW_PORT);
+		sw_multicast.write(sw_packet, len);
+		sw_multicast.endPacket();
+
+		uint32_t start_time = millis();
+		while ((millis() - start_time) < timeout_ms)
+		{
+			int size = sw_multicast.parsePacket();
+			if (size <= 0)
+			{
+				delay(SW_WAIT_STEP);
+				continue;
+			}
+			size = sw_multicast.read(sw_packet, SW_PACKET_MAX);
+			uint32_t ip;
+			if (handle_meter(size) || !sw_parse_discovery(sw_packet, size, &ip))
+			{
+				continue;
+			}
+			bool known = false;
+			for (uint8_t idx = 0; idx < count; idx++)
+			{
+				known |= (uint32_t)list[idx] == ip;
+			}
+			if (!known && (count < max_count))
+			{
+				list[count++] = IPAddress(ip);
+			}
+		}
+	}
+	xSemaphoreGive(sw_mutex);
+	return count;
+}
+
+/**
+ * @brief Get the last Energy Meter reading for AT+METER
+ * Power bought and sold in W, energy bought and sold in Wh, age of the reading in s
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void meter_status(char *buffer, uint8_t size)
+{
+	s_sw_meter meter;
+	uint32_t age;
+	portENTER_CRITICAL(&meter_mux);
+	meter = last_meter;
+	age = millis() - meter_time;
+	bool valid = meter_time != 0;
+	portEXIT_CRITICAL(&meter_mux);
+	if (!valid || (age > METER_MAX_AGE))
+	{
+		snprintf(buffer, size, "0");
+		return;
+	}
+	snprintf(buffer, size, "%ld:%ld:%llu:%llu:%ld", meter.power_in / 10, meter.power_out / 10,
+			 (unsigned long long)(meter.energy_in / 3600), (unsigned long long)(meter.energy_out / 3600), age / 1000);
+}
+
+/**
+ * @brief Add the Energy Meter job to the scheduler
+ *
+ */
+void init_speedwire(void)
+{
+	sw_mutex = xSemaphoreCreateMutex();
+	schedule("EM", meter_job, METER_CHECK_TIME, METER_CHECK_TIME);
+}
@@ -0,0 +1,336 @@
+/**
+ * @file subscribers.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Subscribers of the local UDP feed
+ * Clients subscribe with a UDP packet to SUB_PORT and get a lease.
+ *   SUB[:<port>[:<lease>[:<format>]]]  port 0 or missing = port of the packet, lease in seconds,
+ *                                      format UDP_FORMAT_JSON or UDP_FORMAT_BINARY
+ *   UNSUB[:<port>]                     ends the lease
+ * The reply is ACK:<lease> or NAK. A client renews its lease by subscribing again before it ends.
+ * Depending on g_udp_mode the feed is broadcast, sent unicast to each subscriber
+ * or sent to the multicast group multiIP while there is at least one subscriber.
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+#include "udp_frame.h"
+
+/** Port for the subscribe packets */
+#define SUB_PORT 9998
+
+/** Default lease in seconds */
+#define SUB_LEASE_DEFAULT 600
+
+/** Max lease in seconds */
+#define SUB_LEASE_MAX 3600
+
+/** Interval of the check for subscribe packets and ended leases */
+#define SUB_CHECK_TIME 500
+
+/** Max size of a subscribe packet */
+#define SUB_PACKET_SIZE 32
+
+/** Feed mode */
+uint8_t g_udp_mode = UDP_MODE_BROADCAST;
+
+/** Interval of the local feed in seconds, 0 polls with the uplink interval */
+uint16_t g_udp_local_interval = 0;
+
+/** Lease table */
+static s_subscriber subscribers[MAX_SUBSCRIBERS];
+
+/** Subscribers with a lease */
+static uint8_t num_subscribers = 0;
+
+/** Protects the lease table, it is changed by the scheduler and read by the UDP sink */
+static portMUX_TYPE sub_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** true while the subscribe port is open */
+static bool listening = false;
+
+/**
+ * @brief Add or renew a lease
+ *
+ * @param ip address of the subscriber
+ * @param port port of the subscriber
+ * @param lease lease in seconds
+ * @param format frame format of the subscriber
+ * @return true if the lease was added or renewed, false if the table is full
+ */
+static bool add_lease(uint32_t ip, uint16_t port, uint16_t lease, uint8_t format)
+{
+	int8_t free_idx = -1;
+	int8_t found_idx = -1;
+	bool added = false;
+	portENTER_CRITICAL(&sub_mux);
+	for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+	{
+		if (subscribers[idx].ip == 0)
+		{
+			if (free_idx < 0)
+			{
+				free_idx = idx;
+			}
+		}
+		else if ((subscribers[idx].ip == ip) && (subscribers[idx].port == port))
+		{
+			found_idx = idx;
+			break;
+		}
+	}
+	if (found_idx < 0)
+	{
+		found_idx = free_idx;
+		added = free_idx >= 0;
+	}
+	if (found_idx >= 0)
+	{
+		subscribers[found_idx].ip = ip;
+		subscribers[found_idx].port = port;
+		subscribers[found_idx].format = format;
+		subscribers[found_idx].expires = millis() + lease * 1000;
+		if (added)
+		{
+			num_subscribers++;
+		}
+	}
+	portEXIT_CRITICAL(&sub_mux);
+
+	if (added && (num_subscribers == 1))
+	{
+		// First subscriber, switch to the local feed interval
+		set_poll_interval();
+	}
+	return found_idx >= 0;
+}
+
+/**
+ * @brief End a lease
+ *
+ * @param idx index in the lease table
+ */
+static void remove_lease(uint8_t idx)
+{
+	bool removed = false;
+	portENTER_CRITICAL(&sub_mux);
+	if (subscribers[idx].ip != 0)
+	{
+		subscribers[idx].ip = 0;
+		num_subscribers--;
+		removed = true;
+	}
+	portEXIT_CRITICAL(&sub_mux);
+
+	if (removed && (num_subscribers == 0))
+	{
+		// Last subscriber gone, back to the uplink interval
+		set_poll_interval();
+	}
+}
+
+/**
+ * @brief Handle a subscribe packet
+ *
+ * @param packet the packet, 0 terminated
+ * @param ip address of the sender
+ * @param port port of the sender
+ * @param reply buffer for the reply
+ * @param reply_size size of the reply buffer
+ */
+static void handle_packet(char *packet, uint32_t ip, uint16_t port, char *reply, uint8_t reply_size)
+{
+	char *param = strtok(packet, ":");
+	bool subscribe = (param != NULL) && (strcmp(param, "SUB") == 0);
+	bool unsubscribe = (param != NULL) && (strcmp(param, "UNSUB") == 0);
+	if (!subscribe && !unsubscribe)
+	{
+		snprintf(reply, reply_size, "NAK");
+		return;
+	}
+
+	long values[3] = {0, SUB_LEASE_DEFAULT, g_udp_format};
+	const long max_values[3] = {65535, SUB_LEASE_MAX, UDP_FORMAT_BINARY};
+	for (uint8_t idx = 0; idx < 3; idx++)
+	{
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			break;
+		}
+		values[idx] = strtol(param, NULL, 0);
+		if ((values[idx] < 0) || (values[idx] > max_values[idx]))
+		{
+			snprintf(reply, reply_size, "NAK");
+			return;
+		}
+	}
+	if (values[0] != 0)
+	{
+		port = values[0];
+	}
+
+	if (unsubscribe)
+	{
+		for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+		{
+			if ((subscribers[idx].ip == ip) && (subscribers[idx].port == port))
+			{
+				remove_lease(idx);
+			}
+		}
+		snprintf(reply, reply_size, "ACK:0");
+		return;
+	}
+
+	if ((values[1] == 0) || !add_lease(ip, port, values[1], values[2]))
+	{
+		snprintf(reply, reply_size, "NAK");
+		return;
+	}
+	myLog_d("Subscriber %s:%d lease %ld s", IPAddress(ip).toString().c_str(), port, values[1]);
+	snprintf(reply, reply_size, "ACK:%ld", values[1]);
+}
+
+/**
+ * @brief Scheduler job, read the subscribe packets and end the expired leases
+ *
+ */
+static void subscriber_job(void)
+{
+	if (!WiFi.isConnected())
+	{
+		if (listening)
+		{
+			udpClientServer.stop();
+			listening = false;
+		}
+		return;
+	}
+	if (!listening)
+	{
+		listening = udpClientServer.begin(SUB_PORT) == 1;
+		if (!listening)
+		{
+			return;
+		}
+	}
+
+	while (udpClientServer.parsePacket() > 0)
+	{
+		char packet[SUB_PACKET_SIZE];
+		int len = udpClientServer.read(packet, SUB_PACKET_SIZE - 1);
+		packet[len > 0 ? len : 0] = 0;
+		IPAddress sender = udpClientServer.remoteIP();
+		uint16_t sender_port = udpClientServer.remotePort();
+
+		char reply[16];
+		handle_packet(packet, (uint32_t)sender, sender_port, reply, sizeof(reply));
+		udpClientServer.beginPacket(sender, sender_port);
+		udpClientServer.write((uint8_t *)reply, strlen(reply));
+		udpClientServer.endPacket();
+	}
+
+	uint32_t now = millis();
+	for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+	{
+		if ((subscribers[idx].ip != 0) && ((int32_t)(now - subscribers[idx].expires) >= 0))
+		{
+			myLog_d("Lease of %s:%d ended", IPAddress(subscribers[idx].ip).toString().c_str(), subscribers[idx].port);
+			remove_lease(idx);
+		}
+	}
+}
+
+/**
+ * @brief Get the subscribers with a lease
+ *
+ * @param list buffer for MAX_SUBSCRIBERS entries
+ * @return uint8_t number of subscribers
+ */
+uint8_t get_subscribers(s_subscriber *list)
+{
+	uint8_t count = 0;
+	portENTER_CRITICAL(&sub_mux);
+	for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+	{
+		if (subscribers[idx].ip != 0)
+		{
+			list[count++] = subscribers[idx];
+		}
+	}
+	portEXIT_CRITICAL(&sub_mux);
+	return count;
+}
+
+/**
+ * @brief Get the poll interval of the local feed
+ * In broadcast mode it is always active, otherwise only while there is a subscriber
+ *
+ * @return uint32_t interval in ms, 0 if the local feed does not poll faster
+ */
+uint32_t local_poll_interval(void)
+{
+	if ((g_udp_local_interval == 0) || ((g_udp_mode != UDP_MODE_BROADCAST) && (num_subscribers == 0)))
+	{
+		return 0;
+	}
+	return g_udp_local_interval * 1000;
+}
+
+/**
+ * @brief Get the feed status for AT+UDPSUB
+ * Mode, local interval, multicast group and subscribers
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void subscriber_status(char *buffer, uint8_t size)
+{
+	snprintf(buffer, size, "%d:%d:%d:%d:%d:%d:%d", g_udp_mode, g_udp_local_interval,
+			 multiIP[0], multiIP[1], multiIP[2], multiIP[3], num_subscribers);
+}
+
+/**
+ * @brief Read the feed mode, local interval and multicast group from the preferences
+ *
+ */
+void get_subscriber_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("UDP", false);
+	g_udp_mode = preferences.getUChar("m", UDP_MODE_BROADCAST);
+	g_udp_local_interval = preferences.getUShort("l", 0);
+	uint32_t group = preferences.getULong("g", 0);
+	preferences.end();
+	if (group != 0)
+	{
+		multiIP = group;
+	}
+}
+
+/**
+ * @brief Save the feed mode, local interval and multicast group
+ *
+ */
+void save_subscriber_prefs(void)
+{
+	Preferences preferences;
+	preferences.begin("UDP", false);
+	preferences.putUChar("m", g_udp_mode);
+	preferences.putUShort("l", g_udp_local_interval);
+	preferences.putULong("g", (uint32_t)multiIP);
+	preferences.end();
+}
+
+/**
+ * @brief Read the settings and add the subscriber job to the scheduler
+ *
+ */
+void init_subscribers(void)
+{
+	get_subscriber_prefs();
+	schedule("Sub", subscriber_job, SUB_CHECK_TIME, SUB_CHECK_TIME);
+}
@@ -0,0 +1,294 @@
+/**
+ * @file tasks.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief SMA acquisition task, hands the samples to the sinks
+ * @version 0.1
+ * @date 2021-10-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Core for the acquisition task, the WiFi stack runs on core 0 */
+#define ACQ_TASK_CORE 1
+
+/** Notification bits of the acquisition task */
+#define ACQ_POLL_BIT 0x01
+#define ACQ_BACKFILL_BIT 0x02
+#define ACQ_NOW_BIT 0x04
+
+/** A sample this early before the uplink interval still goes to LoRaWAN */
+#define UPLINK_TOLERANCE 1000
+
+/** Timing statistics of the acquisition task and the sinks */
+s_task_stats g_task_stats[MAX_STAGES];
+
+/** Used entries of g_task_stats */
+uint8_t g_num_stages = STAGE_ACQ + 1;
+
+/** Scheduler job that triggers the acquisition */
+static int8_t poll_job = -1;
+
+/** Interval of the samples for LoRaWAN, the local feed can poll faster */
+static volatile uint32_t uplink_interval = 0;
+
+/** millis() of the last sample for LoRaWAN */
+static uint32_t last_uplink = 0;
+
+/** Log intervals requested by the backfill downlink */
+static volatile uint16_t backfill_intervals = 0;
+
+/**
+ * @brief Update the timing statistics of a stage
+ *
+ * @param stats statistics of the stage
+ * @param wait_ms age of the sample when the stage took it
+ * @param proc_ms time the stage needed for the sample
+ */
+void record_stage(s_task_stats *stats, uint32_t wait_ms, uint32_t proc_ms)
+{
+	stats->runs++;
+	stats->wait_ms = wait_ms;
+	stats->last_ms = proc_ms;
+	if (proc_ms > stats->max_ms)
+	{
+		stats->max_ms = proc_ms;
+	}
+}
+
+/**
+ * @brief Read the values from the inverters, retry up to 5 times if none answered
+ * A sample with the values of some of the inverters is valid, the sinks see from num_ok that some are missing
+ *
+ * @param sample sample to fill
+ */
+static void acquire_sample(s_sample *sample)
+{
+	s_task_stats *stats = &g_task_stats[STAGE_ACQ];
+	uint8_t retry_count = 0;
+
+	while (true)
+	{
+		myLog_d("Heap: %ld", ESP.getFreeHeap());
+		uint32_t start_time = millis();
+		sample->num_ok = cache_fetch(sample->values);
+		record_stage(stats, 0, millis() - start_time);
+		isSuccess = sample->num_ok != 0;
+		myLog_d("Getting values: %d of %d inverters", sample->num_ok, g_num_inverters);
+		BLE_PRINTF("Getting values: %d of %d inverters", sample->num_ok, g_num_inverters);
+		if (isSuccess)
+		{
+			break;
+		}
+		retry_count++;
+		myLog_e("Failed to read data from SMA inverter");
+		BLE_PRINTF("Failed to read data from SMA inverter");
+		if (retry_count == 5)
+		{
+			break;
+		}
+		vTaskDelay(pdMS_TO_TICKS(5000));
+	}
+
+	sample->timestamp = millis();
+	sample->utc = time(NULL);
+	sample->valid = isSuccess && (sample->values[0] < 3000 * sample->num_ok);
+	if (isSuccess && !sample->valid)
+	{
+		myLog_e("Values not valid");
+		BLE_PRINTF("Values not valid");
+	}
+}
+
+/**
+ * @brief Read the energy log of the last intervals and queue it for LoRaWAN
+ * The log is read in chunks of LOG_CHUNK entries, each chunk is one or more packets
+ * The entries come from the history, only the gaps are read from the inverters
+ *
+ * @param intervals number of 5 minute intervals
+ */
+static void run_backfill(uint16_t intervals)
+{
+	uint32_t now = time(NULL);
+	if (now < VALID_TIME)
+	{
+		myLog_e("Backfill needs the time, not synced yet");
+		return;
+	}
+	uint32_t end = now - (now % LOG_INTERVAL);
+	uint32_t start = end - (intervals - 1) * LOG_INTERVAL;
+	myLog_d("Backfill of %d intervals", intervals);
+
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	uint32_t inv_values[LOG_CHUNK];
+	uint32_t inv_timestamps[LOG_CHUNK];
+	while (start <= end)
+	{
+		uint32_t chunk_end = min(end, start + (LOG_CHUNK - 1) * LOG_INTERVAL);
+		int slots = (chunk_end - start) / LOG_INTERVAL + 1;
+		int found = history_read_log(start, chunk_end, values, timestamps);
+		if (found < slots)
+		{
+			int count = read_inverter_log(start, chunk_end, inv_values, inv_timestamps);
+			if ((count < 0) && (found == 0))
+			{
+				myLog_e("Backfill failed at %ld", start);
+				return;
+			}
+			for (int entry = 0; entry < count; entry++)
+			{
+				uint32_t offset = inv_timestamps[entry] - start;
+				if ((inv_timestamps[entry] >= start) && ((offset % LOG_INTERVAL) == 0) && (offset / LOG_INTERVAL < (uint32_t)slots) &&
+					(values[offset / LOG_INTERVAL] == (uint32_t)-1))
+				{
+					values[offset / LOG_INTERVAL] = inv_values[entry];
+				}
+			}
+		}
+		batch_send_log(timestamps, values, slots);
+		start = chunk_end + LOG_INTERVAL;
+	}
+}
+
+/**
+ * @brief Acquisition task, reads the inverters when triggered by the poll job
+ * and hands the samples to the sinks
+ *
+ * @param pvParameters unused
+ */
+static void acq_task(void *pvParameters)
+{
+	while (true)
+	{
+		uint32_t events = 0;
+		xTaskNotifyWait(0, ULONG_MAX, &events, portMAX_DELAY);
+		// The inverters are read over WiFi, each sink decides itself if it can take the sample
+		if (!WiFi.isConnected() || g_ota_running)
+		{
+			continue;
+		}
+
+		if (events & ACQ_BACKFILL_BIT)
+		{
+			run_backfill(backfill_intervals);
+			if ((events & ACQ_POLL_BIT) == 0)
+			{
+				continue;
+			}
+		}
+
+		digitalWrite(LED_GREEN, HIGH);
+		s_sample sample;
+		acquire_sample(&sample);
+		// With a faster local feed only the samples of the uplink interval go to LoRaWAN
+		uint32_t elapsed = millis() - last_uplink;
+		sample.uplink = (last_uplink == 0) || (events & ACQ_NOW_BIT) ||
+						((uplink_interval != 0) && (elapsed + UPLINK_TOLERANCE >= uplink_interval));
+		if (sample.uplink)
+		{
+			last_uplink = millis();
+			elapsed = 0;
+			uplink_interval = get_poll_interval(&sample);
+		}
+		publish_all(&sample);
+		digitalWrite(LED_GREEN, LOW);
+
+		uint32_t local = local_poll_interval();
+		if (local != 0)
+		{
+			uint32_t next = local;
+			if ((uplink_interval != 0) && (uplink_interval - min(elapsed, uplink_interval) < local))
+			{
+				next = uplink_interval - min(elapsed, uplink_interval);
+			}
+			reschedule(poll_job, next, local);
+		}
+		else if (g_poll_settings.enabled && sample.uplink)
+		{
+			reschedule(poll_job, uplink_interval, uplink_interval);
+		}
+	}
+}
+
+/**
+ * @brief Scheduler job, trigger the acquisition task
+ *
+ */
+static void sma_poll_job(void)
+{
+	xTaskNotify(g_task_stats[STAGE_ACQ].task, ACQ_POLL_BIT, eSetBits);
+}
+
+/**
+ * @brief Poll the inverters now and send the sample over LoRaWAN, the poll job keeps its period
+ *
+ */
+void poll_now(void)
+{
+	xTaskNotify(g_task_stats[STAGE_ACQ].task, ACQ_POLL_BIT | ACQ_NOW_BIT, eSetBits);
+}
+
+/**
+ * @brief Read the energy log of the last intervals from the history or the inverters and send it over LoRaWAN
+ *
+ * @param intervals number of 5 minute intervals
+ */
+void request_backfill(uint16_t intervals)
+{
+	backfill_intervals = intervals;
+	xTaskNotify(g_task_stats[STAGE_ACQ].task, ACQ_BACKFILL_BIT, eSetBits);
+}
+
+/**
+ * @brief Get the poll interval, the faster of the uplink interval and the local feed interval
+ *
+ * @return uint32_t poll interval in ms, 0 if polling is stopped
+ */
+static uint32_t poll_job_interval(void)
+{
+	uplink_interval = get_poll_interval(NULL);
+	uint32_t interval = uplink_interval;
+	uint32_t local = local_poll_interval();
+	if ((local != 0) && ((interval == 0) || (local < interval)))
+	{
+		interval = local;
+	}
+	return interval;
+}
+
+/**
+ * @brief Apply a changed send repeat time, adaptive poll setting or local feed interval to the poll job
+ * A send repeat time of 0 stops the automatic polling, except for the local feed
+ *
+ */
+void set_poll_interval(void)
+{
+	uint32_t interval = poll_job_interval();
+	if (interval == 0)
+	{
+		unschedule(poll_job);
+		return;
+	}
+	reschedule(poll_job, interval, interval);
+}
+
+/**
+ * @brief Start the acquisition task and the sinks
+ * and add their jobs to the scheduler
+ *
+ */
+void start_tasks(void)
+{
+	g_task_stats[STAGE_ACQ].name = "Acq";
+	init_sinks();
+	xTaskCreatePinnedToCore(acq_task, g_task_stats[STAGE_ACQ].name, 5120, NULL, 1, &g_task_stats[STAGE_ACQ].task, ACQ_TASK_CORE);
+
+	uint32_t interval = poll_job_interval();
+	poll_job = schedule("Poll", sma_poll_job, 0, interval);
+	if (interval == 0)
+	{
+		unschedule(poll_job);
+	}
+}
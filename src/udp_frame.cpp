@@ -0,0 +1,147 @@
+/**
+ * @file udp_frame.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Serializer of the UDP broadcast frame
+ *
+ * JSON frame, "s" and "c" as before ("c" is always 0), then the new fields:
+ *   {"de":"spm","s":<power W>,"c":0,"e":<energy today Wh>,"t":<time>,"et":<energy total Wh>,"st":<status>}
+ *
+ * Binary frame, schema version 1, big endian:
+ *   header         1 byte  UDP_BINARY_HEADER
+ *   time           4 byte
+ *   power          4 byte  signed
+ *   energy today   4 byte
+ *   energy total   4 byte
+ *   status         1 byte
+ *
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "udp_frame.h"
+
+/**
+ * @brief Append a string
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param len current length, increased by the string length
+ * @param str string to append
+ * @return true if it fits
+ */
+static bool put_str(char *buffer, size_t size, size_t *len, const char *str)
+{
+	while (*str != 0)
+	{
+		if (*len + 1 >= size)
+		{
+			return false;
+		}
+		buffer[(*len)++] = *str++;
+	}
+	return true;
+}
+
+/**
+ * @brief Append a number as decimal text
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ * @param len current length, increased by the text length
+ * @param value number to append
+ * @return true if it fits
+ */
+static bool put_num(char *buffer, size_t size, size_t *len, int64_t value)
+{
+	char digits[20];
+	uint8_t num = 0;
+	uint64_t abs_value = value < 0 ? (uint64_t)(-value) : (uint64_t)value;
+	do
+	{
+		digits[num++] = '0' + abs_value % 10;
+		abs_value /= 10;
+	} while (abs_value != 0);
+	if (*len + num + (value < 0 ? 1 : 0) + 1 > size)
+	{
+		return false;
+	}
+	if (value < 0)
+	{
+		buffer[(*len)++] = '-';
+	}
+	while (num != 0)
+	{
+		buffer[(*len)++] = digits[--num];
+	}
+	return true;
+}
+
+/**
+ * @brief Write a 32 bit value big endian
+ */
+static void put_32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = value >> 24;
+	buffer[1] = value >> 16;
+	buffer[2] = value >> 8;
+	buffer[3] = value;
+}
+
+/**
+ * @brief Write the JSON frame
+ *
+ * @param buffer output buffer, UDP_JSON_MAX bytes are always enough
+ * @param size buffer size
+ * @param frame values of the frame
+ * @return size_t length of the frame without the terminating 0, 0 if the buffer is too small
+ */
+size_t udp_frame_json(char *buffer, size_t size, const s_udp_frame *frame)
+{
+	size_t len = 0;
+	bool ok = put_str(buffer, size, &len, "{\"de\":\"spm\",\"s\":") &&
+			  put_num(buffer, size, &len, frame->power) &&
+			  put_str(buffer, size, &len, ",\"c\":0,\"e\":") &&
+			  put_num(buffer, size, &len, frame->energy_today) &&
+			  put_str(buffer, size, &len, ",\"t\":") &&
+			  put_num(buffer, size, &len, frame->time) &&
+			  put_str(buffer, size, &len, ",\"et\":") &&
+			  put_num(buffer, size, &len, frame->energy_total) &&
+			  put_str(buffer, size, &len, ",\"st\":") &&
+			  put_num(buffer, size, &len, frame->status) &&
+			  put_str(buffer, size, &len, "}");
+	if (!ok)
+	{
+		if (size != 0)
+		{
+			buffer[0] = 0;
+		}
+		return 0;
+	}
+	buffer[len] = 0;
+	return len;
+}
+
+/**
+ * @brief Write the binary frame
+ *
+ * @param buffer output buffer
+ * @param size buffer size, at least UDP_BINARY_SIZE
+ * @param frame values of the frame
+ * @return size_t length of the frame, 0 if the buffer is too small
+ */
+size_t udp_frame_binary(uint8_t *buffer, size_t size, const s_udp_frame *frame)
+{
+	if (size < UDP_BINARY_SIZE)
+	{
+		return 0;
+	}
+	buffer[0] = UDP_BINARY_HEADER;
+	put_32(&buffer[1], frame->time);
+	put_32(&buffer[5], (uint32_t)frame->power);
+	put_32(&buffer[9], (uint32_t)frame->energy_today);
+	put_32(&buffer[13], (uint32_t)frame->energy_total);
+	buffer[17] = frame->status;
+	return UDP_BINARY_SIZE;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file udp_frame.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Serializer of the UDP broadcast frame, writes into a caller supplied buffer without heap allocations
+ * Plain C++ without Arduino dependencies, so the same code can be used on a PC
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __UDP_FRAME_H__
+#define __UDP_FRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Frame formats
+#define UDP_FORMAT_JSON 0
+#define UDP_FORMAT_BINARY 1
+
+// First byte of the binary frame, high nibble marks the frame, low nibble is the schema version
+#define UDP_BINARY_MARK 0x50
+#define UDP_BINARY_VERSION 1
+#define UDP_BINARY_HEADER (UDP_BINARY_MARK | UDP_BINARY_VERSION)
+
+// Size of the binary frame
+#define UDP_BINARY_SIZE 18
+
+// Max size of the JSON frame
+#define UDP_JSON_MAX 96
+
+// Status bits
+#define UDP_STATUS_VALID 0x01
+#define UDP_STATUS_ALL_INVERTERS 0x02
+#define UDP_STATUS_TIME_SYNCED 0x04
+#define UDP_STATUS_JOINED 0x08
+
+struct s_udp_frame
+{
+	// UTC seconds, seconds since boot until the time is synced
+	uint32_t time;
+	// W
+	int32_t power;
+	// Wh
+	int32_t energy_today;
+	// Wh
+	int32_t energy_total;
+	// UDP_STATUS_xxx bits
+	uint8_t status;
+};
+
+size_t udp_frame_json(char *buffer, size_t size, const s_udp_frame *frame);
+size_t udp_frame_binary(uint8_t *buffer, size_t size, const s_udp_frame *frame);
+
+#endif
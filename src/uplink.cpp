@@ -0,0 +1,441 @@
+/**
+ * @file uplink.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Store-and-forward queue for LoRaWAN uplinks
+ * Packets are kept in a ring buffer in PSRAM, when it is full the oldest packets
+ * are moved to a ring file in SPIFFS. Packets are sent in order, the oldest first,
+ * and are removed only after the TX finished (ACK for confirmed packets).
+ * When the file is full as well, the oldest packet is dropped.
+ * @version 0.1
+ * @date 2021-10-21
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Packets in the RAM ring with PSRAM */
+#define UPLINK_RAM_SIZE 256
+
+/** Packets in the RAM ring without PSRAM */
+#define UPLINK_RAM_SIZE_NO_PSRAM 16
+
+/** Packets in the flash ring file */
+#define UPLINK_FILE_SIZE 40
+
+/** Name of the flash ring file */
+#define UPLINK_FILE "/uplink.q"
+
+/** Marker of the flash ring file header */
+#define UPLINK_FILE_MARK 0x55504C31
+
+/** Send attempts before a packet is dropped */
+#define UPLINK_MAX_RETRIES 5
+
+/** Time between send attempts */
+#define UPLINK_DRAIN_TIME 10000
+
+/** Max time to wait for the TX finished callback */
+#define UPLINK_TX_TIMEOUT 30000
+
+/** Header of the flash ring file */
+struct s_uplink_file_header
+{
+	uint32_t mark;
+	uint16_t head;
+	uint16_t count;
+};
+
+/** Queue statistics */
+s_uplink_stats g_uplink_stats;
+
+/** RAM ring */
+static s_uplink *ram_ring = NULL;
+static uint16_t ram_size = 0;
+static uint16_t ram_head = 0;
+static uint16_t ram_count = 0;
+
+/** Flash ring */
+static bool has_file = false;
+static s_uplink_file_header file_header;
+
+/** Protects the queue, packets are added from the LoRa task and sent from the scheduler */
+static SemaphoreHandle_t uplink_mutex = NULL;
+
+/** Scheduler job that sends the packets */
+static int8_t drain_job = -1;
+
+/** Send state of the oldest packet */
+static bool in_flight = false;
+static uint32_t in_flight_start = 0;
+static uint8_t head_retries = 0;
+/** true if the oldest packet was already counted as deferred by the duty cycle */
+static bool head_deferred = false;
+static volatile bool tx_done = false;
+static volatile bool tx_success = false;
+
+/**
+ * @brief Write the header of the flash ring file
+ *
+ * @param file open ring file
+ */
+static void write_file_header(File &file)
+{
+	file.seek(0);
+	file.write((uint8_t *)&file_header, sizeof(file_header));
+}
+
+/**
+ * @brief Open the flash ring file, create it with all slots if it does not exist
+ *
+ * @return true if the file can be used
+ */
+static bool open_file(void)
+{
+	if (!SPIFFS.begin(true))
+	{
+		myLog_e("SPIFFS mount failed, uplink queue only in RAM");
+		return false;
+	}
+
+	File file = SPIFFS.open(UPLINK_FILE, "r");
+	if (file && (file.size() == sizeof(s_uplink_file_header) + UPLINK_FILE_SIZE * sizeof(s_uplink)))
+	{
+		file.read((uint8_t *)&file_header, sizeof(file_header));
+		file.close();
+		if ((file_header.mark == UPLINK_FILE_MARK) && (file_header.head < UPLINK_FILE_SIZE) && (file_header.count <= UPLINK_FILE_SIZE))
+		{
+			myLog_d("Found %d queued uplinks in flash", file_header.count);
+			return true;
+		}
+	}
+	else if (file)
+	{
+		file.close();
+	}
+
+	file = SPIFFS.open(UPLINK_FILE, "w");
+	if (!file)
+	{
+		myLog_e("Can't create uplink queue file");
+		return false;
+	}
+	file_header.mark = UPLINK_FILE_MARK;
+	file_header.head = 0;
+	file_header.count = 0;
+	file.write((uint8_t *)&file_header, sizeof(file_header));
+	s_uplink empty;
+	memset(&empty, 0, sizeof(empty));
+	for (uint16_t idx = 0; idx < UPLINK_FILE_SIZE; idx++)
+	{
+		file.write((uint8_t *)&empty, sizeof(empty));
+	}
+	file.close();
+	return true;
+}
+
+/**
+ * @brief Access a slot of the flash ring file
+ *
+ * @param slot slot number
+ * @param packet packet to write or buffer to read into
+ * @param write true to write the packet
+ */
+static void file_slot(uint16_t slot, s_uplink *packet, bool write)
+{
+	File file = SPIFFS.open(UPLINK_FILE, "r+");
+	if (!file)
+	{
+		myLog_e("Can't open uplink queue file");
+		return;
+	}
+	file.seek(sizeof(s_uplink_file_header) + slot * sizeof(s_uplink));
+	if (write)
+	{
+		file.write((uint8_t *)packet, sizeof(s_uplink));
+		write_file_header(file);
+	}
+	else
+	{
+		file.read((uint8_t *)packet, sizeof(s_uplink));
+	}
+	file.close();
+}
+
+/**
+ * @brief Update only the header of the flash ring file
+ *
+ */
+static void file_sync_header(void)
+{
+	File file = SPIFFS.open(UPLINK_FILE, "r+");
+	if (file)
+	{
+		write_file_header(file);
+		file.close();
+	}
+}
+
+/**
+ * @brief Move a packet to the end of the flash ring, drops the oldest packet if the file is full
+ *
+ * @param packet the packet
+ * @return true if the packet was stored, false if it was dropped
+ */
+static bool spill_to_file(s_uplink *packet)
+{
+	if (!has_file)
+	{
+		g_uplink_stats.dropped++;
+		return false;
+	}
+	if (file_header.count == UPLINK_FILE_SIZE)
+	{
+		myLog_e("Uplink queue full, dropping oldest packet");
+		file_header.head = (file_header.head + 1) % UPLINK_FILE_SIZE;
+		file_header.count--;
+		g_uplink_stats.dropped++;
+		if (in_flight)
+		{
+			// The packet in flight was dropped
+			in_flight = false;
+		}
+		head_retries = 0;
+		head_deferred = false;
+	}
+	uint16_t slot = (file_header.head + file_header.count) % UPLINK_FILE_SIZE;
+	file_header.count++;
+	file_slot(slot, packet, true);
+	g_uplink_stats.spilled++;
+	return true;
+}
+
+/**
+ * @brief Get the oldest packet
+ *
+ * @param packet buffer for the packet
+ * @return true if there is a packet
+ */
+static bool peek_oldest(s_uplink *packet)
+{
+	if (has_file && (file_header.count != 0))
+	{
+		file_slot(file_header.head, packet, false);
+		return true;
+	}
+	if (ram_count != 0)
+	{
+		memcpy(packet, &ram_ring[ram_head], sizeof(s_uplink));
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Remove the oldest packet
+ *
+ */
+static void pop_oldest(void)
+{
+	head_retries = 0;
+	head_deferred = false;
+	if (has_file && (file_header.count != 0))
+	{
+		file_header.head = (file_header.head + 1) % UPLINK_FILE_SIZE;
+		file_header.count--;
+		file_sync_header();
+		return;
+	}
+	if (ram_count != 0)
+	{
+		ram_head = (ram_head + 1) % ram_size;
+		ram_count--;
+	}
+}
+
+/**
+ * @brief Initialize the uplink queue, packets left in flash from before the reboot are sent first
+ *
+ */
+void init_uplink(void)
+{
+	uplink_mutex = xSemaphoreCreateMutex();
+
+	if (psramFound())
+	{
+		ram_ring = (s_uplink *)ps_malloc(UPLINK_RAM_SIZE * sizeof(s_uplink));
+		ram_size = UPLINK_RAM_SIZE;
+	}
+	if (ram_ring == NULL)
+	{
+		ram_ring = (s_uplink *)malloc(UPLINK_RAM_SIZE_NO_PSRAM * sizeof(s_uplink));
+		ram_size = UPLINK_RAM_SIZE_NO_PSRAM;
+	}
+	has_file = open_file();
+	myLog_d("Uplink queue %d packets in RAM, %d in flash", ram_size, has_file ? UPLINK_FILE_SIZE : 0);
+
+	drain_job = schedule("Upl", uplink_drain_job, UPLINK_DRAIN_TIME, UPLINK_DRAIN_TIME);
+}
+
+/**
+ * @brief Add a packet to the queue
+ *
+ * @param port fPort
+ * @param data payload
+ * @param size payload size
+ * @return true if queued, false if the packet is too large
+ */
+bool uplink_enqueue(uint8_t port, uint8_t *data, uint8_t size)
+{
+	if ((size > UPLINK_MAX_PAYLOAD) || (ram_ring == NULL))
+	{
+		return false;
+	}
+
+	s_uplink packet;
+	packet.timestamp = time(NULL);
+	packet.port = port;
+	packet.size = size;
+	memcpy(packet.data, data, size);
+
+	xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+	if (ram_count == ram_size)
+	{
+		// Oldest RAM packet goes to flash, the flash packets stay older than the RAM packets
+		spill_to_file(&ram_ring[ram_head]);
+		ram_head = (ram_head + 1) % ram_size;
+		ram_count--;
+	}
+	memcpy(&ram_ring[(ram_head + ram_count) % ram_size], &packet, sizeof(s_uplink));
+	ram_count++;
+	g_uplink_stats.queued++;
+	xSemaphoreGive(uplink_mutex);
+
+	// Try to send right away
+	if (!in_flight)
+	{
+		reschedule(drain_job, 0, UPLINK_DRAIN_TIME);
+	}
+	return true;
+}
+
+/**
+ * @brief Called from the LoRaWAN TX finished callbacks
+ *
+ * @param success true if sent (unconfirmed) or ACK received (confirmed)
+ */
+void uplink_tx_finished(bool success)
+{
+	tx_success = success;
+	tx_done = true;
+	reschedule(drain_job, 0, UPLINK_DRAIN_TIME);
+}
+
+/**
+ * @brief Scheduler job, send the oldest packet if the network is joined and the radio is free
+ *
+ */
+void uplink_drain_job(void)
+{
+	xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+
+	if (in_flight)
+	{
+		if (!tx_done && ((millis() - in_flight_start) < UPLINK_TX_TIMEOUT))
+		{
+			xSemaphoreGive(uplink_mutex);
+			return;
+		}
+		in_flight = false;
+		if (tx_done && tx_success)
+		{
+			pop_oldest();
+			g_uplink_stats.sent++;
+		}
+		else
+		{
+			g_uplink_stats.retries++;
+			if (++head_retries >= UPLINK_MAX_RETRIES)
+			{
+				myLog_e("Uplink failed %d times, dropping packet", UPLINK_MAX_RETRIES);
+				pop_oldest();
+				g_uplink_stats.dropped++;
+			}
+		}
+	}
+	tx_done = false;
+
+	s_uplink packet;
+	if ((lmh_join_status_get() != LMH_SET) || !peek_oldest(&packet))
+	{
+		xSemaphoreGive(uplink_mutex);
+		return;
+	}
+	if (!airtime_allowed(packet.size))
+	{
+		// Duty cycle budget used up, the packet waits in the queue, it is counted once
+		if (!head_deferred)
+		{
+			head_deferred = true;
+			airtime_deferred();
+		}
+		xSemaphoreGive(uplink_mutex);
+		return;
+	}
+
+	lmh_error_status result = lora_send_frame(packet.port, packet.data, packet.size);
+	switch (result)
+	{
+	case LMH_SUCCESS:
+		in_flight = true;
+		in_flight_start = millis();
+		airtime_charge(packet.size);
+		break;
+	case LMH_BUSY:
+		// Radio busy, try again with the next run
+		break;
+	case LMH_ERROR:
+		// Too big for the current DR, might work after a DR change
+		g_uplink_stats.retries++;
+		if (++head_retries >= UPLINK_MAX_RETRIES)
+		{
+			myLog_e("Uplink too big for current DR, dropping packet");
+			pop_oldest();
+			g_uplink_stats.dropped++;
+		}
+		break;
+	}
+	xSemaphoreGive(uplink_mutex);
+}
+
+/**
+ * @brief Get the number of queued packets
+ *
+ * @param in_flash set to the number of packets in flash
+ * @return uint16_t number of packets in RAM
+ */
+uint16_t uplink_pending(uint16_t *in_flash)
+{
+	*in_flash = has_file ? file_header.count : 0;
+	return ram_count;
+}
+
+/**
+ * @brief Move all RAM packets to flash before a reboot
+ *
+ */
+void uplink_save(void)
+{
+	if ((uplink_mutex == NULL) || !has_file)
+	{
+		return;
+	}
+	xSemaphoreTake(uplink_mutex, portMAX_DELAY);
+	while (ram_count != 0)
+	{
+		spill_to_file(&ram_ring[ram_head]);
+		ram_head = (ram_head + 1) % ram_size;
+		ram_count--;
+	}
+	xSemaphoreGive(uplink_mutex);
+}
@@ -0,0 +1,236 @@
+/**
+ * @file value_cache.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Cache of the inverter values between the inverters and their consumers
+ * All values of poll_keys_t come from one read of the inverters, so they share one TTL,
+ * the one of the power that changes fastest. Device info is not polled and not cached.
+ * cache_fetch() reads the inverters, a caller that comes while a read is running waits for it
+ * and gets its values instead of starting another read.
+ * cache_get() returns the cached value at once, if it is older than the TTL a refresh is started
+ * in the background (stale while revalidate).
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** TTL of the cached values */
+#define CACHE_TTL 10000
+
+/** Event bit, set while no read of the inverters is running */
+#define CACHE_IDLE_BIT 0x01
+
+/** Stack size of the refresh task, it reads the inverters */
+#define CACHE_STACK_SIZE 4096
+
+/** Cached values of poll_keys_t */
+static int cache_values[poll_keys_t::count];
+
+/** millis() of the last update of the values */
+static uint32_t cache_time = 0;
+
+/** true after the first read that an inverter answered */
+static bool cache_valid = false;
+
+/** Inverters that answered the last read */
+static uint8_t cache_num_ok = 0;
+
+/** true while a read of the inverters is running */
+static bool fetching = false;
+
+/** Protects the cache */
+static portMUX_TYPE cache_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** Signals the end of a read */
+static EventGroupHandle_t cache_events = NULL;
+
+/** Background refresh task */
+static TaskHandle_t refresh_task_handle = NULL;
+
+/** Statistics */
+s_cache_stats g_cache_stats;
+
+/**
+ * @brief Find a key in poll_keys_t
+ *
+ * @param id key id
+ * @return int index of the key, -1 if it is not polled
+ */
+static int key_index(SMAKeyId id)
+{
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		if (poll_keys_t::ids[idx] == id)
+		{
+			return idx;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Read the inverters, or wait for the read that is running
+ *
+ * @param values array of poll_keys_t::count values, sums over the inverters that answered
+ * @param timeout_ms max time to wait for the inverters
+ * @return uint8_t number of inverters that answered
+ */
+uint8_t cache_fetch(int *values, uint32_t timeout_ms)
+{
+	portENTER_CRITICAL(&cache_mux);
+	bool coalesce = fetching;
+	if (coalesce)
+	{
+		g_cache_stats.coalesced++;
+	}
+	else
+	{
+		fetching = true;
+		g_cache_stats.fetches++;
+		xEventGroupClearBits(cache_events, CACHE_IDLE_BIT);
+	}
+	portEXIT_CRITICAL(&cache_mux);
+
+	uint8_t num_ok;
+	if (coalesce)
+	{
+		xEventGroupWaitBits(cache_events, CACHE_IDLE_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+		portENTER_CRITICAL(&cache_mux);
+		memcpy(values, cache_values, sizeof(cache_values));
+		num_ok = cache_num_ok;
+		portEXIT_CRITICAL(&cache_mux);
+		return num_ok;
+	}
+
+	num_ok = poll_inverters(values, timeout_ms);
+	uint32_t now = millis();
+	portENTER_CRITICAL(&cache_mux);
+	cache_num_ok = num_ok;
+	if (num_ok != 0)
+	{
+		memcpy(cache_values, values, sizeof(cache_values));
+		cache_time = now;
+		cache_valid = true;
+	}
+	fetching = false;
+	portEXIT_CRITICAL(&cache_mux);
+	xEventGroupSetBits(cache_events, CACHE_IDLE_BIT);
+	return num_ok;
+}
+
+/**
+ * @brief Get a cached value without waiting for the inverters
+ * A value older than the TTL is returned as well and a refresh is started
+ *
+ * @param id key id, must be in poll_keys_t
+ * @param value set to the cached value
+ * @param age_ms set to the age of the value, can be NULL
+ * @return true if there is a value
+ */
+bool cache_get(SMAKeyId id, int *value, uint32_t *age_ms)
+{
+	int idx = key_index(id);
+	if (idx < 0)
+	{
+		return false;
+	}
+	portENTER_CRITICAL(&cache_mux);
+	bool valid = cache_valid;
+	uint32_t updated = cache_time;
+	*value = cache_values[idx];
+	bool stale = !valid || ((millis() - updated) > CACHE_TTL);
+	bool refresh = !fetching && stale;
+	if (!valid)
+	{
+		g_cache_stats.misses++;
+	}
+	else if (stale)
+	{
+		g_cache_stats.stale++;
+	}
+	else
+	{
+		g_cache_stats.hits++;
+	}
+	portEXIT_CRITICAL(&cache_mux);
+
+	if (refresh && (refresh_task_handle != NULL))
+	{
+		xTaskNotifyGive(refresh_task_handle);
+	}
+	if (age_ms != NULL)
+	{
+		*age_ms = millis() - updated;
+	}
+	return valid;
+}
+
+/**
+ * @brief Check if the cached values are older than the TTL
+ *
+ * @return true if there are no values or they are too old
+ */
+static bool cache_stale(void)
+{
+	portENTER_CRITICAL(&cache_mux);
+	bool stale = !cache_valid || ((millis() - cache_time) > CACHE_TTL);
+	portEXIT_CRITICAL(&cache_mux);
+	return stale;
+}
+
+/**
+ * @brief Refresh task, reads the inverters for cache_get()
+ * Readers that found the values stale before the read started requested a refresh as well,
+ * their requests are dropped if the values are fresh again
+ *
+ * @param pvParameters unused
+ */
+static void refresh_task(void *pvParameters)
+{
+	int values[poll_keys_t::count];
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (!WiFi.isConnected() || g_ota_running || !cache_stale())
+		{
+			continue;
+		}
+		cache_fetch(values);
+	}
+}
+
+/**
+ * @brief Get the cached values and the cache status for AT+CACHE
+ * Power, energy today, age of the values in seconds, then
+ * hits, stale hits, misses, reads of the inverters, reads that waited for a running read
+ * Like every consumer, a stale value is returned and a refresh is started
+ *
+ * @param buffer output buffer
+ * @param size buffer size
+ */
+void cache_status(char *buffer, uint8_t size)
+{
+	int power = -1;
+	int today = -1;
+	uint32_t age_ms = 0;
+	long age = -1;
+	if (cache_get(SMAKeyId::POWER, &power, &age_ms) && cache_get(SMAKeyId::ENERGY_TODAY, &today, NULL))
+	{
+		age = age_ms / 1000;
+	}
+	snprintf(buffer, size, "%d:%d:%ld,%ld:%ld:%ld:%ld:%ld", power, today, age,
+			 g_cache_stats.hits, g_cache_stats.stale, g_cache_stats.misses, g_cache_stats.fetches, g_cache_stats.coalesced);
+}
+
+/**
+ * @brief Start the refresh task, call before start_tasks()
+ *
+ */
+void init_cache(void)
+{
+	cache_events = xEventGroupCreate();
+	xEventGroupSetBits(cache_events, CACHE_IDLE_BIT);
+	xTaskCreate(refresh_task, "Cache", CACHE_STACK_SIZE, NULL, 1, &refresh_task_handle);
+}
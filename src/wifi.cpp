@@ -141,6 +141,9 @@ void init_wifi(void)
 	delay(100);
 	WiFi.onEvent(wifi_event_cb);
 
+	// UTC time for the sunrise and sunset of the adaptive polling
+	configTime(0, 0, "pool.ntp.org");
+
 	create_dev_name();
 
 	if (g_has_credentials)
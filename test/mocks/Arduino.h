@@ -0,0 +1,349 @@
+/**
+ * @file Arduino.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the Arduino core for the tests, pio test -e native
+ * Only what the modules under test use. millis() runs with the PC clock,
+ * a test can freeze it and move it on with mock_advance()
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_ARDUINO_H__
+#define __MOCK_ARDUINO_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#define ARDUINO 10816
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::max;
+using std::min;
+
+// Clock stuff
+struct s_mock_clock
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	// Frozen clock, only mock_advance() and the blocking calls move it
+	std::atomic<bool> frozen{false};
+	std::atomic<uint32_t> frozen_ms{0};
+};
+
+inline s_mock_clock &mock_clock(void)
+{
+	static s_mock_clock clock;
+	return clock;
+}
+
+inline uint32_t millis(void)
+{
+	s_mock_clock &clock = mock_clock();
+	if (clock.frozen)
+	{
+		return clock.frozen_ms;
+	}
+	return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - clock.start).count();
+}
+
+inline uint32_t micros(void)
+{
+	s_mock_clock &clock = mock_clock();
+	if (clock.frozen)
+	{
+		return clock.frozen_ms * 1000;
+	}
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clock.start).count();
+}
+
+// Freeze millis() at its current value or let it run with the PC clock again
+inline void mock_freeze_time(bool freeze)
+{
+	s_mock_clock &clock = mock_clock();
+	if (freeze)
+	{
+		clock.frozen_ms = millis();
+	}
+	clock.frozen = freeze;
+}
+
+// Move the frozen clock on
+inline void mock_advance(uint32_t ms)
+{
+	mock_clock().frozen_ms += ms;
+}
+
+inline void delay(uint32_t ms)
+{
+	if (mock_clock().frozen)
+	{
+		mock_advance(ms);
+		return;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void delayMicroseconds(uint32_t us)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+inline void yield(void)
+{
+	std::this_thread::yield();
+}
+
+// Random stuff, the same sequence in every run unless a test seeds it
+inline uint32_t &mock_random_state(void)
+{
+	static uint32_t state = 1;
+	return state;
+}
+
+inline void randomSeed(unsigned long seed)
+{
+	mock_random_state() = (uint32_t)seed;
+}
+
+inline long random(long max_value)
+{
+	if (max_value <= 0)
+	{
+		return 0;
+	}
+	uint32_t &state = mock_random_state();
+	state = state * 1103515245UL + 12345UL;
+	return (long)((state >> 8) % (uint32_t)max_value);
+}
+
+inline long random(long min_value, long max_value)
+{
+	if (min_value >= max_value)
+	{
+		return min_value;
+	}
+	return random(max_value - min_value) + min_value;
+}
+
+// String stuff
+class String
+{
+public:
+	String(const char *str = "") : _str(str == NULL ? "" : str) {}
+	String(const std::string &str) : _str(str) {}
+	String(char c) : _str(1, c) {}
+	String(int value) : _str(std::to_string(value)) {}
+	String(unsigned int value) : _str(std::to_string(value)) {}
+	String(long value) : _str(std::to_string(value)) {}
+	String(unsigned long value) : _str(std::to_string(value)) {}
+
+	unsigned int length(void) const { return (unsigned int)_str.length(); }
+	const char *c_str(void) const { return _str.c_str(); }
+	char operator[](unsigned int index) const { return index < _str.length() ? _str[index] : 0; }
+	char &operator[](unsigned int index) { return _str[index]; }
+	void remove(unsigned int index, unsigned int count = (unsigned int)-1)
+	{
+		if (index < _str.length())
+		{
+			_str.erase(index, count);
+		}
+	}
+	bool concat(const String &str)
+	{
+		_str += str._str;
+		return true;
+	}
+	bool concat(char c)
+	{
+		_str += c;
+		return true;
+	}
+	String &operator+=(const String &str)
+	{
+		concat(str);
+		return *this;
+	}
+	String &operator+=(const char *str)
+	{
+		_str += str;
+		return *this;
+	}
+	String &operator+=(char c)
+	{
+		concat(c);
+		return *this;
+	}
+	bool operator==(const String &str) const { return _str == str._str; }
+	bool operator==(const char *str) const { return _str == str; }
+	bool operator!=(const String &str) const { return _str != str._str; }
+	bool operator!=(const char *str) const { return _str != str; }
+	bool equalsIgnoreCase(const String &str) const { return strcasecmp(_str.c_str(), str.c_str()) == 0; }
+	bool startsWith(const String &str) const { return _str.compare(0, str._str.length(), str._str) == 0; }
+	int indexOf(const char *str) const
+	{
+		size_t pos = _str.find(str);
+		return pos == std::string::npos ? -1 : (int)pos;
+	}
+	String substring(unsigned int from, unsigned int to = (unsigned int)-1) const { return from < _str.length() ? String(_str.substr(from, to - from)) : String(); }
+	void toCharArray(char *buffer, unsigned int size) const { snprintf(buffer, size, "%s", _str.c_str()); }
+	long toInt(void) const { return strtol(_str.c_str(), NULL, 10); }
+
+private:
+	std::string _str;
+};
+
+inline String operator+(const String &left, const String &right)
+{
+	String result(left);
+	result += right;
+	return result;
+}
+
+// Print and Stream stuff
+#define STREAMUTILS_STREAM_READBYTES_IS_VIRTUAL 1
+
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size)
+	{
+		size_t count = 0;
+		while ((count < size) && (write(buffer[count]) == 1))
+		{
+			count++;
+		}
+		return count;
+	}
+	size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	size_t print(const char *str) { return write(str); }
+	size_t print(const String &str) { return write(str.c_str()); }
+	size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+	{
+		char buffer[256];
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(buffer, sizeof(buffer), format, args);
+		va_end(args);
+		return len < 0 ? 0 : write((const uint8_t *)buffer, std::min((size_t)len, sizeof(buffer) - 1));
+	}
+};
+
+class Stream : public Print
+{
+public:
+	virtual int available(void) = 0;
+	virtual int read(void) = 0;
+	virtual int peek(void) = 0;
+	virtual void flush(void) {}
+	// No timeout, the mocks have all data at hand
+	virtual size_t readBytes(char *buffer, size_t length)
+	{
+		size_t count = 0;
+		int c;
+		while ((count < length) && ((c = read()) >= 0))
+		{
+			buffer[count++] = (char)c;
+		}
+		return count;
+	}
+	size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+	void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+protected:
+	unsigned long _timeout = 1000;
+};
+
+// Network stuff
+class IPAddress
+{
+public:
+	IPAddress() : _address(0) {}
+	IPAddress(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4) : _address(b1 | (b2 << 8) | (b3 << 16) | ((uint32_t)b4 << 24)) {}
+	IPAddress(uint32_t address) : _address(address) {}
+	operator uint32_t() const { return _address; }
+	bool operator==(const IPAddress &address) const { return _address == address._address; }
+	bool operator!=(const IPAddress &address) const { return _address != address._address; }
+	uint8_t operator[](int index) const { return (_address >> (8 * index)) & 0xFF; }
+	bool fromString(const char *address)
+	{
+		unsigned int b[4];
+		if (sscanf(address, "%u.%u.%u.%u", &b[0], &b[1], &b[2], &b[3]) != 4)
+		{
+			return false;
+		}
+		_address = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+		return true;
+	}
+	String toString(void) const
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%d.%d.%d.%d", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+		return String(buffer);
+	}
+
+private:
+	// First byte of the address in the lowest byte, like on the ESP32
+	uint32_t _address;
+};
+
+class Client : public Stream
+{
+public:
+	virtual int connect(IPAddress ip, uint16_t port) = 0;
+	virtual int connect(const char *host, uint16_t port) = 0;
+	virtual int read(uint8_t *buffer, size_t size) = 0;
+	virtual void stop(void) = 0;
+	virtual uint8_t connected(void) = 0;
+	virtual operator bool(void) = 0;
+	using Print::write;
+	using Stream::read;
+};
+
+// Chip stuff
+class EspClass
+{
+public:
+	uint64_t getEfuseMac(void) { return 0xF6E5D4C3B2A1ULL; }
+	uint32_t getFreeHeap(void) { return 200000; }
+	void restart(void) {}
+};
+static EspClass ESP __attribute__((unused));
+
+// PSRAM stuff, no PSRAM unless a test adds it
+inline bool &mock_psram(void)
+{
+	static bool found = false;
+	return found;
+}
+
+inline bool psramFound(void)
+{
+	return mock_psram();
+}
+
+inline void *ps_malloc(size_t size)
+{
+	return mock_psram() ? malloc(size) : NULL;
+}
+
+#include "freertos/FreeRTOS.h"
+
+#endif
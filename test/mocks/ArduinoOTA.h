@@ -0,0 +1,2 @@
+// Part of the Arduino core mock, see Arduino.h
+#include "Arduino.h"
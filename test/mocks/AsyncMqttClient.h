@@ -0,0 +1,269 @@
+/**
+ * @file AsyncMqttClient.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the AsyncMqttClient with an in-process fake broker, pio test -e native
+ * The broker records the messages and keeps the retained ones. Like the real client the answers
+ * come later: the test accepts the connection with mock_broker_accept(), confirms messages with
+ * mock_broker_ack() and breaks the connection with mock_broker_drop()
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_ASYNC_MQTT_CLIENT_H__
+#define __MOCK_ASYNC_MQTT_CLIENT_H__
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+enum class AsyncMqttClientDisconnectReason : int8_t
+{
+	TCP_DISCONNECTED = 0,
+	MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 1,
+	MQTT_IDENTIFIER_REJECTED = 2,
+	MQTT_SERVER_UNAVAILABLE = 3,
+	MQTT_MALFORMED_CREDENTIALS = 4,
+	MQTT_NOT_AUTHORIZED = 5,
+};
+
+class AsyncMqttClient;
+
+// Message received by the fake broker
+struct s_mock_mqtt_message
+{
+	std::string topic;
+	std::string payload;
+	uint8_t qos = 0;
+	bool retain = false;
+	uint16_t packet_id = 0;
+};
+
+// Fake broker
+struct s_mock_broker
+{
+	// Client that connected last
+	AsyncMqttClient *client = NULL;
+	bool connected = false;
+	// Settings of the last connect
+	std::string host;
+	uint16_t port = 0;
+	std::string user;
+	std::string pass;
+	std::string client_id;
+	s_mock_mqtt_message will;
+	// Connection requests and disconnects of the client
+	uint32_t connects = 0;
+	uint32_t disconnects = 0;
+	// All messages and the retained ones by topic
+	std::vector<s_mock_mqtt_message> messages;
+	std::map<std::string, std::string> retained;
+	// Packet ids of the messages with QoS > 0 that were not confirmed yet
+	std::vector<uint16_t> unacked;
+	uint16_t next_id = 1;
+};
+
+inline s_mock_broker &mock_broker(void)
+{
+	static s_mock_broker broker;
+	return broker;
+}
+
+class AsyncMqttClient
+{
+public:
+	typedef std::function<void(bool session_present)> OnConnectUserCallback;
+	typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+	typedef std::function<void(uint16_t packet_id)> OnPublishUserCallback;
+
+	AsyncMqttClient &setClientId(const char *client_id)
+	{
+		_client_id = client_id == NULL ? "" : client_id;
+		return *this;
+	}
+	AsyncMqttClient &setServer(const char *host, uint16_t port)
+	{
+		_host = host;
+		_port = port;
+		return *this;
+	}
+	AsyncMqttClient &setCredentials(const char *username, const char *password = NULL)
+	{
+		_user = username == NULL ? "" : username;
+		_pass = password == NULL ? "" : password;
+		return *this;
+	}
+	AsyncMqttClient &setWill(const char *topic, uint8_t qos, bool retain, const char *payload = NULL, size_t length = 0)
+	{
+		_will.topic = topic;
+		_will.qos = qos;
+		_will.retain = retain;
+		_will.payload = payload == NULL ? "" : std::string(payload, length == 0 ? strlen(payload) : length);
+		return *this;
+	}
+	AsyncMqttClient &onConnect(OnConnectUserCallback callback)
+	{
+		_on_connect = callback;
+		return *this;
+	}
+	AsyncMqttClient &onDisconnect(OnDisconnectUserCallback callback)
+	{
+		_on_disconnect = callback;
+		return *this;
+	}
+	AsyncMqttClient &onPublish(OnPublishUserCallback callback)
+	{
+		_on_publish = callback;
+		return *this;
+	}
+
+	bool connected(void) const
+	{
+		s_mock_broker &broker = mock_broker();
+		return broker.connected && (broker.client == this);
+	}
+
+	// The broker answers with mock_broker_accept()
+	void connect(void)
+	{
+		s_mock_broker &broker = mock_broker();
+		broker.client = this;
+		broker.connected = false;
+		broker.host = _host;
+		broker.port = _port;
+		broker.user = _user;
+		broker.pass = _pass;
+		broker.client_id = _client_id;
+		broker.will = _will;
+		broker.connects++;
+	}
+
+	// Without force the client says goodbye and the broker does not send the last will
+	void disconnect(bool force = false)
+	{
+		s_mock_broker &broker = mock_broker();
+		if (broker.client != this)
+		{
+			return;
+		}
+		bool was_connected = broker.connected;
+		broker.connected = false;
+		broker.unacked.clear();
+		broker.disconnects++;
+		if (was_connected && force && _will.retain)
+		{
+			broker.retained[_will.topic] = _will.payload;
+		}
+		if (_on_disconnect)
+		{
+			_on_disconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+		}
+	}
+
+	// 0 if not connected, 1 with QoS 0, the packet id otherwise
+	uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload = NULL, size_t length = 0, bool dup = false, uint16_t message_id = 0)
+	{
+		if (!connected())
+		{
+			return 0;
+		}
+		s_mock_broker &broker = mock_broker();
+		s_mock_mqtt_message message;
+		message.topic = topic;
+		message.payload = payload == NULL ? "" : std::string(payload, length == 0 ? strlen(payload) : length);
+		message.qos = qos;
+		message.retain = retain;
+		if (qos != 0)
+		{
+			message.packet_id = broker.next_id++;
+			if (broker.next_id == 0)
+			{
+				broker.next_id = 1;
+			}
+			broker.unacked.push_back(message.packet_id);
+		}
+		broker.messages.push_back(message);
+		if (retain)
+		{
+			broker.retained[message.topic] = message.payload;
+		}
+		return qos == 0 ? 1 : message.packet_id;
+	}
+
+	OnConnectUserCallback _on_connect;
+	OnDisconnectUserCallback _on_disconnect;
+	OnPublishUserCallback _on_publish;
+
+private:
+	std::string _client_id;
+	std::string _host;
+	uint16_t _port = 0;
+	std::string _user;
+	std::string _pass;
+	s_mock_mqtt_message _will;
+};
+
+// Forget the connection and the messages, the client is disconnected
+inline void mock_broker_reset(void)
+{
+	mock_broker() = s_mock_broker();
+}
+
+// Accept the pending connection request
+inline void mock_broker_accept(void)
+{
+	s_mock_broker &broker = mock_broker();
+	if ((broker.client == NULL) || broker.connected)
+	{
+		return;
+	}
+	broker.connected = true;
+	if (broker.client->_on_connect)
+	{
+		broker.client->_on_connect(false);
+	}
+}
+
+// Confirm a message with QoS > 0, PUBACK or PUBCOMP
+inline bool mock_broker_ack(uint16_t packet_id)
+{
+	s_mock_broker &broker = mock_broker();
+	for (size_t idx = 0; idx < broker.unacked.size(); idx++)
+	{
+		if (broker.unacked[idx] == packet_id)
+		{
+			broker.unacked.erase(broker.unacked.begin() + idx);
+			if (broker.client->_on_publish)
+			{
+				broker.client->_on_publish(packet_id);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// The connection breaks, the broker sends the last will
+inline void mock_broker_drop(void)
+{
+	s_mock_broker &broker = mock_broker();
+	if (!broker.connected)
+	{
+		return;
+	}
+	broker.connected = false;
+	broker.unacked.clear();
+	if (broker.will.retain)
+	{
+		broker.retained[broker.will.topic] = broker.will.payload;
+	}
+	if (broker.client->_on_disconnect)
+	{
+		broker.client->_on_disconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+	}
+}
+
+#endif
@@ -0,0 +1,36 @@
+/**
+ * @file AsyncUDP.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 AsyncUDP class, pio test -e native
+ * Packets are counted, not sent
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_ASYNC_UDP_H__
+#define __MOCK_ASYNC_UDP_H__
+
+#include "Arduino.h"
+
+class AsyncUDP
+{
+public:
+	bool connect(const IPAddress addr, uint16_t port) { return true; }
+	size_t broadcastTo(uint8_t *data, size_t len, uint16_t port)
+	{
+		packets++;
+		return len;
+	}
+	size_t writeTo(const uint8_t *data, size_t len, const IPAddress addr, uint16_t port)
+	{
+		packets++;
+		return len;
+	}
+	void close(void) {}
+
+	uint32_t packets = 0;
+};
+
+#endif
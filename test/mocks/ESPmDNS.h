@@ -0,0 +1,52 @@
+/**
+ * @file ESPmDNS.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 mDNS responder, pio test -e native
+ * A query returns the services a test put into mock_mdns()
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_ESPMDNS_H__
+#define __MOCK_ESPMDNS_H__
+
+#include <vector>
+#include "Arduino.h"
+
+// Service announced in the network
+struct s_mock_mdns_service
+{
+	String hostname;
+	IPAddress ip;
+};
+
+// Services found by the next query
+inline std::vector<s_mock_mdns_service> &mock_mdns(void)
+{
+	static std::vector<s_mock_mdns_service> services;
+	return services;
+}
+
+class MDNSResponder
+{
+public:
+	bool begin(const char *hostname) { return true; }
+	void end(void) {}
+	bool addService(const char *service, const char *proto, uint16_t port) { return true; }
+	bool addServiceTxt(const char *service, const char *proto, const char *key, const char *value) { return true; }
+	int queryService(const char *service, const char *proto)
+	{
+		_results = mock_mdns();
+		return (int)_results.size();
+	}
+	String hostname(int idx) { return idx < (int)_results.size() ? _results[idx].hostname : String(); }
+	IPAddress IP(int idx) { return idx < (int)_results.size() ? _results[idx].ip : IPAddress(); }
+
+private:
+	std::vector<s_mock_mdns_service> _results;
+};
+static MDNSResponder MDNS __attribute__((unused));
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * @file HTTPClient.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 HTTP client, pio test -e native
+ * The requests go to the MockHttpServer of the test, without a server they are refused.
+ * The server simulates the link: handshake and request time on the mock clock, idle connections
+ * closed by the server, Connection: close and chunked responses
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_HTTP_CLIENT_H__
+#define __MOCK_HTTP_CLIENT_H__
+
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_UNAUTHORIZED 401
+
+class MockHttpServer
+{
+public:
+	virtual ~MockHttpServer() {}
+	// Answer a request, returns the HTTP status
+	virtual int handle(const String &url, const String &body, String *response) = 0;
+
+	// Refuse new connections and drop the open ones
+	bool online = true;
+	// Time of the TCP handshake and of a request with its response
+	uint32_t connect_ms = 0;
+	uint32_t request_ms = 0;
+	// Close idle connections after this time, 0 keeps them open
+	uint32_t idle_timeout_ms = 0;
+	// Answer with Connection: close
+	bool close_connections = false;
+	// Answer with Transfer-Encoding: chunked
+	bool chunked = false;
+
+	// Statistics for the tests
+	uint32_t connects = 0;
+	uint32_t requests = 0;
+	uint32_t http10_requests = 0;
+	uint32_t lost = 0;
+};
+
+// Server behind all HTTP requests
+inline MockHttpServer *&mock_http_server(void)
+{
+	static MockHttpServer *server = NULL;
+	return server;
+}
+
+class HTTPClient
+{
+public:
+	void useHTTP10(bool usehttp10 = true) { _http10 = usehttp10; }
+	void setReuse(bool reuse) { _reuse = reuse; }
+	bool begin(WiFiClient &client, const String &url)
+	{
+		_client = &client;
+		_url = url;
+		_connection = String();
+		_encoding = String();
+		return true;
+	}
+	void collectHeaders(const char *headerKeys[], const size_t headerKeysCount) {}
+	void addHeader(const String &name, const String &value) {}
+
+	int POST(const String &payload)
+	{
+		MockHttpServer *server = mock_http_server();
+		if ((server == NULL) || (_client == NULL))
+		{
+			return HTTPC_ERROR_CONNECTION_REFUSED;
+		}
+		if (_client->open && (!server->online || ((server->idle_timeout_ms != 0) && (millis() - _client->last_used >= server->idle_timeout_ms))))
+		{
+			// The server closed the socket, the client notices it when the request is sent
+			server->lost++;
+			_client->stop();
+			return HTTPC_ERROR_CONNECTION_LOST;
+		}
+		if (!_client->open)
+		{
+			if (!server->online)
+			{
+				return HTTPC_ERROR_CONNECTION_REFUSED;
+			}
+			server->connects++;
+			delay(server->connect_ms);
+			_client->open = true;
+		}
+		server->requests++;
+		if (_http10)
+		{
+			server->http10_requests++;
+		}
+		delay(server->request_ms);
+
+		String body;
+		int status = server->handle(_url, payload, &body);
+		_can_reuse = !_http10 && _reuse && !server->close_connections;
+		_connection = _can_reuse ? "keep-alive" : "close";
+		_client->rx = body.c_str();
+		if (server->chunked && !_http10)
+		{
+			_encoding = "chunked";
+			_client->rx = chunk(body.c_str());
+		}
+		_client->rx_pos = 0;
+		return status;
+	}
+	int POST(const char *payload) { return POST(String(payload)); }
+
+	void end(void)
+	{
+		if (_client == NULL)
+		{
+			return;
+		}
+		if (!_can_reuse)
+		{
+			_client->stop();
+		}
+		_client->last_used = millis();
+		_can_reuse = false;
+	}
+
+	String header(const char *name)
+	{
+		if (strcasecmp(name, "Connection") == 0)
+		{
+			return _connection;
+		}
+		if (strcasecmp(name, "Transfer-Encoding") == 0)
+		{
+			return _encoding;
+		}
+		return String();
+	}
+	WiFiClient &getStream(void) { return *_client; }
+	static String errorToString(int error) { return String(error); }
+
+private:
+	WiFiClient *_client = NULL;
+	String _url;
+	bool _http10 = false;
+	bool _reuse = true;
+	bool _can_reuse = false;
+	String _connection;
+	String _encoding;
+
+	// Body in chunks of 16 bytes and the terminating zero size chunk
+	static std::string chunk(const std::string &body)
+	{
+		std::string chunked;
+		char size[8];
+		for (size_t pos = 0; pos < body.length(); pos += 16)
+		{
+			std::string part = body.substr(pos, 16);
+			snprintf(size, sizeof(size), "%x\r\n", (unsigned int)part.length());
+			chunked += size + part + "\r\n";
+		}
+		return chunked + "0\r\n\r\n";
+	}
+};
+
+#endif
@@ -0,0 +1,571 @@
+/**
+ * @file LoRaWan-Arduino.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the SX126x-Arduino LoRaWAN API with a simulated MAC, pio test -e native
+ * lmh_init() resets the MAC to the defaults of the region like the real stack.
+ * The test answers the join requests with mock_mac_join_accept() or mock_mac_join_fail(),
+ * lmh_send() only records the packets
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_LORAWAN_ARDUINO_H__
+#define __MOCK_LORAWAN_ARDUINO_H__
+
+#include "Arduino.h"
+
+// Library types
+typedef enum
+{
+	LMH_SUCCESS = 0,
+	LMH_BUSY = -1,
+	LMH_ERROR = -2,
+} lmh_error_status;
+
+typedef enum
+{
+	LMH_UNCONFIRMED_MSG = 0,
+	LMH_CONFIRMED_MSG = !LMH_UNCONFIRMED_MSG
+} lmh_confirm;
+
+typedef enum
+{
+	LMH_RESET = 0,
+	LMH_SET = 1,
+	LMH_ONGOING = 2,
+	LMH_FAILED = 3,
+} lmh_join_status;
+
+typedef enum eDeviceClass
+{
+	CLASS_A,
+	CLASS_B,
+	CLASS_C,
+} DeviceClass_t;
+
+typedef enum eLoRaMacRegion_t
+{
+	LORAMAC_REGION_AS923 = 0,
+	LORAMAC_REGION_AU915,
+	LORAMAC_REGION_CN470,
+	LORAMAC_REGION_CN779,
+	LORAMAC_REGION_EU433,
+	LORAMAC_REGION_EU868,
+	LORAMAC_REGION_KR920,
+	LORAMAC_REGION_IN865,
+	LORAMAC_REGION_US915,
+	LORAMAC_REGION_AS923_2,
+	LORAMAC_REGION_AS923_3,
+	LORAMAC_REGION_AS923_4,
+	LORAMAC_REGION_RU864,
+} LoRaMacRegion_t;
+
+#define DR_0 0
+#define DR_1 1
+#define DR_2 2
+#define DR_3 3
+#define DR_4 4
+#define DR_5 5
+
+typedef struct
+{
+	uint8_t *buffer;
+	uint8_t buffsize;
+	uint8_t port;
+	int16_t rssi;
+	int8_t snr;
+} lmh_app_data_t;
+
+typedef struct
+{
+	bool adr_enable;
+	int8_t tx_data_rate;
+	bool enable_public_network;
+	uint8_t nb_trials;
+	int8_t tx_power;
+	bool duty_cycle;
+} lmh_param_t;
+
+typedef struct
+{
+	uint8_t (*BoardGetBatteryLevel)(void);
+	void (*BoardGetUniqueId)(uint8_t *id);
+	uint32_t (*BoardGetRandomSeed)(void);
+	void (*lmh_RxData)(lmh_app_data_t *appdata);
+	void (*lmh_has_joined)(void);
+	void (*lmh_ConfirmClass)(DeviceClass_t Class);
+	void (*lmh_has_joined_failed)(void);
+	void (*lmh_unconf_finished)(void);
+	void (*lmh_conf_finished)(bool result);
+} lmh_callback_t;
+
+// MAC types
+typedef enum
+{
+	LORAMAC_STATUS_OK,
+	LORAMAC_STATUS_BUSY,
+	LORAMAC_STATUS_SERVICE_UNKNOWN,
+	LORAMAC_STATUS_PARAMETER_INVALID,
+} LoRaMacStatus_t;
+
+typedef enum
+{
+	MIB_DEVICE_CLASS,
+	MIB_NETWORK_JOINED,
+	MIB_ADR,
+	MIB_NET_ID,
+	MIB_DEV_ADDR,
+	MIB_NWK_SKEY,
+	MIB_APP_SKEY,
+	MIB_PUBLIC_NETWORK,
+	MIB_REPEATER_SUPPORT,
+	MIB_CHANNELS,
+	MIB_RX2_CHANNEL,
+	MIB_RX2_DEFAULT_CHANNEL,
+	MIB_CHANNELS_MASK,
+	MIB_CHANNELS_DEFAULT_MASK,
+	MIB_CHANNELS_NB_REP,
+	MIB_MAX_RX_WINDOW_DURATION,
+	MIB_RECEIVE_DELAY_1,
+	MIB_RECEIVE_DELAY_2,
+	MIB_JOIN_ACCEPT_DELAY_1,
+	MIB_JOIN_ACCEPT_DELAY_2,
+	MIB_CHANNELS_DEFAULT_DATARATE,
+	MIB_CHANNELS_DATARATE,
+	MIB_CHANNELS_TX_POWER,
+	MIB_CHANNELS_DEFAULT_TX_POWER,
+	MIB_UPLINK_COUNTER,
+	MIB_DOWNLINK_COUNTER,
+} Mib_t;
+
+typedef union
+{
+	int8_t Value;
+	struct
+	{
+		int8_t Min : 4;
+		int8_t Max : 4;
+	} Fields;
+} DrRange_t;
+
+typedef struct
+{
+	uint32_t Frequency;
+	uint32_t Rx1Frequency;
+	DrRange_t DrRange;
+	uint8_t Band;
+} ChannelParams_t;
+
+typedef struct
+{
+	uint32_t Frequency;
+	uint8_t Datarate;
+} Rx2ChannelParams_t;
+
+typedef union
+{
+	DeviceClass_t Class;
+	bool IsNetworkJoined;
+	bool AdrEnable;
+	uint32_t NetID;
+	uint32_t DevAddr;
+	uint8_t *NwkSKey;
+	uint8_t *AppSKey;
+	bool EnablePublicNetwork;
+	ChannelParams_t *ChannelList;
+	Rx2ChannelParams_t Rx2Channel;
+	Rx2ChannelParams_t Rx2DefaultChannel;
+	uint16_t *ChannelsMask;
+	uint16_t *ChannelsDefaultMask;
+	uint8_t ChannelNbRep;
+	uint32_t MaxRxWindow;
+	uint32_t ReceiveDelay1;
+	uint32_t ReceiveDelay2;
+	uint32_t JoinAcceptDelay1;
+	uint32_t JoinAcceptDelay2;
+	int8_t ChannelsDefaultDatarate;
+	int8_t ChannelsDatarate;
+	int8_t ChannelsTxPower;
+	int8_t ChannelsDefaultTxPower;
+	uint32_t UpLinkCounter;
+	uint32_t DownLinkCounter;
+} MibParam_t;
+
+typedef struct
+{
+	Mib_t Type;
+	MibParam_t Param;
+} MibRequestConfirm_t;
+
+typedef enum
+{
+	MLME_JOIN,
+	MLME_LINK_CHECK,
+} Mlme_t;
+
+typedef struct
+{
+	Mlme_t Type;
+} MlmeReq_t;
+
+// Simulated MAC
+// Channels of CN470, the largest channel plan
+#define MOCK_MAC_CHANNELS 96
+#define MOCK_MAC_MASK_WORDS 6
+
+struct s_mock_mac
+{
+	lmh_callback_t *callbacks = NULL;
+	bool otaa = true;
+	LoRaMacRegion_t region = LORAMAC_REGION_EU868;
+	lmh_join_status join_status = LMH_RESET;
+	uint32_t dev_addr = 0;
+	uint8_t nwk_skey[16] = {0};
+	uint8_t app_skey[16] = {0};
+	int8_t datarate = 0;
+	bool adr = false;
+	uint32_t fcnt_up = 0;
+	uint32_t fcnt_down = 0;
+	ChannelParams_t channels[MOCK_MAC_CHANNELS];
+	uint16_t mask[MOCK_MAC_MASK_WORDS];
+	Rx2ChannelParams_t rx2;
+	uint32_t rx1_delay = 1000;
+	uint32_t rx2_delay = 2000;
+	// Calls of the API, checked by the tests
+	uint32_t inits = 0;
+	uint32_t joins = 0;
+	uint32_t link_checks = 0;
+	// Data rates of the join requests
+	int8_t join_datarates[64];
+	// Recorded uplinks and the result lmh_send() returns
+	uint32_t sends = 0;
+	lmh_error_status send_result = LMH_SUCCESS;
+	uint8_t last_port = 0;
+	uint8_t last_size = 0;
+	uint8_t last_data[256];
+	lmh_confirm last_confirm = LMH_UNCONFIRMED_MSG;
+};
+
+inline s_mock_mac &mock_mac(void)
+{
+	static s_mock_mac mac;
+	return mac;
+}
+
+// Regions with a fixed channel plan, the network only changes their channel mask
+inline bool mock_mac_fixed_plan(LoRaMacRegion_t region)
+{
+	return (region == LORAMAC_REGION_US915) || (region == LORAMAC_REGION_AU915) || (region == LORAMAC_REGION_CN470);
+}
+
+// Channels and defaults of the region, what the MAC does in lmh_init()
+inline void mock_mac_defaults(LoRaMacRegion_t region)
+{
+	s_mock_mac &mac = mock_mac();
+	memset(mac.channels, 0, sizeof(mac.channels));
+	memset(mac.mask, 0, sizeof(mac.mask));
+	mac.region = region;
+	mac.rx1_delay = 1000;
+	mac.rx2_delay = 2000;
+	mac.rx2.Datarate = DR_0;
+	switch (region)
+	{
+	case LORAMAC_REGION_US915:
+	case LORAMAC_REGION_AU915:
+		// 64 channels of 125 kHz and 8 of 500 kHz, all enabled
+		for (uint8_t ch = 0; ch < 72; ch++)
+		{
+			mac.channels[ch].Frequency = ch < 64 ? 902300000 + ch * 200000 : 903000000 + (ch - 64) * 1600000;
+			mac.channels[ch].DrRange.Value = ch < 64 ? 0x30 : 0x44;
+		}
+		mac.mask[0] = mac.mask[1] = mac.mask[2] = mac.mask[3] = 0xFFFF;
+		mac.mask[4] = 0x00FF;
+		mac.rx2.Frequency = 923300000;
+		mac.rx2.Datarate = DR_0 + 8;
+		break;
+	case LORAMAC_REGION_CN470:
+		for (uint8_t ch = 0; ch < 96; ch++)
+		{
+			mac.channels[ch].Frequency = 470300000 + ch * 200000;
+			mac.channels[ch].DrRange.Value = 0x50;
+		}
+		for (uint8_t word = 0; word < 6; word++)
+		{
+			mac.mask[word] = 0xFFFF;
+		}
+		mac.rx2.Frequency = 505300000;
+		break;
+	default:
+		// Three default channels, the network adds the others
+		for (uint8_t ch = 0; ch < 3; ch++)
+		{
+			mac.channels[ch].Frequency = 868100000 + ch * 200000;
+			mac.channels[ch].DrRange.Value = 0x50;
+		}
+		mac.mask[0] = 0x0007;
+		mac.rx2.Frequency = 869525000;
+		break;
+	}
+}
+
+inline uint32_t lora_rak13300_init(void)
+{
+	return 0;
+}
+
+inline lmh_error_status lmh_init(lmh_callback_t *callbacks, lmh_param_t lora_param, bool otaa, eDeviceClass nodeClass = CLASS_A, LoRaMacRegion_t region = LORAMAC_REGION_AS923, bool region_change = false)
+{
+	s_mock_mac &mac = mock_mac();
+	mac.callbacks = callbacks;
+	mac.otaa = otaa;
+	mac.datarate = lora_param.tx_data_rate;
+	mac.adr = lora_param.adr_enable;
+	mac.join_status = LMH_RESET;
+	mac.fcnt_up = 0;
+	mac.fcnt_down = 0;
+	mac.inits++;
+	mock_mac_defaults(region);
+	return LMH_SUCCESS;
+}
+
+// Enable the 8 channels of the sub band and its 500 kHz channel
+inline bool lmh_setSubBandChannels(uint8_t subBand)
+{
+	s_mock_mac &mac = mock_mac();
+	if (!mock_mac_fixed_plan(mac.region))
+	{
+		return true;
+	}
+	if ((subBand < 1) || (subBand > 8))
+	{
+		return false;
+	}
+	memset(mac.mask, 0, sizeof(mac.mask));
+	uint8_t first = (subBand - 1) * 8;
+	mac.mask[first / 16] = 0xFF << (first % 16);
+	mac.mask[4] = 1 << (subBand - 1);
+	return true;
+}
+
+inline void lmh_join(void)
+{
+	s_mock_mac &mac = mock_mac();
+	if (mac.joins < sizeof(mac.join_datarates))
+	{
+		mac.join_datarates[mac.joins] = mac.datarate;
+	}
+	mac.joins++;
+	if (!mac.otaa)
+	{
+		// ABP, joined at once
+		mac.join_status = LMH_SET;
+		if ((mac.callbacks != NULL) && (mac.callbacks->lmh_has_joined != NULL))
+		{
+			mac.callbacks->lmh_has_joined();
+		}
+		return;
+	}
+	mac.join_status = LMH_ONGOING;
+}
+
+// Join accept of the network, EU868 style with a CFList and the RX settings of TTN
+inline void mock_mac_join_accept(uint32_t dev_addr)
+{
+	s_mock_mac &mac = mock_mac();
+	mac.dev_addr = dev_addr;
+	for (uint8_t idx = 0; idx < 16; idx++)
+	{
+		mac.nwk_skey[idx] = (uint8_t)(dev_addr + idx);
+		mac.app_skey[idx] = (uint8_t)(dev_addr + 0x80 + idx);
+	}
+	mac.fcnt_up = 0;
+	mac.fcnt_down = 0;
+	if (!mock_mac_fixed_plan(mac.region))
+	{
+		for (uint8_t ch = 3; ch < 8; ch++)
+		{
+			mac.channels[ch].Frequency = 867100000 + (ch - 3) * 200000;
+			mac.channels[ch].DrRange.Value = 0x50;
+		}
+		mac.mask[0] = 0x00FF;
+	}
+	mac.rx1_delay = 5000;
+	mac.rx2_delay = 6000;
+	mac.rx2.Datarate = DR_3;
+	mac.join_status = LMH_SET;
+	if ((mac.callbacks != NULL) && (mac.callbacks->lmh_has_joined != NULL))
+	{
+		mac.callbacks->lmh_has_joined();
+	}
+}
+
+// No join accept after all trials of the request
+inline void mock_mac_join_fail(void)
+{
+	s_mock_mac &mac = mock_mac();
+	mac.join_status = LMH_FAILED;
+	if ((mac.callbacks != NULL) && (mac.callbacks->lmh_has_joined_failed != NULL))
+	{
+		mac.callbacks->lmh_has_joined_failed();
+	}
+}
+
+inline lmh_join_status lmh_join_status_get(void)
+{
+	return mock_mac().join_status;
+}
+
+inline lmh_error_status lmh_send(lmh_app_data_t *app_data, lmh_confirm is_type)
+{
+	s_mock_mac &mac = mock_mac();
+	mac.sends++;
+	if (mac.send_result != LMH_SUCCESS)
+	{
+		return mac.send_result;
+	}
+	mac.last_port = app_data->port;
+	mac.last_size = app_data->buffsize;
+	memcpy(mac.last_data, app_data->buffer, app_data->buffsize);
+	mac.last_confirm = is_type;
+	mac.fcnt_up++;
+	return LMH_SUCCESS;
+}
+
+inline void lmh_datarate_set(uint8_t data_rate, bool enable_adr)
+{
+	mock_mac().datarate = data_rate;
+	mock_mac().adr = enable_adr;
+}
+
+inline lmh_error_status lmh_class_request(DeviceClass_t newClass)
+{
+	return LMH_SUCCESS;
+}
+
+inline void lmh_setDevEui(uint8_t *userDevEui) {}
+inline void lmh_setAppEui(uint8_t *userAppEui) {}
+inline void lmh_setAppKey(uint8_t *userAppKey) {}
+
+inline void lmh_setNwkSKey(uint8_t *userNwkSKey)
+{
+	memcpy(mock_mac().nwk_skey, userNwkSKey, 16);
+}
+
+inline void lmh_setAppSKey(uint8_t *userAppSKey)
+{
+	memcpy(mock_mac().app_skey, userAppSKey, 16);
+}
+
+inline void lmh_setDevAddr(uint32_t userDevAddr)
+{
+	mock_mac().dev_addr = userDevAddr;
+}
+
+inline uint32_t lmh_getDevAddr(void)
+{
+	return mock_mac().dev_addr;
+}
+
+inline LoRaMacStatus_t LoRaMacMibGetRequestConfirm(MibRequestConfirm_t *mibGet)
+{
+	s_mock_mac &mac = mock_mac();
+	switch (mibGet->Type)
+	{
+	case MIB_DEV_ADDR:
+		mibGet->Param.DevAddr = mac.dev_addr;
+		break;
+	case MIB_NWK_SKEY:
+		mibGet->Param.NwkSKey = mac.nwk_skey;
+		break;
+	case MIB_APP_SKEY:
+		mibGet->Param.AppSKey = mac.app_skey;
+		break;
+	case MIB_CHANNELS:
+		mibGet->Param.ChannelList = mac.channels;
+		break;
+	case MIB_RX2_CHANNEL:
+		mibGet->Param.Rx2Channel = mac.rx2;
+		break;
+	case MIB_CHANNELS_MASK:
+		mibGet->Param.ChannelsMask = mac.mask;
+		break;
+	case MIB_RECEIVE_DELAY_1:
+		mibGet->Param.ReceiveDelay1 = mac.rx1_delay;
+		break;
+	case MIB_RECEIVE_DELAY_2:
+		mibGet->Param.ReceiveDelay2 = mac.rx2_delay;
+		break;
+	case MIB_CHANNELS_DATARATE:
+		mibGet->Param.ChannelsDatarate = mac.datarate;
+		break;
+	case MIB_UPLINK_COUNTER:
+		mibGet->Param.UpLinkCounter = mac.fcnt_up;
+		break;
+	case MIB_DOWNLINK_COUNTER:
+		mibGet->Param.DownLinkCounter = mac.fcnt_down;
+		break;
+	default:
+		return LORAMAC_STATUS_SERVICE_UNKNOWN;
+	}
+	return LORAMAC_STATUS_OK;
+}
+
+inline LoRaMacStatus_t LoRaMacMibSetRequestConfirm(MibRequestConfirm_t *mibSet)
+{
+	s_mock_mac &mac = mock_mac();
+	switch (mibSet->Type)
+	{
+	case MIB_DEV_ADDR:
+		mac.dev_addr = mibSet->Param.DevAddr;
+		break;
+	case MIB_RX2_CHANNEL:
+		mac.rx2 = mibSet->Param.Rx2Channel;
+		break;
+	case MIB_CHANNELS_MASK:
+		memcpy(mac.mask, mibSet->Param.ChannelsMask, (mock_mac_fixed_plan(mac.region) ? MOCK_MAC_MASK_WORDS : 1) * sizeof(uint16_t));
+		break;
+	case MIB_RECEIVE_DELAY_1:
+		mac.rx1_delay = mibSet->Param.ReceiveDelay1;
+		break;
+	case MIB_RECEIVE_DELAY_2:
+		mac.rx2_delay = mibSet->Param.ReceiveDelay2;
+		break;
+	case MIB_CHANNELS_DATARATE:
+		mac.datarate = mibSet->Param.ChannelsDatarate;
+		break;
+	case MIB_UPLINK_COUNTER:
+		mac.fcnt_up = mibSet->Param.UpLinkCounter;
+		break;
+	case MIB_DOWNLINK_COUNTER:
+		mac.fcnt_down = mibSet->Param.DownLinkCounter;
+		break;
+	default:
+		return LORAMAC_STATUS_SERVICE_UNKNOWN;
+	}
+	return LORAMAC_STATUS_OK;
+}
+
+// Only the channels after the default ones can be set, like in the dynamic channel plans
+inline LoRaMacStatus_t LoRaMacChannelAdd(uint8_t id, ChannelParams_t params)
+{
+	s_mock_mac &mac = mock_mac();
+	if (mock_mac_fixed_plan(mac.region) || (id < 3) || (id >= 16))
+	{
+		return LORAMAC_STATUS_PARAMETER_INVALID;
+	}
+	mac.channels[id] = params;
+	return LORAMAC_STATUS_OK;
+}
+
+inline LoRaMacStatus_t LoRaMacMlmeRequest(MlmeReq_t *mlmeRequest)
+{
+	if (mlmeRequest->Type == MLME_LINK_CHECK)
+	{
+		mock_mac().link_checks++;
+	}
+	return LORAMAC_STATUS_OK;
+}
+
+#endif
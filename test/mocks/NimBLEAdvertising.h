@@ -0,0 +1,2 @@
+// Part of the NimBLE mock, see NimBLEDevice.h
+#include "NimBLEDevice.h"
@@ -0,0 +1,25 @@
+/**
+ * @file NimBLEDevice.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the NimBLE library, pio test -e native
+ * Only the characteristic behind BLE_PRINTF, BLE is never connected on the host
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_NIMBLE_DEVICE_H__
+#define __MOCK_NIMBLE_DEVICE_H__
+
+#include "Arduino.h"
+
+class NimBLECharacteristic
+{
+public:
+	void setValue(const uint8_t *data, size_t length) {}
+	void notify(bool is_notification = true) {}
+};
+typedef NimBLECharacteristic BLECharacteristic;
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * @file Preferences.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 preferences in RAM, pio test -e native
+ * All instances share the same store, like the NVS partition. mock_prefs_clear() erases it
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_PREFERENCES_H__
+#define __MOCK_PREFERENCES_H__
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+typedef std::map<std::string, std::vector<uint8_t>> mock_prefs_ns;
+
+struct s_mock_prefs
+{
+	std::mutex mutex;
+	std::map<std::string, mock_prefs_ns> store;
+};
+
+inline s_mock_prefs &mock_prefs(void)
+{
+	static s_mock_prefs prefs;
+	return prefs;
+}
+
+// Erase all name spaces, like a new NVS partition
+inline void mock_prefs_clear(void)
+{
+	std::lock_guard<std::mutex> lock(mock_prefs().mutex);
+	mock_prefs().store.clear();
+}
+
+class Preferences
+{
+public:
+	bool begin(const char *name, bool read_only = false)
+	{
+		_name = name;
+		_read_only = read_only;
+		_open = true;
+		return true;
+	}
+	void end(void) { _open = false; }
+	bool clear(void)
+	{
+		if (!writable())
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mock_prefs().mutex);
+		mock_prefs().store[_name].clear();
+		return true;
+	}
+	bool remove(const char *key)
+	{
+		if (!writable())
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mock_prefs().mutex);
+		return mock_prefs().store[_name].erase(key) != 0;
+	}
+	bool isKey(const char *key)
+	{
+		std::vector<uint8_t> data;
+		return get(key, &data);
+	}
+
+	size_t putBool(const char *key, bool value) { return put(key, &value, sizeof(value)); }
+	size_t putUChar(const char *key, uint8_t value) { return put(key, &value, sizeof(value)); }
+	size_t putShort(const char *key, int16_t value) { return put(key, &value, sizeof(value)); }
+	size_t putUShort(const char *key, uint16_t value) { return put(key, &value, sizeof(value)); }
+	size_t putLong(const char *key, int32_t value) { return put(key, &value, sizeof(value)); }
+	size_t putULong(const char *key, uint32_t value) { return put(key, &value, sizeof(value)); }
+	size_t putFloat(const char *key, float value) { return put(key, &value, sizeof(value)); }
+	size_t putString(const char *key, const char *value) { return put(key, value, strlen(value) + 1); }
+	size_t putString(const char *key, const String &value) { return putString(key, value.c_str()); }
+	size_t putBytes(const char *key, const void *value, size_t len) { return put(key, value, len); }
+
+	bool getBool(const char *key, bool default_value = false) { return get_value(key, default_value); }
+	uint8_t getUChar(const char *key, uint8_t default_value = 0) { return get_value(key, default_value); }
+	int16_t getShort(const char *key, int16_t default_value = 0) { return get_value(key, default_value); }
+	uint16_t getUShort(const char *key, uint16_t default_value = 0) { return get_value(key, default_value); }
+	int32_t getLong(const char *key, int32_t default_value = 0) { return get_value(key, default_value); }
+	uint32_t getULong(const char *key, uint32_t default_value = 0) { return get_value(key, default_value); }
+	float getFloat(const char *key, float default_value = NAN) { return get_value(key, default_value); }
+	String getString(const char *key, String default_value = String())
+	{
+		std::vector<uint8_t> data;
+		if (!get(key, &data) || data.empty())
+		{
+			return default_value;
+		}
+		return String((const char *)data.data());
+	}
+	// Length with the terminating 0, 0 if the key is missing or the value does not fit
+	size_t getString(const char *key, char *value, size_t max_len)
+	{
+		std::vector<uint8_t> data;
+		if (!get(key, &data) || data.empty() || (data.size() > max_len))
+		{
+			return 0;
+		}
+		memcpy(value, data.data(), data.size());
+		return data.size();
+	}
+	size_t getBytesLength(const char *key)
+	{
+		std::vector<uint8_t> data;
+		return get(key, &data) ? data.size() : 0;
+	}
+	size_t getBytes(const char *key, void *buffer, size_t max_len)
+	{
+		std::vector<uint8_t> data;
+		if (!get(key, &data) || (data.size() > max_len))
+		{
+			return 0;
+		}
+		memcpy(buffer, data.data(), data.size());
+		return data.size();
+	}
+
+private:
+	bool writable(void) { return _open && !_read_only; }
+
+	size_t put(const char *key, const void *value, size_t len)
+	{
+		if (!writable())
+		{
+			return 0;
+		}
+		std::lock_guard<std::mutex> lock(mock_prefs().mutex);
+		mock_prefs().store[_name][key] = std::vector<uint8_t>((const uint8_t *)value, (const uint8_t *)value + len);
+		return len;
+	}
+
+	bool get(const char *key, std::vector<uint8_t> *data)
+	{
+		if (!_open)
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mock_prefs().mutex);
+		mock_prefs_ns &ns = mock_prefs().store[_name];
+		mock_prefs_ns::iterator entry = ns.find(key);
+		if (entry == ns.end())
+		{
+			return false;
+		}
+		*data = entry->second;
+		return true;
+	}
+
+	template <typename T>
+	T get_value(const char *key, T default_value)
+	{
+		std::vector<uint8_t> data;
+		if (!get(key, &data) || (data.size() != sizeof(T)))
+		{
+			return default_value;
+		}
+		T value;
+		memcpy(&value, data.data(), sizeof(T));
+		return value;
+	}
+
+	std::string _name;
+	bool _read_only = false;
+	bool _open = false;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file SPIFFS.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the SPIFFS file system in RAM, pio test -e native
+ * The files survive a new init of the module under test, mock_spiffs_clear() formats it
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_SPIFFS_H__
+#define __MOCK_SPIFFS_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+typedef std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> mock_spiffs_files;
+
+inline mock_spiffs_files &mock_spiffs(void)
+{
+	static mock_spiffs_files files;
+	return files;
+}
+
+// Erase all files, like a new partition
+inline void mock_spiffs_clear(void)
+{
+	mock_spiffs().clear();
+}
+
+class File
+{
+public:
+	File() {}
+	File(std::shared_ptr<std::vector<uint8_t>> data, bool append) : _data(data), _pos(append ? data->size() : 0) {}
+
+	operator bool(void) const { return _data != nullptr; }
+	size_t size(void) const { return _data != nullptr ? _data->size() : 0; }
+	size_t position(void) const { return _pos; }
+	bool seek(uint32_t pos)
+	{
+		if ((_data == nullptr) || (pos > _data->size()))
+		{
+			return false;
+		}
+		_pos = pos;
+		return true;
+	}
+	size_t read(uint8_t *buffer, size_t size)
+	{
+		if (_data == nullptr)
+		{
+			return 0;
+		}
+		size = min(size, _data->size() - _pos);
+		memcpy(buffer, _data->data() + _pos, size);
+		_pos += size;
+		return size;
+	}
+	size_t write(const uint8_t *buffer, size_t size)
+	{
+		if (_data == nullptr)
+		{
+			return 0;
+		}
+		if (_pos + size > _data->size())
+		{
+			_data->resize(_pos + size);
+		}
+		memcpy(_data->data() + _pos, buffer, size);
+		_pos += size;
+		return size;
+	}
+	void flush(void) {}
+	void close(void) { _data = nullptr; }
+
+private:
+	std::shared_ptr<std::vector<uint8_t>> _data;
+	size_t _pos = 0;
+};
+
+class SPIFFSFS
+{
+public:
+	bool begin(bool formatOnFail = false) { return true; }
+	bool exists(const char *path) { return mock_spiffs().count(path) != 0; }
+	bool remove(const char *path) { return mock_spiffs().erase(path) != 0; }
+	File open(const char *path, const char *mode = "r")
+	{
+		mock_spiffs_files::iterator entry = mock_spiffs().find(path);
+		if (mode[0] == 'r')
+		{
+			if (entry == mock_spiffs().end())
+			{
+				return File();
+			}
+			return File(entry->second, false);
+		}
+		if ((mode[0] == 'w') || (entry == mock_spiffs().end()))
+		{
+			mock_spiffs()[path] = std::make_shared<std::vector<uint8_t>>();
+		}
+		return File(mock_spiffs()[path], mode[0] == 'a');
+	}
+};
+static SPIFFSFS SPIFFS __attribute__((unused));
+
+#endif
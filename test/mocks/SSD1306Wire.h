@@ -0,0 +1,23 @@
+/**
+ * @file SSD1306Wire.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the OLED driver, pio test -e native
+ * The display code is not tested, only the declarations in main.h need it
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_SSD1306_WIRE_H__
+#define __MOCK_SSD1306_WIRE_H__
+
+#include "Arduino.h"
+
+class SSD1306Wire
+{
+public:
+	SSD1306Wire(uint8_t address, int sda, int scl) {}
+};
+
+#endif
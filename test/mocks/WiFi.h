@@ -0,0 +1,34 @@
+/**
+ * @file WiFi.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 WiFi library, pio test -e native
+ * The network is the one of the PC, a test can take the WiFi down with mock_wifi_connected()
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_WIFI_H__
+#define __MOCK_WIFI_H__
+
+#include "Arduino.h"
+#include "WiFiUdp.h"
+
+// Connection state of the WiFi
+inline bool &mock_wifi_connected(void)
+{
+	static bool connected = true;
+	return connected;
+}
+
+class WiFiClass
+{
+public:
+	bool isConnected(void) { return mock_wifi_connected(); }
+	IPAddress localIP(void) { return mock_wifi_connected() ? IPAddress(127, 0, 0, 1) : IPAddress(); }
+	IPAddress gatewayIP(void) { return IPAddress(); }
+};
+static WiFiClass WiFi __attribute__((unused));
+
+#endif
@@ -0,0 +1,53 @@
+/**
+ * @file WiFiClient.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 TCP client, pio test -e native
+ * Only the connection state and the received response, the requests go to the server of HTTPClient.h
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_WIFI_CLIENT_H__
+#define __MOCK_WIFI_CLIENT_H__
+
+#include <string>
+#include "Arduino.h"
+
+class WiFiClient : public Client
+{
+public:
+	int connect(IPAddress ip, uint16_t port) { return 0; }
+	int connect(const char *host, uint16_t port) { return 0; }
+	// No TCP on the host, a probe finds nothing
+	int connect(IPAddress ip, uint16_t port, int32_t timeout_ms) { return 0; }
+	size_t write(uint8_t c) { return 0; }
+	int available(void) { return (int)(rx.length() - rx_pos); }
+	int read(void) { return rx_pos < rx.length() ? (uint8_t)rx[rx_pos++] : -1; }
+	int read(uint8_t *buffer, size_t size)
+	{
+		size = min(size, rx.length() - rx_pos);
+		memcpy(buffer, rx.data() + rx_pos, size);
+		rx_pos += size;
+		return (int)size;
+	}
+	int peek(void) { return rx_pos < rx.length() ? (uint8_t)rx[rx_pos] : -1; }
+	void stop(void)
+	{
+		open = false;
+		rx.clear();
+		rx_pos = 0;
+	}
+	uint8_t connected(void) { return open; }
+	operator bool(void) { return open; }
+	using Print::write;
+
+	// Socket state, set by the HTTP client stand-in
+	bool open = false;
+	uint32_t last_used = 0;
+	std::string rx;
+	size_t rx_pos = 0;
+};
+
+#endif
@@ -0,0 +1,23 @@
+/**
+ * @file WiFiMulti.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 WiFiMulti class, pio test -e native
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_WIFI_MULTI_H__
+#define __MOCK_WIFI_MULTI_H__
+
+#include "WiFi.h"
+
+class WiFiMulti
+{
+public:
+	bool addAP(const char *ssid, const char *passphrase = NULL) { return true; }
+	uint8_t run(uint32_t connectTimeout = 5000) { return mock_wifi_connected() ? 3 : 6; }
+};
+
+#endif
@@ -0,0 +1,143 @@
+/**
+ * @file WiFiUdp.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP32 WiFiUDP class on a socket of the PC, pio test -e native
+ * A fake device in the test answers on the loopback interface
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_WIFI_UDP_H__
+#define __MOCK_WIFI_UDP_H__
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Arduino.h"
+
+class WiFiUDP
+{
+public:
+	~WiFiUDP() { stop(); }
+
+	uint8_t begin(uint16_t port)
+	{
+		stop();
+		_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		int on = 1;
+		setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in address = make_address(IPAddress(), port);
+		if (bind(_socket, (sockaddr *)&address, sizeof(address)) != 0)
+		{
+			stop();
+			return 0;
+		}
+		return 1;
+	}
+
+	// The group is joined if the PC allows it, the tests send to the port on loopback
+	uint8_t beginMulticast(IPAddress group, uint16_t port)
+	{
+		if (begin(port) == 0)
+		{
+			return 0;
+		}
+		ip_mreq request;
+		request.imr_multiaddr.s_addr = (uint32_t)group;
+		request.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+		setsockopt(_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request));
+		return 1;
+	}
+
+	void stop(void)
+	{
+		if (_socket >= 0)
+		{
+			close(_socket);
+			_socket = -1;
+		}
+		_rx_len = 0;
+		_rx_pos = 0;
+	}
+
+	int beginPacket(IPAddress ip, uint16_t port)
+	{
+		_tx_address = make_address(ip, port);
+		_tx_len = 0;
+		return _socket >= 0 ? 1 : 0;
+	}
+
+	size_t write(const uint8_t *buffer, size_t size)
+	{
+		size = min(size, sizeof(_tx_buffer) - _tx_len);
+		memcpy(&_tx_buffer[_tx_len], buffer, size);
+		_tx_len += size;
+		return size;
+	}
+
+	int endPacket(void)
+	{
+		if (_socket < 0)
+		{
+			return 0;
+		}
+		return sendto(_socket, _tx_buffer, _tx_len, 0, (sockaddr *)&_tx_address, sizeof(_tx_address)) == (ssize_t)_tx_len ? 1 : 0;
+	}
+
+	int parsePacket(void)
+	{
+		_rx_len = 0;
+		_rx_pos = 0;
+		if (_socket < 0)
+		{
+			return 0;
+		}
+		socklen_t address_len = sizeof(_rx_address);
+		ssize_t len = recvfrom(_socket, _rx_buffer, sizeof(_rx_buffer), MSG_DONTWAIT, (sockaddr *)&_rx_address, &address_len);
+		_rx_len = len > 0 ? len : 0;
+		return (int)_rx_len;
+	}
+
+	int available(void) { return (int)(_rx_len - _rx_pos); }
+
+	int read(uint8_t *buffer, size_t size)
+	{
+		size = min(size, _rx_len - _rx_pos);
+		memcpy(buffer, &_rx_buffer[_rx_pos], size);
+		_rx_pos += size;
+		return (int)size;
+	}
+
+	int read(char *buffer, size_t size) { return read((uint8_t *)buffer, size); }
+
+	void flush(void) { _rx_pos = _rx_len; }
+
+	IPAddress remoteIP(void) { return IPAddress((uint32_t)_rx_address.sin_addr.s_addr); }
+	uint16_t remotePort(void) { return ntohs(_rx_address.sin_port); }
+
+private:
+	static sockaddr_in make_address(IPAddress ip, uint16_t port)
+	{
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		// IPAddress keeps the first byte in the lowest byte, same as the network order in memory
+		address.sin_addr.s_addr = (uint32_t)ip;
+		address.sin_port = htons(port);
+		return address;
+	}
+
+	int _socket = -1;
+	sockaddr_in _tx_address;
+	uint8_t _tx_buffer[1500];
+	size_t _tx_len = 0;
+	sockaddr_in _rx_address;
+	uint8_t _rx_buffer[1500];
+	size_t _rx_len = 0;
+	size_t _rx_pos = 0;
+};
+
+#endif
@@ -0,0 +1,29 @@
+/**
+ * @file esp_system.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the ESP-IDF system functions, pio test -e native
+ * esp_restart() does not restart, the tests check mock_restarts() instead
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_ESP_SYSTEM_H__
+#define __MOCK_ESP_SYSTEM_H__
+
+#include "Arduino.h"
+
+// Calls of esp_restart()
+inline uint32_t &mock_restarts(void)
+{
+	static uint32_t restarts = 0;
+	return restarts;
+}
+
+inline void esp_restart(void)
+{
+	mock_restarts()++;
+}
+
+#endif
@@ -0,0 +1,2 @@
+// Part of the ESP-IDF mock, see esp_system.h
+#include "esp_system.h"
@@ -0,0 +1,159 @@
+/**
+ * @file fake_sma.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Stand-in of the /dyn web API of an SMA inverter for the SMAReader tests, pio test -e native
+ * One session at a time like a full inverter, requests with another sid get {"err":401}.
+ * The requests of every script are counted, the tests check the round trips of a poll
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __FAKE_SMA_H__
+#define __FAKE_SMA_H__
+
+#include <map>
+#include <string>
+#include <HTTPClient.h>
+
+// Device key of the values, "<SUSy id>-<serial>"
+#define FAKE_SMA_DEVICE "0199-B32A7F55"
+
+// Energy counter at the start of the log
+#define FAKE_SMA_ENERGY 1000000
+
+class FakeSMA : public MockHttpServer
+{
+public:
+	int handle(const String &url, const String &body, String *response)
+	{
+		std::string path = url.c_str();
+		size_t pos = path.find("/dyn/");
+		std::string script = pos == std::string::npos ? path : path.substr(pos + 5);
+		std::string request_sid;
+		pos = script.find("?sid=");
+		if (pos != std::string::npos)
+		{
+			request_sid = script.substr(pos + 5);
+			script = script.substr(0, pos);
+		}
+		scripts[script]++;
+
+		if (script == "login.json")
+		{
+			std::string pass = "\"pass\":\"" + std::string(passwd) + "\"";
+			if (strstr(body.c_str(), pass.c_str()) == NULL)
+			{
+				*response = "{\"result\":{\"sid\":null}}";
+				return HTTP_CODE_OK;
+			}
+			sid = "sid" + std::to_string(next_sid++);
+			*response = String(("{\"result\":{\"sid\":\"" + sid + "\"}}").c_str());
+			return HTTP_CODE_OK;
+		}
+		if (sid.empty() || (request_sid != sid))
+		{
+			*response = "{\"err\":401}";
+			return status_401 ? HTTP_CODE_UNAUTHORIZED : HTTP_CODE_OK;
+		}
+		if (script == "logout.json")
+		{
+			sid.clear();
+			*response = "{\"result\":{\"isLogin\":false}}";
+		}
+		else if (script == "getValues.json")
+		{
+			*response = String(values_response(body.c_str()).c_str());
+		}
+		else if (script == "getLogger.json")
+		{
+			*response = String(log_response(body.c_str()).c_str());
+		}
+		else if (script == "getAllOnlValues.json")
+		{
+			*response = String(all_values.c_str());
+		}
+		else
+		{
+			return 404;
+		}
+		return HTTP_CODE_OK;
+	}
+
+	// Drop the session, like the inverter after its session timeout
+	void expire(void) { sid.clear(); }
+
+	// Requests of a script, e.g. "login.json"
+	uint32_t count(const char *script) { return scripts[script]; }
+
+	// Value of a key, the key index + 1 if not set
+	std::map<std::string, int> values;
+	const char *passwd = "secret";
+	// Answer requests with an unknown sid with HTTP 401 instead of {"err":401}
+	bool status_401 = false;
+	// Log entries start at this time, there are none before it
+	uint32_t log_start = 0;
+	// Response of getAllOnlValues.json
+	std::string all_values;
+
+private:
+	std::string sid;
+	uint32_t next_sid = 1;
+	std::map<std::string, uint32_t> scripts;
+
+	// {"result":{"<device>":{"<key>":{"1":[{"val":...}]}}}} for all keys of the request
+	std::string values_response(const char *request)
+	{
+		std::string response = "{\"result\":{\"" FAKE_SMA_DEVICE "\":{";
+		const char *keys = strstr(request, "\"keys\":[");
+		const char *end = keys != NULL ? strchr(keys, ']') : NULL;
+		int idx = 0;
+		for (const char *key = keys != NULL ? strchr(keys + 8, '"') : NULL; (key != NULL) && (key < end); key = strchr(key, '"'))
+		{
+			const char *key_end = strchr(key + 1, '"');
+			std::string name(key + 1, key_end - key - 1);
+			std::map<std::string, int>::iterator value = values.find(name);
+			if (idx > 0)
+			{
+				response += ",";
+			}
+			response += "\"" + name + "\":{\"1\":[{\"val\":" + std::to_string(value != values.end() ? value->second : idx + 1) + "}]}";
+			key = key_end + 1;
+			idx++;
+		}
+		return response + "}}}";
+	}
+
+	// {"result":{"<device>":[{"t":...,"v":...},...]}}, one entry every 5 minutes
+	std::string log_response(const char *request)
+	{
+		unsigned long start = 0;
+		unsigned long end = 0;
+		const char *t_start = strstr(request, "\"tStart\":");
+		const char *t_end = strstr(request, "\"tEnd\":");
+		if (t_start != NULL)
+		{
+			start = strtoul(t_start + 9, NULL, 10);
+		}
+		if (t_end != NULL)
+		{
+			end = strtoul(t_end + 7, NULL, 10);
+		}
+		start = std::max(start, (unsigned long)log_start);
+		std::string response = "{\"result\":{\"" FAKE_SMA_DEVICE "\":[";
+		bool first = true;
+		for (unsigned long t = (start + 299) / 300 * 300; t <= end; t += 300)
+		{
+			if (!first)
+			{
+				response += ",";
+			}
+			response += "{\"t\":" + std::to_string(t) + ",\"v\":" + std::to_string(FAKE_SMA_ENERGY + (t - log_start) / 300 * 10) + "}";
+			first = false;
+		}
+		return response + "]}}";
+	}
+};
+
+#endif
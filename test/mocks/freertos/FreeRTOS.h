@@ -0,0 +1,445 @@
+/**
+ * @file FreeRTOS.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of FreeRTOS for the tests, pio test -e native
+ * Tasks are threads, one tick is 1 ms. With a frozen clock a wait that would time out
+ * moves the clock on instead, so the tests of single threaded code do not wait
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_FREERTOS_H__
+#define __MOCK_FREERTOS_H__
+
+#include <pthread.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "Arduino.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define errQUEUE_FULL 0
+#define portMAX_DELAY 0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// Critical section stuff
+struct portMUX_TYPE
+{
+	std::recursive_mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED \
+	{                                \
+	}
+#define portENTER_CRITICAL(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL(mux) (mux)->mutex.unlock()
+#define portENTER_CRITICAL_ISR(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL_ISR(mux) (mux)->mutex.unlock()
+
+/**
+ * @brief Wait on a condition with a timeout in ticks
+ * With a frozen clock nobody else moves the clock, a wait that is not satisfied
+ * right away moves it by the timeout and gives up
+ *
+ * @return true if the condition is met
+ */
+template <typename Predicate>
+bool mock_wait(std::unique_lock<std::mutex> &lock, std::condition_variable &cv, TickType_t ticks, Predicate ready)
+{
+	if (ready())
+	{
+		return true;
+	}
+	if (ticks == portMAX_DELAY)
+	{
+		cv.wait(lock, ready);
+		return true;
+	}
+	if (mock_clock().frozen)
+	{
+		mock_advance(ticks);
+		return ready();
+	}
+	return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+// Task stuff
+struct mock_task
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	uint32_t notify_value = 0;
+	bool notified = false;
+};
+typedef mock_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+enum eNotifyAction
+{
+	eNoAction = 0,
+	eSetBits,
+	eIncrement,
+	eSetValueWithOverwrite,
+	eSetValueWithoutOverwrite
+};
+
+inline mock_task *&mock_current_task(void)
+{
+	static thread_local mock_task *task = NULL;
+	return task;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	mock_task *&task = mock_current_task();
+	if (task == NULL)
+	{
+		// The test itself, the handle lives as long as the thread
+		task = new mock_task();
+	}
+	return task;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack, void *param, UBaseType_t priority, TaskHandle_t *handle)
+{
+	mock_task *task = new mock_task();
+	if (handle != NULL)
+	{
+		*handle = task;
+	}
+	std::thread([code, param, task]()
+				{
+					mock_current_task() = task;
+					code(param);
+				})
+		.detach();
+	return pdPASS;
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stack, void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+	return xTaskCreate(code, name, stack, param, priority, handle);
+}
+
+// Only a task can delete itself
+inline void vTaskDelete(TaskHandle_t task)
+{
+	if ((task == NULL) || (task == mock_current_task()))
+	{
+		pthread_exit(NULL);
+	}
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+	delay(ticks);
+}
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+	return 1024;
+}
+
+inline BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+	std::lock_guard<std::mutex> lock(task->mutex);
+	switch (action)
+	{
+	case eSetBits:
+		task->notify_value |= value;
+		break;
+	case eIncrement:
+		task->notify_value++;
+		break;
+	case eSetValueWithOverwrite:
+		task->notify_value = value;
+		break;
+	case eSetValueWithoutOverwrite:
+		if (task->notified)
+		{
+			return pdFAIL;
+		}
+		task->notify_value = value;
+		break;
+	default:
+		break;
+	}
+	task->notified = true;
+	task->cv.notify_all();
+	return pdPASS;
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	return xTaskNotify(task, 0, eIncrement);
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+	mock_task *task = xTaskGetCurrentTaskHandle();
+	std::unique_lock<std::mutex> lock(task->mutex);
+	mock_wait(lock, task->cv, ticks, [task]()
+			  { return task->notify_value != 0; });
+	uint32_t value = task->notify_value;
+	if (value != 0)
+	{
+		task->notify_value = clear_on_exit ? 0 : value - 1;
+	}
+	task->notified = false;
+	return value;
+}
+
+inline BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks)
+{
+	mock_task *task = xTaskGetCurrentTaskHandle();
+	std::unique_lock<std::mutex> lock(task->mutex);
+	if (!task->notified)
+	{
+		task->notify_value &= ~clear_on_entry;
+	}
+	bool received = mock_wait(lock, task->cv, ticks, [task]()
+							  { return task->notified; });
+	if (value != NULL)
+	{
+		*value = task->notify_value;
+	}
+	if (received)
+	{
+		task->notify_value &= ~clear_on_exit;
+		task->notified = false;
+	}
+	return received ? pdTRUE : pdFALSE;
+}
+
+// Semaphore stuff
+struct mock_semaphore
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	UBaseType_t count = 0;
+	UBaseType_t max_count = 1;
+};
+typedef mock_semaphore *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+	mock_semaphore *sem = new mock_semaphore();
+	sem->max_count = max_count;
+	sem->count = initial_count;
+	return sem;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return xSemaphoreCreateCounting(1, 0);
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return xSemaphoreCreateCounting(1, 1);
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	std::unique_lock<std::mutex> lock(sem->mutex);
+	if (!mock_wait(lock, sem->cv, ticks, [sem]()
+				   { return sem->count != 0; }))
+	{
+		return pdFALSE;
+	}
+	sem->count--;
+	return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	std::lock_guard<std::mutex> lock(sem->mutex);
+	if (sem->count >= sem->max_count)
+	{
+		return pdFALSE;
+	}
+	sem->count++;
+	sem->cv.notify_all();
+	return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+	return xSemaphoreGive(sem);
+}
+
+inline UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem)
+{
+	std::lock_guard<std::mutex> lock(sem->mutex);
+	return sem->count;
+}
+
+// Event group stuff
+struct mock_event_group
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	EventBits_t bits = 0;
+};
+typedef mock_event_group *EventGroupHandle_t;
+
+inline EventGroupHandle_t xEventGroupCreate(void)
+{
+	return new mock_event_group();
+}
+
+inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	std::lock_guard<std::mutex> lock(group->mutex);
+	group->bits |= bits;
+	group->cv.notify_all();
+	return group->bits;
+}
+
+inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	std::lock_guard<std::mutex> lock(group->mutex);
+	EventBits_t old_bits = group->bits;
+	group->bits &= ~bits;
+	return old_bits;
+}
+
+inline EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	std::lock_guard<std::mutex> lock(group->mutex);
+	return group->bits;
+}
+
+inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit, BaseType_t wait_for_all, TickType_t ticks)
+{
+	std::unique_lock<std::mutex> lock(group->mutex);
+	bool met = mock_wait(lock, group->cv, ticks, [group, bits, wait_for_all]()
+						 { return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0; });
+	EventBits_t result = group->bits;
+	if (met && clear_on_exit)
+	{
+		group->bits &= ~bits;
+	}
+	return result;
+}
+
+// Queue stuff
+struct mock_queue
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::vector<uint8_t>> items;
+	UBaseType_t length = 0;
+	UBaseType_t item_size = 0;
+};
+typedef mock_queue *QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	mock_queue *queue = new mock_queue();
+	queue->length = length;
+	queue->item_size = item_size;
+	return queue;
+}
+
+inline void vQueueDelete(QueueHandle_t queue)
+{
+	delete queue;
+}
+
+inline BaseType_t mock_queue_send(QueueHandle_t queue, const void *item, TickType_t ticks, bool front)
+{
+	std::unique_lock<std::mutex> lock(queue->mutex);
+	if (!mock_wait(lock, queue->cv, ticks, [queue]()
+				   { return queue->items.size() < queue->length; }))
+	{
+		return errQUEUE_FULL;
+	}
+	std::vector<uint8_t> data((const uint8_t *)item, (const uint8_t *)item + queue->item_size);
+	if (front)
+	{
+		queue->items.push_front(data);
+	}
+	else
+	{
+		queue->items.push_back(data);
+	}
+	queue->cv.notify_all();
+	return pdPASS;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+	return mock_queue_send(queue, item, ticks, false);
+}
+
+inline BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+	return mock_queue_send(queue, item, ticks, false);
+}
+
+inline BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+	return mock_queue_send(queue, item, ticks, true);
+}
+
+inline BaseType_t mock_queue_take(QueueHandle_t queue, void *item, TickType_t ticks, bool remove)
+{
+	std::unique_lock<std::mutex> lock(queue->mutex);
+	if (!mock_wait(lock, queue->cv, ticks, [queue]()
+				   { return !queue->items.empty(); }))
+	{
+		return pdFALSE;
+	}
+	memcpy(item, queue->items.front().data(), queue->item_size);
+	if (remove)
+	{
+		queue->items.pop_front();
+		queue->cv.notify_all();
+	}
+	return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+	return mock_queue_take(queue, item, ticks, true);
+}
+
+inline BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+	return mock_queue_take(queue, item, ticks, false);
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	return (UBaseType_t)queue->items.size();
+}
+
+inline UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	return queue->length - (UBaseType_t)queue->items.size();
+}
+
+inline BaseType_t xQueueReset(QueueHandle_t queue)
+{
+	std::lock_guard<std::mutex> lock(queue->mutex);
+	queue->items.clear();
+	queue->cv.notify_all();
+	return pdPASS;
+}
+
+#endif
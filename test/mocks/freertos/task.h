@@ -0,0 +1,2 @@
+// Part of the FreeRTOS mock, see FreeRTOS.h
+#include "FreeRTOS.h"
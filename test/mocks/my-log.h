@@ -0,0 +1,26 @@
+/**
+ * @file my-log.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host stand-in of the log library, the tests are quiet unless MOCK_LOG is defined
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __MOCK_MY_LOG_H__
+#define __MOCK_MY_LOG_H__
+
+#include <stdio.h>
+
+#ifdef MOCK_LOG
+#define myLog_e(...) (printf(__VA_ARGS__), printf("\n"))
+#define myLog_d(...) (printf(__VA_ARGS__), printf("\n"))
+#define myLog_v(...) (printf(__VA_ARGS__), printf("\n"))
+#else
+#define myLog_e(...) ((void)0)
+#define myLog_d(...) ((void)0)
+#define myLog_v(...) ((void)0)
+#endif
+
+#endif
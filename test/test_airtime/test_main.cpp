@@ -0,0 +1,65 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the time on air, pio test -e native
+ * The expected values are from the Semtech LoRa calculator
+ * @version 0.1
+ * @date 2021-10-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include "airtime.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void test_lora_uplinks(void)
+{
+	// 10 bytes application payload, 23 bytes PHY payload
+	TEST_ASSERT_EQUAL_UINT32(61696, uplink_time_on_air(7, 125, 10));
+	TEST_ASSERT_EQUAL_UINT32(30848, uplink_time_on_air(7, 250, 10));
+	// Low data rate optimization is on for SF12
+	TEST_ASSERT_EQUAL_UINT32(1482752, uplink_time_on_air(12, 125, 10));
+	TEST_ASSERT_EQUAL_UINT32(2793472, uplink_time_on_air(12, 125, 51));
+}
+
+static void test_lora_packets(void)
+{
+	// Header and CRC change the symbols
+	TEST_ASSERT_EQUAL_UINT32(uplink_time_on_air(7, 125, 10), lora_time_on_air(7, 125, 23, LORAWAN_CR, LORAWAN_PREAMBLE, true, false));
+	TEST_ASSERT_TRUE(lora_time_on_air(7, 125, 23, LORAWAN_CR, LORAWAN_PREAMBLE, false, true) <
+					 lora_time_on_air(7, 125, 23, LORAWAN_CR, LORAWAN_PREAMBLE, true, false));
+	// Empty packet, preamble and 8 symbols, 1.024 ms per symbol
+	TEST_ASSERT_EQUAL_UINT32((8 + 8) * 1024 + 4352, lora_time_on_air(7, 125, 0, LORAWAN_CR, LORAWAN_PREAMBLE, false, true));
+}
+
+static void test_fsk(void)
+{
+	// 23 bytes and 11 bytes overhead at 50 kbps
+	TEST_ASSERT_EQUAL_UINT32(5440, uplink_time_on_air(SF_FSK, 0, 10));
+	TEST_ASSERT_EQUAL_UINT32(fsk_time_on_air(23), uplink_time_on_air(SF_FSK, 0, 10));
+}
+
+static void test_max_size(void)
+{
+	// The PHY payload is limited to 255 bytes
+	TEST_ASSERT_EQUAL_UINT32(uplink_time_on_air(7, 125, 242), uplink_time_on_air(7, 125, 250));
+	TEST_ASSERT_EQUAL_UINT32(lora_time_on_air(7, 125, 255, LORAWAN_CR, LORAWAN_PREAMBLE, true, false), uplink_time_on_air(7, 125, 250));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_lora_uplinks);
+	RUN_TEST(test_lora_packets);
+	RUN_TEST(test_fsk);
+	RUN_TEST(test_max_size);
+	return UNITY_END();
+}
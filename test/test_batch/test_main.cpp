@@ -0,0 +1,518 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the batch encoder with a decoder like the one in the README, pio test -e native
+ * The packets are captured instead of queued and decoded again, every sample must come back
+ * unchanged and every packet must fit into the max payload of the region and DR.
+ * test_bytes_per_sample prints the table of the README
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <vector>
+// batch.cpp is not in the native build, its statics are checked here
+#include "../../src/batch.cpp"
+
+/** Globals and functions of the other modules that batch.cpp uses */
+s_lorawan_settings g_lorawan_settings;
+bool g_lorawan_initialized = false;
+static bool low_airtime = false;
+bool airtime_low(void)
+{
+	return low_airtime;
+}
+
+/** Captured packets */
+static std::vector<std::vector<uint8_t>> packets;
+
+lmh_error_status send_lora_packet(uint8_t *data, uint8_t size)
+{
+	// Checked here, the region or DR of a test may change after the packet
+	TEST_ASSERT_TRUE(size <= lora_max_payload());
+	packets.push_back(std::vector<uint8_t>(data, data + size));
+	return LMH_SUCCESS;
+}
+
+/** LoRaWAN header of an uplink, MHDR, FHDR without options, FPort and MIC */
+#define LORAWAN_HEADER 13
+
+/** Start of the samples, 2021-11-01 00:00 UTC */
+#define START_UTC 1635724800
+
+/** Poll interval of the samples in seconds */
+#define POLL_TIME 300
+
+/** Max samples per packet of AT+BATCH */
+#define BATCH_LIMIT 64
+
+/** Decoded sample, energy is the energy today for 0x20 and 0x21 and the total energy for 0x22 */
+struct s_decoded
+{
+	uint32_t time;
+	int power;
+	uint32_t energy;
+};
+
+static uint16_t get_16(const std::vector<uint8_t> &b, size_t idx)
+{
+	return (b[idx] << 8) | b[idx + 1];
+}
+
+static uint32_t get_32(const std::vector<uint8_t> &b, size_t idx)
+{
+	return ((uint32_t)get_16(b, idx) << 16) | get_16(b, idx + 2);
+}
+
+/**
+ * @brief Decode a packet, the same as decodeUplink() of the README
+ *
+ * @param b packet
+ * @param samples decoded samples are added
+ * @return true if the packet was decoded to its last byte
+ */
+static bool decode(const std::vector<uint8_t> &b, std::vector<s_decoded> &samples)
+{
+	if (b.empty())
+	{
+		return false;
+	}
+	if (b[0] == FRAME_SINGLE)
+	{
+		samples.push_back({0, get_16(b, 1), get_16(b, 3)});
+		return b.size() == 5;
+	}
+	// 0x21 has the power in the first sample and in each following one
+	bool with_power = b[0] == FRAME_BATCH;
+	if (!with_power && (b[0] != FRAME_LOG))
+	{
+		return false;
+	}
+	size_t idx = with_power ? 11 : 9;
+	if (b.size() < idx)
+	{
+		return false;
+	}
+	uint32_t time = get_32(b, 1);
+	int power = with_power ? get_16(b, 5) : 0;
+	uint32_t energy = get_32(b, with_power ? 7 : 5);
+	samples.push_back({time, power, energy});
+	size_t next_size = with_power ? 6 : 4;
+	while (idx + next_size <= b.size())
+	{
+		time += get_16(b, idx);
+		if (with_power)
+		{
+			power = get_16(b, idx + 2);
+		}
+		uint16_t delta = get_16(b, idx + next_size - 2);
+		idx += next_size;
+		if (delta == BATCH_ENERGY_ABS)
+		{
+			if (idx + 4 > b.size())
+			{
+				return false;
+			}
+			energy = get_32(b, idx);
+			idx += 4;
+		}
+		else
+		{
+			energy += delta;
+		}
+		samples.push_back({time, power, energy});
+	}
+	return idx == b.size();
+}
+
+/**
+ * @brief Decode all captured packets
+ *
+ * @return std::vector<s_decoded> the samples of all packets
+ */
+static std::vector<s_decoded> decode_all(void)
+{
+	std::vector<s_decoded> samples;
+	for (size_t idx = 0; idx < packets.size(); idx++)
+	{
+		TEST_ASSERT_TRUE(decode(packets[idx], samples));
+	}
+	return samples;
+}
+
+/**
+ * @brief Make a sample, poll_keys_t order
+ *
+ * @param sample the sample
+ * @param utc time of the sample
+ * @param power power in W
+ * @param energy energy today in Wh
+ */
+static void make_sample(s_sample *sample, uint32_t utc, int power, int energy)
+{
+	*sample = s_sample();
+	sample->utc = utc;
+	sample->values[0] = power;
+	sample->values[1] = energy;
+	for (uint8_t ch = 0; ch < CH_NUM; ch++)
+	{
+		sample->values[2 + ch] = 1000 * (ch + 1) + power % 100;
+	}
+	sample->valid = true;
+}
+
+/**
+ * @brief Add samples of a sunny day every POLL_TIME
+ *
+ * @param start time of the first sample
+ * @param count number of samples
+ * @param energy energy today at the first sample, updated
+ * @param expected the samples are added
+ */
+static void add_day(uint32_t start, uint16_t count, int *energy, std::vector<s_decoded> &expected)
+{
+	for (uint16_t idx = 0; idx < count; idx++)
+	{
+		uint32_t utc = start + idx * POLL_TIME;
+		if ((utc % 86400) == 0)
+		{
+			// New day, the inverter starts the energy today from 0
+			*energy = 0;
+		}
+		int power = (utc % 86400) / 20;
+		s_sample sample;
+		make_sample(&sample, utc, power, *energy);
+		batch_add(&sample);
+		expected.push_back({utc, power, (uint32_t)*energy});
+		*energy += power * POLL_TIME / 3600;
+	}
+}
+
+static void set_region(LoRaMacRegion_t region, uint8_t data_rate)
+{
+	g_lorawan_settings.lora_region = region;
+	g_lorawan_settings.data_rate = data_rate;
+}
+
+void setUp(void)
+{
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		g_jobs[idx] = s_job();
+	}
+	batch_job_id = -1;
+	batch_len = 0;
+	batch_count = 0;
+	g_batch_max = BATCH_LIMIT;
+	g_batch_format = FORMAT_BATCH;
+	g_batch_mask = 0;
+	g_lorawan_settings = s_lorawan_settings();
+	g_lorawan_initialized = false;
+	set_region(LORAMAC_REGION_EU868, 5);
+	low_airtime = false;
+	packets.clear();
+}
+
+void tearDown(void) {}
+
+static void test_single(void)
+{
+	g_batch_max = 1;
+	s_sample sample;
+	make_sample(&sample, START_UTC, 2310, 12345);
+	batch_add(&sample);
+	TEST_ASSERT_EQUAL(1, packets.size());
+	const uint8_t expected[] = {FRAME_SINGLE, 0x09, 0x06, 0x30, 0x39};
+	TEST_ASSERT_EQUAL(sizeof(expected), packets[0].size());
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, packets[0].data(), sizeof(expected));
+	// Nothing waits for the deadline
+	TEST_ASSERT_EQUAL(-1, batch_job_id);
+}
+
+/**
+ * @brief Two days of samples in all regions and DRs, the packets must decode to the samples
+ *
+ */
+static void test_round_trip(void)
+{
+	const struct
+	{
+		LoRaMacRegion_t region;
+		uint8_t dr_num;
+	} regions[] = {{LORAMAC_REGION_EU868, 8}, {LORAMAC_REGION_US915, 14}, {LORAMAC_REGION_AU915, 14}};
+	for (uint8_t reg = 0; reg < sizeof(regions) / sizeof(regions[0]); reg++)
+	{
+		for (uint8_t dr = 0; dr < regions[reg].dr_num; dr++)
+		{
+			setUp();
+			set_region(regions[reg].region, dr);
+			std::vector<s_decoded> expected;
+			int energy = 0;
+			add_day(START_UTC - 50 * POLL_TIME, 2 * 288, &energy, expected);
+			batch_flush();
+
+			std::vector<s_decoded> decoded = decode_all();
+			TEST_ASSERT_EQUAL(expected.size(), decoded.size());
+			for (size_t idx = 0; idx < expected.size(); idx++)
+			{
+				TEST_ASSERT_EQUAL_UINT32(expected[idx].time, decoded[idx].time);
+				TEST_ASSERT_EQUAL(expected[idx].power, decoded[idx].power);
+				TEST_ASSERT_EQUAL_UINT32(expected[idx].energy, decoded[idx].energy);
+			}
+		}
+	}
+}
+
+static void test_energy_marker(void)
+{
+	g_batch_max = 4;
+	s_sample sample;
+	uint32_t energies[] = {65000, 65100, 200000, 10};
+	for (uint8_t idx = 0; idx < 4; idx++)
+	{
+		make_sample(&sample, START_UTC + idx * POLL_TIME, 100, energies[idx]);
+		batch_add(&sample);
+	}
+	TEST_ASSERT_EQUAL(1, packets.size());
+	// A delta of 0xFFFF or more and a restart of the counter send the absolute energy
+	TEST_ASSERT_EQUAL(11 + 6 + 2 * (6 + 4), packets[0].size());
+	TEST_ASSERT_EQUAL_HEX16(100, get_16(packets[0], 15));
+	TEST_ASSERT_EQUAL_HEX16(BATCH_ENERGY_ABS, get_16(packets[0], 21));
+	std::vector<s_decoded> decoded = decode_all();
+	for (uint8_t idx = 0; idx < 4; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(energies[idx], decoded[idx].energy);
+	}
+}
+
+static void test_time_gap(void)
+{
+	// The device was offline for a day, the time delta does not fit into 16 bit
+	s_sample sample;
+	make_sample(&sample, START_UTC, 100, 1000);
+	batch_add(&sample);
+	make_sample(&sample, START_UTC + 0xFFFF, 100, 1000);
+	batch_add(&sample);
+	make_sample(&sample, START_UTC + 0xFFFF + 0x10000, 100, 1000);
+	batch_add(&sample);
+	batch_flush();
+	TEST_ASSERT_EQUAL(2, packets.size());
+	std::vector<s_decoded> decoded = decode_all();
+	TEST_ASSERT_EQUAL(3, decoded.size());
+	TEST_ASSERT_EQUAL_UINT32(START_UTC + 0xFFFF + 0x10000, decoded[2].time);
+}
+
+static void test_deadline(void)
+{
+	g_batch_max = 10;
+	std::vector<s_decoded> expected;
+	int energy = 0;
+	add_day(START_UTC, 3, &energy, expected);
+	TEST_ASSERT_EQUAL(0, packets.size());
+
+	// The packet is queued BATCH_MAX_AGE after its first sample, not when it is full
+	mock_advance(BATCH_MAX_AGE - 1);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(0, packets.size());
+	mock_advance(1);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(1, packets.size());
+	TEST_ASSERT_EQUAL(3, decode_all().size());
+
+	// The deadline is not repeated without new samples
+	mock_advance(BATCH_MAX_AGE);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(1, packets.size());
+
+	// The next packet has its own deadline
+	add_day(START_UTC + 3 * POLL_TIME, 1, &energy, expected);
+	mock_advance(BATCH_MAX_AGE);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(2, packets.size());
+}
+
+static void test_airtime_low(void)
+{
+	// Low on airtime the packets are filled up to the max payload, 36 samples at DR5
+	g_batch_max = 2;
+	low_airtime = true;
+	std::vector<s_decoded> expected;
+	int energy = 0;
+	add_day(START_UTC, 40, &energy, expected);
+	TEST_ASSERT_EQUAL(1, packets.size());
+	TEST_ASSERT_EQUAL(11 + 35 * 6, packets[0].size());
+
+	// Enough airtime again, the next sample queues the packet
+	low_airtime = false;
+	add_day(START_UTC + 40 * POLL_TIME, 1, &energy, expected);
+	TEST_ASSERT_EQUAL(2, packets.size());
+	TEST_ASSERT_EQUAL(41, decode_all().size());
+}
+
+static void test_adr(void)
+{
+	// With ADR the DR of the MAC is used once the stack runs
+	g_lorawan_settings.adr_enabled = true;
+	g_lorawan_settings.data_rate = 5;
+	mock_mac().datarate = 0;
+	TEST_ASSERT_EQUAL(222, lora_max_payload());
+	g_lorawan_initialized = true;
+	TEST_ASSERT_EQUAL(0, lora_datarate());
+	TEST_ASSERT_EQUAL(51, lora_max_payload());
+
+	// DRs that are not used for uplinks fall back to DR0
+	g_lorawan_settings.adr_enabled = false;
+	set_region(LORAMAC_REGION_US915, 6);
+	TEST_ASSERT_EQUAL(11, lora_max_payload());
+	set_region(LORAMAC_REGION_AU915, 20);
+	TEST_ASSERT_EQUAL(51, lora_max_payload());
+}
+
+static void test_codec(void)
+{
+	g_batch_format = FORMAT_CODEC;
+	g_batch_mask = (1 << CH_DC_VOLTAGE) | (1 << CH_L2_POWER);
+	set_region(LORAMAC_REGION_EU868, 0);
+	std::vector<s_decoded> expected;
+	int energy = 0;
+	add_day(START_UTC - 50 * POLL_TIME, 288, &energy, expected);
+	batch_flush();
+
+	s_codec_sample decoded[BATCH_LIMIT];
+	size_t found = 0;
+	for (size_t pkt = 0; pkt < packets.size(); pkt++)
+	{
+		uint8_t mask = 0;
+		int count = codec_decode(packets[pkt].data(), packets[pkt].size(), decoded, BATCH_LIMIT, &mask);
+		TEST_ASSERT_TRUE(count > 0);
+		TEST_ASSERT_EQUAL_HEX8(g_batch_mask, mask);
+		for (int idx = 0; idx < count; idx++, found++)
+		{
+			TEST_ASSERT_EQUAL_UINT32(expected[found].time, decoded[idx].time);
+			TEST_ASSERT_EQUAL(expected[found].power, decoded[idx].power);
+			TEST_ASSERT_EQUAL(expected[found].energy, decoded[idx].energy);
+			TEST_ASSERT_EQUAL(1000 + expected[found].power % 100, decoded[idx].channels[CH_DC_VOLTAGE]);
+			TEST_ASSERT_EQUAL(5000 + expected[found].power % 100, decoded[idx].channels[CH_L2_POWER]);
+		}
+	}
+	TEST_ASSERT_EQUAL(expected.size(), found);
+}
+
+static void test_log(void)
+{
+	const uint32_t count = 200;
+	uint32_t timestamps[count];
+	uint32_t values[count];
+	for (uint32_t idx = 0; idx < count; idx++)
+	{
+		timestamps[idx] = START_UTC + idx * POLL_TIME;
+		values[idx] = 5000000 + idx * 150;
+	}
+	// Entries without a value, a jump of the total energy and a gap of a day
+	values[10] = (uint32_t)-1;
+	values[11] = (uint32_t)-1;
+	for (uint32_t idx = 50; idx < count; idx++)
+	{
+		values[idx] += 100000;
+	}
+	for (uint32_t idx = 120; idx < count; idx++)
+	{
+		timestamps[idx] += 86400;
+	}
+	set_region(LORAMAC_REGION_EU868, 3);
+	batch_send_log(timestamps, values, count);
+
+	std::vector<s_decoded> decoded = decode_all();
+	TEST_ASSERT_EQUAL(count - 2, decoded.size());
+	size_t found = 0;
+	for (uint32_t idx = 0; idx < count; idx++)
+	{
+		if (values[idx] == (uint32_t)-1)
+		{
+			continue;
+		}
+		TEST_ASSERT_EQUAL_UINT32(timestamps[idx], decoded[found].time);
+		TEST_ASSERT_EQUAL_UINT32(values[idx], decoded[found].energy);
+		found++;
+	}
+	// The gap starts a new packet
+	bool gap_packet = false;
+	for (size_t pkt = 0; pkt < packets.size(); pkt++)
+	{
+		TEST_ASSERT_EQUAL_HEX8(FRAME_LOG, packets[pkt][0]);
+		gap_packet |= get_32(packets[pkt], 1) == timestamps[120];
+	}
+	TEST_ASSERT_TRUE(gap_packet);
+}
+
+/**
+ * @brief Fill one packet and return its samples and size
+ *
+ * @param size set to the packet size
+ * @return uint8_t samples in the packet
+ */
+static uint8_t fill_packet(uint8_t *size)
+{
+	packets.clear();
+	batch_count = 0;
+	batch_len = 0;
+	std::vector<s_decoded> expected;
+	int energy = 0;
+	// Mid day, power and energy change by the same amount every sample
+	add_day(START_UTC + 43200, BATCH_LIMIT, &energy, expected);
+	batch_flush();
+	*size = packets[0].size();
+	std::vector<s_decoded> decoded;
+	TEST_ASSERT_TRUE(decode(packets[0], decoded));
+	return decoded.size();
+}
+
+static void test_bytes_per_sample(void)
+{
+	const struct
+	{
+		const char *name;
+		LoRaMacRegion_t region;
+		uint8_t dr_num;
+	} regions[] = {{"EU868", LORAMAC_REGION_EU868, 8}, {"US915", LORAMAC_REGION_US915, 5}, {"AU915", LORAMAC_REGION_AU915, 7}};
+
+	printf("| Region | DR | Max payload | Samples | Bytes on air per sample |\n");
+	printf("| --- | --- | --- | --- | --- |\n");
+	printf("| all | single sample frame | - | 1 | %.1f |\n", 5.0 + LORAWAN_HEADER);
+	for (uint8_t reg = 0; reg < sizeof(regions) / sizeof(regions[0]); reg++)
+	{
+		for (uint8_t dr = 0; dr < regions[reg].dr_num; dr++)
+		{
+			set_region(regions[reg].region, dr);
+			uint8_t max_payload = lora_max_payload();
+			uint8_t size = 0;
+			uint8_t samples = fill_packet(&size);
+			// First sample 11 bytes, each following one 6 bytes
+			TEST_ASSERT_EQUAL(1 + (max_payload - 11) / 6, samples);
+			TEST_ASSERT_EQUAL(11 + (samples - 1) * 6, size);
+			printf("| %s | DR%d | %d | %d | %.1f |\n", regions[reg].name, dr, max_payload, samples,
+				   (float)(size + LORAWAN_HEADER) / samples);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+	get_batch_prefs();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_single);
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_energy_marker);
+	RUN_TEST(test_time_gap);
+	RUN_TEST(test_deadline);
+	RUN_TEST(test_airtime_low);
+	RUN_TEST(test_adr);
+	RUN_TEST(test_codec);
+	RUN_TEST(test_log);
+	RUN_TEST(test_bytes_per_sample);
+	return UNITY_END();
+}
@@ -0,0 +1,195 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the compact codec, pio test -e native
+ * @version 0.1
+ * @date 2021-10-23
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include "codec.h"
+
+/** Packet size of DR0 in EU868 */
+#define SMALL_PACKET 51
+
+/** Packet size of DR5 in EU868 */
+#define LARGE_PACKET 222
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Fill a sample
+ */
+static void make_sample(s_codec_sample *sample, uint32_t time, int32_t power, int32_t energy)
+{
+	memset(sample, 0, sizeof(s_codec_sample));
+	sample->time = time;
+	sample->power = power;
+	sample->energy = energy;
+}
+
+static void test_layout(void)
+{
+	uint8_t buffer[SMALL_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample sample;
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	make_sample(&sample, 1000, 500, 100);
+	TEST_ASSERT_TRUE(codec_add(&enc, &sample));
+	make_sample(&sample, 1060, 499, 101);
+	TEST_ASSERT_TRUE(codec_add(&enc, &sample));
+
+	const uint8_t expected[] = {CODEC_HEADER, 0x00, 0x02,
+								0xE8, 0x07, 0xE8, 0x07, 0xC8, 0x01,
+								0x3C, 0x01, 0x02};
+	TEST_ASSERT_EQUAL(sizeof(expected), codec_end(&enc));
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, sizeof(expected));
+}
+
+static void test_round_trip(void)
+{
+	uint8_t buffer[LARGE_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample samples[10];
+	uint8_t mask = (1 << CH_DC_VOLTAGE) | (1 << CH_AC_FREQUENCY) | (1 << CH_L3_POWER);
+	codec_begin(&enc, buffer, sizeof(buffer), mask);
+	for (int idx = 0; idx < 10; idx++)
+	{
+		make_sample(&samples[idx], 1635000000 + idx * 300, 2500 - idx * 137, 1200000 + idx * 210);
+		samples[idx].channels[CH_DC_VOLTAGE] = 38000 + idx;
+		samples[idx].channels[CH_AC_FREQUENCY] = 5000 - idx;
+		samples[idx].channels[CH_L3_POWER] = -idx;
+		TEST_ASSERT_TRUE(codec_add(&enc, &samples[idx]));
+	}
+	uint8_t len = codec_end(&enc);
+	TEST_ASSERT_TRUE(len > 0);
+
+	s_codec_sample decoded[10];
+	uint8_t decoded_mask;
+	TEST_ASSERT_EQUAL(10, codec_decode(buffer, len, decoded, 10, &decoded_mask));
+	TEST_ASSERT_EQUAL_HEX8(mask, decoded_mask);
+	for (int idx = 0; idx < 10; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(samples[idx].time, decoded[idx].time);
+		TEST_ASSERT_EQUAL_INT32(samples[idx].power, decoded[idx].power);
+		TEST_ASSERT_EQUAL_INT32(samples[idx].energy, decoded[idx].energy);
+		for (int ch = 0; ch < CH_NUM; ch++)
+		{
+			TEST_ASSERT_EQUAL_INT32(samples[idx].channels[ch], decoded[idx].channels[ch]);
+		}
+	}
+}
+
+static void test_energy_reset(void)
+{
+	uint8_t buffer[SMALL_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample sample;
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	make_sample(&sample, 1000, 100, 5000);
+	TEST_ASSERT_TRUE(codec_add(&enc, &sample));
+	make_sample(&sample, 1300, 100, 3);
+	TEST_ASSERT_TRUE(codec_add(&enc, &sample));
+	uint8_t len = codec_end(&enc);
+
+	s_codec_sample decoded[2];
+	uint8_t mask;
+	TEST_ASSERT_EQUAL(2, codec_decode(buffer, len, decoded, 2, &mask));
+	TEST_ASSERT_EQUAL_INT32(5000, decoded[0].energy);
+	TEST_ASSERT_EQUAL_INT32(3, decoded[1].energy);
+}
+
+static void test_rejected_samples(void)
+{
+	uint8_t buffer[SMALL_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample sample;
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	make_sample(&sample, 1000, 100, -1);
+	TEST_ASSERT_FALSE(codec_add(&enc, &sample));
+	make_sample(&sample, 1000, 100, 10);
+	TEST_ASSERT_TRUE(codec_add(&enc, &sample));
+	// Time goes backwards
+	make_sample(&sample, 999, 100, 10);
+	TEST_ASSERT_FALSE(codec_add(&enc, &sample));
+	TEST_ASSERT_EQUAL(1, enc.count);
+	// Nothing added
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	TEST_ASSERT_EQUAL(0, codec_end(&enc));
+}
+
+static void test_packet_full(void)
+{
+	uint8_t buffer[SMALL_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample sample;
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	int added = 0;
+	while (true)
+	{
+		make_sample(&sample, 1635000000 + added * 300, (added & 1) ? 100000 : -100000, added * 100000);
+		uint8_t len = enc.len;
+		if (!codec_add(&enc, &sample))
+		{
+			// The packet is unchanged
+			TEST_ASSERT_EQUAL(len, enc.len);
+			break;
+		}
+		added++;
+	}
+	TEST_ASSERT_TRUE(added > 1);
+	uint8_t len = codec_end(&enc);
+	TEST_ASSERT_TRUE(len <= SMALL_PACKET);
+
+	s_codec_sample decoded[CODEC_MAX_SAMPLES];
+	uint8_t mask;
+	TEST_ASSERT_EQUAL(added, codec_decode(buffer, len, decoded, CODEC_MAX_SAMPLES, &mask));
+	TEST_ASSERT_EQUAL_INT32(added & 1 ? -100000 : 100000, decoded[added - 1].power);
+}
+
+static void test_invalid_packets(void)
+{
+	uint8_t buffer[SMALL_PACKET];
+	s_codec_encoder enc;
+	s_codec_sample sample;
+	s_codec_sample decoded[2];
+	uint8_t mask;
+	codec_begin(&enc, buffer, sizeof(buffer), 0);
+	make_sample(&sample, 1000, 500, 100);
+	codec_add(&enc, &sample);
+	make_sample(&sample, 1060, 499, 101);
+	codec_add(&enc, &sample);
+	uint8_t len = codec_end(&enc);
+
+	// Truncated, extra bytes, too many samples
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, len - 1, decoded, 2, &mask));
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, len + 1, decoded, 2, &mask));
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, len, decoded, 1, &mask));
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, 2, decoded, 2, &mask));
+	// Wrong schema version, unknown channels
+	buffer[0] = CODEC_MARK | (CODEC_VERSION + 1);
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, len, decoded, 2, &mask));
+	buffer[0] = CODEC_HEADER;
+	buffer[1] = 1 << CH_NUM;
+	TEST_ASSERT_EQUAL(-1, codec_decode(buffer, len, decoded, 2, &mask));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_layout);
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_energy_reset);
+	RUN_TEST(test_rejected_samples);
+	RUN_TEST(test_packet_full);
+	RUN_TEST(test_invalid_packets);
+	return UNITY_END();
+}
@@ -0,0 +1,265 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the assignment of the discovered devices, pio test -e native
+ * The candidates are fake devices with a serial, a failing inverter may only move to the
+ * device with its own serial. Other SMA devices are listed but the saved IP stays
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+// discovery.cpp is not in the native build, its statics are checked here
+#include "../../src/discovery.cpp"
+
+/** Globals and functions of the other modules that discovery.cpp uses */
+IPAddress inverterIP(192, 168, 1, 127);
+
+/** Fake device found by the discovery */
+struct s_candidate
+{
+	IPAddress ip;
+	// Serial of the device, 0 if it does not answer with the password of the inverter
+	uint32_t serial;
+	// Serial reads of the device
+	uint8_t reads;
+};
+
+/** Fake devices of a test */
+static s_candidate candidates[DISC_MAX_FOUND];
+static uint8_t num_candidates = 0;
+
+/** Saved IPs by the index of the inverter, 0 if set_inverter_ip() was not called */
+static uint32_t saved_ip[MAX_INVERTERS];
+
+uint32_t read_inverter_serial(uint8_t idx, IPAddress ip)
+{
+	for (uint8_t c_idx = 0; c_idx < num_candidates; c_idx++)
+	{
+		if (candidates[c_idx].ip == ip)
+		{
+			candidates[c_idx].reads++;
+			return candidates[c_idx].serial;
+		}
+	}
+	return 0;
+}
+
+/** The same as in inverters.cpp, the preferences are replaced by saved_ip */
+void set_inverter_ip(uint8_t idx, IPAddress ip)
+{
+	g_inverters[idx].ip = ip;
+	g_inverters[idx].fails = 0;
+	saved_ip[idx] = (uint32_t)ip;
+}
+
+/**
+ * @brief Add a fake device to the candidates of the discovery
+ *
+ * @param host host part of the IP in 192.168.1.0/24
+ * @param serial serial of the device, 0 if it does not answer
+ */
+static void add_candidate(uint8_t host, uint32_t serial)
+{
+	s_candidate *candidate = &candidates[num_candidates++];
+	candidate->ip = IPAddress(192, 168, 1, host);
+	candidate->serial = serial;
+	candidate->reads = 0;
+	add_found(candidate->ip);
+}
+
+/**
+ * @brief Set up an inverter
+ *
+ * @param idx index into g_inverters
+ * @param host host part of the IP in 192.168.1.0/24
+ * @param serial known serial, 0 if the inverter never answered
+ * @param fails failed polls in a row
+ */
+static void set_inverter(uint8_t idx, uint8_t host, uint32_t serial, uint8_t fails)
+{
+	g_inverters[idx].ip = IPAddress(192, 168, 1, host);
+	g_inverters[idx].serial = serial;
+	g_inverters[idx].fails = fails;
+	if (idx >= g_num_inverters)
+	{
+		g_num_inverters = idx + 1;
+	}
+}
+
+void setUp(void)
+{
+	num_candidates = 0;
+	num_found = 0;
+	num_moved = 0;
+	memset(saved_ip, 0, sizeof(saved_ip));
+	g_num_inverters = 0;
+	g_disc_fail_limit = DISC_FAIL_DEFAULT;
+}
+
+void tearDown(void) {}
+
+static void test_add_found(void)
+{
+	// Twice the same, the own IP and 0.0.0.0 are ignored
+	add_found(IPAddress(192, 168, 1, 20));
+	add_found(IPAddress(192, 168, 1, 20));
+	add_found(WiFi.localIP());
+	add_found(IPAddress());
+	TEST_ASSERT_EQUAL(1, num_found);
+
+	for (uint8_t host = 21; host < 40; host++)
+	{
+		add_found(IPAddress(192, 168, 1, host));
+	}
+	TEST_ASSERT_EQUAL(DISC_MAX_FOUND, num_found);
+	TEST_ASSERT_TRUE(found[DISC_MAX_FOUND - 1] == IPAddress(192, 168, 1, 20 + DISC_MAX_FOUND - 1));
+}
+
+static void test_mdns(void)
+{
+	// Only HTTP services of SMA devices
+	mock_mdns().clear();
+	mock_mdns().push_back({"SMA3010123456", IPAddress(192, 168, 1, 40)});
+	mock_mdns().push_back({"printer", IPAddress(192, 168, 1, 41)});
+	mock_mdns().push_back({"sma-homemanager", IPAddress(192, 168, 1, 42)});
+	find_mdns();
+	mock_mdns().clear();
+	TEST_ASSERT_EQUAL(2, num_found);
+	TEST_ASSERT_TRUE(found[0] == IPAddress(192, 168, 1, 40));
+	TEST_ASSERT_TRUE(found[1] == IPAddress(192, 168, 1, 42));
+}
+
+static void test_moved_to_own_serial(void)
+{
+	set_inverter(0, 10, 1001, DISC_FAIL_DEFAULT);
+	set_inverter(1, 11, 1002, 0);
+	// The working inverter, a Home Manager, a second inverter that is not configured, the failing inverter
+	add_candidate(11, 1002);
+	add_candidate(20, 3001);
+	add_candidate(21, 1003);
+	add_candidate(22, 1001);
+	TEST_ASSERT_TRUE(has_new());
+
+	assign_found(false);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 22));
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)IPAddress(192, 168, 1, 22), saved_ip[0]);
+	TEST_ASSERT_EQUAL(0, g_inverters[0].fails);
+	TEST_ASSERT_EQUAL(1, num_moved);
+	// The working inverter keeps its IP, its device is not read
+	TEST_ASSERT_TRUE(g_inverters[1].ip == IPAddress(192, 168, 1, 11));
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[1]);
+	TEST_ASSERT_EQUAL(0, candidates[0].reads);
+	TEST_ASSERT_EQUAL(1, candidates[1].reads);
+	TEST_ASSERT_EQUAL(1, candidates[2].reads);
+	TEST_ASSERT_EQUAL(1, candidates[3].reads);
+}
+
+static void test_no_match(void)
+{
+	// The inverter is off at night, only other SMA devices answer
+	set_inverter(0, 10, 1001, DISC_FAIL_DEFAULT + 5);
+	add_candidate(20, 3001);
+	add_candidate(21, 1003);
+	add_candidate(23, 0);
+
+	assign_found(false);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 10));
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[0]);
+	TEST_ASSERT_EQUAL(DISC_FAIL_DEFAULT + 5, g_inverters[0].fails);
+	TEST_ASSERT_EQUAL(0, num_moved);
+
+	// The candidates are only reported
+	char status[80];
+	discovery_status(status, sizeof(status));
+	TEST_ASSERT_EQUAL_STRING("3:0:0:0,192:168:1:20,192:168:1:21,192:168:1:23", status);
+
+	// The next run does the same
+	assign_found(true);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 10));
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[0]);
+}
+
+static void test_unknown_serial(void)
+{
+	// The inverter never answered, nothing to compare with
+	set_inverter(0, 10, 0, DISC_FAIL_DEFAULT);
+	add_candidate(20, 3001);
+
+	assign_found(true);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 10));
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[0]);
+	TEST_ASSERT_EQUAL(0, candidates[0].reads);
+}
+
+static void test_fail_limit(void)
+{
+	set_inverter(0, 10, 1001, DISC_FAIL_DEFAULT - 1);
+	set_inverter(1, 11, 1002, 0);
+	add_candidate(20, 1001);
+	add_candidate(21, 1002);
+
+	// The automatic run moves only inverters over the limit
+	assign_found(false);
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[0]);
+	TEST_ASSERT_EQUAL(0, candidates[0].reads);
+
+	// AT+DISC moves every failing inverter, a working one stays even if its serial is found
+	assign_found(true);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 20));
+	TEST_ASSERT_TRUE(g_inverters[1].ip == IPAddress(192, 168, 1, 11));
+	TEST_ASSERT_EQUAL_UINT32(0, saved_ip[1]);
+	TEST_ASSERT_EQUAL(1, num_moved);
+}
+
+static void test_two_failing(void)
+{
+	// Both inverters got new leases, the order of the candidates does not matter
+	set_inverter(0, 10, 1001, DISC_FAIL_DEFAULT);
+	set_inverter(1, 11, 1002, DISC_FAIL_DEFAULT);
+	add_candidate(30, 1002);
+	add_candidate(31, 3001);
+	add_candidate(32, 1001);
+
+	assign_found(false);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 32));
+	TEST_ASSERT_TRUE(g_inverters[1].ip == IPAddress(192, 168, 1, 30));
+	TEST_ASSERT_EQUAL(2, num_moved);
+	// Each device is read once per run
+	for (uint8_t idx = 0; idx < num_candidates; idx++)
+	{
+		TEST_ASSERT_EQUAL(1, candidates[idx].reads);
+	}
+}
+
+static void test_old_ip_taken(void)
+{
+	// Inverter 1 got the old IP of inverter 0, it is free once inverter 0 moved
+	set_inverter(0, 10, 1001, DISC_FAIL_DEFAULT);
+	set_inverter(1, 11, 1002, DISC_FAIL_DEFAULT);
+	add_candidate(10, 1002);
+	add_candidate(12, 1001);
+
+	assign_found(false);
+	TEST_ASSERT_TRUE(g_inverters[0].ip == IPAddress(192, 168, 1, 12));
+	TEST_ASSERT_TRUE(g_inverters[1].ip == IPAddress(192, 168, 1, 10));
+	TEST_ASSERT_EQUAL(2, num_moved);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_add_found);
+	RUN_TEST(test_mdns);
+	RUN_TEST(test_moved_to_own_serial);
+	RUN_TEST(test_no_match);
+	RUN_TEST(test_unknown_serial);
+	RUN_TEST(test_fail_limit);
+	RUN_TEST(test_two_failing);
+	RUN_TEST(test_old_ip_taken);
+	return UNITY_END();
+}
@@ -0,0 +1,270 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the downlink command dispatcher, pio test -e native
+ * The encoded downlinks are fed through downlink_dispatch() and through the scheduler job like
+ * the RX callback does. The AT command table is a stub that records the calls and checks
+ * the values like the setters of at_cmd.cpp
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string>
+#include <vector>
+// downlink.cpp is not in the native build, its statics are checked here
+#include "../../src/downlink.cpp"
+
+/** Globals and functions of the other modules that downlink.cpp uses */
+uint8_t g_rx_lora_data[256];
+uint8_t g_rx_data_len = 0;
+uint8_t g_rx_port = 0;
+static uint8_t max_payload = 51;
+uint8_t lora_max_payload(void)
+{
+	return max_payload;
+}
+
+/** Captured ACK uplinks */
+static std::vector<std::vector<uint8_t>> packets;
+lmh_error_status send_lora_packet(uint8_t *data, uint8_t size)
+{
+	packets.push_back(std::vector<uint8_t>(data, data + size));
+	return LMH_SUCCESS;
+}
+
+static uint32_t polls = 0;
+void poll_now(void)
+{
+	polls++;
+}
+
+static uint16_t backfill = 0;
+void request_backfill(uint16_t intervals)
+{
+	backfill = intervals;
+}
+
+/** Calls of the AT command table, command and parameter */
+static std::vector<std::string> at_calls;
+
+/**
+ * @brief AT command table stub, the value checks of +SENDFREQ, +DR and +ADR
+ *
+ * @param cmd_name command
+ * @param str parameter or NULL
+ * @return int 0 if success, AT_ERRNO_xxx otherwise
+ */
+int at_exec_cmd(const char *cmd_name, char *str)
+{
+	at_calls.push_back(std::string(cmd_name) + "=" + (str == NULL ? "" : str));
+	long value = str == NULL ? 0 : atol(str);
+	if (strcmp(cmd_name, "+DR") == 0)
+	{
+		return value > 7 ? AT_ERRNO_PARA_VAL : 0;
+	}
+	if (strcmp(cmd_name, "+ADR") == 0)
+	{
+		return value > 1 ? AT_ERRNO_PARA_VAL : 0;
+	}
+	if ((strcmp(cmd_name, "+SENDFREQ") == 0) || (strcmp(cmd_name, "Z") == 0))
+	{
+		return 0;
+	}
+	return AT_ERRNO_NOSUPP;
+}
+
+/**
+ * @brief Dispatch a downlink and check the ACK
+ *
+ * @param data downlink
+ * @param size downlink size
+ * @param reply_size size of the ACK buffer
+ * @param expected expected ACK without the flag
+ * @param expected_size size of the expected ACK
+ * @return uint8_t executed commands
+ */
+static uint8_t dispatch(uint8_t *data, uint8_t size, uint8_t reply_size, const uint8_t *expected, uint8_t expected_size)
+{
+	uint8_t reply[UPLINK_MAX_PAYLOAD];
+	uint8_t reply_len = 0;
+	uint8_t executed = downlink_dispatch(data, size, reply, reply_size, &reply_len);
+	TEST_ASSERT_TRUE(reply_len <= reply_size);
+	TEST_ASSERT_EQUAL(expected_size + 1, reply_len);
+	TEST_ASSERT_EQUAL_HEX8(FRAME_ACK, reply[0]);
+	if (expected_size != 0)
+	{
+		TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, &reply[1], expected_size);
+	}
+	return executed;
+}
+
+void setUp(void)
+{
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		g_jobs[idx] = s_job();
+	}
+	init_downlink();
+	reboot_pending = false;
+	g_rx_data_len = 0;
+	max_payload = 51;
+	packets.clear();
+	at_calls.clear();
+	polls = 0;
+	backfill = 0;
+}
+
+void tearDown(void) {}
+
+static void test_all_opcodes(void)
+{
+	uint8_t data[] = {OP_SEND_INTERVAL, 0x01, 0x2C,
+					  OP_POLL_NOW,
+					  OP_BACKFILL, 0x00, 0x90,
+					  OP_DATARATE, 3,
+					  OP_ADR, 1,
+					  OP_REBOOT};
+	const uint8_t expected[] = {OP_SEND_INTERVAL, 0, OP_POLL_NOW, 0, OP_BACKFILL, 0,
+								OP_DATARATE, 0, OP_ADR, 0, OP_REBOOT, 0};
+	TEST_ASSERT_EQUAL(6, dispatch(data, sizeof(data), max_payload, expected, sizeof(expected)));
+	TEST_ASSERT_EQUAL(3, at_calls.size());
+	TEST_ASSERT_EQUAL_STRING("+SENDFREQ=300", at_calls[0].c_str());
+	TEST_ASSERT_EQUAL_STRING("+DR=3", at_calls[1].c_str());
+	TEST_ASSERT_EQUAL_STRING("+ADR=1", at_calls[2].c_str());
+	TEST_ASSERT_EQUAL_UINT32(1, polls);
+	TEST_ASSERT_EQUAL(144, backfill);
+	// The reboot waits for the ACK
+	TEST_ASSERT_TRUE(reboot_pending);
+}
+
+static void test_setter_errors(void)
+{
+	// The values are checked by the AT commands, a wrong value does not stop the next command
+	uint8_t data[] = {OP_DATARATE, 9, OP_BACKFILL, 0x00, 0x00, OP_BACKFILL, 0x07, 0xE1, OP_ADR, 0};
+	const uint8_t expected[] = {OP_DATARATE, AT_ERRNO_PARA_VAL, OP_BACKFILL, AT_ERRNO_PARA_VAL,
+								OP_BACKFILL, AT_ERRNO_PARA_VAL, OP_ADR, 0};
+	TEST_ASSERT_EQUAL(4, dispatch(data, sizeof(data), max_payload, expected, sizeof(expected)));
+	TEST_ASSERT_EQUAL(0, backfill);
+	TEST_ASSERT_EQUAL_STRING("+DR=9", at_calls[0].c_str());
+}
+
+static void test_unknown(void)
+{
+	// Processing stops at an unknown opcode, its parameter size is not known
+	uint8_t data[] = {OP_POLL_NOW, 0x7F, OP_POLL_NOW};
+	const uint8_t expected[] = {OP_POLL_NOW, 0, 0x7F, AT_ERRNO_NOSUPP};
+	TEST_ASSERT_EQUAL(1, dispatch(data, sizeof(data), max_payload, expected, sizeof(expected)));
+	TEST_ASSERT_EQUAL_UINT32(1, polls);
+}
+
+static void test_truncated(void)
+{
+	// The parameter of the last command is cut off, the command is not executed
+	uint8_t data[] = {OP_DATARATE, 2, OP_SEND_INTERVAL, 0x01};
+	const uint8_t expected[] = {OP_DATARATE, 0, OP_SEND_INTERVAL, AT_ERRNO_PARA_NUM};
+	TEST_ASSERT_EQUAL(1, dispatch(data, sizeof(data), max_payload, expected, sizeof(expected)));
+	TEST_ASSERT_EQUAL(1, at_calls.size());
+
+	// Only the opcode
+	uint8_t opcode_only[] = {OP_BACKFILL};
+	const uint8_t expected_only[] = {OP_BACKFILL, AT_ERRNO_PARA_NUM};
+	TEST_ASSERT_EQUAL(0, dispatch(opcode_only, sizeof(opcode_only), max_payload, expected_only, sizeof(expected_only)));
+	TEST_ASSERT_EQUAL(0, backfill);
+
+	// Empty downlink, empty ACK
+	TEST_ASSERT_EQUAL(0, dispatch(data, 0, max_payload, NULL, 0));
+}
+
+static void test_ack_full(void)
+{
+	// 20 commands, the ACK has room for the results of 5, the rest is not executed
+	uint8_t data[20];
+	memset(data, OP_POLL_NOW, sizeof(data));
+	uint8_t expected[10];
+	for (uint8_t idx = 0; idx < sizeof(expected); idx += 2)
+	{
+		expected[idx] = OP_POLL_NOW;
+		expected[idx + 1] = 0;
+	}
+	TEST_ASSERT_EQUAL(5, dispatch(data, sizeof(data), 12, expected, sizeof(expected)));
+	TEST_ASSERT_EQUAL_UINT32(5, polls);
+
+	// Room for the flag only
+	TEST_ASSERT_EQUAL(0, dispatch(data, sizeof(data), 2, NULL, 0));
+	TEST_ASSERT_EQUAL_UINT32(5, polls);
+}
+
+/**
+ * @brief Receive a downlink like the RX callback and run the scheduler
+ *
+ * @param port fPort of the downlink
+ * @param data downlink
+ * @param size downlink size
+ */
+static void receive(uint8_t port, const uint8_t *data, uint8_t size)
+{
+	memcpy(g_rx_lora_data, data, size);
+	g_rx_data_len = size;
+	g_rx_port = port;
+	downlink_received();
+	run_scheduler();
+}
+
+static void test_job(void)
+{
+	// Other ports are not commands
+	const uint8_t poll[] = {OP_POLL_NOW};
+	receive(DOWNLINK_PORT + 1, poll, sizeof(poll));
+	TEST_ASSERT_EQUAL(0, packets.size());
+	TEST_ASSERT_EQUAL(0, polls);
+	TEST_ASSERT_EQUAL(0, g_rx_data_len);
+
+	receive(DOWNLINK_PORT, poll, sizeof(poll));
+	TEST_ASSERT_EQUAL(1, packets.size());
+	const uint8_t ack[] = {FRAME_ACK, OP_POLL_NOW, 0};
+	TEST_ASSERT_EQUAL(sizeof(ack), packets[0].size());
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(ack, packets[0].data(), sizeof(ack));
+
+	// The ACK is limited to the max payload of the DR
+	max_payload = 11;
+	uint8_t many[20];
+	memset(many, OP_POLL_NOW, sizeof(many));
+	receive(DOWNLINK_PORT, many, sizeof(many));
+	TEST_ASSERT_EQUAL(11, packets[1].size());
+	TEST_ASSERT_EQUAL_UINT32(1 + 5, polls);
+}
+
+static void test_reboot(void)
+{
+	const uint8_t reboot[] = {OP_REBOOT};
+	receive(DOWNLINK_PORT, reboot, sizeof(reboot));
+	TEST_ASSERT_EQUAL(1, packets.size());
+	TEST_ASSERT_EQUAL(0, at_calls.size());
+
+	// The reboot comes REBOOT_DELAY after the ACK was queued
+	mock_advance(REBOOT_DELAY - 1);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(0, at_calls.size());
+	mock_advance(1);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(1, at_calls.size());
+	TEST_ASSERT_EQUAL_STRING("Z=", at_calls[0].c_str());
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_all_opcodes);
+	RUN_TEST(test_setter_errors);
+	RUN_TEST(test_unknown);
+	RUN_TEST(test_truncated);
+	RUN_TEST(test_ack_full);
+	RUN_TEST(test_job);
+	RUN_TEST(test_reboot);
+	return UNITY_END();
+}
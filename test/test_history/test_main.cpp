@@ -0,0 +1,244 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the history store with a RAM flash, pio test -e native
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string.h>
+#include "history.h"
+
+/** 2021-10-31 00:00 UTC */
+#define DAY_START 1635638400
+
+/** Seconds of a day */
+#define DAY_SECONDS 86400
+
+/** The flash, like NOR flash only bits that are 1 can be programmed */
+static uint8_t flash[HIST_SECTORS * HIST_SECTOR_SIZE];
+
+/** Reads of the flash */
+static uint32_t flash_reads = 0;
+
+static bool flash_read(uint32_t address, void *data, size_t len)
+{
+	flash_reads++;
+	memcpy(data, &flash[address], len);
+	return true;
+}
+
+static bool flash_write(uint32_t address, const void *data, size_t len)
+{
+	for (size_t idx = 0; idx < len; idx++)
+	{
+		flash[address + idx] &= ((const uint8_t *)data)[idx];
+	}
+	return true;
+}
+
+static bool flash_erase(uint32_t sector)
+{
+	memset(&flash[sector * HIST_SECTOR_SIZE], 0xFF, HIST_SECTOR_SIZE);
+	return true;
+}
+
+static const s_hist_flash ram_flash = {flash_read, flash_write, flash_erase};
+
+/** The store, large for the stack */
+static s_history history;
+
+/** Second store to compare after a remount */
+static s_history remounted;
+
+/** Read buffer */
+static s_hist_point points[300];
+
+void setUp(void)
+{
+	memset(flash, 0xFF, sizeof(flash));
+	hist_mount(&history, &ram_flash);
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Add a sample every minute, 3000 W from 06:40 to 16:40, 50 Wh per sample while there is power
+ *
+ * @param days days to add
+ * @return uint32_t total energy at the end
+ */
+static uint32_t add_days(uint32_t days)
+{
+	uint32_t energy = 1000000;
+	for (uint32_t idx = 0; idx < days * 1440; idx++)
+	{
+		uint32_t minute = idx % 1440;
+		bool sun = (minute > 400) && (minute < 1000);
+		energy += sun ? 50 : 0;
+		TEST_ASSERT_TRUE(hist_add(&history, DAY_START + idx * 60, sun ? 3000 : 0, energy));
+	}
+	return energy;
+}
+
+static void test_empty(void)
+{
+	for (uint8_t level = 0; level < HIST_LEVELS; level++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(0, hist_records(&history, level));
+	}
+	TEST_ASSERT_EQUAL(0, hist_read(&history, HIST_LVL_RAW, 0, 0xFFFFFFFF, points, 300));
+}
+
+static void test_raw(void)
+{
+	for (uint32_t idx = 0; idx <= 10; idx++)
+	{
+		TEST_ASSERT_TRUE(hist_add(&history, DAY_START + idx * 60, idx * 100, 1000 + idx * 10));
+	}
+	TEST_ASSERT_EQUAL_UINT32(11, hist_records(&history, HIST_LVL_RAW));
+	TEST_ASSERT_EQUAL_UINT32(DAY_START, hist_oldest(&history, HIST_LVL_RAW));
+	TEST_ASSERT_EQUAL(3, hist_read(&history, HIST_LVL_RAW, DAY_START + 60, DAY_START + 180, points, 300));
+	TEST_ASSERT_EQUAL_UINT32(DAY_START + 60, points[0].utc);
+	TEST_ASSERT_EQUAL(100, points[0].power);
+	TEST_ASSERT_EQUAL_UINT32(1010, points[0].energy);
+	TEST_ASSERT_EQUAL_UINT32(DAY_START + 180, points[2].utc);
+	// Max points
+	TEST_ASSERT_EQUAL(2, hist_read(&history, HIST_LVL_RAW, DAY_START, DAY_START + 600, points, 2));
+	TEST_ASSERT_EQUAL_UINT32(DAY_START + 60, points[1].utc);
+}
+
+static void test_rollups(void)
+{
+	for (uint32_t idx = 0; idx <= 10; idx++)
+	{
+		hist_add(&history, DAY_START + idx * 60, idx * 100, 1000 + idx * 10);
+	}
+	// A sample at the end of a period belongs to it, the last period is not closed yet
+	TEST_ASSERT_EQUAL(2, hist_read(&history, HIST_LVL_5MIN, DAY_START, DAY_START + 600, points, 300));
+	TEST_ASSERT_EQUAL_UINT32(DAY_START, points[0].utc);
+	TEST_ASSERT_EQUAL(1, points[0].samples);
+	TEST_ASSERT_EQUAL_UINT32(DAY_START + 300, points[1].utc);
+	TEST_ASSERT_EQUAL(300, points[1].power);
+	TEST_ASSERT_EQUAL(500, points[1].peak);
+	TEST_ASSERT_EQUAL(5, points[1].samples);
+	TEST_ASSERT_EQUAL_UINT32(1050, points[1].energy);
+}
+
+static void test_days(void)
+{
+	uint32_t energy = add_days(30);
+	uint32_t last = DAY_START + (30 * 1440 - 1) * 60;
+
+	// The newest sample survives the wrap of the rings
+	int count = hist_read(&history, HIST_LVL_RAW, last - 600, last, points, 300);
+	TEST_ASSERT_EQUAL(11, count);
+	TEST_ASSERT_EQUAL_UINT32(last, points[count - 1].utc);
+	TEST_ASSERT_EQUAL_UINT32(energy, points[count - 1].energy);
+	TEST_ASSERT_TRUE(hist_oldest(&history, HIST_LVL_RAW) > DAY_START);
+
+	count = hist_read(&history, HIST_LVL_5MIN, last - 3600, last, points, 300);
+	TEST_ASSERT_EQUAL(12, count);
+	for (int idx = 0; idx < count; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(0, points[idx].utc % 300);
+	}
+
+	// Every day has 599 samples with power
+	count = hist_read(&history, HIST_LVL_DAY, 0, 0xFFFFFFFF, points, 300);
+	TEST_ASSERT_TRUE(count >= 29);
+	for (int idx = 1; idx < count; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(599 * 50, points[idx].energy - points[idx - 1].energy);
+	}
+}
+
+static void test_remount(void)
+{
+	add_days(30);
+	hist_mount(&remounted, &ram_flash);
+	for (uint8_t level = 0; level < HIST_LEVELS; level++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(hist_records(&history, level), hist_records(&remounted, level));
+		TEST_ASSERT_EQUAL_UINT32(hist_oldest(&history, level), hist_oldest(&remounted, level));
+		TEST_ASSERT_EQUAL_UINT32(history.rings[level].last_utc, remounted.rings[level].last_utc);
+		for (uint8_t day = 0; day < HIST_DAY_SLOTS; day++)
+		{
+			TEST_ASSERT_EQUAL(history.rings[level].days[day].day, remounted.rings[level].days[day].day);
+		}
+	}
+	uint32_t last = DAY_START + (30 * 1440 - 1) * 60;
+	int count = hist_read(&remounted, HIST_LVL_HOUR, last - DAY_SECONDS, last, points, 300);
+	TEST_ASSERT_TRUE((count == 23) || (count == 24));
+}
+
+static void test_seek(void)
+{
+	add_days(30);
+	uint32_t last = DAY_START + (30 * 1440 - 1) * 60;
+	for (uint32_t utc = hist_oldest(&history, HIST_LVL_RAW); utc < last; utc += 3777)
+	{
+		s_hist_pos pos;
+		TEST_ASSERT_TRUE(hist_seek(&history, HIST_LVL_RAW, utc, &pos));
+		s_hist_point point;
+		TEST_ASSERT_EQUAL(1, hist_read(&history, HIST_LVL_RAW, utc, utc + 59, &point, 1));
+		TEST_ASSERT_TRUE((point.utc >= utc) && (point.utc < utc + 60));
+	}
+	s_hist_pos pos;
+	TEST_ASSERT_FALSE(hist_seek(&history, HIST_LVL_RAW, last + 1, &pos));
+
+	// The day index keeps a seek to a few reads of the flash
+	flash_reads = 0;
+	for (uint32_t idx = 0; idx < 100; idx++)
+	{
+		hist_seek(&history, HIST_LVL_HOUR, last - DAY_SECONDS * (idx % 28), &pos);
+	}
+	TEST_ASSERT_TRUE(flash_reads < 100 * 16);
+}
+
+static void test_torn_record(void)
+{
+	uint32_t energy = add_days(1);
+	uint32_t last = DAY_START + (1440 - 1) * 60;
+	// Power fail while a record was written, only a part of it is programmed
+	s_hist_ring *ring = &history.rings[HIST_LVL_RAW];
+	uint8_t head = ring->head;
+	flash[(ring->first + head) * HIST_SECTOR_SIZE + HIST_HEADER_SIZE + ring->used[head] * HIST_RECORD_SIZE] = 0x12;
+
+	hist_mount(&remounted, &ram_flash);
+	TEST_ASSERT_TRUE(hist_add(&remounted, last + 60, 100, energy + 1));
+	TEST_ASSERT_EQUAL(2, hist_read(&remounted, HIST_LVL_RAW, last, last + 60, points, 10));
+	TEST_ASSERT_EQUAL_UINT32(last + 60, points[1].utc);
+	TEST_ASSERT_EQUAL_UINT32(energy + 1, points[1].energy);
+}
+
+static void test_time_order(void)
+{
+	TEST_ASSERT_TRUE(hist_add(&history, DAY_START + 60, 100, 1000));
+	TEST_ASSERT_FALSE(hist_add(&history, DAY_START + 60, 100, 1000));
+	TEST_ASSERT_FALSE(hist_add(&history, DAY_START, 100, 1000));
+	TEST_ASSERT_EQUAL_UINT32(1, hist_records(&history, HIST_LVL_RAW));
+	// Negative power is stored as 0
+	TEST_ASSERT_TRUE(hist_add(&history, DAY_START + 120, -5, 1000));
+	hist_read(&history, HIST_LVL_RAW, DAY_START + 120, DAY_START + 120, points, 1);
+	TEST_ASSERT_EQUAL(0, points[0].power);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_empty);
+	RUN_TEST(test_raw);
+	RUN_TEST(test_rollups);
+	RUN_TEST(test_days);
+	RUN_TEST(test_remount);
+	RUN_TEST(test_seek);
+	RUN_TEST(test_torn_record);
+	RUN_TEST(test_time_order);
+	return UNITY_END();
+}
@@ -0,0 +1,284 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the poll rounds with fake inverters, pio test -e native
+ * The fake inverters answer after a fixed latency, the wall time of a round
+ * is reported for 1 .. MAX_INVERTERS inverters
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include "inverters.h"
+
+/** Latency of the fake inverters */
+#define LATENCY_MS 100
+
+/** 2021-11-02 06:00 UTC */
+#define LOG_START 1635832800
+
+/** Log entries of a request in the tests */
+#define LOG_ENTRIES 12
+
+/** Inverter that answers after a fixed time */
+class FakeInverter : public InverterReader
+{
+public:
+	bool getValues(int *values)
+	{
+		requests++;
+		delay(latency);
+		if (!alive)
+		{
+			return false;
+		}
+		memcpy(values, this->values, sizeof(this->values));
+		return true;
+	}
+	int getLog(uint32_t start, uint32_t end, uint32_t *values, uint32_t *timestamps)
+	{
+		requests++;
+		delay(latency);
+		if (!alive)
+		{
+			return -1;
+		}
+		int count = min((int)((end - start) / LOG_INTERVAL) + 1 - log_short, LOG_CHUNK);
+		for (int entry = 0; entry < count; entry++)
+		{
+			timestamps[entry] = start + entry * LOG_INTERVAL + log_shift;
+			values[entry] = energy + entry;
+		}
+		return count;
+	}
+	void logout(void) {}
+	uint32_t getSerial(void) { return 0; }
+
+	uint32_t latency = 0;
+	bool alive = true;
+	int values[poll_keys_t::count];
+	uint32_t energy = 0;
+	// Shift of the log times and missing entries at the end of the log
+	uint32_t log_shift = 0;
+	int log_short = 0;
+	uint32_t requests = 0;
+};
+
+static FakeInverter fakes[MAX_INVERTERS];
+
+/** Index of a key in the values */
+static uint8_t val_index(SMAKeyId id)
+{
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		if (poll_keys_t::ids[idx] == id)
+		{
+			return idx;
+		}
+	}
+	return 0;
+}
+
+void setUp(void)
+{
+	// Let a poll task of a timed out round finish
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		while (g_inverters[idx].busy)
+		{
+			delay(5);
+		}
+	}
+	g_num_inverters = MAX_INVERTERS;
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		FakeInverter *fake = &fakes[idx];
+		fake->latency = 0;
+		fake->alive = true;
+		fake->log_shift = 0;
+		fake->log_short = 0;
+		fake->requests = 0;
+		fake->energy = 10000 * (idx + 1);
+		for (uint8_t val_idx = 0; val_idx < poll_keys_t::count; val_idx++)
+		{
+			fake->values[val_idx] = idx + 1;
+		}
+		fake->values[val_index(SMAKeyId::POWER)] = 1000 * (idx + 1);
+		fake->values[val_index(SMAKeyId::DC_VOLTAGE)] = 300 + 10 * idx;
+		g_inverters[idx].fails = 0;
+	}
+}
+
+void tearDown(void) {}
+
+static void test_wall_time(void)
+{
+	int values[poll_keys_t::count];
+	uint32_t wall_ms[MAX_INVERTERS];
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		fakes[idx].latency = LATENCY_MS;
+	}
+	for (uint8_t num = 1; num <= MAX_INVERTERS; num++)
+	{
+		g_num_inverters = num;
+		uint32_t start_time = millis();
+		TEST_ASSERT_EQUAL(num, poll_round(values, 10 * LATENCY_MS));
+		wall_ms[num - 1] = millis() - start_time;
+		TEST_ASSERT_EQUAL(500 * num * (num + 1), values[val_index(SMAKeyId::POWER)]);
+	}
+	printf("Poll round with %d ms latency per inverter:\n", LATENCY_MS);
+	for (uint8_t num = 1; num <= MAX_INVERTERS; num++)
+	{
+		printf("  %d inverters: %u ms\n", num, (unsigned int)wall_ms[num - 1]);
+		// In parallel, not one after the other
+		TEST_ASSERT_TRUE(wall_ms[num - 1] < 2 * LATENCY_MS);
+	}
+}
+
+static void test_aggregate(void)
+{
+	int values[poll_keys_t::count];
+	fakes[0].values[val_index(SMAKeyId::POWER)] = -1;
+	TEST_ASSERT_EQUAL(MAX_INVERTERS, poll_round(values, LATENCY_MS));
+	// -1 at night is left out
+	TEST_ASSERT_EQUAL(20000, values[val_index(SMAKeyId::POWER)]);
+	// Voltages are averaged
+	TEST_ASSERT_EQUAL(325, values[val_index(SMAKeyId::DC_VOLTAGE)]);
+	TEST_ASSERT_EQUAL(21, values[VAL_ENERGY_TOTAL]);
+}
+
+static uint8_t answered_count = 0;
+
+static void count_answered(s_inverter *inv)
+{
+	answered_count++;
+}
+
+static void test_dead_inverter(void)
+{
+	int values[poll_keys_t::count];
+	fakes[2].alive = false;
+	answered_count = 0;
+	TEST_ASSERT_EQUAL(MAX_INVERTERS - 1, poll_round(values, LATENCY_MS, count_answered));
+	TEST_ASSERT_EQUAL(MAX_INVERTERS - 1, answered_count);
+	TEST_ASSERT_EQUAL(18000, values[val_index(SMAKeyId::POWER)]);
+	TEST_ASSERT_EQUAL(1, g_inverters[2].fails);
+	TEST_ASSERT_EQUAL(0, g_inverters[1].fails);
+	// One request per round, no retries of the others
+	TEST_ASSERT_EQUAL(1, fakes[0].requests);
+	TEST_ASSERT_EQUAL(1, fakes[2].requests);
+
+	poll_round(values, LATENCY_MS);
+	TEST_ASSERT_EQUAL(2, g_inverters[2].fails);
+	fakes[2].alive = true;
+	poll_round(values, LATENCY_MS);
+	TEST_ASSERT_EQUAL(0, g_inverters[2].fails);
+}
+
+static void test_slow_inverter(void)
+{
+	int values[poll_keys_t::count];
+	fakes[1].latency = 3 * LATENCY_MS;
+	uint32_t start_time = millis();
+	TEST_ASSERT_EQUAL(MAX_INVERTERS - 1, poll_round(values, LATENCY_MS));
+	TEST_ASSERT_TRUE(millis() - start_time < 2 * LATENCY_MS);
+	TEST_ASSERT_EQUAL(19000, values[val_index(SMAKeyId::POWER)]);
+
+	// Still busy with the old round, it is skipped
+	TEST_ASSERT_EQUAL(MAX_INVERTERS - 1, poll_round(values, LATENCY_MS));
+	TEST_ASSERT_EQUAL(1, fakes[1].requests);
+
+	// The late result of the old round is not taken
+	delay(3 * LATENCY_MS);
+	fakes[1].latency = 0;
+	TEST_ASSERT_EQUAL(MAX_INVERTERS, poll_round(values, LATENCY_MS));
+	TEST_ASSERT_EQUAL(21000, values[val_index(SMAKeyId::POWER)]);
+}
+
+static void test_log_sum(void)
+{
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	uint32_t end = LOG_START + (LOG_ENTRIES - 1) * LOG_INTERVAL;
+	TEST_ASSERT_EQUAL(LOG_ENTRIES, read_inverter_log(LOG_START, end, values, timestamps, LATENCY_MS));
+	for (int entry = 0; entry < LOG_ENTRIES; entry++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(LOG_START + entry * LOG_INTERVAL, timestamps[entry]);
+		TEST_ASSERT_EQUAL_UINT32(210000 + MAX_INVERTERS * entry, values[entry]);
+	}
+}
+
+static void test_log_missing_inverter(void)
+{
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	uint32_t end = LOG_START + (LOG_ENTRIES - 1) * LOG_INTERVAL;
+	fakes[3].alive = false;
+	TEST_ASSERT_EQUAL(LOG_ENTRIES, read_inverter_log(LOG_START, end, values, timestamps, LATENCY_MS));
+	for (int entry = 0; entry < LOG_ENTRIES; entry++)
+	{
+		// A sum without the inverter would look like a drop of the total energy
+		TEST_ASSERT_EQUAL_UINT32(LOG_START + entry * LOG_INTERVAL, timestamps[entry]);
+		TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[entry]);
+	}
+
+	// The first inverter is the one that did not answer
+	fakes[3].alive = true;
+	fakes[0].alive = false;
+	TEST_ASSERT_EQUAL(LOG_ENTRIES, read_inverter_log(LOG_START, end, values, timestamps, LATENCY_MS));
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[0]);
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[LOG_ENTRIES - 1]);
+}
+
+static void test_log_mismatch(void)
+{
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	uint32_t end = LOG_START + (LOG_ENTRIES - 1) * LOG_INTERVAL;
+	fakes[4].log_short = 2;
+	TEST_ASSERT_EQUAL(LOG_ENTRIES, read_inverter_log(LOG_START, end, values, timestamps, LATENCY_MS));
+	TEST_ASSERT_EQUAL_UINT32(210000, values[0]);
+	TEST_ASSERT_EQUAL_UINT32(210000 + MAX_INVERTERS * (LOG_ENTRIES - 3), values[LOG_ENTRIES - 3]);
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[LOG_ENTRIES - 2]);
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[LOG_ENTRIES - 1]);
+
+	fakes[4].log_short = 0;
+	fakes[5].log_shift = 60;
+	TEST_ASSERT_EQUAL(LOG_ENTRIES, read_inverter_log(LOG_START, end, values, timestamps, LATENCY_MS));
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-1, values[0]);
+}
+
+static void test_log_none(void)
+{
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		fakes[idx].alive = false;
+	}
+	TEST_ASSERT_EQUAL(-1, read_inverter_log(LOG_START, LOG_START + LOG_INTERVAL, values, timestamps, LATENCY_MS));
+}
+
+int main(int argc, char **argv)
+{
+	g_num_inverters = MAX_INVERTERS;
+	for (uint8_t idx = 0; idx < MAX_INVERTERS; idx++)
+	{
+		g_inverters[idx].reader = &fakes[idx];
+	}
+	start_inverter_tasks();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_wall_time);
+	RUN_TEST(test_aggregate);
+	RUN_TEST(test_dead_inverter);
+	RUN_TEST(test_slow_inverter);
+	RUN_TEST(test_log_sum);
+	RUN_TEST(test_log_missing_inverter);
+	RUN_TEST(test_log_mismatch);
+	RUN_TEST(test_log_none);
+	return UNITY_END();
+}
@@ -0,0 +1,296 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the join manager with a simulated MAC, pio test -e native
+ * The scheduler runs on a frozen clock, the backoff of many failed joins takes no time.
+ * A reboot is simulated with a new lmh_init(), it resets the MAC like the real stack
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+// join.cpp is not in the native build, its statics are checked here
+#include "../../src/join.cpp"
+
+/** Globals and functions of the other modules that join.cpp uses */
+s_lorawan_settings g_lorawan_settings;
+uint32_t otaaDevAddr = 0;
+static uint32_t uplink_saves = 0;
+void uplink_save(void)
+{
+	uplink_saves++;
+}
+
+/** Failed joins in the backoff test */
+#define FAILED_JOINS 10
+
+/** Device address of the join accept */
+#define DEV_ADDR 0x260B1234
+
+/** Callbacks of the simulated MAC, the same as in lorawan.cpp */
+static void joined_handler(void)
+{
+	otaaDevAddr = lmh_getDevAddr();
+	join_succeeded();
+}
+
+static lmh_callback_t callbacks = {NULL, NULL, NULL, NULL, joined_handler, NULL, join_failed, NULL, NULL};
+
+/**
+ * @brief Start the LoRaWAN stack like init_lorawan() after a reboot
+ *
+ */
+static void boot(void)
+{
+	bool restored = join_restore_session();
+	lmh_param_t param = {false, (int8_t)g_lorawan_settings.data_rate, true, 1, 0, false};
+	lmh_init(&callbacks, param, g_lorawan_settings.otaa_enabled && !restored, CLASS_A, (LoRaMacRegion_t)g_lorawan_settings.lora_region);
+	lmh_setSubBandChannels(g_lorawan_settings.subband_channels);
+	start_join();
+}
+
+/**
+ * @brief Run the due jobs and move the clock on
+ *
+ * @param ms time to run
+ */
+static void run_for(uint32_t ms)
+{
+	uint32_t end = millis() + ms;
+	while (true)
+	{
+		uint32_t idle = run_scheduler();
+		int32_t left = (int32_t)(end - millis());
+		if (left <= 0)
+		{
+			break;
+		}
+		mock_advance(min(idle, (uint32_t)left));
+	}
+}
+
+/** Time until the join job runs */
+static uint32_t join_due(void)
+{
+	return g_jobs[join_job_id].due - millis();
+}
+
+/** Join request count saved in the preferences */
+static uint32_t saved_joins(void)
+{
+	Preferences preferences;
+	preferences.begin("Join", true);
+	uint32_t joins = preferences.getULong("joins", 0);
+	preferences.end();
+	return joins;
+}
+
+/** Join, accept it and let the scheduler save the session */
+static void join_and_save(void)
+{
+	boot();
+	run_for(0);
+	mock_mac_join_accept(DEV_ADDR);
+	run_for(0);
+}
+
+void setUp(void)
+{
+	mock_prefs_clear();
+	mock_mac() = s_mock_mac();
+	mock_restarts() = 0;
+	g_lorawan_settings = s_lorawan_settings();
+	g_lorawan_settings.lora_region = LORAMAC_REGION_EU868;
+	g_lorawan_settings.data_rate = 5;
+	session_restored = false;
+	mac_restored = false;
+}
+
+void tearDown(void) {}
+
+static void test_failed_joins(void)
+{
+	boot();
+	run_for(0);
+	TEST_ASSERT_EQUAL(JOIN_PENDING, g_join_state);
+	TEST_ASSERT_EQUAL_UINT32(1, mock_mac().joins);
+
+	bool jittered = false;
+	for (uint8_t fails = 1; fails <= FAILED_JOINS; fails++)
+	{
+		mock_mac_join_fail();
+		TEST_ASSERT_EQUAL(JOIN_BACKOFF, g_join_state);
+		uint32_t nominal = min((uint32_t)JOIN_BACKOFF_MIN << (fails - 1), (uint32_t)JOIN_BACKOFF_MAX) * 1000;
+		uint32_t backoff = join_due();
+		TEST_ASSERT_UINT32_WITHIN(nominal * JOIN_JITTER / 100, nominal, backoff);
+		jittered |= backoff != nominal;
+
+		// No request before the backoff ends
+		run_for(backoff - 1);
+		TEST_ASSERT_EQUAL_UINT32(fails, mock_mac().joins);
+		run_for(1);
+		TEST_ASSERT_EQUAL(JOIN_PENDING, g_join_state);
+		TEST_ASSERT_EQUAL_UINT32(fails + 1, mock_mac().joins);
+	}
+	TEST_ASSERT_TRUE(jittered);
+
+	// DR5, DR3, DR1, then again from DR5
+	for (uint8_t idx = 0; idx <= FAILED_JOINS; idx++)
+	{
+		TEST_ASSERT_EQUAL(5 - (idx % 3) * 2, mock_mac().join_datarates[idx]);
+	}
+	TEST_ASSERT_EQUAL_UINT32(FAILED_JOINS + 1, g_join_attempts);
+	TEST_ASSERT_EQUAL_UINT32(FAILED_JOINS + 1, saved_joins());
+
+	// The join succeeds with the configured DR again
+	mock_mac_join_accept(DEV_ADDR);
+	TEST_ASSERT_EQUAL(JOIN_JOINED, g_join_state);
+	TEST_ASSERT_EQUAL(5, mock_mac().datarate);
+	TEST_ASSERT_EQUAL(0, join_fails);
+}
+
+static void test_join_timeout(void)
+{
+	boot();
+	run_for(0);
+	// The MAC never answers
+	run_for(JOIN_TIMEOUT);
+	TEST_ASSERT_EQUAL(JOIN_BACKOFF, g_join_state);
+	TEST_ASSERT_EQUAL(1, join_fails);
+}
+
+static void test_session_saved(void)
+{
+	join_and_save();
+	TEST_ASSERT_EQUAL(JOIN_JOINED, g_join_state);
+
+	Preferences preferences;
+	preferences.begin("Join", true);
+	TEST_ASSERT_TRUE(preferences.getBool("valid", false));
+	TEST_ASSERT_EQUAL_HEX32(DEV_ADDR, preferences.getULong("addr", 0));
+	s_mac_params params;
+	TEST_ASSERT_EQUAL(sizeof(params), preferences.getBytes("mac", &params, sizeof(params)));
+	preferences.end();
+	TEST_ASSERT_EQUAL_UINT32(5000, params.rx1_delay);
+	TEST_ASSERT_EQUAL_UINT32(6000, params.rx2_delay);
+	TEST_ASSERT_EQUAL_UINT32(869525000, params.rx2.Frequency);
+	TEST_ASSERT_EQUAL(DR_3, params.rx2.Datarate);
+	TEST_ASSERT_EQUAL_HEX16(0x00FF, params.mask[0]);
+	TEST_ASSERT_EQUAL_UINT32(867900000, params.channels[7].Frequency);
+}
+
+static void test_restore(void)
+{
+	join_and_save();
+	uint32_t attempts = g_join_attempts;
+
+	// Reboot, lmh_init() resets the MAC to the defaults
+	boot();
+	TEST_ASSERT_EQUAL_UINT32(1000, mock_mac().rx1_delay);
+	TEST_ASSERT_EQUAL_HEX16(0x0007, mock_mac().mask[0]);
+	run_for(0);
+
+	TEST_ASSERT_EQUAL(JOIN_JOINED, g_join_state);
+	TEST_ASSERT_TRUE(session_restored);
+	TEST_ASSERT_EQUAL_UINT32(attempts, g_join_attempts);
+	TEST_ASSERT_EQUAL_HEX32(DEV_ADDR, otaaDevAddr);
+	TEST_ASSERT_EQUAL_UINT32(JOIN_FCNT_STEP, mock_mac().fcnt_up);
+	TEST_ASSERT_EQUAL_UINT32(5000, mock_mac().rx1_delay);
+	TEST_ASSERT_EQUAL_UINT32(6000, mock_mac().rx2_delay);
+	TEST_ASSERT_EQUAL_UINT32(869525000, mock_mac().rx2.Frequency);
+	TEST_ASSERT_EQUAL(DR_3, mock_mac().rx2.Datarate);
+	TEST_ASSERT_EQUAL_HEX16(0x00FF, mock_mac().mask[0]);
+	for (uint8_t ch = 3; ch < 8; ch++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(867100000 + (ch - 3) * 200000, mock_mac().channels[ch].Frequency);
+	}
+}
+
+static void test_mac_command_saved(void)
+{
+	join_and_save();
+	// RXTimingSetupReq and a LinkADRReq of the network, then enough uplinks for a save
+	mock_mac().rx1_delay = 3000;
+	mock_mac().rx2_delay = 4000;
+	mock_mac().mask[0] = 0x00F8;
+	mock_mac().fcnt_up += JOIN_FCNT_STEP;
+	run_for(JOIN_CHECK_TIME);
+
+	boot();
+	run_for(0);
+	TEST_ASSERT_EQUAL_UINT32(3000, mock_mac().rx1_delay);
+	TEST_ASSERT_EQUAL_UINT32(4000, mock_mac().rx2_delay);
+	TEST_ASSERT_EQUAL_HEX16(0x00F8, mock_mac().mask[0]);
+	TEST_ASSERT_EQUAL_UINT32(2 * JOIN_FCNT_STEP, mock_mac().fcnt_up);
+}
+
+static void test_restore_fixed_plan(void)
+{
+	g_lorawan_settings.lora_region = LORAMAC_REGION_US915;
+	g_lorawan_settings.data_rate = 3;
+	g_lorawan_settings.subband_channels = 2;
+	boot();
+	run_for(0);
+	TEST_ASSERT_EQUAL_HEX16(0xFF00, mock_mac().mask[0]);
+	mock_mac_join_accept(DEV_ADDR);
+	// LinkADRReq of the join answer, half of the sub band
+	mock_mac().mask[0] = 0x0F00;
+	mock_mac().mask[4] = 0x0000;
+	run_for(0);
+
+	boot();
+	TEST_ASSERT_EQUAL_HEX16(0xFF00, mock_mac().mask[0]);
+	run_for(0);
+	TEST_ASSERT_EQUAL(JOIN_JOINED, g_join_state);
+	TEST_ASSERT_EQUAL_HEX16(0x0F00, mock_mac().mask[0]);
+	TEST_ASSERT_EQUAL_HEX16(0x0000, mock_mac().mask[4]);
+	TEST_ASSERT_EQUAL_UINT32(6000, mock_mac().rx2_delay);
+}
+
+static void test_old_session(void)
+{
+	join_and_save();
+	// Session saved without the MAC parameters
+	Preferences preferences;
+	preferences.begin("Join", false);
+	preferences.remove("mac");
+	preferences.end();
+
+	boot();
+	run_for(0);
+	TEST_ASSERT_EQUAL(JOIN_JOINED, g_join_state);
+	TEST_ASSERT_TRUE(session_restored);
+	TEST_ASSERT_FALSE(mac_restored);
+	TEST_ASSERT_EQUAL_UINT32(1000, mock_mac().rx1_delay);
+	TEST_ASSERT_EQUAL_HEX16(0x0007, mock_mac().mask[0]);
+}
+
+static void test_other_credentials(void)
+{
+	join_and_save();
+	// A session of another device EUI is not restored
+	g_lorawan_settings.node_device_eui[7]++;
+	boot();
+	run_for(0);
+	TEST_ASSERT_FALSE(session_restored);
+	TEST_ASSERT_EQUAL(JOIN_PENDING, g_join_state);
+	TEST_ASSERT_EQUAL_UINT32(1000, mock_mac().rx1_delay);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_failed_joins);
+	RUN_TEST(test_join_timeout);
+	RUN_TEST(test_session_saved);
+	RUN_TEST(test_restore);
+	RUN_TEST(test_mac_command_saved);
+	RUN_TEST(test_restore_fixed_plan);
+	RUN_TEST(test_old_session);
+	RUN_TEST(test_other_credentials);
+	return UNITY_END();
+}
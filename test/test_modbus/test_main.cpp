@@ -0,0 +1,158 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the Modbus TCP requests and the register coalescing, pio test -e native
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string.h>
+#include "modbus.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/**
+ * @brief Write a big endian 32 bit value, two registers
+ */
+static void put_be32(uint8_t *ptr, uint32_t value)
+{
+	ptr[0] = value >> 24;
+	ptr[1] = value >> 16;
+	ptr[2] = value >> 8;
+	ptr[3] = value;
+}
+
+/**
+ * @brief Build a read response like the inverter sends it
+ *
+ * @return size_t length of the response
+ */
+static size_t make_response(uint8_t *buffer, uint16_t transaction, const uint8_t *data, uint8_t byte_count)
+{
+	buffer[0] = transaction >> 8;
+	buffer[1] = transaction & 0xFF;
+	buffer[2] = 0;
+	buffer[3] = 0;
+	buffer[4] = 0;
+	buffer[5] = 3 + byte_count;
+	buffer[6] = MB_UNIT_ID;
+	buffer[7] = MB_FUNC_READ_INPUT;
+	buffer[8] = byte_count;
+	memcpy(&buffer[9], data, byte_count);
+	return MB_HEADER_SIZE + 3 + byte_count;
+}
+
+static void test_build_read(void)
+{
+	uint8_t buffer[MB_REQUEST_SIZE];
+	const s_mb_block block = {30529, 8};
+	TEST_ASSERT_EQUAL(0, mb_build_read(buffer, MB_REQUEST_SIZE - 1, 0x1234, &block));
+	TEST_ASSERT_EQUAL(MB_REQUEST_SIZE, mb_build_read(buffer, sizeof(buffer), 0x1234, &block));
+	const uint8_t expected[] = {0x12, 0x34, 0x00, 0x00, 0x00, 0x06, MB_UNIT_ID, MB_FUNC_READ_INPUT, 0x77, 0x41, 0x00, 0x08};
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, sizeof(expected));
+	TEST_ASSERT_EQUAL(MB_REQUEST_SIZE, mb_frame_length(buffer));
+}
+
+static void test_plan_blocks(void)
+{
+	const SMAKeyId ids[] = {SMAKeyId::POWER, SMAKeyId::AC_L1_POWER, SMAKeyId::DC_CURRENT, SMAKeyId::ENERGY_TOTAL,
+							SMAKeyId::ENERGY_TODAY, SMAKeyId::AC_FREQUENCY, SMAKeyId::AC_L1_CURRENT, SMAKeyId::WLAN_IP,
+							SMAKeyId::POWER};
+	s_mb_block blocks[MB_MAX_BLOCKS];
+	TEST_ASSERT_EQUAL(3, mb_plan_blocks(ids, 9, blocks, MB_MAX_BLOCKS));
+	// Energy today and total, 4 registers between them
+	TEST_ASSERT_EQUAL(30529, blocks[0].address);
+	TEST_ASSERT_EQUAL(8, blocks[0].count);
+	// DC current up to the frequency, the power is read only once
+	TEST_ASSERT_EQUAL(30769, blocks[1].address);
+	TEST_ASSERT_EQUAL(36, blocks[1].count);
+	// Too far away
+	TEST_ASSERT_EQUAL(30977, blocks[2].address);
+	TEST_ASSERT_EQUAL(2, blocks[2].count);
+	// Blocks that do not fit are dropped
+	TEST_ASSERT_EQUAL(2, mb_plan_blocks(ids, 9, blocks, 2));
+	// No key with a register
+	const SMAKeyId none[] = {SMAKeyId::WLAN_IP, SMAKeyId::DEVICE_OK};
+	TEST_ASSERT_EQUAL(0, mb_plan_blocks(none, 2, blocks, MB_MAX_BLOCKS));
+}
+
+static void test_values(void)
+{
+	const s_mb_block block = {30769, 36};
+	uint8_t data[72];
+	memset(data, 0, sizeof(data));
+	// POWER signed, AC_L1_POWER NaN, AC_FREQUENCY unsigned, DC_CURRENT negative
+	put_be32(&data[2 * (30775 - 30769)], 2500);
+	put_be32(&data[2 * (30777 - 30769)], 0x80000000);
+	put_be32(&data[2 * (30803 - 30769)], 5001);
+	put_be32(&data[0], (uint32_t)-5);
+	uint8_t buffer[MB_RESPONSE_MAX];
+	size_t len = make_response(buffer, 7, data, sizeof(data));
+
+	const uint8_t *registers = NULL;
+	TEST_ASSERT_EQUAL(72, mb_parse_read(buffer, len, 7, &block, &registers));
+	TEST_ASSERT_TRUE(registers == &buffer[9]);
+	int value = 0;
+	TEST_ASSERT_TRUE(mb_find_value(&block, registers, SMAKeyId::POWER, &value));
+	TEST_ASSERT_EQUAL(2500, value);
+	TEST_ASSERT_TRUE(mb_find_value(&block, registers, SMAKeyId::AC_L1_POWER, &value));
+	TEST_ASSERT_EQUAL(-1, value);
+	TEST_ASSERT_TRUE(mb_find_value(&block, registers, SMAKeyId::AC_FREQUENCY, &value));
+	TEST_ASSERT_EQUAL(5001, value);
+	TEST_ASSERT_TRUE(mb_find_value(&block, registers, SMAKeyId::DC_CURRENT, &value));
+	TEST_ASSERT_EQUAL(-5, value);
+	// Unsigned NaN
+	put_be32(&data[2 * (30803 - 30769)], 0xFFFFFFFF);
+	make_response(buffer, 7, data, sizeof(data));
+	TEST_ASSERT_TRUE(mb_find_value(&block, registers, SMAKeyId::AC_FREQUENCY, &value));
+	TEST_ASSERT_EQUAL(-1, value);
+	// Not in the block, no register
+	TEST_ASSERT_FALSE(mb_find_value(&block, registers, SMAKeyId::ENERGY_TOTAL, &value));
+	TEST_ASSERT_FALSE(mb_find_value(&block, registers, SMAKeyId::AC_L1_CURRENT, &value));
+	TEST_ASSERT_FALSE(mb_find_value(&block, registers, SMAKeyId::WLAN_IP, &value));
+}
+
+static void test_bad_responses(void)
+{
+	const s_mb_block block = {30529, 8};
+	uint8_t data[16] = {0};
+	uint8_t buffer[MB_RESPONSE_MAX];
+	const uint8_t *registers = NULL;
+	size_t len = make_response(buffer, 9, data, sizeof(data));
+	TEST_ASSERT_EQUAL(16, mb_parse_read(buffer, len, 9, &block, &registers));
+	// Other transaction, truncated, other register count
+	TEST_ASSERT_EQUAL(-1, mb_parse_read(buffer, len, 10, &block, &registers));
+	TEST_ASSERT_EQUAL(-1, mb_parse_read(buffer, len - 1, 9, &block, &registers));
+	const s_mb_block other = {30529, 10};
+	TEST_ASSERT_EQUAL(-1, mb_parse_read(buffer, len, 9, &other, &registers));
+	// Exception, illegal data address
+	const uint8_t exception[] = {0x00, 0x09, 0x00, 0x00, 0x00, 0x03, MB_UNIT_ID, MB_FUNC_READ_INPUT | 0x80, 0x02};
+	TEST_ASSERT_EQUAL(-2, mb_parse_read(exception, sizeof(exception), 9, &block, &registers));
+}
+
+static void test_serial(void)
+{
+	uint8_t data[4];
+	put_be32(data, 3012345678UL);
+	TEST_ASSERT_EQUAL_UINT32(3012345678UL, mb_get_u32(data));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_build_read);
+	RUN_TEST(test_plan_blocks);
+	RUN_TEST(test_values);
+	RUN_TEST(test_bad_responses);
+	RUN_TEST(test_serial);
+	return UNITY_END();
+}
@@ -0,0 +1,357 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the MQTT sink against the in-process fake broker, pio test -e native
+ * The scheduler job and the sink are called directly on a frozen clock, the broker answers
+ * when the test says so. The samples carry their number in the power, the tests check that
+ * every sample of the offline buffer reaches the broker in order and is removed only after
+ * the broker confirmed it
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string>
+#include <vector>
+// mqtt.cpp is not in the native build, its statics are checked here
+#include "../../src/mqtt.cpp"
+
+/** Globals and functions of the other modules that mqtt.cpp uses */
+char g_ap_name[] = "RAK-SMA-TEST";
+int8_t add_sink(const char *name, void (*handler)(s_sample *sample), bool (*ready)(void), uint8_t backlog)
+{
+	return 1;
+}
+
+/** Time of the first sample */
+#define START_UTC 1635724800
+
+/** Power of the first sample, the sample number is added */
+#define START_POWER 1000
+
+/** Samples put into the sink */
+static uint32_t next_sample = 0;
+
+/**
+ * @brief Put the next sample into the sink like the sink task
+ *
+ * @param count number of samples
+ */
+static void add_samples(uint32_t count)
+{
+	for (uint32_t idx = 0; idx < count; idx++)
+	{
+		s_sample sample;
+		sample.utc = START_UTC + next_sample * 300;
+		sample.values[0] = START_POWER + next_sample;
+		sample.valid = true;
+		mqtt_sink(&sample);
+		next_sample++;
+	}
+}
+
+/**
+ * @brief Get the sample numbers of a message, from the power of each sample
+ *
+ * @param message message of the broker
+ * @return std::vector<uint32_t> sample numbers
+ */
+static std::vector<uint32_t> samples_of(const s_mock_mqtt_message &message)
+{
+	std::vector<uint32_t> found;
+	const std::string &payload = message.payload;
+	TEST_ASSERT_EQUAL('[', payload[0]);
+	TEST_ASSERT_EQUAL(']', payload[payload.size() - 1]);
+	size_t pos = 0;
+	while ((pos = payload.find("{\"t\":", pos)) != std::string::npos)
+	{
+		uint32_t utc = strtoul(payload.c_str() + pos + 5, NULL, 10);
+		size_t power_pos = payload.find(",\"p\":", pos);
+		TEST_ASSERT_TRUE(power_pos != std::string::npos);
+		uint32_t number = strtoul(payload.c_str() + power_pos + 5, NULL, 10) - START_POWER;
+		TEST_ASSERT_EQUAL_UINT32(START_UTC + number * 300, utc);
+		found.push_back(number);
+		pos = power_pos;
+	}
+	return found;
+}
+
+/**
+ * @brief Get the messages of a topic
+ *
+ * @param topic topic
+ * @return std::vector<s_mock_mqtt_message> messages in the order they were sent
+ */
+static std::vector<s_mock_mqtt_message> messages_of(const char *topic)
+{
+	std::vector<s_mock_mqtt_message> found;
+	s_mock_broker &broker = mock_broker();
+	for (size_t idx = 0; idx < broker.messages.size(); idx++)
+	{
+		if (broker.messages[idx].topic == topic)
+		{
+			found.push_back(broker.messages[idx]);
+		}
+	}
+	return found;
+}
+
+/**
+ * @brief Connect to the broker like the scheduler job does, the broker confirms the status
+ *
+ */
+static void connect(void)
+{
+	uint32_t connects = mock_broker().connects;
+	mqtt_job();
+	TEST_ASSERT_EQUAL_UINT32(connects + 1, mock_broker().connects);
+	mock_broker_accept();
+	TEST_ASSERT_TRUE(mqtt_client.connected());
+	// The status "online" is sent with QoS 1
+	TEST_ASSERT_EQUAL(1, mock_broker().unacked.size());
+	TEST_ASSERT_TRUE(mock_broker_ack(mock_broker().unacked[0]));
+}
+
+/**
+ * @brief Confirm the messages one by one until the offline buffer has less than a batch
+ *
+ * @return uint32_t confirmed messages
+ */
+static uint32_t ack_all(void)
+{
+	uint32_t acks = 0;
+	while (!mock_broker().unacked.empty())
+	{
+		TEST_ASSERT_EQUAL(1, mock_broker().unacked.size());
+		TEST_ASSERT_TRUE(mock_broker_ack(mock_broker().unacked[0]));
+		acks++;
+		// The confirmation reschedules the job, it sends the next message
+		mqtt_job();
+	}
+	return acks;
+}
+
+void setUp(void)
+{
+	mock_broker_reset();
+	mock_wifi_connected() = true;
+	g_mqtt_settings = s_mqtt_settings();
+	snprintf(g_mqtt_settings.host, sizeof(g_mqtt_settings.host), "192.168.1.10");
+	snprintf(g_mqtt_settings.topic, sizeof(g_mqtt_settings.topic), "home/solar");
+	ring_head = 0;
+	ring_count = 0;
+	pending_id = 0;
+	pending_count = 0;
+	connecting = false;
+	reconnect = false;
+	mqtt_sent = 0;
+	mqtt_dropped = 0;
+	next_sample = 0;
+}
+
+void tearDown(void) {}
+
+static void test_offline_buffer(void)
+{
+	// The broker does not answer, the samples are kept in the offline buffer
+	mqtt_job();
+	TEST_ASSERT_EQUAL_UINT32(1, mock_broker().connects);
+	add_samples(MQTT_BUFFER_SIZE_NO_PSRAM + 8);
+	TEST_ASSERT_EQUAL(MQTT_BUFFER_SIZE_NO_PSRAM, ring_count);
+	TEST_ASSERT_EQUAL_UINT32(8, mqtt_dropped);
+	TEST_ASSERT_EQUAL(0, mock_broker().messages.size());
+
+	// The connection attempt times out, the next job tries again
+	mock_advance(MQTT_CONNECT_TIMEOUT - 1);
+	mqtt_job();
+	TEST_ASSERT_TRUE(connecting);
+	mock_advance(1);
+	mqtt_job();
+	TEST_ASSERT_FALSE(connecting);
+	connect();
+	TEST_ASSERT_EQUAL_STRING("online", mock_broker().retained["home/solar/status"].c_str());
+
+	// The oldest samples were dropped, the others arrive in order, each one once
+	mqtt_job();
+	TEST_ASSERT_EQUAL_UINT32(MQTT_BUFFER_SIZE_NO_PSRAM, ack_all());
+	std::vector<s_mock_mqtt_message> messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(MQTT_BUFFER_SIZE_NO_PSRAM, messages.size());
+	for (size_t idx = 0; idx < messages.size(); idx++)
+	{
+		std::vector<uint32_t> samples = samples_of(messages[idx]);
+		TEST_ASSERT_EQUAL(1, samples.size());
+		TEST_ASSERT_EQUAL_UINT32(8 + idx, samples[0]);
+		TEST_ASSERT_EQUAL(1, messages[idx].qos);
+		TEST_ASSERT_TRUE(messages[idx].retain);
+	}
+	TEST_ASSERT_EQUAL(0, ring_count);
+	TEST_ASSERT_EQUAL_UINT32(MQTT_BUFFER_SIZE_NO_PSRAM, mqtt_sent);
+
+	// Online the samples go out when they come
+	add_samples(1);
+	TEST_ASSERT_EQUAL(1, mock_broker().unacked.size());
+	ack_all();
+	TEST_ASSERT_EQUAL(0, ring_count);
+}
+
+static void test_ack_handling(void)
+{
+	g_mqtt_settings.batch = 5;
+	connect();
+	add_samples(12);
+	// One message at a time, the second batch waits for the confirmation of the first
+	std::vector<s_mock_mqtt_message> messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(1, messages.size());
+	uint16_t first_id = messages[0].packet_id;
+	TEST_ASSERT_EQUAL(12, ring_count);
+
+	// A confirmation of another message changes nothing
+	on_mqtt_publish(first_id + 100);
+	TEST_ASSERT_EQUAL(12, ring_count);
+
+	TEST_ASSERT_TRUE(mock_broker_ack(first_id));
+	TEST_ASSERT_EQUAL(7, ring_count);
+	mqtt_job();
+	messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(2, messages.size());
+
+	// Not confirmed in time, the same samples are sent again with a new packet id
+	mock_advance(MQTT_PUBLISH_TIMEOUT - 1);
+	mqtt_job();
+	TEST_ASSERT_EQUAL(2, messages_of("home/solar/samples").size());
+	mock_advance(1);
+	mqtt_job();
+	messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(3, messages.size());
+	TEST_ASSERT_TRUE(messages[2].packet_id != messages[1].packet_id);
+	TEST_ASSERT_TRUE(samples_of(messages[1]) == samples_of(messages[2]));
+
+	// The late confirmation of the first send is ignored
+	on_mqtt_publish(messages[1].packet_id);
+	TEST_ASSERT_EQUAL(7, ring_count);
+
+	// The connection breaks before the confirmation, the samples are sent again after the reconnect
+	mock_broker_drop();
+	TEST_ASSERT_EQUAL_STRING("offline", mock_broker().retained["home/solar/status"].c_str());
+	TEST_ASSERT_EQUAL(7, ring_count);
+	connect();
+	mqtt_job();
+	messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(4, messages.size());
+	TEST_ASSERT_TRUE(samples_of(messages[1]) == samples_of(messages[3]));
+	TEST_ASSERT_EQUAL(1, ack_all());
+
+	// Samples 0 to 9 confirmed once, 10 and 11 wait for a full batch
+	std::vector<uint32_t> expected = samples_of(messages[0]);
+	std::vector<uint32_t> second = samples_of(messages[3]);
+	expected.insert(expected.end(), second.begin(), second.end());
+	TEST_ASSERT_EQUAL(10, expected.size());
+	for (uint32_t idx = 0; idx < expected.size(); idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(idx, expected[idx]);
+	}
+	TEST_ASSERT_EQUAL_UINT32(10, mqtt_sent);
+	TEST_ASSERT_EQUAL(2, ring_count);
+}
+
+static void test_qos0(void)
+{
+	// Without confirmation the samples are removed when they are sent
+	g_mqtt_settings.qos = 0;
+	g_mqtt_settings.retain = false;
+	g_mqtt_settings.batch = 2;
+	connect();
+	add_samples(7);
+	std::vector<s_mock_mqtt_message> messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(3, messages.size());
+	TEST_ASSERT_EQUAL(0, mock_broker().unacked.size());
+	for (size_t idx = 0; idx < messages.size(); idx++)
+	{
+		std::vector<uint32_t> samples = samples_of(messages[idx]);
+		TEST_ASSERT_EQUAL(2, samples.size());
+		TEST_ASSERT_EQUAL_UINT32(2 * idx, samples[0]);
+		TEST_ASSERT_EQUAL_UINT32(2 * idx + 1, samples[1]);
+		TEST_ASSERT_EQUAL(0, messages[idx].qos);
+		TEST_ASSERT_FALSE(messages[idx].retain);
+	}
+	TEST_ASSERT_EQUAL(1, ring_count);
+	TEST_ASSERT_EQUAL_UINT32(6, mqtt_sent);
+	TEST_ASSERT_EQUAL(0, mock_broker().retained.count("home/solar/samples"));
+}
+
+static void test_full_while_pending(void)
+{
+	// The buffer fills up while a message waits for its confirmation
+	connect();
+	add_samples(MQTT_BUFFER_SIZE_NO_PSRAM + 5);
+	TEST_ASSERT_EQUAL(MQTT_BUFFER_SIZE_NO_PSRAM, ring_count);
+	TEST_ASSERT_EQUAL_UINT32(5, mqtt_dropped);
+
+	// The samples of the pending message were kept, the new ones were dropped
+	TEST_ASSERT_EQUAL(MQTT_BUFFER_SIZE_NO_PSRAM, ack_all());
+	std::vector<s_mock_mqtt_message> messages = messages_of("home/solar/samples");
+	TEST_ASSERT_EQUAL(MQTT_BUFFER_SIZE_NO_PSRAM, messages.size());
+	for (size_t idx = 0; idx < messages.size(); idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(idx, samples_of(messages[idx])[0]);
+	}
+}
+
+static void test_settings_changed(void)
+{
+	connect();
+	TEST_ASSERT_EQUAL_STRING("192.168.1.10", mock_broker().host.c_str());
+	TEST_ASSERT_EQUAL(1883, mock_broker().port);
+	TEST_ASSERT_EQUAL_STRING("", mock_broker().user.c_str());
+	TEST_ASSERT_EQUAL_STRING("home/solar/status", mock_broker().will.topic.c_str());
+	TEST_ASSERT_EQUAL_STRING("offline", mock_broker().will.payload.c_str());
+	TEST_ASSERT_TRUE(mock_broker().will.retain);
+
+	// New settings, the client disconnects and connects with them
+	snprintf(g_mqtt_settings.host, sizeof(g_mqtt_settings.host), "broker.local");
+	g_mqtt_settings.port = 8883;
+	snprintf(g_mqtt_settings.user, sizeof(g_mqtt_settings.user), "solar");
+	snprintf(g_mqtt_settings.pass, sizeof(g_mqtt_settings.pass), "secret");
+	snprintf(g_mqtt_settings.topic, sizeof(g_mqtt_settings.topic), "pv");
+	mqtt_settings_changed();
+	mqtt_job();
+	TEST_ASSERT_FALSE(mqtt_client.connected());
+	connect();
+	TEST_ASSERT_EQUAL_STRING("broker.local", mock_broker().host.c_str());
+	TEST_ASSERT_EQUAL(8883, mock_broker().port);
+	TEST_ASSERT_EQUAL_STRING("solar", mock_broker().user.c_str());
+	TEST_ASSERT_EQUAL_STRING("secret", mock_broker().pass.c_str());
+	TEST_ASSERT_EQUAL_STRING("pv/status", mock_broker().will.topic.c_str());
+	TEST_ASSERT_EQUAL_STRING("online", mock_broker().retained["pv/status"].c_str());
+	add_samples(1);
+	TEST_ASSERT_EQUAL(1, messages_of("pv/samples").size());
+
+	// Without a broker MQTT is off, the client disconnects
+	g_mqtt_settings.host[0] = 0;
+	mqtt_settings_changed();
+	mqtt_job();
+	TEST_ASSERT_FALSE(mqtt_client.connected());
+	uint32_t connects = mock_broker().connects;
+	mqtt_job();
+	TEST_ASSERT_EQUAL_UINT32(connects, mock_broker().connects);
+
+	char status[32];
+	mqtt_status(status, sizeof(status));
+	TEST_ASSERT_EQUAL_STRING("0:1:0:0", status);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+	init_mqtt();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_offline_buffer);
+	RUN_TEST(test_ack_handling);
+	RUN_TEST(test_qos0);
+	RUN_TEST(test_full_while_pending);
+	RUN_TEST(test_settings_changed);
+	return UNITY_END();
+}
@@ -0,0 +1,116 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of sunrise/sunset and the poll mode selection, pio test -e native
+ * @version 0.1
+ * @date 2021-10-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include "poll_mode.h"
+
+// Day of the year (0 based) of June 21 and December 21 2021
+#define DAY_SUMMER 171
+#define DAY_WINTER 354
+
+// 2021-06-21 12:00 UTC
+#define JUNE_21_NOON 1624276800
+
+void setUp(void)
+{
+	// Start every test in the night without fast polls
+	poll_policy(0, false);
+}
+
+void tearDown(void)
+{
+}
+
+static void test_sun_times_berlin(void)
+{
+	float sunrise;
+	float sunset;
+	// Sunrise 04:43 CEST, sunset 21:33 CEST
+	TEST_ASSERT_EQUAL(0, sun_times(DAY_SUMMER, 52.52, 13.40, &sunrise, &sunset));
+	TEST_ASSERT_FLOAT_WITHIN(3.0, 2 * 60 + 43, sunrise);
+	TEST_ASSERT_FLOAT_WITHIN(3.0, 19 * 60 + 33, sunset);
+}
+
+static void test_sun_times_tokyo(void)
+{
+	float sunrise;
+	float sunset;
+	// Sunrise 04:25 JST is before midnight UTC, sunset 19:00 JST
+	TEST_ASSERT_EQUAL(0, sun_times(DAY_SUMMER, 35.68, 139.77, &sunrise, &sunset));
+	TEST_ASSERT_FLOAT_WITHIN(3.0, -(4 * 60 + 35), sunrise);
+	TEST_ASSERT_FLOAT_WITHIN(3.0, 10 * 60, sunset);
+}
+
+static void test_sun_times_polar(void)
+{
+	float sunrise;
+	float sunset;
+	TEST_ASSERT_EQUAL(1, sun_times(DAY_SUMMER, 80.0, 0.0, &sunrise, &sunset));
+	TEST_ASSERT_EQUAL(-1, sun_times(DAY_WINTER, 80.0, 0.0, &sunrise, &sunset));
+	TEST_ASSERT_EQUAL(-1, sun_times(DAY_SUMMER, -80.0, 0.0, &sunrise, &sunset));
+}
+
+static void test_is_daytime(void)
+{
+	TEST_ASSERT_TRUE(is_daytime(JUNE_21_NOON, 52.52, 13.40));
+	TEST_ASSERT_FALSE(is_daytime(JUNE_21_NOON + 11 * 3600, 52.52, 13.40));
+	// Tokyo, the day crosses midnight UTC, 05:00 JST and 21:00 JST
+	TEST_ASSERT_TRUE(is_daytime(JUNE_21_NOON + 8 * 3600, 35.68, 139.77));
+	TEST_ASSERT_FALSE(is_daytime(JUNE_21_NOON, 35.68, 139.77));
+	// Midnight sun
+	TEST_ASSERT_TRUE(is_daytime(JUNE_21_NOON + 12 * 3600, 80.0, 0.0));
+}
+
+static void test_policy_fast_after_change(void)
+{
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(1000, true));
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(1010, true));
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(1020, true));
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(1030, true));
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(1040, true));
+}
+
+static void test_policy_threshold(void)
+{
+	poll_policy(2000, true);
+	poll_policy(2000, true);
+	poll_policy(2000, true);
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(2000, true));
+	// 10 % of 2000 W
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(2200, true));
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(2500, true));
+	// Small power, the min delta of 50 W counts
+	poll_policy(100, true);
+	poll_policy(100, true);
+	poll_policy(100, true);
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(140, true));
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(200, true));
+}
+
+static void test_policy_night(void)
+{
+	TEST_ASSERT_EQUAL(POLL_FAST, poll_policy(1000, true));
+	TEST_ASSERT_EQUAL(POLL_NIGHT, poll_policy(-1, false));
+	// The fast polls are not continued after the night
+	TEST_ASSERT_EQUAL(POLL_SLOW, poll_policy(-1, true));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_sun_times_berlin);
+	RUN_TEST(test_sun_times_tokyo);
+	RUN_TEST(test_sun_times_polar);
+	RUN_TEST(test_is_daytime);
+	RUN_TEST(test_policy_fast_after_change);
+	RUN_TEST(test_policy_threshold);
+	RUN_TEST(test_policy_night);
+	return UNITY_END();
+}
@@ -0,0 +1,263 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the deadline scheduler on a simulated clock, pio test -e native
+ * The clock is frozen, sched_idle() moves it to the next deadline like the light sleep of the device.
+ * The jobs record when they ran, the tests check the order of the deadlines and the jitter
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <thread>
+#include <vector>
+#include "scheduler.h"
+
+/** Calls of the jobs, job letter and millis() of the call */
+struct s_call
+{
+	char job;
+	uint32_t time;
+};
+static std::vector<s_call> calls;
+
+/** Time a job needs, moves the frozen clock on */
+static uint32_t busy_ms = 0;
+
+static void job_a(void)
+{
+	calls.push_back({'a', millis()});
+	delay(busy_ms);
+}
+
+static void job_b(void)
+{
+	calls.push_back({'b', millis()});
+}
+
+static void job_c(void)
+{
+	calls.push_back({'c', millis()});
+}
+
+/**
+ * @brief Run the scheduler like the loop task, idle until the next deadline
+ *
+ * @param ms simulated time to run
+ */
+static void run_for(uint32_t ms)
+{
+	uint32_t end = millis() + ms;
+	while ((int32_t)(end - millis()) > 0)
+	{
+		uint32_t idle = run_scheduler();
+		sched_idle(min(idle, end - millis()));
+	}
+}
+
+/**
+ * @brief Count the calls of a job
+ *
+ * @param job job letter
+ * @return uint32_t number of calls
+ */
+static uint32_t count(char job)
+{
+	uint32_t found = 0;
+	for (size_t idx = 0; idx < calls.size(); idx++)
+	{
+		if (calls[idx].job == job)
+		{
+			found++;
+		}
+	}
+	return found;
+}
+
+void setUp(void)
+{
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		g_jobs[idx] = s_job();
+	}
+	calls.clear();
+	busy_ms = 0;
+}
+
+void tearDown(void) {}
+
+static void test_deadline_order(void)
+{
+	uint32_t start = millis();
+	schedule("C", job_c, 300, 0);
+	schedule("A", job_a, 100, 0);
+	schedule("B", job_b, 200, 0);
+	run_for(1000);
+	TEST_ASSERT_EQUAL(3, calls.size());
+	TEST_ASSERT_EQUAL('a', calls[0].job);
+	TEST_ASSERT_EQUAL('b', calls[1].job);
+	TEST_ASSERT_EQUAL('c', calls[2].job);
+	// Idle until the deadline, not polled every SCHED_MAX_IDLE
+	TEST_ASSERT_EQUAL_UINT32(start + 100, calls[0].time);
+	TEST_ASSERT_EQUAL_UINT32(start + 200, calls[1].time);
+	TEST_ASSERT_EQUAL_UINT32(start + 300, calls[2].time);
+	// Single calls are not repeated
+	TEST_ASSERT_FALSE(g_jobs[0].active);
+}
+
+static void test_periodic_no_jitter(void)
+{
+	uint32_t start = millis();
+	schedule("A", job_a, 0, 1000);
+	schedule("B", job_b, 250, 500);
+	run_for(10000);
+	TEST_ASSERT_EQUAL_UINT32(10, count('a'));
+	TEST_ASSERT_EQUAL_UINT32(20, count('b'));
+	uint32_t next_a = start;
+	uint32_t next_b = start + 250;
+	for (size_t idx = 0; idx < calls.size(); idx++)
+	{
+		if (calls[idx].job == 'a')
+		{
+			TEST_ASSERT_EQUAL_UINT32(next_a, calls[idx].time);
+			next_a += 1000;
+		}
+		else
+		{
+			TEST_ASSERT_EQUAL_UINT32(next_b, calls[idx].time);
+			next_b += 500;
+		}
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, g_jobs[0].max_late);
+	TEST_ASSERT_EQUAL_UINT32(0, g_jobs[1].max_late);
+}
+
+static void test_busy_job_jitter(void)
+{
+	// A needs 30 ms, B is due while A runs and is late by the rest of it
+	uint32_t start = millis();
+	busy_ms = 30;
+	schedule("A", job_a, 0, 1000);
+	schedule("B", job_b, 10, 1000);
+	run_for(5000);
+	TEST_ASSERT_EQUAL_UINT32(5, count('b'));
+	TEST_ASSERT_EQUAL_UINT32(20, g_jobs[1].max_late);
+	TEST_ASSERT_EQUAL_UINT32(0, g_jobs[0].max_late);
+	// The period is kept, the delay does not add up
+	TEST_ASSERT_EQUAL('b', calls.back().job);
+	TEST_ASSERT_EQUAL_UINT32(start + 4030, calls.back().time);
+	printf("Job of 30 ms: max jitter of the next job %u ms\n", (unsigned int)g_jobs[1].max_late);
+}
+
+static void test_most_overdue_first(void)
+{
+	// Both are due when the scheduler runs, the one with the earlier deadline goes first
+	uint32_t start = millis();
+	schedule("B", job_b, 50, 0);
+	schedule("C", job_c, 20, 0);
+	mock_advance(100);
+	run_scheduler();
+	TEST_ASSERT_EQUAL(2, calls.size());
+	TEST_ASSERT_EQUAL('c', calls[0].job);
+	TEST_ASSERT_EQUAL('b', calls[1].job);
+	TEST_ASSERT_EQUAL_UINT32(80, g_jobs[1].max_late);
+	TEST_ASSERT_EQUAL_UINT32(start + 100, calls[1].time);
+}
+
+static void test_missed_periods(void)
+{
+	// A blocks for 2.5 periods, the missed calls of B are skipped and not run back to back
+	int8_t a = schedule("A", job_a, 100, 0);
+	schedule("B", job_b, 0, 100);
+	busy_ms = 250;
+	run_for(1000);
+	for (size_t idx = 1; idx < calls.size(); idx++)
+	{
+		TEST_ASSERT_TRUE(calls[idx].time > calls[idx - 1].time);
+	}
+	TEST_ASSERT_FALSE(g_jobs[a].active);
+	TEST_ASSERT_EQUAL_UINT32(8, count('b'));
+}
+
+static void test_reschedule(void)
+{
+	uint32_t start = millis();
+	int8_t a = schedule("A", job_a, 100, 100);
+	run_for(350);
+	TEST_ASSERT_EQUAL_UINT32(3, count('a'));
+
+	unschedule(a);
+	run_for(1000);
+	TEST_ASSERT_EQUAL_UINT32(3, count('a'));
+	TEST_ASSERT_EQUAL_UINT32(1000, run_scheduler());
+
+	reschedule(a, 50, 0);
+	run_for(1000);
+	TEST_ASSERT_EQUAL_UINT32(4, count('a'));
+	TEST_ASSERT_EQUAL_UINT32(start + 1400, calls.back().time);
+
+	// Out of range ids are ignored
+	reschedule(-1, 0, 0);
+	reschedule(MAX_JOBS, 0, 0);
+	unschedule(MAX_JOBS);
+}
+
+static void test_table_full(void)
+{
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		TEST_ASSERT_EQUAL(idx, schedule("C", job_c, 1000, 0));
+	}
+	TEST_ASSERT_EQUAL(-1, schedule("B", job_b, 0, 0));
+	run_for(10);
+	TEST_ASSERT_EQUAL(0, calls.size());
+}
+
+static void test_millis_wrap(void)
+{
+	// Deadlines across the wrap of millis() keep their order
+	mock_advance((uint32_t)0 - millis() - 150);
+	schedule("B", job_b, 200, 0);
+	schedule("A", job_a, 100, 0);
+	run_for(300);
+	TEST_ASSERT_EQUAL(2, calls.size());
+	TEST_ASSERT_EQUAL('a', calls[0].job);
+	TEST_ASSERT_EQUAL_UINT32((uint32_t)-50, calls[0].time);
+	TEST_ASSERT_EQUAL_UINT32(50, calls[1].time);
+}
+
+static void test_wake_on_schedule(void)
+{
+	// A job added by another task ends the idle wait at once
+	schedule("A", job_a, 5000, 0);
+	uint32_t idle = run_scheduler();
+	TEST_ASSERT_EQUAL_UINT32(SCHED_MAX_IDLE, idle);
+	std::thread other([]()
+					  { schedule("B", job_b, 0, 0); });
+	other.join();
+	uint32_t start = millis();
+	sched_idle(idle);
+	TEST_ASSERT_EQUAL_UINT32(start, millis());
+	run_scheduler();
+	TEST_ASSERT_EQUAL(1, calls.size());
+	TEST_ASSERT_EQUAL('b', calls[0].job);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_deadline_order);
+	RUN_TEST(test_periodic_no_jitter);
+	RUN_TEST(test_busy_job_jitter);
+	RUN_TEST(test_most_overdue_first);
+	RUN_TEST(test_missed_periods);
+	RUN_TEST(test_reschedule);
+	RUN_TEST(test_table_full);
+	RUN_TEST(test_millis_wrap);
+	RUN_TEST(test_wake_on_schedule);
+	return UNITY_END();
+}
@@ -0,0 +1,236 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the sink fan-out with mock sinks, pio test -e native
+ * A fast sink, a sink that stalls in its handler and a sink that is not ready get the same
+ * samples. The fast sink must get every sample at the sample rate, the others keep the
+ * newest samples of their backlog and count the dropped ones. The clock runs, the sink tasks are threads
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <thread>
+#include <vector>
+// sinks.cpp is not in the native build, its statics are checked here
+#include "../../src/sinks.cpp"
+
+/** Globals and functions of the other modules that sinks.cpp uses */
+s_task_stats g_task_stats[MAX_STAGES];
+uint8_t g_num_stages = STAGE_ACQ + 1;
+AsyncUDP udp;
+IPAddress multiIP(239, 0, 0, 57);
+uint8_t g_udp_mode = UDP_MODE_BROADCAST;
+bool g_lpwan_has_joined = false;
+bool g_ble_uart_is_connected = false;
+BLECharacteristic *uart_tx_characteristic = NULL;
+void batch_add(s_sample *sample) {}
+void write_display(int power, int collected) {}
+uint8_t get_subscribers(s_subscriber *list)
+{
+	return 0;
+}
+
+/** The same as in tasks.cpp */
+void record_stage(s_task_stats *stats, uint32_t wait_ms, uint32_t proc_ms)
+{
+	stats->runs++;
+	stats->wait_ms = wait_ms;
+	stats->last_ms = proc_ms;
+	if (proc_ms > stats->max_ms)
+	{
+		stats->max_ms = proc_ms;
+	}
+}
+
+/** Samples published by the test */
+#define SAMPLES 40
+
+/** Time between the samples */
+#define SAMPLE_TIME 5
+
+/** Backlog of the mock sinks */
+#define BACKLOG 4
+
+/** Received samples of a mock sink, the sample number is in utc */
+struct s_mock_sink
+{
+	std::mutex mutex;
+	std::vector<uint32_t> samples;
+	uint32_t max_delay = 0;
+	int8_t stage = -1;
+};
+static s_mock_sink fast;
+static s_mock_sink stalled;
+static s_mock_sink not_ready;
+
+/** Gate of the stalled sink */
+static std::mutex gate_mutex;
+static std::condition_variable gate_cv;
+static bool gate_open = false;
+
+/** Readiness of the not ready sink */
+static std::atomic<bool> is_ready{false};
+
+static void receive(s_mock_sink &sink, s_sample *sample)
+{
+	std::lock_guard<std::mutex> lock(sink.mutex);
+	sink.samples.push_back(sample->utc);
+	uint32_t delay = millis() - sample->timestamp;
+	if (delay > sink.max_delay)
+	{
+		sink.max_delay = delay;
+	}
+}
+
+static void fast_sink(s_sample *sample)
+{
+	receive(fast, sample);
+}
+
+static void stalled_sink(s_sample *sample)
+{
+	std::unique_lock<std::mutex> lock(gate_mutex);
+	gate_cv.wait(lock, []()
+				 { return gate_open; });
+	lock.unlock();
+	receive(stalled, sample);
+}
+
+static void not_ready_sink(s_sample *sample)
+{
+	receive(not_ready, sample);
+}
+
+static bool not_ready_ready(void)
+{
+	return is_ready;
+}
+
+static size_t received(s_mock_sink &sink)
+{
+	std::lock_guard<std::mutex> lock(sink.mutex);
+	return sink.samples.size();
+}
+
+/**
+ * @brief Wait with the running clock until a condition is met
+ *
+ * @param ready condition
+ * @return true if it was met within 3 seconds, the not ready sink checks once a second
+ */
+template <typename Predicate>
+static bool wait_for(Predicate ready)
+{
+	for (uint16_t wait = 0; wait < 3000; wait++)
+	{
+		if (ready())
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return ready();
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+static void test_fan_out(void)
+{
+	uint32_t max_publish_us = 0;
+	for (uint32_t idx = 0; idx < SAMPLES; idx++)
+	{
+		s_sample sample;
+		sample.timestamp = millis();
+		sample.utc = idx;
+		sample.valid = true;
+		uint32_t start = micros();
+		publish_all(&sample);
+		uint32_t publish_us = micros() - start;
+		if (publish_us > max_publish_us)
+		{
+			max_publish_us = publish_us;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLE_TIME));
+	}
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return received(fast) == SAMPLES; }));
+
+	// The fast sink got every sample in order, without waiting for the others
+	for (uint32_t idx = 0; idx < SAMPLES; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(idx, fast.samples[idx]);
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, g_task_stats[fast.stage].drops);
+
+	// The stalled sink holds an early sample in its handler and the newest in its backlog,
+	// all samples were published while it was stalled
+	TEST_ASSERT_EQUAL(0, received(stalled));
+	TEST_ASSERT_EQUAL_UINT32(SAMPLES - 1 - BACKLOG, g_task_stats[stalled.stage].drops);
+	TEST_ASSERT_EQUAL(BACKLOG, uxQueueMessagesWaiting(g_task_stats[stalled.stage].queue));
+
+	// The not ready sink keeps its backlog
+	TEST_ASSERT_EQUAL(0, received(not_ready));
+	TEST_ASSERT_FALSE(g_task_stats[not_ready.stage].is_ready);
+	TEST_ASSERT_EQUAL_UINT32(SAMPLES - BACKLOG, g_task_stats[not_ready.stage].drops);
+
+	printf("%d samples every %d ms: fast sink %d, max delay %u ms, max publish %u us, drops of the stalled sink %u\n",
+		   SAMPLES, SAMPLE_TIME, (int)received(fast), (unsigned int)fast.max_delay, (unsigned int)max_publish_us,
+		   (unsigned int)g_task_stats[stalled.stage].drops);
+}
+
+static void test_drop_oldest(void)
+{
+	// The stalled sink goes on, it gets the sample it held and the newest samples
+	{
+		std::lock_guard<std::mutex> lock(gate_mutex);
+		gate_open = true;
+		gate_cv.notify_all();
+	}
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return received(stalled) == BACKLOG + 1; }));
+	TEST_ASSERT_TRUE(stalled.samples[0] < SAMPLES - BACKLOG);
+	for (uint32_t idx = 1; idx <= BACKLOG; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(SAMPLES - BACKLOG - 1 + idx, stalled.samples[idx]);
+	}
+
+	// The not ready sink is ready again, it gets the newest samples at its next check
+	is_ready = true;
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return received(not_ready) == BACKLOG; }));
+	for (uint32_t idx = 0; idx < BACKLOG; idx++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(SAMPLES - BACKLOG + idx, not_ready.samples[idx]);
+	}
+	TEST_ASSERT_TRUE(g_task_stats[not_ready.stage].is_ready);
+	TEST_ASSERT_EQUAL_UINT32(BACKLOG, g_task_stats[not_ready.stage].runs);
+	TEST_ASSERT_EQUAL_UINT32(SAMPLES, g_task_stats[fast.stage].runs);
+}
+
+static void test_table_full(void)
+{
+	while (g_num_stages < MAX_STAGES)
+	{
+		TEST_ASSERT_EQUAL(g_num_stages, add_sink("More", fast_sink, NULL, BACKLOG));
+	}
+	TEST_ASSERT_EQUAL(-1, add_sink("Full", fast_sink, NULL, BACKLOG));
+	TEST_ASSERT_EQUAL(MAX_STAGES, g_num_stages);
+}
+
+int main(int argc, char **argv)
+{
+	fast.stage = add_sink("Fast", fast_sink, NULL, BACKLOG);
+	stalled.stage = add_sink("Stall", stalled_sink, NULL, BACKLOG);
+	not_ready.stage = add_sink("NoRdy", not_ready_sink, not_ready_ready, BACKLOG);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_fan_out);
+	RUN_TEST(test_drop_oldest);
+	RUN_TEST(test_table_full);
+	return UNITY_END();
+}
@@ -0,0 +1,197 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the SMAReader keep-alive connections with a simulated link, pio test -e native
+ * The request times are on the mock clock, a new connection costs the TCP handshake.
+ * The benchmark compares cold and warm requests and the polls with and without keep-alive
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+// The library is not in the native build
+#include "SMAJsonParser.cpp"
+#include "SMAReader.cpp"
+#include "fake_sma.h"
+
+/** TCP handshake on a weak 2.4 GHz link */
+#define CONNECT_MS 120
+
+/** Request and response */
+#define REQUEST_MS 40
+
+/** Polls in the benchmark */
+#define POLLS 10
+
+typedef SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY> test_keys_t;
+
+static FakeSMA fake;
+
+/**
+ * @brief Time of a poll on the mock clock
+ *
+ * @param reader reader of the poll
+ * @return uint32_t duration in ms, 0 if the poll failed
+ */
+static uint32_t timed_poll(SMAReader &reader)
+{
+	int values[test_keys_t::count];
+	uint32_t start = millis();
+	if (!reader.getValues<test_keys_t>(values))
+	{
+		return 0;
+	}
+	TEST_ASSERT_EQUAL(1234, values[0]);
+	return millis() - start;
+}
+
+void setUp(void)
+{
+	SMAConnectionPool::closeAll();
+	fake = FakeSMA();
+	fake.values[KEY_POWER] = 1234;
+	fake.connect_ms = CONNECT_MS;
+	fake.request_ms = REQUEST_MS;
+	mock_http_server() = &fake;
+}
+
+void tearDown(void) {}
+
+static void test_cold_warm(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	// Login, then a cold and a warm request
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	SMAConnectionPool::closeAll();
+	uint32_t cold_ms = timed_poll(reader);
+	uint32_t warm_ms = timed_poll(reader);
+	TEST_ASSERT_EQUAL_UINT32(CONNECT_MS + REQUEST_MS, cold_ms);
+	TEST_ASSERT_EQUAL_UINT32(REQUEST_MS, warm_ms);
+
+	// Polls with keep-alive, the first one with the login
+	SMAReader keep_alive(IPAddress(192, 168, 1, 51), SMAREADER_USER, "secret", 3);
+	fake = FakeSMA();
+	fake.values[KEY_POWER] = 1234;
+	fake.connect_ms = CONNECT_MS;
+	fake.request_ms = REQUEST_MS;
+	uint32_t keep_alive_ms = 0;
+	for (uint8_t poll = 0; poll < POLLS; poll++)
+	{
+		keep_alive_ms += timed_poll(keep_alive);
+	}
+	TEST_ASSERT_EQUAL_UINT32(1, fake.connects);
+	TEST_ASSERT_EQUAL_UINT32(0, fake.http10_requests);
+
+	// A new connection for every request
+	SMAReader http10(IPAddress(192, 168, 1, 52), SMAREADER_USER, "secret", 3);
+	http10.setKeepAlive(false);
+	uint32_t requests = fake.requests;
+	uint32_t connects = fake.connects;
+	uint32_t http10_ms = 0;
+	for (uint8_t poll = 0; poll < POLLS; poll++)
+	{
+		http10_ms += timed_poll(http10);
+	}
+	TEST_ASSERT_EQUAL_UINT32(fake.requests - requests, fake.connects - connects);
+	TEST_ASSERT_EQUAL_UINT32(fake.requests - requests, fake.http10_requests);
+
+	printf("Cold request %u ms, warm request %u ms\n", (unsigned int)cold_ms, (unsigned int)warm_ms);
+	printf("%d polls with login: keep-alive %u ms, HTTP/1.0 %u ms\n", POLLS, (unsigned int)keep_alive_ms, (unsigned int)http10_ms);
+	TEST_ASSERT_TRUE(keep_alive_ms < http10_ms);
+}
+
+static void test_chunked(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	fake.chunked = true;
+	for (uint8_t poll = 0; poll < POLLS; poll++)
+	{
+		TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	}
+	// The body is read to the end, the connection is reused
+	TEST_ASSERT_EQUAL_UINT32(1, fake.connects);
+	TEST_ASSERT_EQUAL_UINT32(POLLS + 1, fake.requests);
+}
+
+static void test_idle_socket_closed(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	fake.idle_timeout_ms = 5000;
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+
+	// The inverter closed the idle socket, the request is repeated once with HTTP/1.0
+	delay(10000);
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.lost);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.http10_requests);
+
+	// HTTP/1.0 for SMAREADER_HTTP10_REQUESTS requests, then keep-alive again
+	for (uint8_t poll = 1; poll < SMAREADER_HTTP10_REQUESTS; poll++)
+	{
+		TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	}
+	TEST_ASSERT_EQUAL_UINT32(SMAREADER_HTTP10_REQUESTS, fake.http10_requests);
+	uint32_t connects = fake.connects;
+	TEST_ASSERT_EQUAL_UINT32(CONNECT_MS + REQUEST_MS, timed_poll(reader));
+	TEST_ASSERT_EQUAL_UINT32(REQUEST_MS, timed_poll(reader));
+	TEST_ASSERT_EQUAL_UINT32(SMAREADER_HTTP10_REQUESTS, fake.http10_requests);
+	TEST_ASSERT_EQUAL_UINT32(connects + 1, fake.connects);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.lost);
+}
+
+static void test_offline_keeps_mode(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+
+	// Warm connection lost and no new connection: offline, not a keep-alive problem
+	fake.online = false;
+	TEST_ASSERT_EQUAL_UINT32(0, timed_poll(reader));
+	TEST_ASSERT_EQUAL_UINT32(1, fake.lost);
+
+	// Cold requests refused
+	SMAConnectionPool::closeAll();
+	TEST_ASSERT_EQUAL_UINT32(0, timed_poll(reader));
+
+	fake.online = true;
+	TEST_ASSERT_EQUAL_UINT32(CONNECT_MS + REQUEST_MS, timed_poll(reader));
+	TEST_ASSERT_EQUAL_UINT32(REQUEST_MS, timed_poll(reader));
+	TEST_ASSERT_EQUAL_UINT32(0, fake.http10_requests);
+}
+
+static void test_connection_close(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	fake.close_connections = true;
+	// Login with HTTP/1.1, answered with Connection: close
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.http10_requests);
+	for (uint8_t poll = 1; poll < SMAREADER_HTTP10_REQUESTS; poll++)
+	{
+		TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	}
+	TEST_ASSERT_EQUAL_UINT32(SMAREADER_HTTP10_REQUESTS, fake.http10_requests);
+	// Keep-alive is tried again and refused again
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	TEST_ASSERT_EQUAL_UINT32(SMAREADER_HTTP10_REQUESTS, fake.http10_requests);
+	TEST_ASSERT_TRUE(timed_poll(reader) > 0);
+	TEST_ASSERT_EQUAL_UINT32(SMAREADER_HTTP10_REQUESTS + 1, fake.http10_requests);
+	// Never a lost connection, every request on a new one
+	TEST_ASSERT_EQUAL_UINT32(0, fake.lost);
+	TEST_ASSERT_EQUAL_UINT32(fake.requests, fake.connects);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_cold_warm);
+	RUN_TEST(test_chunked);
+	RUN_TEST(test_idle_socket_closed);
+	RUN_TEST(test_offline_keeps_mode);
+	RUN_TEST(test_connection_close);
+	return UNITY_END();
+}
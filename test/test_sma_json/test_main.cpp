@@ -0,0 +1,390 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests and benchmark of the streaming JSON parser of the SMA library, pio test -e native
+ * getValues responses of 2, 20 and 200 keys and a 50 kB getAllOnlValues response in the format of the inverter
+ * are parsed with the read buffer and handlers of SMAReader. The heap is counted by the new and delete
+ * of this test, the parser must not use it
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string>
+// The library is not in the native build
+#include "SMAJsonParser.cpp"
+#include "SMAReader.cpp"
+#include "fake_sma.h"
+
+/** Size of the getAllOnlValues response */
+#define ALL_VALUES_SIZE (50 * 1024)
+
+/** Parse runs of the benchmark */
+#define BENCH_RUNS 20
+
+/** Heap use while counting is on */
+static bool heap_counting = false;
+static size_t heap_now = 0;
+static size_t heap_peak = 0;
+static uint32_t heap_allocs = 0;
+
+/** The size is kept in front of each block, aligned for any type */
+#define HEAP_HEADER 16
+
+void *operator new(size_t size)
+{
+	uint8_t *block = (uint8_t *)malloc(size + HEAP_HEADER);
+	if (block == NULL)
+	{
+		throw std::bad_alloc();
+	}
+	*(size_t *)block = size;
+	if (heap_counting)
+	{
+		heap_allocs++;
+		heap_now += size;
+		heap_peak = max(heap_peak, heap_now);
+	}
+	return block + HEAP_HEADER;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	if (ptr == NULL)
+	{
+		return;
+	}
+	uint8_t *block = (uint8_t *)ptr - HEAP_HEADER;
+	if (heap_counting)
+	{
+		heap_now -= min(heap_now, *(size_t *)block);
+	}
+	free(block);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+
+static void heap_start(void)
+{
+	heap_now = 0;
+	heap_peak = 0;
+	heap_allocs = 0;
+	heap_counting = true;
+}
+
+/**
+ * @brief Name of a key of the generated responses, the first two are power and energy today
+ *
+ * @param idx index of the key
+ * @return std::string key
+ */
+static std::string key_name(int idx)
+{
+	if (idx == 0)
+	{
+		return KEY_POWER;
+	}
+	if (idx == 1)
+	{
+		return KEY_ENERGY_TODAY;
+	}
+	char key[SMA_KEY_LENGTH + 1];
+	snprintf(key, sizeof(key), "6100_4%07X", idx);
+	return key;
+}
+
+/**
+ * @brief getValues.json response of the inverter, every tenth value is null like at night
+ *
+ * @param num_keys number of keys
+ * @return std::string response
+ */
+static std::string values_payload(int num_keys)
+{
+	std::string payload = "{\"result\":{\"" FAKE_SMA_DEVICE "\":{";
+	for (int idx = 0; idx < num_keys; idx++)
+	{
+		if (idx > 0)
+		{
+			payload += ",";
+		}
+		std::string val = (idx % 10 == 9) ? "null" : std::to_string(idx * 7 + 1);
+		payload += "\"" + key_name(idx) + "\":{\"1\":[{\"val\":" + val + "}]}";
+	}
+	return payload + "}}}";
+}
+
+/** Tuples of a generated getAllOnlValues response */
+struct s_all_values
+{
+	uint32_t tuples = 0;
+	uint32_t tags = 0;
+	uint32_t strings = 0;
+	uint32_t nulls = 0;
+	long sum = 0;
+};
+
+/**
+ * @brief getAllOnlValues.json response of the inverter
+ * Single values, DC inputs with two indices, status values with tags, IP strings and nulls
+ *
+ * @param size min size of the response
+ * @param expected set to the tuples of the response
+ * @return std::string response
+ */
+static std::string all_values_payload(size_t size, s_all_values *expected)
+{
+	std::string payload = "{\"result\":{\"" FAKE_SMA_DEVICE "\":{";
+	for (int idx = 0; payload.length() < size; idx++)
+	{
+		if (idx > 0)
+		{
+			payload += ",";
+		}
+		payload += "\"" + key_name(idx) + "\":{\"1\":[";
+		switch (idx % 5)
+		{
+		case 0:
+			payload += "{\"val\":" + std::to_string(idx) + "}";
+			expected->sum += idx;
+			expected->tuples++;
+			break;
+		case 1:
+			payload += "{\"val\":" + std::to_string(idx) + ",\"low\":0,\"high\":5000},{\"val\":" + std::to_string(idx + 1) + "}";
+			expected->sum += 2 * idx + 1;
+			expected->tuples += 2;
+			break;
+		case 2:
+			payload += "{\"val\":[{\"tag\":307}]}";
+			expected->tags++;
+			expected->tuples++;
+			break;
+		case 3:
+			payload += "{\"val\":\"192.168.1." + std::to_string(idx % 250) + "\"}";
+			expected->strings++;
+			expected->tuples++;
+			break;
+		default:
+			payload += "{\"val\":null}";
+			expected->nulls++;
+			expected->tuples++;
+			break;
+		}
+		payload += "]}";
+	}
+	return payload + "}}}";
+}
+
+/**
+ * @brief Parse a response like SMAReader::postSMA(), buffered reads with the buffer on the stack
+ *
+ * @param payload response body
+ * @param handler handler of the values
+ * @return true if the response was parsed
+ */
+static bool parse(const std::string &payload, SMAJsonHandler &handler)
+{
+	// The copy of the response is not part of the parse
+	bool counting = heap_counting;
+	heap_counting = false;
+	WiFiClient client;
+	client.rx = payload;
+	heap_counting = counting;
+	char readBuffer[SMAREADER_READ_BUFFER];
+	BasicReadBufferingStream<SMAFixedAllocator> bufferedStream(client, sizeof(readBuffer), SMAFixedAllocator(readBuffer));
+	SMAErrorFilter errorFilter(handler);
+	SMAJsonParser parser(bufferedStream, errorFilter);
+	return parser.parse();
+}
+
+/** Callback of getAllValues, sums up the tuples */
+static void count_value(const char *key, const char *channel, int index, const char *value, SMAJsonType type, void *context)
+{
+	s_all_values *found = (s_all_values *)context;
+	found->tuples++;
+	switch (type)
+	{
+	case SMAJSON_NUMBER:
+		found->sum += atol(value);
+		break;
+	case SMAJSON_STRING:
+		found->strings++;
+		break;
+	case SMAJSON_NULL:
+		found->nulls++;
+		break;
+	default:
+		break;
+	}
+}
+
+void setUp(void)
+{
+	heap_counting = false;
+}
+
+void tearDown(void)
+{
+	heap_counting = false;
+}
+
+static void test_recorded_values(void)
+{
+	// Response of a Sunny Boy 3.0 as sent, with whitespace
+	std::string payload = "{\"result\": {\"" FAKE_SMA_DEVICE "\": {\n"
+						  "  \"6100_40263F00\": {\"1\": [{\"val\": 2310}]},\n"
+						  "  \"6400_00262200\": {\"1\": [{\"val\": 8420}]}\n"
+						  "}}}\r\n";
+	SMAKeyId ids[2] = {SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY};
+	int values[2];
+	SMAIntValuesHandler handler(2, ids, values);
+	handler.reset();
+	heap_start();
+	TEST_ASSERT_TRUE(parse(payload, handler));
+	heap_counting = false;
+	TEST_ASSERT_TRUE(handler.hasResult);
+	TEST_ASSERT_EQUAL_STRING(FAKE_SMA_DEVICE, handler.device);
+	TEST_ASSERT_EQUAL(2310, values[0]);
+	TEST_ASSERT_EQUAL(8420, values[1]);
+	TEST_ASSERT_EQUAL_UINT32(0, heap_allocs);
+}
+
+static void test_night_and_error(void)
+{
+	// At night the power is null
+	SMAKeyId ids[2] = {SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY};
+	int values[2];
+	SMAIntValuesHandler handler(2, ids, values);
+	handler.reset();
+	TEST_ASSERT_TRUE(parse("{\"result\":{\"" FAKE_SMA_DEVICE "\":{\"6100_40263F00\":{\"1\":[{\"val\":null}]},\"6400_00262200\":{\"1\":[{\"val\":8420}]}}}}", handler));
+	TEST_ASSERT_EQUAL(-1, values[0]);
+	TEST_ASSERT_EQUAL(8420, values[1]);
+
+	// Expired session
+	handler.reset();
+	SMAErrorFilter filter(handler);
+	WiFiClient client;
+	client.rx = "{\"err\":401}";
+	SMAJsonParser parser(client, filter);
+	TEST_ASSERT_TRUE(parser.parse());
+	TEST_ASSERT_EQUAL(401, filter.err);
+	TEST_ASSERT_FALSE(handler.hasResult);
+
+	// Truncated response
+	handler.reset();
+	TEST_ASSERT_FALSE(parse("{\"result\":{\"" FAKE_SMA_DEVICE "\":{\"6100_40263F00\":{\"1\":[{\"val\":23", handler));
+}
+
+static void test_values_benchmark(void)
+{
+	const int sizes[3] = {2, 20, 200};
+	for (uint8_t size_idx = 0; size_idx < 3; size_idx++)
+	{
+		int num_keys = sizes[size_idx];
+		String keys[200];
+		int values[200];
+		for (int idx = 0; idx < num_keys; idx++)
+		{
+			keys[idx] = key_name(idx).c_str();
+		}
+		std::string payload = values_payload(num_keys);
+		SMAIntValuesHandler handler(num_keys, keys, values);
+
+		uint32_t start = micros();
+		heap_start();
+		for (uint8_t run = 0; run < BENCH_RUNS; run++)
+		{
+			handler.reset();
+			TEST_ASSERT_TRUE(parse(payload, handler));
+		}
+		heap_counting = false;
+		uint32_t parse_us = (micros() - start) / BENCH_RUNS;
+
+		TEST_ASSERT_TRUE(handler.hasResult);
+		for (int idx = 0; idx < num_keys; idx++)
+		{
+			TEST_ASSERT_EQUAL((idx % 10 == 9) ? -1 : idx * 7 + 1, values[idx]);
+		}
+		TEST_ASSERT_EQUAL_UINT32(0, heap_peak);
+		printf("%3d keys, %5u bytes: %5u us per parse, heap high-water mark %u bytes, %u bytes on the stack\n",
+			   num_keys, (unsigned int)payload.length(), (unsigned int)parse_us, (unsigned int)heap_peak,
+			   (unsigned int)(sizeof(SMAJsonParser) + SMAREADER_READ_BUFFER));
+	}
+}
+
+static void test_all_values(void)
+{
+	// The memory used does not depend on the size of the response
+	const size_t sizes[2] = {ALL_VALUES_SIZE / 10, ALL_VALUES_SIZE};
+	for (uint8_t size_idx = 0; size_idx < 2; size_idx++)
+	{
+		s_all_values expected;
+		std::string payload = all_values_payload(sizes[size_idx], &expected);
+		s_all_values found;
+		SMAAllValuesHandler handler(count_value, &found);
+		uint32_t start = micros();
+		heap_start();
+		TEST_ASSERT_TRUE(parse(payload, handler));
+		heap_counting = false;
+		uint32_t parse_us = micros() - start;
+
+		TEST_ASSERT_TRUE(handler.hasResult);
+		TEST_ASSERT_EQUAL_UINT32(expected.tuples, handler.count);
+		TEST_ASSERT_EQUAL_UINT32(expected.tuples, found.tuples);
+		TEST_ASSERT_EQUAL_UINT32(expected.strings, found.strings);
+		TEST_ASSERT_EQUAL_UINT32(expected.nulls, found.nulls);
+		// The tag numbers are numbers as well
+		TEST_ASSERT_EQUAL(expected.sum + 307 * (long)expected.tags, found.sum);
+		TEST_ASSERT_EQUAL_UINT32(0, heap_peak);
+		printf("getAllOnlValues %6u bytes, %4u values: %5u us, heap high-water mark %u bytes\n",
+			   (unsigned int)payload.length(), (unsigned int)handler.count, (unsigned int)parse_us, (unsigned int)heap_peak);
+	}
+}
+
+static void test_all_values_reader(void)
+{
+	// The 50 kB response replayed through the reader
+	FakeSMA fake;
+	s_all_values expected;
+	fake.all_values = all_values_payload(ALL_VALUES_SIZE, &expected);
+	mock_http_server() = &fake;
+	SMAConnectionPool::closeAll();
+
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	s_all_values found;
+	TEST_ASSERT_TRUE(reader.getAllValues(count_value, &found));
+	TEST_ASSERT_EQUAL_UINT32(expected.tuples, found.tuples);
+	TEST_ASSERT_EQUAL(expected.sum + 307 * (long)expected.tags, found.sum);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("getAllOnlValues.json"));
+
+	// Without a callback the values are only parsed
+	TEST_ASSERT_TRUE(reader.getAllValues());
+	mock_http_server() = NULL;
+}
+
+static void test_too_deep(void)
+{
+	// Deeper than SMAJSON_MAX_DEPTH, the parser gives up instead of overflowing its path
+	std::string payload;
+	for (uint8_t level = 0; level <= SMAJSON_MAX_DEPTH; level++)
+	{
+		payload += "[";
+	}
+	SMAIgnoreHandler handler;
+	TEST_ASSERT_FALSE(parse(payload, handler));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_recorded_values);
+	RUN_TEST(test_night_and_error);
+	RUN_TEST(test_values_benchmark);
+	RUN_TEST(test_all_values);
+	RUN_TEST(test_all_values_reader);
+	RUN_TEST(test_too_deep);
+	return UNITY_END();
+}
@@ -0,0 +1,71 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the compile time request bodies of SMAKeys.h, pio test -e native
+ * @version 0.1
+ * @date 2021-10-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string.h>
+#include <SMAKeys.h>
+
+typedef SMAKeySet<SMAKeyId::POWER> OneKey;
+typedef SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY, SMAKeyId::DC_CURRENT> ThreeKeys;
+
+// The body is a constant expression, nothing is built at runtime
+static_assert(ThreeKeys::body[0] == '{', "body is not constexpr");
+static_assert(SMAKeys::bodyLength(1) == 9 + 15 + 16, "wrong body length");
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void test_one_key(void)
+{
+	TEST_ASSERT_EQUAL(1, OneKey::count);
+	TEST_ASSERT_EQUAL_STRING("{\"keys\":[\"6100_40263F00\"], \"destDev\":[]}", OneKey::body);
+}
+
+static void test_three_keys(void)
+{
+	TEST_ASSERT_EQUAL(3, ThreeKeys::count);
+	TEST_ASSERT_EQUAL_STRING("{\"keys\":[\"6100_40263F00\",\"6400_00262200\",\"6380_40452100\"], \"destDev\":[]}", ThreeKeys::body);
+	TEST_ASSERT_EQUAL(SMAKeys::bodyLength(3), strlen(ThreeKeys::body));
+}
+
+static void test_ids(void)
+{
+	TEST_ASSERT_TRUE(ThreeKeys::ids[0] == SMAKeyId::POWER);
+	TEST_ASSERT_TRUE(ThreeKeys::ids[1] == SMAKeyId::ENERGY_TODAY);
+	TEST_ASSERT_TRUE(ThreeKeys::ids[2] == SMAKeyId::DC_CURRENT);
+}
+
+static void test_key_info(void)
+{
+	TEST_ASSERT_EQUAL_STRING(KEY_AC_L1_VOLTAGE, smaKeyInfo(SMAKeyId::AC_L1_VOLTAGE).key);
+	TEST_ASSERT_TRUE(smaKeyInfo(SMAKeyId::AC_L1_VOLTAGE).unit == SMAUnit::V);
+	TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.01f, smaKeyInfo(SMAKeyId::AC_L1_VOLTAGE).scale);
+	TEST_ASSERT_TRUE(smaKeyInfo(SMAKeyId::WLAN_IP).type == SMAValueType::STRING);
+	TEST_ASSERT_TRUE(smaKeyInfo(SMAKeyId::DEVICE_ERROR).type == SMAValueType::STATUS);
+	for (uint8_t idx = 0; idx < (uint8_t)SMAKeyId::COUNT; idx++)
+	{
+		TEST_ASSERT_EQUAL(SMA_KEY_LENGTH, strlen(SMA_KEY_TABLE[idx].key));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_one_key);
+	RUN_TEST(test_three_keys);
+	RUN_TEST(test_ids);
+	RUN_TEST(test_key_info);
+	return UNITY_END();
+}
@@ -0,0 +1,169 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the paged SMAReader getLog against a fake getLogger.json, pio test -e native
+ * The fake inverter has 30 days of 5 minute entries. They are read into ring buffers smaller
+ * than the range, the caller pops the entries and the next call resumes after the last one
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+// The library is not in the native build
+#include "SMAJsonParser.cpp"
+#include "SMAReader.cpp"
+#include "fake_sma.h"
+
+/** Days in the log of the fake inverter */
+#define LOG_DAYS 30
+
+/** Entries per day, one every 5 minutes */
+#define DAY_ENTRIES (86400 / 300)
+
+/** Start of the log, 2021-10-01 00:00 UTC */
+#define LOG_START 1633046400
+
+static FakeSMA fake;
+
+/**
+ * @brief Read a range into a ring buffer and pop the entries like a caller that forwards them
+ * Every entry must come once, in order, with the value of the fake inverter
+ *
+ * @param reader reader of the log
+ * @param start start of the range
+ * @param end end of the range
+ * @param capacity capacity of the ring buffer
+ * @param calls set to the calls of getLog
+ * @return uint32_t entries read
+ */
+static uint32_t read_range(SMAReader &reader, uint32_t start, uint32_t end, uint16_t capacity, uint32_t *calls)
+{
+	SMALogEntry entries[DAY_ENTRIES + 12];
+	TEST_ASSERT_TRUE(capacity <= sizeof(entries) / sizeof(entries[0]));
+	SMALogBuffer buffer(entries, capacity);
+	uint32_t read = 0;
+	uint32_t next = (start + 299) / 300 * 300;
+	*calls = 0;
+	while (true)
+	{
+		int added = reader.getLog(start, end, buffer);
+		(*calls)++;
+		TEST_ASSERT_TRUE(added >= 0);
+		TEST_ASSERT_EQUAL(added, buffer.size());
+		if (added == 0)
+		{
+			break;
+		}
+		SMALogEntry entry;
+		while (buffer.pop(entry))
+		{
+			TEST_ASSERT_EQUAL_UINT32(next, entry.timestamp);
+			TEST_ASSERT_EQUAL_UINT32(FAKE_SMA_ENERGY + (entry.timestamp - LOG_START) / 300 * 10, entry.value);
+			next += 300;
+			read++;
+		}
+		TEST_ASSERT_TRUE(*calls < 1000);
+	}
+	return read;
+}
+
+void setUp(void)
+{
+	SMAConnectionPool::closeAll();
+	fake = FakeSMA();
+	fake.log_start = LOG_START;
+	mock_http_server() = &fake;
+}
+
+void tearDown(void) {}
+
+static void test_month(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	uint32_t end = LOG_START + LOG_DAYS * 86400 - 1;
+	uint32_t calls = 0;
+	// A buffer of one day, one window per call
+	TEST_ASSERT_EQUAL_UINT32(LOG_DAYS * DAY_ENTRIES, read_range(reader, LOG_START, end, DAY_ENTRIES, &calls));
+	TEST_ASSERT_EQUAL_UINT32(LOG_DAYS + 1, calls);
+	// The last call finds nothing after the last entry
+	TEST_ASSERT_EQUAL_UINT32(LOG_DAYS + 1, fake.count("getLogger.json"));
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("login.json"));
+	printf("%d days, %d entries: %u requests\n", LOG_DAYS, LOG_DAYS * DAY_ENTRIES, (unsigned int)fake.count("getLogger.json"));
+}
+
+static void test_small_buffer(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	uint32_t end = LOG_START + LOG_DAYS * 86400 - 1;
+	uint32_t calls = 0;
+	// The buffer is full in the middle of a window, the next call resumes there
+	TEST_ASSERT_EQUAL_UINT32(LOG_DAYS * DAY_ENTRIES, read_range(reader, LOG_START, end, 100, &calls));
+	TEST_ASSERT_EQUAL_UINT32((LOG_DAYS * DAY_ENTRIES + 99) / 100 + 1, calls);
+}
+
+static void test_windows(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	SMALogEntry entries[DAY_ENTRIES + 12];
+	SMALogBuffer buffer(entries, sizeof(entries) / sizeof(entries[0]));
+	// Half a day before the log starts and a part of the first day, one window per day of the range
+	uint32_t start = LOG_START - 43200;
+	uint32_t end = LOG_START + 3600 - 1;
+	TEST_ASSERT_EQUAL(12, reader.getLog(start, end, buffer));
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("getLogger.json"));
+	TEST_ASSERT_EQUAL_UINT32(LOG_START + 11 * 300, buffer.lastTimestamp());
+
+	// Nothing new in the range, the request after the last entry is empty
+	TEST_ASSERT_EQUAL(0, reader.getLog(start, end, buffer));
+	TEST_ASSERT_EQUAL_UINT32(2, fake.count("getLogger.json"));
+
+	// Entries after the end of the range are not taken, the buffer fills up over two windows
+	buffer.clear();
+	end = LOG_START + 86400 + 12 * 300 - 1;
+	TEST_ASSERT_EQUAL(DAY_ENTRIES + 12, reader.getLog(LOG_START, end, buffer));
+	TEST_ASSERT_TRUE(buffer.isFull());
+	TEST_ASSERT_EQUAL_UINT32(end - 299, buffer.lastTimestamp());
+	TEST_ASSERT_EQUAL_UINT32(4, fake.count("getLogger.json"));
+}
+
+static void test_resume_after_failure(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	SMALogEntry entries[DAY_ENTRIES];
+	SMALogBuffer buffer(entries, DAY_ENTRIES);
+	uint32_t end = LOG_START + 3 * 86400 - 1;
+	TEST_ASSERT_EQUAL(DAY_ENTRIES, reader.getLog(LOG_START, end, buffer));
+	buffer.clear();
+	TEST_ASSERT_EQUAL(0, buffer.lastTimestamp());
+
+	// The inverter is offline, nothing is added and the caller keeps its resume point
+	SMALogEntry entry;
+	SMALogBuffer resumed(entries, DAY_ENTRIES);
+	resumed.push(LOG_START + (DAY_ENTRIES - 1) * 300, 0);
+	resumed.pop(entry);
+	fake.online = false;
+	TEST_ASSERT_EQUAL(-1, reader.getLog(LOG_START, end, resumed));
+	TEST_ASSERT_EQUAL(0, resumed.size());
+
+	// Online again, the session expired meanwhile, the second day follows the first one
+	fake.online = true;
+	fake.expire();
+	TEST_ASSERT_EQUAL(DAY_ENTRIES, reader.getLog(LOG_START, end, resumed));
+	TEST_ASSERT_TRUE(resumed.pop(entry));
+	TEST_ASSERT_EQUAL_UINT32(LOG_START + 86400, entry.timestamp);
+	TEST_ASSERT_EQUAL_UINT32(2, fake.count("login.json"));
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_month);
+	RUN_TEST(test_small_buffer);
+	RUN_TEST(test_windows);
+	RUN_TEST(test_resume_after_failure);
+	return UNITY_END();
+}
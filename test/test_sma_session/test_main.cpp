@@ -0,0 +1,161 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the SMAReader session reuse against a fake /dyn web API, pio test -e native
+ * Counts the HTTP round trips of a poll, a login is only needed for the first poll
+ * and after the inverter dropped the session
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+// The library is not in the native build
+#include "SMAJsonParser.cpp"
+#include "SMAReader.cpp"
+#include "fake_sma.h"
+
+/** Polls in the round trip tests */
+#define POLLS 10
+
+typedef SMAKeySet<SMAKeyId::POWER, SMAKeyId::ENERGY_TODAY> test_keys_t;
+
+static FakeSMA fake;
+
+void setUp(void)
+{
+	SMAConnectionPool::closeAll();
+	fake = FakeSMA();
+	fake.values[KEY_POWER] = 1234;
+	mock_http_server() = &fake;
+}
+
+void tearDown(void) {}
+
+static void test_session_reuse(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	for (uint8_t poll = 0; poll < POLLS; poll++)
+	{
+		uint32_t requests = fake.requests;
+		TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+		TEST_ASSERT_EQUAL(1234, values[0]);
+		TEST_ASSERT_EQUAL(2, values[1]);
+		// Login and getValues for the first poll, getValues only after it
+		TEST_ASSERT_EQUAL_UINT32(poll == 0 ? 2 : 1, fake.requests - requests);
+	}
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("login.json"));
+	TEST_ASSERT_EQUAL_UINT32(POLLS, fake.count("getValues.json"));
+	TEST_ASSERT_EQUAL_UINT32(0, fake.count("logout.json"));
+	TEST_ASSERT_EQUAL_UINT32(0xB32A7F55, reader.getSerial());
+	printf("%d polls: %u round trips, %u without the session reuse\n", POLLS, (unsigned int)fake.requests, 3 * POLLS);
+}
+
+static void test_expired_session(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+
+	// {"err":401}, the sid is renewed and the request repeated
+	fake.expire();
+	uint32_t requests = fake.requests;
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_EQUAL_UINT32(3, fake.requests - requests);
+	TEST_ASSERT_EQUAL_UINT32(2, fake.count("login.json"));
+	TEST_ASSERT_EQUAL(1234, values[0]);
+
+	// Back to one round trip
+	requests = fake.requests;
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_EQUAL_UINT32(1, fake.requests - requests);
+}
+
+static void test_expired_http_401(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+
+	fake.status_401 = true;
+	fake.expire();
+	uint32_t requests = fake.requests;
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_EQUAL_UINT32(3, fake.requests - requests);
+	TEST_ASSERT_EQUAL(1234, values[0]);
+}
+
+static void test_log_reuses_session(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+
+	uint32_t log_values[12];
+	uint32_t timestamps[12];
+	fake.log_start = 1635832800;
+	uint32_t requests = fake.requests;
+	TEST_ASSERT_EQUAL(12, reader.getLog(fake.log_start, fake.log_start + 11 * 300, log_values, timestamps));
+	TEST_ASSERT_EQUAL_UINT32(1, fake.requests - requests);
+	TEST_ASSERT_EQUAL_UINT32(fake.log_start + 300, timestamps[1]);
+	TEST_ASSERT_EQUAL_UINT32(FAKE_SMA_ENERGY + 110, log_values[11]);
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("login.json"));
+}
+
+static void test_logout(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_FALSE(reader.logout());
+	TEST_ASSERT_EQUAL_UINT32(0, fake.requests);
+
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_TRUE(reader.hasSession());
+	TEST_ASSERT_TRUE(reader.logout());
+	TEST_ASSERT_FALSE(reader.hasSession());
+	TEST_ASSERT_EQUAL_UINT32(1, fake.count("logout.json"));
+
+	// The next poll logs in again
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_EQUAL_UINT32(2, fake.count("login.json"));
+}
+
+static void test_wrong_password(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "wrong", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_FALSE(reader.getValues<test_keys_t>(values));
+	// One login per try, no request without a sid
+	TEST_ASSERT_EQUAL_UINT32(3, fake.count("login.json"));
+	TEST_ASSERT_EQUAL_UINT32(0, fake.count("getValues.json"));
+	TEST_ASSERT_FALSE(reader.hasSession());
+}
+
+static void test_new_inverter(void)
+{
+	SMAReader reader(IPAddress(192, 168, 1, 50), SMAREADER_USER, "secret", 3);
+	int values[test_keys_t::count];
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+
+	// The sid belongs to the old inverter
+	reader.setInverterIP(IPAddress(192, 168, 1, 51));
+	TEST_ASSERT_FALSE(reader.hasSession());
+	TEST_ASSERT_EQUAL_UINT32(0, reader.getSerial());
+	TEST_ASSERT_TRUE(reader.getValues<test_keys_t>(values));
+	TEST_ASSERT_EQUAL_UINT32(2, fake.count("login.json"));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_session_reuse);
+	RUN_TEST(test_expired_session);
+	RUN_TEST(test_expired_http_401);
+	RUN_TEST(test_log_reuses_session);
+	RUN_TEST(test_logout);
+	RUN_TEST(test_wrong_password);
+	RUN_TEST(test_new_inverter);
+	return UNITY_END();
+}
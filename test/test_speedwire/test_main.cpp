@@ -0,0 +1,299 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the Speedwire packets, pio test -e native
+ * @version 0.1
+ * @date 2021-10-29
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string.h>
+#include "speedwire.h"
+
+/** Size of a value record */
+#define VALUE_RECORD 28
+
+/** Size of a counter record */
+#define COUNTER_RECORD 16
+
+/** Address of the client */
+static const s_sw_address client = {0x007D, 0x3A28A5E1};
+
+/** Address of the inverter */
+static const s_sw_address inverter = {0x0174, 0x7BE2F5A1};
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+static void test_discovery(void)
+{
+	uint8_t buffer[SW_REQUEST_MAX];
+	TEST_ASSERT_EQUAL(0, sw_build_discovery(buffer, SW_DISCOVERY_SIZE - 1));
+	TEST_ASSERT_EQUAL(SW_DISCOVERY_SIZE, sw_build_discovery(buffer, sizeof(buffer)));
+	const uint8_t start[] = {'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0xFF, 0xFF, 0xFF, 0xFF};
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(start, buffer, sizeof(start));
+
+	// Response with the IP tag 192.168.1.50
+	const uint8_t response[] = {'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0xFF, 0xFF, 0xFF, 0xFF,
+								0x00, 0x04, 0x00, 0x30, 192, 168, 1, 50, 0x00, 0x00, 0x00, 0x00};
+	uint32_t ip = 0;
+	TEST_ASSERT_TRUE(sw_parse_discovery(response, sizeof(response), &ip));
+	TEST_ASSERT_EQUAL_HEX32(0x3201A8C0, ip);
+	// The request has no IP tag
+	TEST_ASSERT_FALSE(sw_parse_discovery(buffer, SW_DISCOVERY_SIZE, &ip));
+}
+
+static void test_login(void)
+{
+	uint8_t buffer[SW_REQUEST_MAX];
+	TEST_ASSERT_EQUAL(0, sw_build_login(buffer, 77, &client, 1, "0000", 1635000000));
+	size_t len = sw_build_login(buffer, sizeof(buffer), &client, 1, "0000", 1635000000);
+	TEST_ASSERT_EQUAL(78, len);
+	// Length of the data tag and in words after the protocol id
+	TEST_ASSERT_EQUAL_HEX8(58, buffer[13]);
+	TEST_ASSERT_EQUAL_HEX8(14, buffer[18]);
+	// Command, user group, timeout, time
+	const uint8_t command[] = {0x0C, 0x04, 0xFD, 0xFF, 0x07, 0x00, 0x00, 0x00, 0x84, 0x03, 0x00, 0x00, 0xC0, 0x1E, 0x74, 0x61};
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(command, &buffer[42], sizeof(command));
+	// Password, characters + 0x88, filled up to 12 characters
+	const uint8_t password[] = {0xB8, 0xB8, 0xB8, 0xB8, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88};
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(password, &buffer[62], sizeof(password));
+	// End tag
+	const uint8_t end[] = {0, 0, 0, 0};
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(end, &buffer[74], sizeof(end));
+
+	s_sw_response response;
+	TEST_ASSERT_TRUE(sw_parse_response(buffer, len, &response));
+	TEST_ASSERT_EQUAL_HEX32(SW_CMD_LOGIN, response.command);
+	TEST_ASSERT_EQUAL_HEX16(client.susy_id, response.src.susy_id);
+	TEST_ASSERT_EQUAL_HEX32(client.serial, response.src.serial);
+	TEST_ASSERT_EQUAL(1, response.packet_id);
+}
+
+static void test_query(void)
+{
+	uint8_t buffer[SW_REQUEST_MAX];
+	s_sw_query query;
+	TEST_ASSERT_TRUE(sw_key_query(SMAKeyId::POWER, &query));
+	TEST_ASSERT_EQUAL_HEX32(0x51000200, query.command);
+	TEST_ASSERT_EQUAL_HEX32(0x00263F00, query.first);
+	TEST_ASSERT_EQUAL_HEX32(0x00263FFF, query.last);
+	TEST_ASSERT_FALSE(sw_key_query(SMAKeyId::WLAN_IP, &query));
+
+	sw_key_query(SMAKeyId::DC_VOLTAGE, &query);
+	size_t len = sw_build_query(buffer, sizeof(buffer), &client, &inverter, 2, &query);
+	TEST_ASSERT_EQUAL(58, len);
+	TEST_ASSERT_EQUAL_HEX8(0xA0, buffer[19]);
+	s_sw_response response;
+	TEST_ASSERT_TRUE(sw_parse_response(buffer, len, &response));
+	TEST_ASSERT_EQUAL_HEX32(0x53800200, response.command);
+	TEST_ASSERT_EQUAL_HEX32(0x00451F00, response.first);
+	TEST_ASSERT_EQUAL_HEX32(0x00451FFF, response.last);
+
+	// The day archive has another control byte
+	query.command = SW_CMD_ARCHIVE_DAY;
+	sw_build_query(buffer, sizeof(buffer), &client, &inverter, 3, &query);
+	TEST_ASSERT_EQUAL_HEX8(0xE0, buffer[19]);
+}
+
+static void test_plan_queries(void)
+{
+	const SMAKeyId ids[] = {SMAKeyId::AC_L1_POWER, SMAKeyId::ENERGY_TODAY, SMAKeyId::AC_L1_VOLTAGE,
+							SMAKeyId::POWER, SMAKeyId::ENERGY_TOTAL, SMAKeyId::WLAN_IP};
+	s_sw_query queries[SW_MAX_QUERIES];
+	TEST_ASSERT_EQUAL(3, sw_plan_queries(ids, 6, queries, SW_MAX_QUERIES));
+	// L1 power and voltage are close, the total power is too far away
+	TEST_ASSERT_EQUAL_HEX32(0x51000200, queries[0].command);
+	TEST_ASSERT_EQUAL_HEX32(0x00464000, queries[0].first);
+	TEST_ASSERT_EQUAL_HEX32(0x004648FF, queries[0].last);
+	TEST_ASSERT_EQUAL_HEX32(0x54000200, queries[1].command);
+	TEST_ASSERT_EQUAL_HEX32(0x00260100, queries[1].first);
+	TEST_ASSERT_EQUAL_HEX32(0x002622FF, queries[1].last);
+	TEST_ASSERT_EQUAL_HEX32(0x51000200, queries[2].command);
+	TEST_ASSERT_EQUAL_HEX32(0x00263F00, queries[2].first);
+	// Queries that do not fit are dropped
+	TEST_ASSERT_EQUAL(2, sw_plan_queries(ids, 6, queries, 2));
+}
+
+/** Value response, AC power 3376 W and no value of the power of L1 */
+static const uint8_t value_response[] = {
+	'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x5E, 0x00, 0x10,							// Data tag, 94 bytes
+	0x60, 0x65, 0x17, 0xA0,							// Inverter protocol, length in words, control
+	0x7D, 0x00, 0xE1, 0xA5, 0x28, 0x3A, 0x00, 0x01, // Destination, the client
+	0x74, 0x01, 0xA1, 0xF5, 0xE2, 0x7B, 0x00, 0x01, // Source, the inverter
+	0x00, 0x00, 0x00, 0x00, 0x05, 0x80,				// Error, fragment, packet id with the response bit
+	0x01, 0x02, 0x00, 0x51,							// Command
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, // First and last record
+	0x01, 0x3F, 0x26, 0x40, 0xA8, 0x4B, 0x82, 0x61, 0x30, 0x0D, 0x00, 0x00, 0x30, 0x0D, 0x00, 0x00,
+	0x30, 0x0D, 0x00, 0x00, 0x30, 0x0D, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+	0x01, 0x40, 0x46, 0x40, 0xA8, 0x4B, 0x82, 0x61, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80,
+	0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00};
+
+/** Counter response, total energy 12345678 Wh, no value of the energy today */
+static const uint8_t counter_response[] = {
+	'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x46, 0x00, 0x10,
+	0x60, 0x65, 0x11, 0xA0,
+	0x7D, 0x00, 0xE1, 0xA5, 0x28, 0x3A, 0x00, 0x01,
+	0x74, 0x01, 0xA1, 0xF5, 0xE2, 0x7B, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x06, 0x80,
+	0x01, 0x02, 0x00, 0x54,
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+	0x01, 0x01, 0x26, 0x00, 0xA8, 0x4B, 0x82, 0x61, 0x4E, 0x61, 0xBC, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x22, 0x26, 0x00, 0xA8, 0x4B, 0x82, 0x61, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x00, 0x00, 0x00};
+
+/** Response with the full record range, the record count wraps to 0 */
+static const uint8_t full_range_response[] = {
+	'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x36, 0x00, 0x10,
+	0x60, 0x65, 0x0D, 0xA0,
+	0x7D, 0x00, 0xE1, 0xA5, 0x28, 0x3A, 0x00, 0x01,
+	0x74, 0x01, 0xA1, 0xF5, 0xE2, 0x7B, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x07, 0x80,
+	0x01, 0x02, 0x00, 0x54,
+	0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x01, 0x01, 0x26, 0x00, 0xA8, 0x4B, 0x82, 0x61, 0x4E, 0x61, 0xBC, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00};
+
+/** Day archive response, two entries of 5 minutes, more packets follow */
+static const uint8_t archive_response[] = {
+	'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x3E, 0x00, 0x10,
+	0x60, 0x65, 0x0F, 0xE0,
+	0x7D, 0x00, 0xE1, 0xA5, 0x28, 0x3A, 0x00, 0x01,
+	0x74, 0x01, 0xA1, 0xF5, 0xE2, 0x7B, 0x00, 0x01,
+	0x00, 0x00, 0x02, 0x00, 0x08, 0x80,
+	0x01, 0x02, 0x00, 0x70,
+	0x88, 0x48, 0x82, 0x61, 0xB4, 0x49, 0x82, 0x61,
+	0x88, 0x48, 0x82, 0x61, 0x4E, 0x61, 0xBC, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xB4, 0x49, 0x82, 0x61, 0x6B, 0x62, 0xBC, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00};
+
+/** Energy Meter frame, power and energy bought and sold, then the power of L1 */
+static const uint8_t meter_frame[] = {
+	'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x3C, 0x00, 0x10,
+	0x60, 0x69, 0x01, 0x5D, 0x71, 0x23, 0x45, 0x67, 0x00, 0x01, 0xE2, 0x40, // Meter protocol, address, ticker
+	0x00, 0x01, 0x04, 0x00, 0x00, 0x00, 0x3A, 0x98,
+	0x00, 0x01, 0x08, 0x00, 0x00, 0x00, 0x00, 0x08, 0x61, 0xC4, 0x68, 0x00,
+	0x00, 0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0xFA,
+	0x00, 0x02, 0x08, 0x00, 0x00, 0x00, 0x00, 0x10, 0xC3, 0x88, 0xD0, 0x00,
+	0x00, 0x15, 0x04, 0x00, 0x00, 0x00, 0x27, 0x0F,
+	0x00, 0x00, 0x00, 0x00};
+
+static void test_values(void)
+{
+	s_sw_response response;
+	TEST_ASSERT_TRUE(sw_parse_response(value_response, sizeof(value_response), &response));
+	TEST_ASSERT_EQUAL(5, response.packet_id);
+	TEST_ASSERT_EQUAL(0, response.error);
+	TEST_ASSERT_EQUAL(0, response.fragment);
+	TEST_ASSERT_EQUAL_HEX16(inverter.susy_id, response.src.susy_id);
+	TEST_ASSERT_EQUAL_HEX32(inverter.serial, response.src.serial);
+	TEST_ASSERT_EQUAL(VALUE_RECORD, response.record_size);
+
+	int value = 0;
+	TEST_ASSERT_TRUE(sw_find_value(&response, SMAKeyId::POWER, &value));
+	TEST_ASSERT_EQUAL(3376, value);
+	// NaN
+	TEST_ASSERT_TRUE(sw_find_value(&response, SMAKeyId::AC_L1_POWER, &value));
+	TEST_ASSERT_EQUAL(-1, value);
+	// Not in the response, other command
+	TEST_ASSERT_FALSE(sw_find_value(&response, SMAKeyId::AC_L2_POWER, &value));
+	TEST_ASSERT_FALSE(sw_find_value(&response, SMAKeyId::DC_VOLTAGE, &value));
+	// Truncated datagram
+	TEST_ASSERT_FALSE(sw_parse_response(value_response, 16 + 30, &response));
+}
+
+static void test_counters(void)
+{
+	s_sw_response response;
+	TEST_ASSERT_TRUE(sw_parse_response(counter_response, sizeof(counter_response), &response));
+	TEST_ASSERT_EQUAL(COUNTER_RECORD, response.record_size);
+	int value = 0;
+	TEST_ASSERT_TRUE(sw_find_value(&response, SMAKeyId::ENERGY_TOTAL, &value));
+	TEST_ASSERT_EQUAL(12345678, value);
+	// Counter without a value
+	TEST_ASSERT_TRUE(sw_find_value(&response, SMAKeyId::ENERGY_TODAY, &value));
+	TEST_ASSERT_EQUAL(-1, value);
+}
+
+static void test_full_range(void)
+{
+	s_sw_response response;
+	// No division by a record count of 0, the size of the records is not known
+	TEST_ASSERT_TRUE(sw_parse_response(full_range_response, sizeof(full_range_response), &response));
+	TEST_ASSERT_EQUAL_HEX32(0xFFFFFFFF, response.last);
+	TEST_ASSERT_EQUAL(COUNTER_RECORD, response.records_size);
+	TEST_ASSERT_EQUAL(0, response.record_size);
+	int value = 0;
+	TEST_ASSERT_FALSE(sw_find_value(&response, SMAKeyId::ENERGY_TOTAL, &value));
+}
+
+static void test_archive(void)
+{
+	s_sw_response response;
+	TEST_ASSERT_TRUE(sw_parse_response(archive_response, sizeof(archive_response), &response));
+	TEST_ASSERT_EQUAL(2, response.fragment);
+	TEST_ASSERT_EQUAL(2 * SW_ARCHIVE_RECORD, response.records_size);
+	// 2021-11-03 08:30 UTC
+	TEST_ASSERT_EQUAL_UINT32(1635928200, response.first);
+	TEST_ASSERT_EQUAL_UINT32(1635928200, sw_get_u32(&response.records[SW_ARCHIVE_RECORD * 0]));
+	TEST_ASSERT_EQUAL_UINT32(1635928500, sw_get_u32(&response.records[SW_ARCHIVE_RECORD * 1]));
+	TEST_ASSERT_TRUE(sw_get_u64(&response.records[4]) == 12345678);
+	TEST_ASSERT_TRUE(sw_get_u64(&response.records[SW_ARCHIVE_RECORD + 4]) == 12345963);
+}
+
+static void test_meter(void)
+{
+	s_sw_meter meter;
+	TEST_ASSERT_TRUE(sw_parse_meter(meter_frame, sizeof(meter_frame), &meter));
+	TEST_ASSERT_EQUAL_HEX16(0x015D, meter.src.susy_id);
+	TEST_ASSERT_EQUAL_HEX32(0x71234567, meter.src.serial);
+	TEST_ASSERT_EQUAL_UINT32(123456, meter.ticker);
+	TEST_ASSERT_EQUAL_UINT32(15000, meter.power_in);
+	TEST_ASSERT_EQUAL_UINT32(250, meter.power_out);
+	TEST_ASSERT_TRUE(meter.energy_in == 36000000000ULL);
+	TEST_ASSERT_TRUE(meter.energy_out == 72000000000ULL);
+
+	// An inverter response is no meter frame and the other way round
+	s_sw_response response;
+	TEST_ASSERT_FALSE(sw_parse_response(meter_frame, sizeof(meter_frame), &response));
+	TEST_ASSERT_FALSE(sw_parse_meter(value_response, sizeof(value_response), &meter));
+}
+
+static void test_not_speedwire(void)
+{
+	const uint8_t buffer[] = {'H', 'T', 'T', 'P', 0x00, 0x04, 0x00, 0x10, 0x60, 0x65, 0x00, 0x00};
+	uint16_t tag_len;
+	TEST_ASSERT_NULL(sw_find_tag(buffer, sizeof(buffer), SW_TAG_DATA, &tag_len));
+	// Tag longer than the datagram
+	const uint8_t short_tag[] = {'S', 'M', 'A', 0, 0x00, 0x40, 0x00, 0x10, 0x60, 0x65, 0x00, 0x00};
+	TEST_ASSERT_NULL(sw_find_tag(short_tag, sizeof(short_tag), SW_TAG_DATA, &tag_len));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_discovery);
+	RUN_TEST(test_login);
+	RUN_TEST(test_query);
+	RUN_TEST(test_plan_queries);
+	RUN_TEST(test_values);
+	RUN_TEST(test_counters);
+	RUN_TEST(test_full_range);
+	RUN_TEST(test_archive);
+	RUN_TEST(test_meter);
+	RUN_TEST(test_not_speedwire);
+	return UNITY_END();
+}
@@ -0,0 +1,332 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the Speedwire reader with a fake inverter on the loopback interface, pio test -e native
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <WiFi.h>
+#include "inverters.h"
+#include "speedwire.h"
+
+/** Address of the fake inverter */
+static const s_sw_address inverter = {0x0174, 0x7BE2F5A1};
+
+/** Error code of an expired session */
+#define SESSION_ERROR 0x0017
+
+/** Log entries per packet of the fake inverter */
+#define LOG_PER_PACKET 5
+
+/** 2021-11-03 06:00 UTC */
+#define LOG_START 1635919200
+
+/** Inverter that answers the requests of the reader on the loopback interface */
+class FakeInverter
+{
+public:
+	void start(void)
+	{
+		_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		int on = 1;
+		setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		timeval timeout = {0, 20000};
+		setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(SW_PORT);
+		TEST_ASSERT_EQUAL(0, bind(_socket, (sockaddr *)&address, sizeof(address)));
+		std::thread([this]()
+					{ run(); })
+			.detach();
+	}
+
+	void reset(void)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		silent = false;
+		expire_session = false;
+		logins = 0;
+		queries = 0;
+		archives = 0;
+	}
+
+	// Settings and counters, change only with the lock
+	std::mutex &lock(void) { return _mutex; }
+	bool silent = false;
+	bool expire_session = false;
+	uint32_t logins = 0;
+	uint32_t queries = 0;
+	uint32_t archives = 0;
+
+private:
+	void run(void)
+	{
+		uint8_t request[SW_PACKET_MAX];
+		while (true)
+		{
+			sockaddr_in client;
+			socklen_t client_len = sizeof(client);
+			ssize_t len = recvfrom(_socket, request, sizeof(request), 0, (sockaddr *)&client, &client_len);
+			s_sw_response parsed;
+			if ((len <= 0) || !sw_parse_response(request, len, &parsed))
+			{
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (silent)
+			{
+				continue;
+			}
+			if (parsed.command == SW_CMD_LOGIN)
+			{
+				logins++;
+				// Password "0000", each character + 0x88
+				bool ok = memcmp(&request[62], "\xB8\xB8\xB8\xB8\x88", 5) == 0;
+				reply(&client, &parsed, ok ? 0 : SW_ERROR_LOGIN, 0, NULL, 0);
+			}
+			else if (parsed.command == SW_CMD_ARCHIVE_DAY)
+			{
+				archives++;
+				send_archive(&client, &parsed);
+			}
+			else if (expire_session)
+			{
+				queries++;
+				expire_session = false;
+				reply(&client, &parsed, SESSION_ERROR, 0, NULL, 0);
+			}
+			else
+			{
+				queries++;
+				send_values(&client, &parsed);
+			}
+		}
+	}
+
+	// Records of the keys of poll_keys_t in the range of the query, the value of a key is 100 * (index + 1)
+	void send_values(sockaddr_in *client, s_sw_response *query)
+	{
+		uint8_t records[SW_PACKET_MAX];
+		uint16_t size = 0;
+		bool counters = (query->command >> 24) == 0x54;
+		uint16_t record_size = counters ? 16 : 28;
+		for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+		{
+			s_sw_query key_query;
+			if (!sw_key_query(poll_keys_t::ids[idx], &key_query) || (key_query.command != query->command) ||
+				(key_query.first < query->first) || (key_query.first > query->last))
+			{
+				continue;
+			}
+			memset(&records[size], 0, record_size);
+			put_u32(&records[size], key_query.first | 0x01 | (counters ? 0 : SW_TYPE_SIGNED << 24));
+			put_u32(&records[size + 4], LOG_START);
+			put_u32(&records[size + 8], 100 * (idx + 1));
+			size += record_size;
+		}
+		query->first = 0;
+		query->last = size / record_size - 1;
+		reply(client, query, 0, 0, records, size);
+	}
+
+	// Entries every 5 minutes from the start to the end, a few per packet
+	void send_archive(sockaddr_in *client, s_sw_response *query)
+	{
+		uint32_t count = (query->last - query->first) / LOG_INTERVAL + 1;
+		uint32_t packets = (count + LOG_PER_PACKET - 1) / LOG_PER_PACKET;
+		for (uint32_t packet = 0; packet < packets; packet++)
+		{
+			uint8_t records[LOG_PER_PACKET * SW_ARCHIVE_RECORD];
+			uint16_t size = 0;
+			for (uint32_t entry = packet * LOG_PER_PACKET; (entry < count) && (entry < (packet + 1) * LOG_PER_PACKET); entry++)
+			{
+				memset(&records[size], 0, SW_ARCHIVE_RECORD);
+				put_u32(&records[size], query->first + entry * LOG_INTERVAL);
+				put_u32(&records[size + 4], 1000000 + entry);
+				size += SW_ARCHIVE_RECORD;
+			}
+			reply(client, query, 0, packets - 1 - packet, records, size);
+		}
+	}
+
+	void reply(sockaddr_in *client, s_sw_response *request, uint16_t error, uint16_t fragment, const uint8_t *records, uint16_t size)
+	{
+		uint8_t buffer[SW_PACKET_MAX];
+		const uint8_t header[] = {'S', 'M', 'A', 0, 0x00, 0x04, 0x02, 0xA0, 0x00, 0x00, 0x00, 0x01};
+		memcpy(buffer, header, sizeof(header));
+		uint16_t data_len = 38 + size;
+		buffer[12] = data_len >> 8;
+		buffer[13] = data_len & 0xFF;
+		buffer[14] = SW_TAG_DATA >> 8;
+		buffer[15] = SW_TAG_DATA & 0xFF;
+		uint8_t *data = &buffer[16];
+		memset(data, 0, 38);
+		data[0] = SW_PROTOCOL_INVERTER >> 8;
+		data[1] = SW_PROTOCOL_INVERTER & 0xFF;
+		data[2] = (data_len - 2) / 4;
+		data[3] = 0xA0;
+		data[4] = request->src.susy_id & 0xFF;
+		data[5] = request->src.susy_id >> 8;
+		put_u32(&data[6], request->src.serial);
+		data[12] = inverter.susy_id & 0xFF;
+		data[13] = inverter.susy_id >> 8;
+		put_u32(&data[14], inverter.serial);
+		data[20] = error & 0xFF;
+		data[21] = error >> 8;
+		data[22] = fragment & 0xFF;
+		data[23] = fragment >> 8;
+		data[24] = request->packet_id & 0xFF;
+		data[25] = (request->packet_id >> 8) | 0x80;
+		put_u32(&data[26], request->command | 1);
+		put_u32(&data[30], request->first);
+		put_u32(&data[34], request->last);
+		memcpy(&data[38], records, size);
+		memset(&data[data_len], 0, 4);
+		sendto(_socket, buffer, 16 + data_len + 4, 0, (sockaddr *)client, sizeof(*client));
+	}
+
+	static void put_u32(uint8_t *ptr, uint32_t value)
+	{
+		for (uint8_t idx = 0; idx < 4; idx++)
+		{
+			ptr[idx] = value >> (8 * idx);
+		}
+	}
+
+	int _socket = -1;
+	std::mutex _mutex;
+};
+
+static FakeInverter fake;
+
+/** The fake inverter is on the loopback interface */
+static IPAddress inverter_ip(127, 0, 0, 1);
+
+void setUp(void)
+{
+	fake.reset();
+	mock_wifi_connected() = true;
+}
+
+void tearDown(void)
+{
+}
+
+static void test_values(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "0000");
+	TEST_ASSERT_EQUAL_UINT32(0, reader->getSerial());
+
+	int values[poll_keys_t::count];
+	TEST_ASSERT_TRUE(reader->getValues(values));
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		TEST_ASSERT_EQUAL(100 * (idx + 1), values[idx]);
+	}
+	TEST_ASSERT_EQUAL_UINT32(inverter.serial, reader->getSerial());
+
+	// One login, then only the planned queries
+	s_sw_query queries[SW_MAX_QUERIES];
+	uint8_t num_queries = sw_plan_queries(poll_keys_t::ids, poll_keys_t::count, queries, SW_MAX_QUERIES);
+	TEST_ASSERT_TRUE(reader->getValues(values));
+	std::lock_guard<std::mutex> lock(fake.lock());
+	TEST_ASSERT_EQUAL(1, fake.logins);
+	TEST_ASSERT_EQUAL(2 * num_queries, fake.queries);
+	delete reader;
+}
+
+static void test_wrong_password(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "1111");
+	int values[poll_keys_t::count];
+	TEST_ASSERT_FALSE(reader->getValues(values));
+	TEST_ASSERT_EQUAL(-1, values[0]);
+	TEST_ASSERT_EQUAL_UINT32(0, reader->getSerial());
+	std::lock_guard<std::mutex> lock(fake.lock());
+	TEST_ASSERT_EQUAL(1, fake.logins);
+	TEST_ASSERT_EQUAL(0, fake.queries);
+	delete reader;
+}
+
+static void test_session_expired(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "0000");
+	int values[poll_keys_t::count];
+	TEST_ASSERT_TRUE(reader->getValues(values));
+	fake.lock().lock();
+	fake.expire_session = true;
+	fake.lock().unlock();
+	TEST_ASSERT_FALSE(reader->getValues(values));
+	// Logs in again on the next poll
+	TEST_ASSERT_TRUE(reader->getValues(values));
+	std::lock_guard<std::mutex> lock(fake.lock());
+	TEST_ASSERT_EQUAL(2, fake.logins);
+	delete reader;
+}
+
+static void test_log(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "0000");
+	uint32_t values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	// 12 entries in 3 packets
+	int count = reader->getLog(LOG_START, LOG_START + 11 * LOG_INTERVAL, values, timestamps);
+	TEST_ASSERT_EQUAL(12, count);
+	for (int entry = 0; entry < count; entry++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(LOG_START + entry * LOG_INTERVAL, timestamps[entry]);
+		TEST_ASSERT_EQUAL_UINT32(1000000 + entry, values[entry]);
+	}
+	std::lock_guard<std::mutex> lock(fake.lock());
+	TEST_ASSERT_EQUAL(1, fake.archives);
+	delete reader;
+}
+
+static void test_no_answer(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "0000");
+	fake.lock().lock();
+	fake.silent = true;
+	fake.lock().unlock();
+	int values[poll_keys_t::count];
+	uint32_t start_time = millis();
+	TEST_ASSERT_FALSE(reader->getValues(values));
+	// Gives up after the timeout of the login
+	TEST_ASSERT_UINT32_WITHIN(200, 1000, millis() - start_time);
+	delete reader;
+}
+
+static void test_wifi_down(void)
+{
+	InverterReader *reader = new_speedwire_reader(&inverter_ip, "0000");
+	mock_wifi_connected() = false;
+	int values[poll_keys_t::count];
+	uint32_t log_values[LOG_CHUNK];
+	uint32_t timestamps[LOG_CHUNK];
+	TEST_ASSERT_FALSE(reader->getValues(values));
+	TEST_ASSERT_EQUAL(-1, reader->getLog(LOG_START, LOG_START + LOG_INTERVAL, log_values, timestamps));
+	std::lock_guard<std::mutex> lock(fake.lock());
+	TEST_ASSERT_EQUAL(0, fake.logins);
+	delete reader;
+}
+
+int main(int argc, char **argv)
+{
+	fake.start();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_values);
+	RUN_TEST(test_wrong_password);
+	RUN_TEST(test_session_expired);
+	RUN_TEST(test_log);
+	RUN_TEST(test_no_answer);
+	RUN_TEST(test_wifi_down);
+	return UNITY_END();
+}
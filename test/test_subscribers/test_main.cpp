@@ -0,0 +1,310 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the subscriber registry on the loopback interface, pio test -e native
+ * The clients are sockets of the PC that send the subscribe packets to SUB_PORT and wait for
+ * the reply of the scheduler job. The clock is frozen, the leases end when the test moves it on
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <string>
+// subscribers.cpp is not in the native build, its statics are checked here
+#include "../../src/subscribers.cpp"
+
+/** Globals and functions of the other modules that subscribers.cpp uses */
+IPAddress multiIP(239, 0, 0, 57);
+WiFiUDP udpClientServer;
+uint8_t g_udp_format = UDP_FORMAT_JSON;
+static uint32_t poll_changes = 0;
+void set_poll_interval(void)
+{
+	poll_changes++;
+}
+
+/** Address of the clients */
+static const IPAddress loopback(127, 0, 0, 1);
+
+/** Subscriber on the loopback interface */
+class FakeClient
+{
+public:
+	FakeClient()
+	{
+		_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		timeval timeout = {0, 200000};
+		setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		TEST_ASSERT_EQUAL(0, bind(_socket, (sockaddr *)&address, sizeof(address)));
+		socklen_t address_len = sizeof(address);
+		getsockname(_socket, (sockaddr *)&address, &address_len);
+		port = ntohs(address.sin_port);
+	}
+	~FakeClient() { close(_socket); }
+
+	/**
+	 * @brief Send a packet to the subscribe port and run the job until it answers
+	 *
+	 * @param packet the packet
+	 * @return std::string the reply, empty if there was none
+	 */
+	std::string request(const char *packet)
+	{
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(SUB_PORT);
+		sendto(_socket, packet, strlen(packet), 0, (sockaddr *)&address, sizeof(address));
+		subscriber_job();
+
+		char reply[32];
+		ssize_t len = recv(_socket, reply, sizeof(reply) - 1, 0);
+		return len > 0 ? std::string(reply, len) : std::string();
+	}
+
+	uint16_t port = 0;
+
+private:
+	int _socket = -1;
+};
+
+/**
+ * @brief Call handle_packet() like the job does
+ *
+ * @param packet the packet
+ * @param port port of the sender
+ * @return std::string the reply
+ */
+static std::string handle(const char *packet, uint16_t port = 5000)
+{
+	char buffer[SUB_PACKET_SIZE];
+	snprintf(buffer, sizeof(buffer), "%s", packet);
+	char reply[16];
+	handle_packet(buffer, (uint32_t)loopback, port, reply, sizeof(reply));
+	return reply;
+}
+
+/**
+ * @brief Find a subscriber
+ *
+ * @param port port of the subscriber
+ * @param found set to the subscriber
+ * @return true if it has a lease
+ */
+static bool find(uint16_t port, s_subscriber *found)
+{
+	s_subscriber list[MAX_SUBSCRIBERS];
+	uint8_t count = get_subscribers(list);
+	for (uint8_t idx = 0; idx < count; idx++)
+	{
+		if ((list[idx].ip == (uint32_t)loopback) && (list[idx].port == port))
+		{
+			*found = list[idx];
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint8_t count(void)
+{
+	s_subscriber list[MAX_SUBSCRIBERS];
+	return get_subscribers(list);
+}
+
+void setUp(void)
+{
+	for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+	{
+		subscribers[idx] = s_subscriber();
+	}
+	num_subscribers = 0;
+	poll_changes = 0;
+	g_udp_mode = UDP_MODE_UNICAST;
+	g_udp_local_interval = 0;
+	g_udp_format = UDP_FORMAT_JSON;
+	mock_wifi_connected() = true;
+	// Open the subscribe port
+	subscriber_job();
+	TEST_ASSERT_TRUE(listening);
+}
+
+void tearDown(void) {}
+
+static void test_parse(void)
+{
+	TEST_ASSERT_EQUAL_STRING("ACK:600", handle("SUB").c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:60", handle("SUB:9000:60:1").c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:3600", handle("SUB:0:3600", 5001).c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:0", handle("UNSUB:5001").c_str());
+
+	s_subscriber found;
+	TEST_ASSERT_TRUE(find(5000, &found));
+	TEST_ASSERT_EQUAL(UDP_FORMAT_JSON, found.format);
+	TEST_ASSERT_EQUAL_UINT32(millis() + 600000, found.expires);
+	TEST_ASSERT_TRUE(find(9000, &found));
+	TEST_ASSERT_EQUAL(UDP_FORMAT_BINARY, found.format);
+	TEST_ASSERT_FALSE(find(5001, &found));
+	TEST_ASSERT_EQUAL(2, count());
+
+	// Wrong commands and values out of range, nothing changes
+	const char *wrong[] = {"", "HELLO", "sub", "SUB:70000", "SUB:-1", "SUB:0:3601", "SUB:0:0", "SUB:0:10:2", "UNSUB:65536"};
+	for (uint8_t idx = 0; idx < sizeof(wrong) / sizeof(wrong[0]); idx++)
+	{
+		TEST_ASSERT_EQUAL_STRING("NAK", handle(wrong[idx], 6000).c_str());
+	}
+	TEST_ASSERT_EQUAL(2, count());
+	// Unsubscribe of an unknown client is fine
+	TEST_ASSERT_EQUAL_STRING("ACK:0", handle("UNSUB", 6000).c_str());
+}
+
+static void test_loopback(void)
+{
+	FakeClient phone;
+	FakeClient display;
+	TEST_ASSERT_EQUAL_STRING("ACK:600", phone.request("SUB").c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:120", display.request("SUB:0:120:1").c_str());
+	s_subscriber found;
+	TEST_ASSERT_TRUE(find(phone.port, &found));
+	TEST_ASSERT_EQUAL(UDP_FORMAT_JSON, found.format);
+	TEST_ASSERT_TRUE(find(display.port, &found));
+	TEST_ASSERT_EQUAL(UDP_FORMAT_BINARY, found.format);
+	// The first subscriber switched to the local feed interval
+	TEST_ASSERT_EQUAL_UINT32(1, poll_changes);
+
+	TEST_ASSERT_EQUAL_STRING("NAK", phone.request("SUB:0:99999").c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:0", phone.request("UNSUB").c_str());
+	TEST_ASSERT_EQUAL(1, count());
+	TEST_ASSERT_EQUAL_STRING("ACK:0", display.request("UNSUB").c_str());
+	TEST_ASSERT_EQUAL(0, count());
+	// The last one is gone, back to the uplink interval
+	TEST_ASSERT_EQUAL_UINT32(2, poll_changes);
+}
+
+static void test_lease_expiry(void)
+{
+	FakeClient phone;
+	FakeClient display;
+	TEST_ASSERT_EQUAL_STRING("ACK:10", phone.request("SUB:0:10").c_str());
+	TEST_ASSERT_EQUAL_STRING("ACK:30", display.request("SUB:0:30").c_str());
+
+	// The phone renews before its lease ends
+	mock_advance(8000);
+	TEST_ASSERT_EQUAL_STRING("ACK:10", phone.request("SUB:0:10").c_str());
+	mock_advance(8000);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(2, count());
+
+	// Not renewed, the lease ends to the ms
+	mock_advance(1999);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(2, count());
+	mock_advance(1);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(1, count());
+	s_subscriber found;
+	TEST_ASSERT_FALSE(find(phone.port, &found));
+	TEST_ASSERT_EQUAL_UINT32(1, poll_changes);
+
+	mock_advance(12000);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(0, count());
+	TEST_ASSERT_EQUAL_UINT32(2, poll_changes);
+}
+
+static void test_lease_wrap(void)
+{
+	// A lease across the wrap of millis()
+	mock_advance((uint32_t)0 - millis() - 5000);
+	TEST_ASSERT_EQUAL_STRING("ACK:10", handle("SUB:0:10").c_str());
+	mock_advance(9999);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(1, count());
+	mock_advance(1);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(0, count());
+}
+
+static void test_table_full(void)
+{
+	FakeClient client;
+	char packet[SUB_PACKET_SIZE];
+	for (uint8_t idx = 0; idx < MAX_SUBSCRIBERS; idx++)
+	{
+		snprintf(packet, sizeof(packet), "SUB:%d:%d", 7000 + idx, 10 + idx);
+		TEST_ASSERT_EQUAL_STRING(("ACK:" + std::to_string(10 + idx)).c_str(), client.request(packet).c_str());
+	}
+	TEST_ASSERT_EQUAL_STRING("NAK", client.request("SUB:7100").c_str());
+	// A renewal needs no free entry
+	TEST_ASSERT_EQUAL_STRING("ACK:600", client.request("SUB:7003").c_str());
+	TEST_ASSERT_EQUAL(MAX_SUBSCRIBERS, count());
+
+	// The first lease ends, its entry is free again
+	mock_advance(10000);
+	subscriber_job();
+	TEST_ASSERT_EQUAL(MAX_SUBSCRIBERS - 1, count());
+	TEST_ASSERT_EQUAL_STRING("ACK:600", client.request("SUB:7100").c_str());
+}
+
+static void test_wifi_lost(void)
+{
+	FakeClient phone;
+	TEST_ASSERT_EQUAL_STRING("ACK:600", phone.request("SUB").c_str());
+
+	// Without WiFi the port is closed, the lease stays
+	mock_wifi_connected() = false;
+	subscriber_job();
+	TEST_ASSERT_FALSE(listening);
+	TEST_ASSERT_EQUAL_STRING("", phone.request("UNSUB").c_str());
+	TEST_ASSERT_EQUAL(1, count());
+
+	mock_wifi_connected() = true;
+	subscriber_job();
+	TEST_ASSERT_TRUE(listening);
+	TEST_ASSERT_EQUAL_STRING("ACK:0", phone.request("UNSUB").c_str());
+	TEST_ASSERT_EQUAL(0, count());
+}
+
+static void test_local_interval(void)
+{
+	// Without a local interval the feed polls with the uplink interval
+	TEST_ASSERT_EQUAL_UINT32(0, local_poll_interval());
+	g_udp_local_interval = 10;
+	// Unicast and multicast poll faster only while somebody listens
+	TEST_ASSERT_EQUAL_UINT32(0, local_poll_interval());
+	handle("SUB");
+	TEST_ASSERT_EQUAL_UINT32(10000, local_poll_interval());
+	g_udp_mode = UDP_MODE_MULTICAST;
+	TEST_ASSERT_EQUAL_UINT32(10000, local_poll_interval());
+	handle("UNSUB");
+	TEST_ASSERT_EQUAL_UINT32(0, local_poll_interval());
+	// Broadcast always
+	g_udp_mode = UDP_MODE_BROADCAST;
+	TEST_ASSERT_EQUAL_UINT32(10000, local_poll_interval());
+
+	char status[40];
+	subscriber_status(status, sizeof(status));
+	TEST_ASSERT_EQUAL_STRING("0:10:239:0:0:57:0", status);
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_parse);
+	RUN_TEST(test_loopback);
+	RUN_TEST(test_lease_expiry);
+	RUN_TEST(test_lease_wrap);
+	RUN_TEST(test_table_full);
+	RUN_TEST(test_wifi_lost);
+	RUN_TEST(test_local_interval);
+	return UNITY_END();
+}
@@ -0,0 +1,150 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the UDP frame serializer, pio test -e native
+ * The serializer must not allocate, every heap allocation during a call is counted
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "udp_frame.h"
+
+/** Heap allocations since the last reset */
+static volatile unsigned int allocs = 0;
+
+void *operator new(size_t size)
+{
+	allocs++;
+	void *ptr = malloc(size);
+	if (ptr == NULL)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+#ifdef __GLIBC__
+// Count the C allocations as well
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t num, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t num, size_t size)
+{
+	allocs++;
+	return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static s_udp_frame frame;
+
+void setUp(void)
+{
+	frame.time = 1635321600;
+	frame.power = 2310;
+	frame.energy_today = 8420;
+	frame.energy_total = 18342210;
+	frame.status = 15;
+}
+
+void tearDown(void)
+{
+}
+
+static void test_json(void)
+{
+	char buffer[UDP_JSON_MAX];
+	size_t len = udp_frame_json(buffer, sizeof(buffer), &frame);
+	TEST_ASSERT_EQUAL_STRING("{\"de\":\"spm\",\"s\":2310,\"c\":0,\"e\":8420,\"t\":1635321600,\"et\":18342210,\"st\":15}", buffer);
+	TEST_ASSERT_EQUAL(strlen(buffer), len);
+}
+
+static void test_json_limits(void)
+{
+	char buffer[UDP_JSON_MAX];
+	frame.time = 0xFFFFFFFF;
+	frame.power = -2147483647 - 1;
+	frame.energy_today = -2147483647 - 1;
+	frame.energy_total = -2147483647 - 1;
+	frame.status = 255;
+	size_t len = udp_frame_json(buffer, sizeof(buffer), &frame);
+	TEST_ASSERT_EQUAL_STRING("{\"de\":\"spm\",\"s\":-2147483648,\"c\":0,\"e\":-2147483648,\"t\":4294967295,\"et\":-2147483648,\"st\":255}", buffer);
+	TEST_ASSERT_TRUE(len < UDP_JSON_MAX);
+}
+
+static void test_json_too_small(void)
+{
+	char buffer[UDP_JSON_MAX];
+	size_t needed = udp_frame_json(buffer, sizeof(buffer), &frame);
+	TEST_ASSERT_EQUAL(0, udp_frame_json(buffer, needed, &frame));
+	TEST_ASSERT_EQUAL_STRING("", buffer);
+	TEST_ASSERT_EQUAL(needed, udp_frame_json(buffer, needed + 1, &frame));
+}
+
+static void test_binary(void)
+{
+	const uint8_t expected[UDP_BINARY_SIZE] = {UDP_BINARY_HEADER, 0x61, 0x79, 0x07, 0x00, 0x00, 0x00, 0x09, 0x06,
+											   0x00, 0x00, 0x20, 0xE4, 0x01, 0x17, 0xE1, 0x42, 15};
+	uint8_t buffer[UDP_BINARY_SIZE];
+	TEST_ASSERT_EQUAL(UDP_BINARY_SIZE, udp_frame_binary(buffer, sizeof(buffer), &frame));
+	TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, UDP_BINARY_SIZE);
+	TEST_ASSERT_EQUAL(0, udp_frame_binary(buffer, UDP_BINARY_SIZE - 1, &frame));
+}
+
+static void test_no_allocations(void)
+{
+	char json[UDP_JSON_MAX];
+	uint8_t binary[UDP_BINARY_SIZE];
+	allocs = 0;
+	for (int idx = 0; idx < 100; idx++)
+	{
+		frame.power = idx * 1000 - 50000;
+		udp_frame_json(json, sizeof(json), &frame);
+		udp_frame_binary(binary, sizeof(binary), &frame);
+	}
+	TEST_ASSERT_EQUAL(0, allocs);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_json);
+	RUN_TEST(test_json_limits);
+	RUN_TEST(test_json_too_small);
+	RUN_TEST(test_binary);
+	RUN_TEST(test_no_allocations);
+	return UNITY_END();
+}
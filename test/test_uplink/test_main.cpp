@@ -0,0 +1,381 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the LoRaWAN uplink queue with a stubbed lmh_send, pio test -e native
+ * lmh_send of the simulated MAC returns BUSY or ERROR at random, the TX finished callback
+ * fails at random. The packets carry a sequence number, the tests check that the delivered
+ * packets are in order, without duplicates, and that the queue keeps its memory bounds
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <vector>
+// uplink.cpp is not in the native build, its statics are checked here
+#include "../../src/uplink.cpp"
+
+/** Globals and functions of the other modules that uplink.cpp uses */
+static bool airtime_ok = true;
+static uint32_t deferred = 0;
+bool airtime_allowed(uint8_t size)
+{
+	return airtime_ok;
+}
+void airtime_deferred(void)
+{
+	deferred++;
+}
+void airtime_charge(uint8_t size) {}
+
+/** The same as in lorawan.cpp, without the LED */
+lmh_error_status lora_send_frame(uint8_t port, uint8_t *data, uint8_t size)
+{
+	if (lmh_join_status_get() != LMH_SET)
+	{
+		return LMH_ERROR;
+	}
+	static uint8_t buffer[256];
+	static lmh_app_data_t app_data = {buffer, 0, 0, 0, 0};
+	app_data.port = port;
+	app_data.buffsize = size;
+	memcpy(buffer, data, size);
+	return lmh_send(&app_data, LMH_UNCONFIRMED_MSG);
+}
+
+/** Packets in RAM and in flash without PSRAM */
+#define RAM_PACKETS UPLINK_RAM_SIZE_NO_PSRAM
+#define QUEUE_PACKETS (UPLINK_RAM_SIZE_NO_PSRAM + UPLINK_FILE_SIZE)
+
+/** Size of the test packets */
+#define PACKET_SIZE 10
+
+/** Sequence number of the next packet */
+static uint16_t next_seq = 0;
+
+/** Sequence numbers of the packets with a successful TX */
+static std::vector<uint16_t> delivered;
+
+/**
+ * @brief Start the queue like after a reboot, the flash file is kept
+ *
+ */
+static void boot(void)
+{
+	for (uint8_t idx = 0; idx < MAX_JOBS; idx++)
+	{
+		g_jobs[idx] = s_job();
+	}
+	free(ram_ring);
+	ram_ring = NULL;
+	ram_head = 0;
+	ram_count = 0;
+	in_flight = false;
+	head_retries = 0;
+	head_deferred = false;
+	tx_done = false;
+	tx_success = false;
+	g_uplink_stats = s_uplink_stats();
+	init_uplink();
+}
+
+static bool enqueue(void)
+{
+	uint8_t data[PACKET_SIZE] = {0};
+	data[0] = next_seq & 0xFF;
+	data[1] = next_seq >> 8;
+	next_seq++;
+	return uplink_enqueue(2, data, PACKET_SIZE);
+}
+
+static uint16_t pending(void)
+{
+	uint16_t in_flash = 0;
+	return uplink_pending(&in_flash) + in_flash;
+}
+
+/**
+ * @brief Run the drain job, lmh_send and the TX finish at random
+ *
+ * @param busy_pct chance of LMH_BUSY in %
+ * @param error_pct chance of LMH_ERROR in %
+ * @param tx_fail_pct chance of a failed TX in %
+ */
+static void drain_step(long busy_pct, long error_pct, long tx_fail_pct)
+{
+	s_mock_mac &mac = mock_mac();
+	long pick = random(100);
+	mac.send_result = pick < busy_pct ? LMH_BUSY : (pick < busy_pct + error_pct ? LMH_ERROR : LMH_SUCCESS);
+	uint32_t sends = mac.sends;
+	uplink_drain_job();
+	if ((mac.sends != sends) && (mac.send_result == LMH_SUCCESS))
+	{
+		TEST_ASSERT_TRUE(in_flight);
+		TEST_ASSERT_EQUAL(PACKET_SIZE, mac.last_size);
+		bool success = random(100) >= tx_fail_pct;
+		if (success)
+		{
+			delivered.push_back(mac.last_data[0] | (mac.last_data[1] << 8));
+		}
+		uplink_tx_finished(success);
+	}
+}
+
+/**
+ * @brief Drain the queue until it is empty
+ *
+ * @return uint32_t runs of the drain job
+ */
+static uint32_t drain_all(long busy_pct, long error_pct, long tx_fail_pct)
+{
+	uint32_t runs = 0;
+	while ((pending() != 0) || in_flight)
+	{
+		drain_step(busy_pct, error_pct, tx_fail_pct);
+		TEST_ASSERT_TRUE(++runs < 10000);
+	}
+	return runs;
+}
+
+/**
+ * @brief Check that the packets were delivered in order without duplicates
+ *
+ * @param first first sequence number that must be delivered, -1 if some may be missing
+ * @param count packets that must be delivered
+ */
+static void check_order(int first, uint32_t count)
+{
+	for (size_t idx = 1; idx < delivered.size(); idx++)
+	{
+		TEST_ASSERT_TRUE(delivered[idx] > delivered[idx - 1]);
+	}
+	if (first >= 0)
+	{
+		TEST_ASSERT_EQUAL_UINT32(count, delivered.size());
+		for (size_t idx = 0; idx < delivered.size(); idx++)
+		{
+			TEST_ASSERT_EQUAL(first + idx, delivered[idx]);
+		}
+	}
+}
+
+void setUp(void)
+{
+	mock_spiffs_clear();
+	mock_mac() = s_mock_mac();
+	mock_psram() = false;
+	airtime_ok = true;
+	deferred = 0;
+	next_seq = 0;
+	delivered.clear();
+	boot();
+}
+
+void tearDown(void) {}
+
+static void test_random_busy_error(void)
+{
+	mock_mac().join_status = LMH_SET;
+	randomSeed(11);
+	uint32_t runs = 0;
+	// New packets while the queue drains, some go through flash
+	for (uint8_t packet = 0; packet < 40; packet++)
+	{
+		TEST_ASSERT_TRUE(enqueue());
+		if (packet % 2 == 0)
+		{
+			drain_step(30, 10, 20);
+			runs++;
+		}
+	}
+	runs += drain_all(30, 10, 20);
+
+	check_order(-1, 0);
+	TEST_ASSERT_EQUAL_UINT32(40, g_uplink_stats.queued);
+	TEST_ASSERT_EQUAL_UINT32(delivered.size(), g_uplink_stats.sent);
+	// Only the packets that failed UPLINK_MAX_RETRIES times are missing
+	TEST_ASSERT_EQUAL_UINT32(40, g_uplink_stats.sent + g_uplink_stats.dropped);
+	TEST_ASSERT_TRUE(g_uplink_stats.sent >= 35);
+	printf("40 packets, 30%% BUSY, 10%% ERROR, 20%% TX failed: %u sent, %u dropped, %u retries, %u spilled, %u runs\n",
+		   (unsigned int)g_uplink_stats.sent, (unsigned int)g_uplink_stats.dropped, (unsigned int)g_uplink_stats.retries,
+		   (unsigned int)g_uplink_stats.spilled, (unsigned int)runs);
+
+	// A bad link, packets are dropped after UPLINK_MAX_RETRIES, the others are still in order
+	for (uint8_t packet = 0; packet < 40; packet++)
+	{
+		enqueue();
+	}
+	drain_all(30, 20, 50);
+	check_order(-1, 0);
+	TEST_ASSERT_EQUAL_UINT32(delivered.size(), g_uplink_stats.sent);
+	TEST_ASSERT_EQUAL_UINT32(80, g_uplink_stats.sent + g_uplink_stats.dropped);
+	TEST_ASSERT_TRUE(g_uplink_stats.dropped > 0);
+	printf("40 more, 30%% BUSY, 20%% ERROR, 50%% TX failed: %u sent, %u dropped in total\n",
+		   (unsigned int)g_uplink_stats.sent, (unsigned int)g_uplink_stats.dropped);
+}
+
+static void test_busy_only(void)
+{
+	// BUSY is not a failure, every packet gets through
+	mock_mac().join_status = LMH_SET;
+	randomSeed(3);
+	for (uint8_t packet = 0; packet < 20; packet++)
+	{
+		enqueue();
+	}
+	drain_all(70, 0, 0);
+	check_order(0, 20);
+	TEST_ASSERT_EQUAL_UINT32(0, g_uplink_stats.retries);
+	TEST_ASSERT_EQUAL_UINT32(0, g_uplink_stats.dropped);
+}
+
+static void test_join_loss(void)
+{
+	// Not joined, the packets wait and go to flash when the RAM ring is full
+	for (uint8_t packet = 0; packet < 50; packet++)
+	{
+		TEST_ASSERT_TRUE(enqueue());
+	}
+	for (uint8_t run = 0; run < 20; run++)
+	{
+		drain_step(0, 0, 0);
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, mock_mac().sends);
+	uint16_t in_flash = 0;
+	TEST_ASSERT_EQUAL(RAM_PACKETS, uplink_pending(&in_flash));
+	TEST_ASSERT_EQUAL(50 - RAM_PACKETS, in_flash);
+	TEST_ASSERT_EQUAL_UINT32(50 - RAM_PACKETS, g_uplink_stats.spilled);
+
+	// Joined again, flash first, then RAM, all in order
+	mock_mac().join_status = LMH_SET;
+	drain_all(0, 0, 0);
+	check_order(0, 50);
+}
+
+static void test_drop_oldest(void)
+{
+	// More packets than RAM and flash hold, the oldest are dropped
+	for (uint8_t packet = 0; packet < QUEUE_PACKETS + 7; packet++)
+	{
+		TEST_ASSERT_TRUE(enqueue());
+	}
+	TEST_ASSERT_EQUAL(QUEUE_PACKETS, pending());
+	TEST_ASSERT_EQUAL_UINT32(7, g_uplink_stats.dropped);
+	TEST_ASSERT_EQUAL(sizeof(s_uplink_file_header) + UPLINK_FILE_SIZE * sizeof(s_uplink), SPIFFS.open(UPLINK_FILE, "r").size());
+
+	mock_mac().join_status = LMH_SET;
+	drain_all(0, 0, 0);
+	check_order(7, QUEUE_PACKETS);
+}
+
+static void test_reboot(void)
+{
+	for (uint8_t packet = 0; packet < 20; packet++)
+	{
+		enqueue();
+	}
+	uplink_save();
+	uint16_t in_flash = 0;
+	TEST_ASSERT_EQUAL(0, uplink_pending(&in_flash));
+	TEST_ASSERT_EQUAL(20, in_flash);
+
+	// The packets from before the reboot are sent first
+	boot();
+	TEST_ASSERT_EQUAL(0, uplink_pending(&in_flash));
+	TEST_ASSERT_EQUAL(20, in_flash);
+	enqueue();
+	enqueue();
+	mock_mac().join_status = LMH_SET;
+	drain_all(0, 0, 0);
+	check_order(0, 22);
+
+	// A file of another size is replaced
+	mock_spiffs_clear();
+	File file = SPIFFS.open(UPLINK_FILE, "w");
+	file.write((uint8_t *)"junk", 4);
+	file.close();
+	boot();
+	TEST_ASSERT_EQUAL(0, pending());
+	TEST_ASSERT_TRUE(enqueue());
+}
+
+static void test_psram(void)
+{
+	mock_psram() = true;
+	boot();
+	TEST_ASSERT_EQUAL(UPLINK_RAM_SIZE, ram_size);
+	for (uint16_t packet = 0; packet < UPLINK_RAM_SIZE; packet++)
+	{
+		enqueue();
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, g_uplink_stats.spilled);
+	enqueue();
+	TEST_ASSERT_EQUAL_UINT32(1, g_uplink_stats.spilled);
+	mock_mac().join_status = LMH_SET;
+	drain_all(0, 0, 0);
+	check_order(0, UPLINK_RAM_SIZE + 1);
+}
+
+static void test_tx_timeout(void)
+{
+	mock_mac().join_status = LMH_SET;
+	enqueue();
+	for (uint8_t attempt = 0; attempt < UPLINK_MAX_RETRIES; attempt++)
+	{
+		uplink_drain_job();
+		TEST_ASSERT_TRUE(in_flight);
+		TEST_ASSERT_EQUAL_UINT32(attempt + 1, mock_mac().sends);
+		// Waits for the callback until the timeout
+		uplink_drain_job();
+		TEST_ASSERT_EQUAL_UINT32(attempt + 1, mock_mac().sends);
+		mock_advance(UPLINK_TX_TIMEOUT);
+	}
+	uplink_drain_job();
+	TEST_ASSERT_FALSE(in_flight);
+	TEST_ASSERT_EQUAL_UINT32(UPLINK_MAX_RETRIES, g_uplink_stats.retries);
+	TEST_ASSERT_EQUAL_UINT32(1, g_uplink_stats.dropped);
+	TEST_ASSERT_EQUAL(0, pending());
+}
+
+static void test_duty_cycle(void)
+{
+	// The packet waits for the budget and is counted as deferred once
+	mock_mac().join_status = LMH_SET;
+	airtime_ok = false;
+	enqueue();
+	for (uint8_t run = 0; run < 5; run++)
+	{
+		uplink_drain_job();
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, mock_mac().sends);
+	TEST_ASSERT_EQUAL_UINT32(1, deferred);
+	airtime_ok = true;
+	drain_all(0, 0, 0);
+	check_order(0, 1);
+}
+
+static void test_too_large(void)
+{
+	uint8_t data[UPLINK_MAX_PAYLOAD + 1] = {0};
+	TEST_ASSERT_FALSE(uplink_enqueue(2, data, UPLINK_MAX_PAYLOAD + 1));
+	TEST_ASSERT_TRUE(uplink_enqueue(2, data, UPLINK_MAX_PAYLOAD));
+	TEST_ASSERT_EQUAL(1, pending());
+}
+
+int main(int argc, char **argv)
+{
+	mock_freeze_time(true);
+
+	UNITY_BEGIN();
+	RUN_TEST(test_random_busy_error);
+	RUN_TEST(test_busy_only);
+	RUN_TEST(test_join_loss);
+	RUN_TEST(test_drop_oldest);
+	RUN_TEST(test_reboot);
+	RUN_TEST(test_psram);
+	RUN_TEST(test_tx_timeout);
+	RUN_TEST(test_duty_cycle);
+	RUN_TEST(test_too_large);
+	return UNITY_END();
+}
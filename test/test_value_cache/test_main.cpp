@@ -0,0 +1,244 @@
+/**
+ * @file test_main.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host tests of the value cache with concurrent consumers, pio test -e native
+ * The read of the inverters is a stub that counts the upstream requests and blocks
+ * until the test lets it finish, so the consumers are sure to come while it runs
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <unity.h>
+#include <atomic>
+#include <thread>
+// value_cache.cpp is not in the native build, its statics are checked here
+#include "../../src/value_cache.cpp"
+
+/** Consumers that want the values at the same time */
+#define CONSUMERS 8
+
+/** Power of the stub inverter */
+#define STUB_POWER 2310
+
+/** Globals and functions of the other modules that value_cache.cpp uses */
+bool g_ota_running = false;
+
+/** Upstream requests, reads of the inverters */
+static std::atomic<uint32_t> upstream{0};
+
+/** Gate of the stub read, open lets the reads finish */
+static std::mutex gate_mutex;
+static std::condition_variable gate_cv;
+static bool gate_open = true;
+
+uint8_t poll_inverters(int *values, uint32_t timeout_ms)
+{
+	upstream++;
+	std::unique_lock<std::mutex> lock(gate_mutex);
+	gate_cv.wait(lock, []()
+				 { return gate_open; });
+	for (uint8_t idx = 0; idx < poll_keys_t::count; idx++)
+	{
+		values[idx] = idx == 0 ? STUB_POWER : idx;
+	}
+	return 1;
+}
+
+static void set_gate(bool open)
+{
+	std::lock_guard<std::mutex> lock(gate_mutex);
+	gate_open = open;
+	gate_cv.notify_all();
+}
+
+/**
+ * @brief Wait with the running clock until a condition is met
+ *
+ * @param ready condition
+ * @return true if it was met within a second
+ */
+template <typename Predicate>
+static bool wait_for(Predicate ready)
+{
+	for (uint16_t wait = 0; wait < 1000; wait++)
+	{
+		if (ready())
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return ready();
+}
+
+/**
+ * @brief Wait until the refresh task is idle again
+ *
+ */
+static void wait_refresh_done(void)
+{
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return (xEventGroupGetBits(cache_events) & CACHE_IDLE_BIT) != 0; }));
+}
+
+void setUp(void)
+{
+	mock_freeze_time(false);
+	mock_wifi_connected() = true;
+	set_gate(true);
+	cache_valid = false;
+	memset(cache_values, 0, sizeof(cache_values));
+	g_cache_stats = s_cache_stats();
+	upstream = 0;
+}
+
+void tearDown(void)
+{
+	set_gate(true);
+	wait_refresh_done();
+	mock_freeze_time(false);
+}
+
+static void test_coalesced_fetch(void)
+{
+	// The first consumer starts the read, the others come while it runs
+	set_gate(false);
+	std::atomic<uint8_t> answered{0};
+	int results[CONSUMERS][poll_keys_t::count];
+	std::vector<std::thread> consumers;
+	for (uint8_t consumer = 0; consumer < CONSUMERS; consumer++)
+	{
+		consumers.push_back(std::thread([consumer, &results, &answered]()
+										{
+											if (cache_fetch(results[consumer], 5000) == 1)
+											{
+												answered++;
+											}
+										}));
+		if (consumer == 0)
+		{
+			TEST_ASSERT_TRUE(wait_for([]()
+									  { return upstream == 1; }));
+		}
+	}
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return g_cache_stats.coalesced == CONSUMERS - 1; }));
+	set_gate(true);
+	for (uint8_t consumer = 0; consumer < CONSUMERS; consumer++)
+	{
+		consumers[consumer].join();
+	}
+
+	TEST_ASSERT_EQUAL_UINT32(1, upstream);
+	TEST_ASSERT_EQUAL_UINT32(1, g_cache_stats.fetches);
+	TEST_ASSERT_EQUAL(CONSUMERS, answered);
+	for (uint8_t consumer = 0; consumer < CONSUMERS; consumer++)
+	{
+		TEST_ASSERT_EQUAL(STUB_POWER, results[consumer][0]);
+	}
+	printf("%d concurrent consumers: %u upstream request\n", CONSUMERS, (unsigned int)upstream.load());
+
+	// A fetch after the read is a new read
+	TEST_ASSERT_EQUAL(1, cache_fetch(results[0], 5000));
+	TEST_ASSERT_EQUAL_UINT32(2, upstream);
+}
+
+/**
+ * @brief cache_get() of all consumers at the same time
+ *
+ * @param fresh set to the consumers that got a fresh value
+ * @return uint8_t consumers that got a value
+ */
+static uint8_t get_all(uint8_t *fresh)
+{
+	std::atomic<uint8_t> found{0};
+	std::atomic<uint8_t> fresh_found{0};
+	std::vector<std::thread> consumers;
+	for (uint8_t consumer = 0; consumer < CONSUMERS; consumer++)
+	{
+		consumers.push_back(std::thread([&found, &fresh_found]()
+										{
+											int power = 0;
+											uint32_t age_ms = 0;
+											if (cache_get(SMAKeyId::POWER, &power, &age_ms) && (power == STUB_POWER))
+											{
+												found++;
+												if (age_ms <= CACHE_TTL)
+												{
+													fresh_found++;
+												}
+											}
+										}));
+	}
+	for (uint8_t consumer = 0; consumer < CONSUMERS; consumer++)
+	{
+		consumers[consumer].join();
+	}
+	*fresh = fresh_found;
+	return found;
+}
+
+static void test_stale_while_revalidate(void)
+{
+	mock_freeze_time(true);
+	uint8_t fresh = 0;
+
+	// No values yet, every consumer misses, the refresh reads the inverters once
+	set_gate(false);
+	TEST_ASSERT_EQUAL(0, get_all(&fresh));
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return upstream == 1; }));
+	set_gate(true);
+	wait_refresh_done();
+	TEST_ASSERT_EQUAL(CONSUMERS, g_cache_stats.misses);
+
+	// Fresh values, no upstream request
+	TEST_ASSERT_EQUAL(CONSUMERS, get_all(&fresh));
+	TEST_ASSERT_EQUAL(CONSUMERS, fresh);
+	TEST_ASSERT_EQUAL_UINT32(CONSUMERS, g_cache_stats.hits);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	TEST_ASSERT_EQUAL_UINT32(1, upstream);
+
+	// Stale values are returned at once, the refresh reads the inverters once more
+	mock_advance(CACHE_TTL + 1);
+	set_gate(false);
+	TEST_ASSERT_EQUAL(CONSUMERS, get_all(&fresh));
+	TEST_ASSERT_EQUAL(0, fresh);
+	TEST_ASSERT_TRUE(wait_for([]()
+							  { return upstream == 2; }));
+	set_gate(true);
+	wait_refresh_done();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	wait_refresh_done();
+	TEST_ASSERT_EQUAL_UINT32(2, upstream);
+	TEST_ASSERT_EQUAL_UINT32(2, g_cache_stats.fetches);
+	printf("%d consumers, 3 rounds: %u upstream requests\n", CONSUMERS, (unsigned int)upstream.load());
+
+	// Fresh again
+	TEST_ASSERT_EQUAL(CONSUMERS, get_all(&fresh));
+	TEST_ASSERT_EQUAL(CONSUMERS, fresh);
+}
+
+static void test_no_wifi(void)
+{
+	mock_wifi_connected() = false;
+	int power = 0;
+	TEST_ASSERT_FALSE(cache_get(SMAKeyId::POWER, &power, NULL));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	TEST_ASSERT_EQUAL_UINT32(0, upstream);
+	// Keys that are not polled are not cached
+	TEST_ASSERT_FALSE(cache_get(SMAKeyId::ETHERNET_IP, &power, NULL));
+}
+
+int main(int argc, char **argv)
+{
+	init_cache();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_coalesced_fetch);
+	RUN_TEST(test_stale_while_revalidate);
+	RUN_TEST(test_no_wifi);
+	return UNITY_END();
+}